@@ -0,0 +1,854 @@
+#define _GNU_SOURCE  /* syscall(). */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "../cmd/cmd.h"
+#include "../halva.h"
+
+/* Path of the default word list, relative to the root of the repository. */
+#define WORDS_PATH "test/words.txt"
+
+/* Size of the vocabularies used to generate URLs and n-grams. */
+#define NUM_HOSTS 1000
+#define NUM_TOKENS 20000
+
+/* Number of words extracted after each seek. */
+#define SEEK_LEN 4
+
+static struct {
+   size_t size;
+   size_t min_len;
+   size_t max_len;
+   size_t alphabet;
+   size_t num_queries;
+   size_t blocking_factor;
+   int engine;                /* HV_ENGINE_* constant, or -1 for all. */
+   uint64_t seed;
+} g_opts = {
+   .size = 1000000,
+   .min_len = 8,
+   .max_len = 32,
+   .alphabet = 36,
+   .num_queries = 1000000,
+   .blocking_factor = HV_BLOCKING_FACTOR,
+   .engine = -1,
+   .seed = 1,
+};
+
+/* Names of engines, as given on the command-line, and in results. */
+static const char *const g_engines[][2] = {
+   [HV_ENGINE_FRONT_CODING] = {"front-coding", "front"},
+   [HV_ENGINE_TRIE] = {"trie", "trie"},
+};
+
+#define NUM_ENGINES (sizeof g_engines / sizeof *g_engines)
+
+
+/* Accumulates benchmark results, so that the compiler cannot drop them. */
+static volatile size_t g_sink;
+
+static void *xmalloc(size_t size)
+{
+   void *p = malloc(size ? size : 1);
+   if (!p)
+      die("out of memory");
+   return p;
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+   p = realloc(p, size);
+   if (!p)
+      die("out of memory");
+   return p;
+}
+
+static int lmemcmp(const void *str1, size_t len1, const void *str2, size_t len2)
+{
+   int cmp = memcmp(str1, str2, len1 < len2 ? len1 : len2);
+   if (cmp)
+      return cmp;
+   return len1 < len2 ? -1 : len1 > len2;
+}
+
+/*******************************************************************************
+ * Random numbers
+ ******************************************************************************/
+
+static uint64_t g_rng;
+
+/* xorshift64*. */
+static uint64_t rng_next(void)
+{
+   g_rng ^= g_rng >> 12;
+   g_rng ^= g_rng << 25;
+   g_rng ^= g_rng >> 27;
+   return g_rng * UINT64_C(2685821657736338717);
+}
+
+/* Uniform in [0, n). */
+static size_t rng_below(size_t n)
+{
+   return rng_next() % n;
+}
+
+/* Skewed towards small values, roughly following Zipf's law. */
+static size_t rng_zipf(size_t n)
+{
+   double u = (rng_next() >> 11) * (1. / (UINT64_C(1) << 53));
+   size_t i = (size_t)(n * u * u * u);
+   return i < n ? i : n - 1;
+}
+
+/*******************************************************************************
+ * Corpora
+ ******************************************************************************/
+
+struct corpus {
+   char *data;             /* Words, one after the other. */
+   size_t data_size;
+   size_t data_alloc;
+   size_t *offs;           /* Offset of each word in "data". */
+   size_t *lens;
+   size_t num;
+   size_t alloc;
+};
+
+static void corpus_add(struct corpus *c, const void *word, size_t len)
+{
+   if (!len)
+      return;
+   if (len > HV_MAX_WORD_LEN)
+      len = HV_MAX_WORD_LEN;
+   if (c->num == c->alloc) {
+      c->alloc = c->alloc ? c->alloc * 2 : 1024;
+      c->offs = xrealloc(c->offs, c->alloc * sizeof *c->offs);
+      c->lens = xrealloc(c->lens, c->alloc * sizeof *c->lens);
+   }
+   if (c->data_size + len > c->data_alloc) {
+      c->data_alloc = c->data_alloc ? c->data_alloc * 2 : 1 << 16;
+      if (c->data_alloc < c->data_size + len)
+         c->data_alloc = c->data_size + len;
+      c->data = xrealloc(c->data, c->data_alloc);
+   }
+   memcpy(&c->data[c->data_size], word, len);
+   c->offs[c->num] = c->data_size;
+   c->lens[c->num] = len;
+   c->data_size += len;
+   c->num++;
+}
+
+static const char *corpus_word(const struct corpus *c, size_t i)
+{
+   return &c->data[c->offs[i]];
+}
+
+static void corpus_fini(struct corpus *c)
+{
+   free(c->data);
+   free(c->offs);
+   free(c->lens);
+}
+
+static const struct corpus *g_sorted;
+
+static int cmp_words(const void *a, const void *b)
+{
+   size_t i = *(const size_t *)a, j = *(const size_t *)b;
+   return lmemcmp(corpus_word(g_sorted, i), g_sorted->lens[i],
+                  corpus_word(g_sorted, j), g_sorted->lens[j]);
+}
+
+/* Sorts words and removes duplicates, as halva requires. */
+static void corpus_sort(struct corpus *c)
+{
+   size_t *order = xmalloc(c->num * sizeof *order);
+   for (size_t i = 0; i < c->num; i++)
+      order[i] = i;
+   g_sorted = c;
+   qsort(order, c->num, sizeof *order, cmp_words);
+
+   struct corpus sorted = {0};
+   for (size_t i = 0; i < c->num; i++) {
+      size_t k = order[i];
+      if (i && !cmp_words(&order[i - 1], &k))
+         continue;
+      corpus_add(&sorted, corpus_word(c, k), c->lens[k]);
+   }
+   free(order);
+   corpus_fini(c);
+   *c = sorted;
+}
+
+static void load_file(struct corpus *c, const char *path)
+{
+   FILE *fp = fopen(path, "r");
+   if (!fp)
+      die("cannot open '%s':", path);
+   char line[HV_MAX_WORD_LEN + 2];
+   while (fgets(line, sizeof line, fp)) {
+      size_t len = strlen(line);
+      if (len && line[len - 1] == '\n')
+         len--;
+      corpus_add(c, line, len);
+   }
+   if (ferror(fp))
+      die("cannot read '%s':", path);
+   fclose(fp);
+}
+
+/* Pronounceable made-up word. */
+static size_t gen_token(char *buf, size_t num_syllables)
+{
+   static const char consonants[] = "bcdfghjklmnprstvz";
+   static const char vowels[] = "aeiou";
+   size_t len = 0;
+   for (size_t i = 0; i < num_syllables; i++) {
+      buf[len++] = consonants[rng_below(sizeof consonants - 1)];
+      buf[len++] = vowels[rng_below(sizeof vowels - 1)];
+   }
+   return len;
+}
+
+static struct corpus gen_vocabulary(size_t num, size_t max_syllables)
+{
+   struct corpus voc = {0};
+   char buf[64];
+   for (size_t i = 0; i < num; i++)
+      corpus_add(&voc, buf, gen_token(buf, 1 + rng_below(max_syllables)));
+   return voc;
+}
+
+static void gen_urls(struct corpus *c)
+{
+   static const char *const tlds[] = {".com", ".org", ".net", ".io", ".fr"};
+   struct corpus hosts = gen_vocabulary(NUM_HOSTS, 4);
+   struct corpus segs = gen_vocabulary(NUM_TOKENS, 3);
+
+   char buf[HV_MAX_WORD_LEN + 64];
+   for (size_t i = 0; i < g_opts.size; i++) {
+      size_t h = rng_zipf(hosts.num);
+      int len = sprintf(buf, "https://www.%.*s%s", (int)hosts.lens[h],
+                        corpus_word(&hosts, h), tlds[h % 5]);
+      size_t depth = 1 + rng_below(4);
+      for (size_t j = 0; j < depth && len < HV_MAX_WORD_LEN; j++) {
+         size_t s = rng_zipf(segs.num);
+         len += sprintf(&buf[len], "/%.*s", (int)segs.lens[s],
+                        corpus_word(&segs, s));
+      }
+      if (rng_below(2))
+         len += sprintf(&buf[len], "?id=%zu", rng_below(100000));
+      corpus_add(c, buf, len);
+   }
+   corpus_fini(&hosts);
+   corpus_fini(&segs);
+}
+
+static void gen_ngrams(struct corpus *c)
+{
+   struct corpus toks = gen_vocabulary(NUM_TOKENS, 4);
+
+   char buf[HV_MAX_WORD_LEN + 64];
+   for (size_t i = 0; i < g_opts.size; i++) {
+      size_t n = 1 + rng_below(3), len = 0;
+      for (size_t j = 0; j < n; j++) {
+         size_t t = rng_zipf(toks.num);
+         len += sprintf(&buf[len], "%s%.*s", j ? " " : "", (int)toks.lens[t],
+                        corpus_word(&toks, t));
+      }
+      corpus_add(c, buf, len);
+   }
+   corpus_fini(&toks);
+}
+
+static void gen_random(struct corpus *c)
+{
+   /* Alphanumeric characters first, then the other non-zero bytes. */
+   static const char alnum[] =
+      "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+   unsigned char alphabet[255];
+   size_t size = sizeof alnum - 1;
+   memcpy(alphabet, alnum, size);
+   for (int b = 1; b < 256; b++)
+      if (!memchr(alnum, b, sizeof alnum - 1))
+         alphabet[size++] = b;
+
+   char buf[HV_MAX_WORD_LEN];
+   for (size_t i = 0; i < g_opts.size; i++) {
+      size_t len = g_opts.min_len
+                 + rng_below(g_opts.max_len - g_opts.min_len + 1);
+      for (size_t j = 0; j < len; j++)
+         buf[j] = alphabet[rng_below(g_opts.alphabet)];
+      corpus_add(c, buf, len);
+   }
+}
+
+/*******************************************************************************
+ * Measurements
+ ******************************************************************************/
+
+enum {
+   CNT_CYCLES,
+   CNT_INSTRUCTIONS,
+   CNT_LLC_MISSES,
+   CNT_DTLB_MISSES,
+   NUM_COUNTERS
+};
+
+static int g_perf_fds[NUM_COUNTERS];
+static bool g_perf_ok;
+
+static int perf_open(uint32_t type, uint64_t config, int group_fd)
+{
+   struct perf_event_attr attr = {
+      .type = type,
+      .size = sizeof attr,
+      .config = config,
+      .disabled = group_fd < 0,
+      .exclude_kernel = 1,
+      .exclude_hv = 1,
+      .read_format = PERF_FORMAT_GROUP,
+   };
+   return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+/* Counters are optional: they are often unavailable in containers and
+ * virtual machines, or restricted by perf_event_paranoid.
+ */
+static void perf_init(void)
+{
+   static const struct {
+      uint32_t type;
+      uint64_t config;
+   } events[NUM_COUNTERS] = {
+      [CNT_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      [CNT_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      [CNT_LLC_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+      [CNT_DTLB_MISSES] = {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB
+                           | PERF_COUNT_HW_CACHE_OP_READ << 8
+                           | PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+   };
+
+   for (size_t i = 0; i < NUM_COUNTERS; i++) {
+      g_perf_fds[i] = perf_open(events[i].type, events[i].config,
+                                i ? g_perf_fds[0] : -1);
+      if (g_perf_fds[i] < 0) {
+         fprintf(stderr, "%s: hardware counters are not available: %s\n",
+                 g_progname, strerror(errno));
+         while (i--)
+            close(g_perf_fds[i]);
+         return;
+      }
+   }
+   g_perf_ok = true;
+}
+
+struct measure {
+   struct timespec start;
+   uint64_t counters[NUM_COUNTERS];
+   double nsecs;
+};
+
+static void measure_start(struct measure *m)
+{
+   if (g_perf_ok) {
+      ioctl(g_perf_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+      ioctl(g_perf_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+   }
+   clock_gettime(CLOCK_MONOTONIC, &m->start);
+}
+
+static void measure_stop(struct measure *m)
+{
+   struct timespec end;
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   m->nsecs = (end.tv_sec - m->start.tv_sec) * 1e9
+            + (end.tv_nsec - m->start.tv_nsec);
+
+   if (g_perf_ok) {
+      ioctl(g_perf_fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+      uint64_t buf[1 + NUM_COUNTERS];
+      if (read(g_perf_fds[0], buf, sizeof buf) != sizeof buf)
+         die("cannot read hardware counters:");
+      memcpy(m->counters, &buf[1], sizeof m->counters);
+   }
+}
+
+static void report(const char *op, const char *impl, const struct measure *m,
+                   size_t num_ops)
+{
+   printf("%-12s %-8s %10.1f", op, impl, m->nsecs / num_ops);
+   for (size_t i = 0; i < NUM_COUNTERS; i++) {
+      if (g_perf_ok)
+         printf(" %10.2f", (double)m->counters[i] / num_ops);
+      else
+         printf(" %10s", "-");
+   }
+   putchar('\n');
+}
+
+/*******************************************************************************
+ * Baselines
+ ******************************************************************************/
+
+/* Sorted array of strings, searched by bisection. */
+struct sorted_array {
+   char **words;
+   uint8_t *lens;
+   size_t num;
+};
+
+static void array_build(struct sorted_array *a, const struct corpus *c)
+{
+   a->num = c->num;
+   a->words = xmalloc(c->num * sizeof *a->words);
+   a->lens = xmalloc(c->num);
+   for (size_t i = 0; i < c->num; i++) {
+      a->words[i] = xmalloc(c->lens[i]);
+      memcpy(a->words[i], corpus_word(c, i), c->lens[i]);
+      a->lens[i] = c->lens[i];
+   }
+}
+
+static size_t array_size(const struct sorted_array *a)
+{
+   size_t size = a->num * (sizeof *a->words + sizeof *a->lens);
+   for (size_t i = 0; i < a->num; i++)
+      size += a->lens[i];
+   return size;
+}
+
+/* Index of the first word >= the given one. */
+static size_t array_lower_bound(const struct sorted_array *a,
+                                const void *word, size_t len)
+{
+   size_t low = 0, high = a->num;
+   while (low < high) {
+      size_t mid = (low + high) / 2;
+      if (lmemcmp(a->words[mid], a->lens[mid], word, len) < 0)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   return low;
+}
+
+static void array_fini(struct sorted_array *a)
+{
+   for (size_t i = 0; i < a->num; i++)
+      free(a->words[i]);
+   free(a->words);
+   free(a->lens);
+}
+
+/* Open addressing hash table, mapping words to ordinals. */
+struct hash_table {
+   const struct sorted_array *keys;    /* Words are not copied. */
+   uint32_t *slots;                    /* Ordinal, or 0 if empty. */
+   size_t mask;
+};
+
+static uint64_t hash(const void *word, size_t len)
+{
+   const unsigned char *p = word;
+   uint64_t h = len * UINT64_C(0x9e3779b97f4a7c15);
+   for (; len >= 8; p += 8, len -= 8) {
+      uint64_t v;
+      memcpy(&v, p, 8);
+      h = (h ^ v) * UINT64_C(0xff51afd7ed558ccd);
+      h ^= h >> 32;
+   }
+   uint64_t v = 0;
+   memcpy(&v, p, len);
+   h = (h ^ v) * UINT64_C(0xc4ceb9fe1a85ec53);
+   return h ^ h >> 29;
+}
+
+static void hash_build(struct hash_table *t, const struct sorted_array *a)
+{
+   size_t size = 16;
+   while (size < 2 * a->num)
+      size *= 2;
+   t->keys = a;
+   t->mask = size - 1;
+   t->slots = calloc(size, sizeof *t->slots);
+   if (!t->slots)
+      die("out of memory");
+   for (size_t i = 0; i < a->num; i++) {
+      size_t s = hash(a->words[i], a->lens[i]) & t->mask;
+      while (t->slots[s])
+         s = (s + 1) & t->mask;
+      t->slots[s] = i + 1;
+   }
+}
+
+static uint32_t hash_locate(const struct hash_table *t, const void *word,
+                            size_t len)
+{
+   size_t s = hash(word, len) & t->mask;
+   for (uint32_t ord; (ord = t->slots[s]); s = (s + 1) & t->mask)
+      if (t->keys->lens[ord - 1] == len
+          && !memcmp(t->keys->words[ord - 1], word, len))
+         return ord;
+   return 0;
+}
+
+/*******************************************************************************
+ * Benchmarks
+ ******************************************************************************/
+
+struct membuf {
+   char *data;
+   size_t size;
+   size_t alloc;
+   size_t pos;
+};
+
+static int membuf_write(void *arg, const void *data, size_t size)
+{
+   struct membuf *b = arg;
+   if (b->size + size > b->alloc) {
+      b->alloc = (b->size + size) * 2;
+      b->data = xrealloc(b->data, b->alloc);
+   }
+   memcpy(&b->data[b->size], data, size);
+   b->size += size;
+   return 0;
+}
+
+static int membuf_read(void *arg, void *data, size_t size)
+{
+   struct membuf *b = arg;
+   if (size > b->size - b->pos)
+      return -1;
+   memcpy(data, &b->data[b->pos], size);
+   b->pos += size;
+   return 0;
+}
+
+/* Lookup keys: words of the corpus, and variants of them that are not in it. */
+struct queries {
+   struct corpus hits;
+   struct corpus misses;
+   uint32_t *ords;
+};
+
+static void make_queries(struct queries *q, const struct corpus *c)
+{
+   memset(q, 0, sizeof *q);
+   q->ords = xmalloc(g_opts.num_queries * sizeof *q->ords);
+   char buf[HV_MAX_WORD_LEN + 1];
+   for (size_t i = 0; i < g_opts.num_queries; i++) {
+      size_t k = rng_below(c->num);
+      q->ords[i] = k + 1;
+      corpus_add(&q->hits, corpus_word(c, k), c->lens[k]);
+
+      /* Appending a control character to a word rarely gives another one. */
+      size_t len = c->lens[k];
+      memcpy(buf, corpus_word(c, k), len);
+      if (len < HV_MAX_WORD_LEN)
+         buf[len++] = '\1';
+      else
+         buf[len - 1] = '\1';
+      corpus_add(&q->misses, buf, len);
+   }
+}
+
+/* A lexicon built with one of the engines. */
+struct engine_run {
+   const char *label;
+   struct membuf mem;
+   struct measure enc_m;
+   struct halva *hv;
+};
+
+static void bench_corpus(const char *name, struct corpus *c)
+{
+   struct measure m;
+   size_t n = c->num, nq = g_opts.num_queries;
+   size_t sum = 0;
+   char buf[HV_MAX_WORD_LEN + 1];
+
+   corpus_sort(c);
+   n = c->num;
+   if (!n) {
+      printf("corpus %s: empty\n\n", name);
+      return;
+   }
+   struct queries q;
+   make_queries(&q, c);
+
+   const void **words = xmalloc(n * sizeof *words);
+   for (size_t i = 0; i < n; i++)
+      words[i] = corpus_word(c, i);
+
+   /* Encode. */
+   struct engine_run runs[NUM_ENGINES];
+   size_t num_runs = 0;
+   for (int e = 0; e < (int)NUM_ENGINES; e++) {
+      if (g_opts.engine >= 0 && e != g_opts.engine)
+         continue;
+      struct engine_run *run = &runs[num_runs++];
+      run->label = g_engines[e][1];
+      run->mem = (struct membuf){0};
+
+      struct halva_enc enc = HV_ENC_INIT;
+      int ret = hv_enc_set_blocking_factor(&enc, g_opts.blocking_factor);
+      if (ret)
+         die("invalid blocking factor: %s", hv_strerror(ret));
+      hv_enc_set_engine(&enc, e);
+      measure_start(&m);
+      if ((ret = hv_enc_add_many(&enc, n, words, c->lens))
+          || (ret = hv_enc_dump(&enc, membuf_write, &run->mem)))
+         die("cannot encode corpus %s: %s", name, hv_strerror(ret));
+      measure_stop(&m);
+      hv_enc_fini(&enc);
+      run->enc_m = m;
+   }
+
+   struct sorted_array arr;
+   measure_start(&m);
+   array_build(&arr, c);
+   measure_stop(&m);
+   struct measure arr_m = m;
+
+   struct hash_table ht;
+   measure_start(&m);
+   hash_build(&ht, &arr);
+   measure_stop(&m);
+   struct measure hash_m = m;
+
+   size_t total_len = 0;
+   for (size_t i = 0; i < n; i++)
+      total_len += c->lens[i];
+   size_t arr_size = array_size(&arr);
+   printf("corpus %s: %zu words, %.1f bytes per word on average\n",
+          name, n, (double)total_len / n);
+   printf("size:");
+   for (size_t r = 0; r < num_runs; r++)
+      printf(" %s %.2f,", runs[r].label, (double)runs[r].mem.size / n);
+   printf(" array %.2f, hash %.2f bytes per word\n", (double)arr_size / n,
+          (double)(arr_size + (ht.mask + 1) * sizeof *ht.slots) / n);
+   printf("%-12s %-8s %10s %10s %10s %10s %10s\n", "operation", "impl",
+          "ns/op", "cycles/op", "instrs/op", "llc/op", "dtlb/op");
+
+   for (size_t r = 0; r < num_runs; r++)
+      report("encode", runs[r].label, &runs[r].enc_m, n);
+   report("encode", "array", &arr_m, n);
+   report("encode", "hash", &hash_m, n);
+
+   /* Load. */
+   for (size_t r = 0; r < num_runs; r++) {
+      int ret;
+      measure_start(&m);
+      if ((ret = hv_load(&runs[r].hv, membuf_read, &runs[r].mem)))
+         die("cannot load corpus %s: %s", name, hv_strerror(ret));
+      measure_stop(&m);
+      report("load", runs[r].label, &m, n);
+   }
+
+   /* Lookups. */
+   const struct corpus *keys[] = {&q.hits, &q.misses};
+   const char *ops[] = {"locate hit", "locate miss"};
+   for (size_t k = 0; k < 2; k++) {
+      const struct corpus *qs = keys[k];
+
+      for (size_t r = 0; r < num_runs; r++) {
+         const struct halva *hv = runs[r].hv;
+         measure_start(&m);
+         for (size_t i = 0; i < nq; i++)
+            sum += hv_locate(hv, corpus_word(qs, i), qs->lens[i]);
+         measure_stop(&m);
+         report(ops[k], runs[r].label, &m, nq);
+      }
+
+      measure_start(&m);
+      for (size_t i = 0; i < nq; i++) {
+         size_t pos = array_lower_bound(&arr, corpus_word(qs, i),
+                                        qs->lens[i]);
+         sum += pos < n && !lmemcmp(arr.words[pos], arr.lens[pos],
+                                    corpus_word(qs, i), qs->lens[i]);
+      }
+      measure_stop(&m);
+      report(ops[k], "array", &m, nq);
+
+      measure_start(&m);
+      for (size_t i = 0; i < nq; i++)
+         sum += hash_locate(&ht, corpus_word(qs, i), qs->lens[i]);
+      measure_stop(&m);
+      report(ops[k], "hash", &m, nq);
+   }
+
+   for (size_t r = 0; r < num_runs; r++) {
+      const struct halva *hv = runs[r].hv;
+      measure_start(&m);
+      for (size_t i = 0; i < nq; i++)
+         sum += hv_extract(hv, q.ords[i], buf);
+      measure_stop(&m);
+      report("extract", runs[r].label, &m, nq);
+   }
+
+   measure_start(&m);
+   for (size_t i = 0; i < nq; i++) {
+      size_t k = q.ords[i] - 1;
+      memcpy(buf, arr.words[k], arr.lens[k]);
+      buf[arr.lens[k]] = '\0';
+      sum += arr.lens[k];
+   }
+   measure_stop(&m);
+   report("extract", "array", &m, nq);
+
+   /* Seek to a missing word, and read a few words from there. */
+   struct halva_iter it;
+   for (size_t r = 0; r < num_runs; r++) {
+      const struct halva *hv = runs[r].hv;
+      measure_start(&m);
+      for (size_t i = 0; i < nq; i++) {
+         hv_iter_inits(&it, hv, corpus_word(&q.misses, i), q.misses.lens[i]);
+         size_t len;
+         for (size_t j = 0; j < SEEK_LEN && hv_iter_next(&it, &len); j++)
+            sum += len;
+      }
+      measure_stop(&m);
+      report("seek", runs[r].label, &m, nq);
+   }
+
+   measure_start(&m);
+   for (size_t i = 0; i < nq; i++) {
+      size_t pos = array_lower_bound(&arr, corpus_word(&q.misses, i),
+                                     q.misses.lens[i]);
+      for (size_t j = 0; j < SEEK_LEN && pos + j < n; j++) {
+         memcpy(buf, arr.words[pos + j], arr.lens[pos + j]);
+         sum += arr.lens[pos + j];
+      }
+   }
+   measure_stop(&m);
+   report("seek", "array", &m, nq);
+
+   /* Full scan. */
+   for (size_t r = 0; r < num_runs; r++) {
+      measure_start(&m);
+      hv_iter_init(&it, runs[r].hv);
+      for (size_t len; hv_iter_next(&it, &len); )
+         sum += len;
+      measure_stop(&m);
+      report("scan", runs[r].label, &m, n);
+   }
+
+   measure_start(&m);
+   for (size_t i = 0; i < n; i++) {
+      memcpy(buf, arr.words[i], arr.lens[i]);
+      sum += arr.lens[i] + (unsigned char)buf[0];
+   }
+   measure_stop(&m);
+   report("scan", "array", &m, n);
+
+   putchar('\n');
+   g_sink += sum;
+
+   for (size_t r = 0; r < num_runs; r++) {
+      hv_free(runs[r].hv);
+      free(runs[r].mem.data);
+   }
+   free(ht.slots);
+   array_fini(&arr);
+   free(words);
+   corpus_fini(&q.hits);
+   corpus_fini(&q.misses);
+   free(q.ords);
+}
+
+static void parse_lengths(const char *str)
+{
+   char *end;
+   errno = 0;
+   unsigned long min = strtoul(str, &end, 10);
+   if (*end != ':' || errno)
+      die("invalid length range '%s'", str);
+   unsigned long max = strtoul(end + 1, &end, 10);
+   if (*end || errno || !min || min > max || max > HV_MAX_WORD_LEN)
+      die("invalid length range '%s'", str);
+   g_opts.min_len = min;
+   g_opts.max_len = max;
+}
+
+int main(int argc, char **argv)
+{
+   const char *corpus = NULL, *lengths = NULL, *engine = NULL;
+   size_t seed = g_opts.seed;
+   struct option opts[] = {
+      {'c', "corpus", OPT_STR(corpus)},
+      {'n', "size", OPT_SIZE_T(g_opts.size)},
+      {'l', "lengths", OPT_STR(lengths)},
+      {'a', "alphabet", OPT_SIZE_T(g_opts.alphabet)},
+      {'q', "queries", OPT_SIZE_T(g_opts.num_queries)},
+      {'b', "blocking-factor", OPT_SIZE_T(g_opts.blocking_factor)},
+      {'e', "engine", OPT_STR(engine)},
+      {'s', "seed", OPT_SIZE_T(seed)},
+      {0},
+   };
+   const char *help =
+      #include "bench.ih"
+   ;
+   parse_options(opts, help, &argc, &argv);
+   if (argc)
+      die("wrong number of arguments");
+   if (lengths)
+      parse_lengths(lengths);
+   if (engine) {
+      for (size_t i = 0; i < NUM_ENGINES; i++)
+         if (!strcmp(engine, g_engines[i][0]))
+            g_opts.engine = i;
+      if (g_opts.engine < 0)
+         die("unknown engine '%s'", engine);
+   }
+   if (g_opts.alphabet < 2 || g_opts.alphabet > 255)
+      die("alphabet size must be between 2 and 255");
+   if (!g_opts.num_queries)
+      die("number of queries must be > 0");
+   g_opts.seed = seed;
+
+   perf_init();
+
+   static const struct {
+      const char *name;
+      void (*gen)(struct corpus *);
+   } gens[] = {
+      {"words", NULL},
+      {"urls", gen_urls},
+      {"ngrams", gen_ngrams},
+      {"random", gen_random},
+   };
+   bool found = false;
+   for (size_t i = 0; i < sizeof gens / sizeof *gens; i++) {
+      if (corpus && strcmp(corpus, gens[i].name))
+         continue;
+      found = true;
+      g_rng = g_opts.seed | 1;
+      struct corpus c = {0};
+      if (gens[i].gen)
+         gens[i].gen(&c);
+      else
+         load_file(&c, WORDS_PATH);
+      bench_corpus(gens[i].name, &c);
+      corpus_fini(&c);
+   }
+   if (!found) {
+      g_rng = g_opts.seed | 1;
+      struct corpus c = {0};
+      load_file(&c, corpus);
+      bench_corpus(corpus, &c);
+      corpus_fini(&c);
+   }
+   return EXIT_SUCCESS;
+}
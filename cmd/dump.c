@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "cmd.h"
+#include "dump.h"
+
+/* Words are written by blocks of that many bytes. */
+#define DUMP_BLOCK_SIZE (1 << 20)
+
+/* Number of buckets per chunk, before chunks are balanced by size. */
+#define CHUNK_BUCKETS 4096
+
+/* Number of chunks in flight per worker thread. */
+#define CHUNKS_PER_THREAD 4
+
+struct chunk {
+   char *out;           /* Formatted words. */
+   size_t size;
+   size_t alloc;
+   bool done;           /* Whether the words are ready. */
+};
+
+struct dumper {
+   const struct halva *hv;
+   enum format fmt;
+   uint32_t *bounds;       /* Bucket ranges of the chunks. */
+   size_t num_chunks;
+   struct chunk *slots;    /* Ring of chunks, indexed by chunk number. */
+   size_t num_slots;
+   size_t next_job;        /* Number of the next chunk to format. */
+   size_t num_written;     /* Number of chunks written so far. */
+   pthread_mutex_t lock;
+   pthread_cond_t job_cond;   /* A slot was freed. */
+   pthread_cond_t done_cond;  /* A chunk was formatted. */
+};
+
+static void write_out(const char *data, size_t size)
+{
+   if (fwrite(data, 1, size, stdout) != size)
+      die("cannot dump lexicon:");
+}
+
+static void format_chunk(const struct halva *hv, enum format fmt,
+                         uint32_t first_bkt, uint32_t end_bkt,
+                         struct chunk *chunk)
+{
+   struct halva_iter itor;
+   hv_iter_init_bucket_range(&itor, hv, first_bkt, end_bkt);
+   chunk->size = 0;
+   const char *word;
+   size_t len;
+   while ((word = hv_iter_next(&itor, &len))) {
+      chunk->out = grow(chunk->out, &chunk->alloc,
+                        chunk->size + RECORD_MAX_SIZE(len));
+      chunk->size += put_record(fmt, &chunk->out[chunk->size], word, len);
+   }
+}
+
+static void *worker(void *arg)
+{
+   struct dumper *d = arg;
+
+   for (;;) {
+      pthread_mutex_lock(&d->lock);
+      while (d->next_job < d->num_chunks
+             && d->next_job - d->num_written == d->num_slots)
+         pthread_cond_wait(&d->job_cond, &d->lock);
+      if (d->next_job == d->num_chunks) {
+         pthread_mutex_unlock(&d->lock);
+         return NULL;
+      }
+      size_t i = d->next_job++;
+      struct chunk *chunk = &d->slots[i % d->num_slots];
+      pthread_mutex_unlock(&d->lock);
+
+      format_chunk(d->hv, d->fmt, d->bounds[i], d->bounds[i + 1], chunk);
+
+      pthread_mutex_lock(&d->lock);
+      chunk->done = true;
+      pthread_cond_broadcast(&d->done_cond);
+      pthread_mutex_unlock(&d->lock);
+   }
+}
+
+/* Has chunks formatted by workers, and writes them in order on the calling
+ * thread. At most "num_slots" chunks are kept in memory.
+ */
+static void run_dumper(struct dumper *d, size_t num_threads)
+{
+   pthread_t *threads = malloc(num_threads * sizeof *threads);
+   if (!threads)
+      die("out of memory");
+   for (size_t i = 0; i < num_threads; i++)
+      if ((errno = pthread_create(&threads[i], NULL, worker, d)))
+         die("cannot create thread:");
+
+   for (size_t i = 0; i < d->num_chunks; i++) {
+      struct chunk *chunk = &d->slots[i % d->num_slots];
+      pthread_mutex_lock(&d->lock);
+      while (!chunk->done)
+         pthread_cond_wait(&d->done_cond, &d->lock);
+      pthread_mutex_unlock(&d->lock);
+
+      write_out(chunk->out, chunk->size);
+
+      pthread_mutex_lock(&d->lock);
+      chunk->done = false;
+      d->num_written++;
+      pthread_cond_broadcast(&d->job_cond);
+      pthread_mutex_unlock(&d->lock);
+   }
+
+   for (size_t i = 0; i < num_threads; i++)
+      pthread_join(threads[i], NULL);
+   free(threads);
+}
+
+static void dump_serial(const struct halva *hv, const struct halva_subset *sub,
+                        enum format fmt)
+{
+   static char buf[DUMP_BLOCK_SIZE];
+   size_t size = 0;
+   struct halva_iter itor;
+   struct halva_subset_iter sub_itor;
+   if (sub)
+      hv_subset_iter_init(&sub_itor, sub, hv);
+   else
+      hv_iter_init(&itor, hv);
+   const char *word;
+   size_t len;
+   while ((word = sub ? hv_subset_iter_next(&sub_itor, &len, NULL)
+                      : hv_iter_next(&itor, &len))) {
+      if (size + RECORD_MAX_SIZE(HV_MAX_WORD_LEN) > sizeof buf) {
+         write_out(buf, size);
+         size = 0;
+      }
+      size += put_record(fmt, &buf[size], word, len);
+   }
+   write_out(buf, size);
+}
+
+void dump_lexicon(const struct halva *hv, const struct halva_subset *sub,
+                  enum format fmt, size_t num_threads)
+{
+   uint32_t num_bkts = hv_num_buckets(hv);
+   if (!sub && num_threads > 1 && num_bkts > CHUNK_BUCKETS) {
+      struct dumper d = {
+         .hv = hv,
+         .fmt = fmt,
+         .num_chunks = (num_bkts + CHUNK_BUCKETS - 1) / CHUNK_BUCKETS,
+         .num_slots = num_threads * CHUNKS_PER_THREAD,
+         .lock = PTHREAD_MUTEX_INITIALIZER,
+         .job_cond = PTHREAD_COND_INITIALIZER,
+         .done_cond = PTHREAD_COND_INITIALIZER,
+      };
+      d.bounds = malloc((d.num_chunks + 1) * sizeof *d.bounds);
+      d.slots = calloc(d.num_slots, sizeof *d.slots);
+      if (!d.bounds || !d.slots)
+         die("out of memory");
+      hv_split_buckets(hv, d.num_chunks, d.bounds);
+
+      run_dumper(&d, num_threads);
+
+      for (size_t i = 0; i < d.num_slots; i++)
+         free(d.slots[i].out);
+      free(d.slots);
+      free(d.bounds);
+   } else {
+      dump_serial(hv, sub, fmt);
+   }
+   if (fflush(stdout))
+      die("cannot dump lexicon:");
+}
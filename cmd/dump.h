@@ -0,0 +1,16 @@
+#ifndef DUMP_H
+#define DUMP_H
+
+#include <stddef.h>
+#include "input.h"
+#include "../halva.h"
+
+/* Writes the words of a lexicon to the standard output, in order, in the
+ * given format. If "num_threads" is > 1, the lexicon is split into chunks that
+ * are formatted in parallel, and written back in order. If "sub" is not NULL,
+ * only the words of this subset are written, by the calling thread.
+ */
+void dump_lexicon(const struct halva *hv, const struct halva_subset *sub,
+                  enum format fmt, size_t num_threads);
+
+#endif
@@ -1,6 +1,15 @@
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <unistd.h>
 #include "cmd.h"
+#include "input.h"
+#include "dump.h"
+#include "lookup.h"
+#include "optimize.h"
+#include "serve.h"
 #include "../halva.h"
 
 static const char *read_line(size_t *len_p, size_t *line_no_p)
@@ -26,61 +35,685 @@ static const char *read_line(size_t *len_p, size_t *line_no_p)
    return NULL;
 }
 
+static int read_file(void *fp, void *buf, size_t size)
+{
+   return fread(buf, 1, size, fp) == size ? 0 : -1;
+}
+
+/* Loads a lexicon with the given allocator, or with the standard one if it is
+ * NULL.
+ */
+static struct halva *load_with(const char *path,
+                               const struct halva_allocator *allocator)
+{
+   FILE *fp = fopen(path, "rb");
+   if (!fp)
+      die("cannot open '%s':", path);
+
+   /* Compressed lexicons are decompressed on all processors. */
+   long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+   struct halva *hv;
+   int ret = hv_load_with_allocator(&hv, read_file, fp, ncpus > 0 ? ncpus : 1,
+                                    allocator);
+   fclose(fp);
+   if (ret)
+      die("cannot load lexicon '%s': %s", path, hv_strerror(ret));
+   return hv;
+}
+
+static struct halva *load(const char *path)
+{
+   return load_with(path, NULL);
+}
+
+static struct halva_subset *load_subset(const char *path,
+                                        const struct halva *hv)
+{
+   FILE *fp = fopen(path, "rb");
+   if (!fp)
+      die("cannot open '%s':", path);
+
+   struct halva_subset *sub;
+   int ret = hv_subset_load_file(&sub, hv, fp);
+   fclose(fp);
+   if (ret == HV_EINVAL)
+      die("subset '%s' was built for another lexicon", path);
+   if (ret)
+      die("cannot load subset '%s': %s", path, hv_strerror(ret));
+   return sub;
+}
+
+static void save(struct halva_enc *enc, const char *path)
+{
+   FILE *fp = fopen(path, "wb");
+   if (!fp)
+      die("cannot open '%s' for writing:", path);
+   int ret = hv_enc_dump_file(enc, fp);
+   if (ret)
+      die("cannot dump lexicon: %s", hv_strerror(ret));
+   if (fclose(fp))
+      die("IO error:");
+}
+
+/* Words are read by blocks of that many bytes, and added by batches of that
+ * many words, without being copied.
+ */
+#define CREATE_BLOCK_SIZE (1 << 23)
+#define CREATE_BATCH_SIZE 4096
+
+/* Reports an error while adding "word". In delimited formats, records are
+ * numbered by counting delimiters from the start of the batch, because empty
+ * ones are skipped. Otherwise, the record number is the index of the word in
+ * the batch.
+ */
+static noreturn void add_error(enum format fmt, const char *batch,
+                               size_t batch_no, size_t idx,
+                               const char *word, size_t len, int err)
+{
+   size_t rec_no = batch_no + idx;
+   if (fmt == FORMAT_LINES || fmt == FORMAT_NUL) {
+      int delim = fmt == FORMAT_NUL ? '\0' : '\n';
+      rec_no = batch_no;
+      for (const char *p = batch; (p = memchr(p, delim, word - p)); p++)
+         rec_no++;
+   }
+   if (fmt != FORMAT_LINES)
+      die("cannot add record %zu: %s", rec_no, hv_strerror(err));
+   if (err == HV_EWORD && len > HV_MAX_WORD_LEN)
+      die("word '%.*s' too long at line %zu (length limit is %d)",
+          (int)len, word, rec_no, HV_MAX_WORD_LEN);
+   die("cannot add word '%.*s' at line %zu: %s",
+       (int)len, word, rec_no, hv_strerror(err));
+}
+
+static const char *const engine_names[] = {
+   [HV_ENGINE_FRONT_CODING] = "front-coding",
+   [HV_ENGINE_TRIE] = "trie",
+};
+
+static int parse_engine(const char *name)
+{
+   for (size_t i = 0; i < sizeof engine_names / sizeof *engine_names; i++)
+      if (!strcmp(name, engine_names[i]))
+         return i;
+   die("unknown engine '%s'", name);
+}
+
 static void create(int argc, char **argv)
 {
-   parse_options(NULL, NULL, &argc, &argv);
+   const char *format = "lines";
+   const char *engine = "front-coding";
+   size_t bf = HV_BLOCKING_FACTOR;
+   bool compress = false, suffixes = false, optimize = false;
+   struct opt_target target = {0};
+   size_t num_threads = 0;
+   struct option opts[] = {
+      {'f', "format", OPT_STR(format)},
+      {'b', "blocking-factor", OPT_SIZE_T(bf)},
+      {'e', "engine", OPT_STR(engine)},
+      {'z', "compress", OPT_BOOL(compress)},
+      {'s', "suffixes", OPT_BOOL(suffixes)},
+      {'O', "optimize", OPT_BOOL(optimize)},
+      {'l', "max-latency", OPT_DOUBLE(target.max_latency)},
+      {'m', "max-size", OPT_SIZE_T(target.max_size)},
+      {'j', "threads", OPT_SIZE_T(num_threads)},
+      {0},
+   };
+   parse_options(opts, NULL, &argc, &argv);
    if (argc != 1)
       die("wrong number of arguments");
+   enum format fmt = parse_format(format);
+   if (optimize && !(target.max_latency > 0) && !target.max_size)
+      die("--optimize requires --max-latency or --max-size");
+   if (!num_threads) {
+      long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+      num_threads = ncpus > 0 ? ncpus : 1;
+   }
 
    struct halva_enc enc = HV_ENC_INIT;
+   if (bf > UINT32_MAX || hv_enc_set_blocking_factor(&enc, bf))
+      die("invalid blocking factor (must be a power of two between %d and %d)",
+          HV_MIN_BLOCKING_FACTOR, HV_MAX_BLOCKING_FACTOR);
+   hv_enc_set_engine(&enc, parse_engine(engine));
+   hv_enc_set_compression(&enc, compress ? HV_FRAME_SIZE : 0);
+   hv_enc_set_suffix_index(&enc, suffixes);
+   struct reader rd = READER_INIT(fmt);
+   char *block = NULL;
+   size_t size, alloc = 0;
+   size_t rec_no = 1;
+   static const void *words[CREATE_BATCH_SIZE];
+   static size_t lens[CREATE_BATCH_SIZE];
+
+   while (read_block(&rd, CREATE_BLOCK_SIZE, &block, &size, &alloc)) {
+      const char *p = block, *end = block + size;
+      while (p < end) {
+         const char *batch = p;
+         size_t num_recs;
+         size_t num = split_records(fmt, &p, end, words, lens,
+                                    CREATE_BATCH_SIZE, &num_recs);
+         uint32_t num_words = enc.num_words;
+         int ret = hv_enc_add_many(&enc, num, words, lens);
+         if (ret) {
+            size_t i = enc.num_words - num_words;
+            add_error(fmt, batch, rec_no, i, words[i], lens[i], ret);
+         }
+         rec_no += num_recs;
+      }
+   }
+   free(block);
+   reader_fini(&rd);
+
+   if (optimize)
+      optimize_lexicon(&enc, &target, num_threads, *argv);
+   else
+      save(&enc, *argv);
+   hv_enc_fini(&enc);
+}
+
+static void dump(int argc, char **argv)
+{
+   const char *format = "lines";
+   const char *subset_path = NULL;
+   size_t num_threads = 1;
+   struct option opts[] = {
+      {'f', "format", OPT_STR(format)},
+      {'j', "threads", OPT_SIZE_T(num_threads)},
+      {'s', "subset", OPT_STR(subset_path)},
+      {0},
+   };
+   parse_options(opts, NULL, &argc, &argv);
+   if (argc != 1)
+      die("wrong number of arguments");
+   enum format fmt = parse_format(format);
+
+   struct halva *hv = load(*argv);
+   struct halva_subset *sub = subset_path ? load_subset(subset_path, hv) : NULL;
+   dump_lexicon(hv, sub, fmt, num_threads);
+   hv_subset_free(sub);
+   hv_free(hv);
+}
+
+static void lookup(int argc, char **argv, enum lookup_op op)
+{
+   size_t num_threads = 1, cache_size = 0;
+   struct option opts[] = {
+      {'j', "threads", OPT_SIZE_T(num_threads)},
+      {'c', "cache", OPT_SIZE_T(cache_size)},
+      {0},
+   };
+   parse_options(opts, NULL, &argc, &argv);
+   if (argc != 1)
+      die("wrong number of arguments");
+
+   struct halva *hv = load(*argv);
+   lookup_stream(hv, op, num_threads, cache_size);
+   hv_free(hv);
+}
+
+static void locate(int argc, char **argv)
+{
+   lookup(argc, argv, LOOKUP_LOCATE);
+}
+
+static void extract(int argc, char **argv)
+{
+   lookup(argc, argv, LOOKUP_EXTRACT);
+}
+
+static void verify(int argc, char **argv)
+{
+   parse_options(NULL, NULL, &argc, &argv);
+   if (argc != 1)
+      die("wrong number of arguments");
+
+   struct halva *hv = load(*argv);
+   int ret = hv_verify(hv);
+   if (ret)
+      die("invalid lexicon '%s': %s", *argv, hv_strerror(ret));
+   hv_free(hv);
+}
+
+static void print_hist(const char *title, const uint32_t *hist, size_t size,
+                       bool log_scale)
+{
+   printf("%s:\n", title);
+   for (size_t i = 0; i < size; i++) {
+      if (!hist[i])
+         continue;
+      if (log_scale)
+         printf("   %10zu-%-10zu %10" PRIu32 "\n",
+                (size_t)1 << i, ((size_t)1 << (i + 1)) - 1, hist[i]);
+      else
+         printf("   %-21zu %10" PRIu32 "\n", i, hist[i]);
+   }
+}
+
+static void stats(int argc, char **argv)
+{
+   bool queries = false;
+   size_t cache_size = 0;
+   struct option opts[] = {
+      {'q', "queries", OPT_BOOL(queries)},
+      {'c', "cache", OPT_SIZE_T(cache_size)},
+      {0},
+   };
+   parse_options(opts, NULL, &argc, &argv);
+   if (argc != 1)
+      die("wrong number of arguments");
+#ifndef HV_STATS
+   /* Don't run the queries for nothing. */
+   if (queries && !cache_size)
+      die("runtime counters are not available (compile with HV_STATS)");
+#endif
+
+   struct halva *hv = load(*argv);
+
+   struct hv_report rep;
+   hv_report(hv, &rep);
+   printf("words                 %10" PRIu32 "\n", rep.num_words);
+   printf("buckets               %10" PRIu32 "\n", rep.num_bkts);
+   printf("blocking factor       %10" PRIu32 "\n", rep.blocking_factor);
+   printf("engine                %10s\n", engine_names[rep.engine]);
+   printf("total size            %10zu\n", rep.total_size);
+   if (rep.engine == HV_ENGINE_TRIE) {
+      printf("trie size             %10zu\n", rep.body_size);
+      printf("trie nodes            %10" PRIu32 "\n", rep.num_nodes);
+   } else {
+      printf("pointers size         %10zu\n", rep.header_size);
+      printf("buckets size          %10zu\n", rep.body_size);
+   }
+   printf("values size           %10zu\n", rep.values_size);
+   printf("value width           %10u\n", rep.value_width);
+   printf("suffix index size     %10zu\n", rep.suffix_size);
+   printf("frame size            %10" PRIu32 "\n", rep.frame_size);
+   printf("stored size           %10zu\n", rep.stored_size);
+   printf("bytes per word        %10.2f\n",
+          rep.num_words ? (double)rep.total_size / rep.num_words : 0.);
+   if (rep.engine == HV_ENGINE_FRONT_CODING) {
+      printf("two-byte entries      %10" PRIu32 "\n", rep.byte_entries);
+      print_hist("bucket sizes", rep.bkt_sizes,
+                 sizeof rep.bkt_sizes / sizeof *rep.bkt_sizes, true);
+   }
+   print_hist("shared prefix lengths", rep.prefix_lens,
+              sizeof rep.prefix_lens / sizeof *rep.prefix_lens, false);
+   print_hist("word lengths", rep.word_lens,
+              sizeof rep.word_lens / sizeof *rep.word_lens, false);
+
+   struct halva_cache *cache = NULL;
+   int ret;
+   if (queries && cache_size && (ret = hv_cache_new(&cache, hv, cache_size)))
+      die("cannot create cache: %s", hv_strerror(ret));
+
+   if (queries) {
+      const char *word;
+      size_t len, line_no;
+      while ((word = read_line(&len, &line_no))) {
+         if (cache)
+            hv_cache_locate(cache, word, len);
+         else
+            hv_locate(hv, word, len);
+      }
+   }
+
+   if (cache) {
+      struct hv_cache_stats st;
+      hv_cache_get_stats(cache, &st);
+      uint64_t lookups = st.hits + st.misses;
+      printf("cache:\n");
+      printf("   hits               %10" PRIu64 "\n", st.hits);
+      printf("   misses             %10" PRIu64 "\n", st.misses);
+      printf("   evictions          %10" PRIu64 "\n", st.evictions);
+      printf("   hit rate           %10.2f\n",
+             lookups ? (double)st.hits / lookups : 0.);
+      hv_cache_free(cache);
+   }
+
+#ifdef HV_STATS
+   struct hv_stats st;
+   hv_get_stats(&st);
+   uint64_t lookups = st.locate_hits + st.locate_misses;
+   printf("counters:\n");
+   printf("   locate hits        %10" PRIu64 "\n", st.locate_hits);
+   printf("   locate misses      %10" PRIu64 "\n", st.locate_misses);
+   printf("   bucket probes      %10" PRIu64 "\n", st.bkt_probes);
+   printf("   entries decoded    %10" PRIu64 "\n", st.entries_decoded);
+   printf("   entries per lookup %10.2f\n",
+          lookups ? (double)st.entries_decoded / lookups : 0.);
+   printf("   iterated words     %10" PRIu64 "\n", st.iter_words);
+   printf("   bytes loaded       %10" PRIu64 "\n", st.bytes_loaded);
+#endif
+
+   if (ferror(stdout))
+      die("cannot display statistics:");
+   hv_free(hv);
+}
+
+static void grep(int argc, char **argv)
+{
+   parse_options(NULL, NULL, &argc, &argv);
+   if (argc != 2)
+      die("wrong number of arguments");
+
+   struct halva *hv = load(argv[0]);
+   const char *pattern = argv[1];
+
+   struct halva_glob_iter itor;
+   int ret = hv_glob_iter_init(&itor, hv, pattern, strlen(pattern));
+   if (ret)
+      die("cannot match pattern: %s", hv_strerror(ret));
+   const char *word;
+   while ((word = hv_glob_iter_next(&itor, NULL)))
+      puts(word);
+
+   if (ferror(stdout))
+      die("cannot display matching words:");
+
+   hv_glob_iter_fini(&itor);
+   hv_free(hv);
+}
+
+static void subset(int argc, char **argv)
+{
+   parse_options(NULL, NULL, &argc, &argv);
+   if (argc != 2)
+      die("wrong number of arguments");
+
+   struct halva *hv = load(argv[0]);
+   struct halva_subset *sub;
+   if (hv_subset_new(&sub, hv))
+      die("out of memory");
+
    const char *word;
    size_t len, line_no;
    while ((word = read_line(&len, &line_no))) {
-      int ret = hv_enc_add(&enc, word, len);
-      if (ret)
-         die("cannot add word '%s' at line %zu: %s", word, line_no, hv_strerror(ret));
+      uint32_t pos = hv_locate(hv, word, len);
+      if (!pos)
+         die("word '%s' at line %zu is not in the lexicon", word, line_no);
+      if (hv_subset_add(sub, pos))
+         die("out of memory");
    }
 
-   const char *path = *argv;
-   FILE *fp = fopen(path, "wb");
+   FILE *fp = fopen(argv[1], "wb");
    if (!fp)
-      die("cannot open '%s' for writing:", path);
-   int ret = hv_enc_dump_file(&enc, fp);
+      die("cannot open '%s' for writing:", argv[1]);
+   int ret = hv_subset_dump_file(sub, fp);
    if (ret)
-      die("cannot dump lexicon: %s", hv_strerror(ret));
+      die("cannot dump subset: %s", hv_strerror(ret));
    if (fclose(fp))
       die("IO error:");
 
+   hv_subset_free(sub);
+   hv_free(hv);
+}
+
+static int compare_ords(const void *a, const void *b)
+{
+   uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+   return (x > y) - (x < y);
+}
+
+static void suffix(int argc, char **argv)
+{
+   parse_options(NULL, NULL, &argc, &argv);
+   if (argc != 2)
+      die("wrong number of arguments");
+
+   struct halva *hv = load(argv[0]);
+   const char *suffix = argv[1];
+   if (!hv_has_suffix_index(hv))
+      die("lexicon '%s' has no suffix index", argv[0]);
+
+   /* Matches come in the order of their reversed spelling, display them in
+    * lexicon order.
+    */
+   struct halva_suffix_iter itor;
+   uint32_t num = hv_suffix_iter_init(&itor, hv, suffix, strlen(suffix));
+   uint32_t *ords = malloc((num ? num : 1) * sizeof *ords);
+   if (!ords)
+      die("out of memory");
+   for (uint32_t i = 0; i < num; i++)
+      hv_suffix_iter_next(&itor, NULL, &ords[i]);
+   qsort(ords, num, sizeof *ords, compare_ords);
+
+   char word[HV_MAX_WORD_LEN + 1];
+   for (uint32_t i = 0; i < num; i++) {
+      hv_extract(hv, ords[i], word);
+      puts(word);
+   }
+   if (ferror(stdout))
+      die("cannot display matching words:");
+
+   free(ords);
+   hv_free(hv);
+}
+
+static void write_remap(const char *prefix, size_t n, const uint32_t *remap,
+                        size_t size)
+{
+   char path[FILENAME_MAX];
+   if (snprintf(path, sizeof path, "%s%zu.remap", prefix, n) >= (int)sizeof path)
+      die("remap file path too long");
+
+   FILE *fp = fopen(path, "wb");
+   if (!fp)
+      die("cannot open '%s' for writing:", path);
+   if (fwrite(remap, sizeof *remap, size, fp) != size || fclose(fp))
+      die("cannot write '%s':", path);
+}
+
+static void combine(int argc, char **argv,
+                    int (*op)(struct halva_enc *, const struct halva *const *,
+                              size_t, uint32_t *const *))
+{
+   const char *remap_prefix = NULL;
+   struct option opts[] = {
+      {'r', "remap", OPT_STR(remap_prefix)},
+      {0},
+   };
+   parse_options(opts, NULL, &argc, &argv);
+   if (argc < 2)
+      die("wrong number of arguments");
+
+   const char *path = *argv++;
+   size_t num = --argc;
+
+   struct halva **hvs = malloc(num * sizeof *hvs);
+   uint32_t **remaps = calloc(num, sizeof *remaps);
+   if (!hvs || !remaps)
+      die("out of memory");
+   for (size_t i = 0; i < num; i++) {
+      hvs[i] = load(argv[i]);
+      if (remap_prefix && hv_size(hvs[i])) {
+         remaps[i] = malloc(hv_size(hvs[i]) * sizeof **remaps);
+         if (!remaps[i])
+            die("out of memory");
+      }
+   }
+
+   struct halva_enc enc = HV_ENC_INIT;
+   hv_enc_set_blocking_factor(&enc, hv_blocking_factor(hvs[0]));
+   hv_enc_set_engine(&enc, hv_engine(hvs[0]));
+   hv_enc_set_compression(&enc, hv_frame_size(hvs[0]));
+   hv_enc_set_suffix_index(&enc, hv_has_suffix_index(hvs[0]));
+   int ret = op(&enc, (const struct halva *const *)hvs, num, remaps);
+   if (ret)
+      die("cannot combine lexicons: %s", hv_strerror(ret));
+   save(&enc, path);
    hv_enc_fini(&enc);
+
+   for (size_t i = 0; i < num; i++) {
+      if (remap_prefix)
+         write_remap(remap_prefix, i + 1, remaps[i], hv_size(hvs[i]));
+      free(remaps[i]);
+      hv_free(hvs[i]);
+   }
+   free(remaps);
+   free(hvs);
 }
 
-static void dump(int argc, char **argv)
+static void merge(int argc, char **argv)
+{
+   combine(argc, argv, hv_merge);
+}
+
+static void intersect(int argc, char **argv)
+{
+   combine(argc, argv, hv_intersect);
+}
+
+static void diff(int argc, char **argv)
+{
+   combine(argc, argv, hv_diff);
+}
+
+static void compact(int argc, char **argv)
 {
    parse_options(NULL, NULL, &argc, &argv);
-   if (argc != 1)
+   if (argc != 2)
       die("wrong number of arguments");
 
+   const char *path = argv[0];
+   struct halva *base = load(argv[0]), *delta = load(argv[1]);
+   const struct halva *hvs[] = {base, delta};
+
+   struct halva_enc enc = HV_ENC_INIT;
+   hv_enc_set_blocking_factor(&enc, hv_blocking_factor(base));
+   hv_enc_set_engine(&enc, hv_engine(base));
+   hv_enc_set_compression(&enc, hv_frame_size(base));
+   hv_enc_set_suffix_index(&enc, hv_has_suffix_index(base));
+   int ret = hv_merge(&enc, hvs, 2, NULL);
+   if (ret)
+      die("cannot merge lexicons: %s", hv_strerror(ret));
+
+   /* Don't clobber the base lexicon if something goes wrong. */
+   char tmp[FILENAME_MAX];
+   if (snprintf(tmp, sizeof tmp, "%s.tmp", path) >= (int)sizeof tmp)
+      die("lexicon path too long");
+   save(&enc, tmp);
+   if (rename(tmp, path))
+      die("cannot rename '%s' to '%s':", tmp, path);
+
+   hv_enc_fini(&enc);
+   hv_free(base);
+   hv_free(delta);
+}
+
+/* Makes a C identifier from the file name of a path, without its extension. */
+static const char *identifier(const char *path)
+{
+   static char name[FILENAME_MAX + 2];
+   const char *base = strrchr(path, '/');
+   base = base ? base + 1 : path;
+   size_t len = strcspn(base, ".");
+
+   char *p = name;
+   if (!len || isdigit((unsigned char)*base))
+      *p++ = '_';
+   for (size_t i = 0; i < len && i < FILENAME_MAX; i++)
+      *p++ = isalnum((unsigned char)base[i]) ? base[i] : '_';
+   *p = '\0';
+   return name;
+}
+
+static void embed(int argc, char **argv)
+{
+   const char *name = NULL;
+   struct option opts[] = {
+      {'n', "name", OPT_STR(name)},
+      {0},
+   };
+   parse_options(opts, NULL, &argc, &argv);
+   if (argc != 1)
+      die("wrong number of arguments");
    const char *path = *argv;
+   if (!name)
+      name = identifier(path);
+
    FILE *fp = fopen(path, "rb");
    if (!fp)
       die("cannot open '%s':", path);
+   unsigned char *data = NULL;
+   size_t size = 0, alloc = 0, got;
+   do {
+      data = grow(data, &alloc, size + 65536);
+      size += got = fread(&data[size], 1, alloc - size, fp);
+   } while (got);
+   if (ferror(fp))
+      die("cannot read '%s':", path);
+   fclose(fp);
 
+   /* Check the lexicon now, so that the generated code can load it as
+    * trusted.
+    */
    struct halva *hv;
-   int ret = hv_load_file(&hv, fp);
-   fclose(fp);
+   int ret = hv_load_buffer(&hv, data, size, HV_LOAD_VERIFY);
    if (ret)
-      die("cannot load lexicon: %s", hv_strerror(ret));
+      die("cannot load lexicon '%s': %s", path, hv_strerror(ret));
+   if (hv_frame_size(hv))
+      die("lexicon '%s' is compressed, and can't be used in place", path);
+   hv_free(hv);
 
-   struct halva_iter itor;
-   hv_iter_init(&itor, hv);
-   const char *word;
-   while ((word = hv_iter_next(&itor, NULL)))
-      puts(word);
+   printf("/* Lexicon '%s', generated by \"halva embed\". Load it with:\n"
+          " *    hv_load_buffer(&hv, %s, %s_size, HV_LOAD_TRUSTED);\n"
+          " */\n"
+          "#include <stddef.h>\n\n"
+          "#ifndef HV_EMBED_ALIGN\n"
+          "#ifdef __cplusplus\n"
+          "#define HV_EMBED_ALIGN alignas(64)\n"
+          "#else\n"
+          "#define HV_EMBED_ALIGN _Alignas(64)\n"
+          "#endif\n"
+          "#endif\n\n"
+          "extern const unsigned char %s[];\n"
+          "extern const size_t %s_size;\n\n"
+          "HV_EMBED_ALIGN const unsigned char %s[] = {",
+          path, name, name, name, name, name);
+   for (size_t i = 0; i < size; i++)
+      printf("%s0x%02x,", i % 12 ? " " : "\n   ", data[i]);
+   printf("\n};\n\nconst size_t %s_size = %zu;\n", name, size);
+   if (fflush(stdout))
+      die("IO error:");
+   free(data);
+}
 
-   if (ferror(stdout))
-      die("cannot dump lexicon:");
+static void serve(int argc, char **argv)
+{
+   size_t num_threads = 0;
+   bool huge_pages = false;
+   struct option opts[] = {
+      {'j', "threads", OPT_SIZE_T(num_threads)},
+      {'H', "huge-pages", OPT_BOOL(huge_pages)},
+      {0},
+   };
+   parse_options(opts, NULL, &argc, &argv);
+   if (argc < 2)
+      die("wrong number of arguments");
 
-   hv_free(hv);
+   const char *socket_path = *argv++;
+   size_t num = --argc;
+   if (num > UINT8_MAX + 1)
+      die("too many lexicons (limit is %d)", UINT8_MAX + 1);
+   if (!num_threads) {
+      long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+      num_threads = ncpus > 0 ? ncpus : 1;
+   }
+
+   struct halva **hvs = malloc(num * sizeof *hvs);
+   if (!hvs)
+      die("out of memory");
+   /* Lexicons never get freed one by one, so pack them together. */
+   struct halva_arena *arena = NULL;
+   if (huge_pages && hv_arena_new(&arena, 0, HV_ARENA_HUGE_PAGES))
+      die("out of memory");
+   for (size_t i = 0; i < num; i++)
+      hvs[i] = load_with(argv[i], arena ? hv_arena_allocator(arena) : NULL);
+
+   serve_lexicons(socket_path, hvs, num, num_threads);
+
+   for (size_t i = 0; i < num; i++)
+      hv_free(hvs[i]);
+   hv_arena_free(arena);
+   free(hvs);
 }
 
 int main(int argc, char **argv)
@@ -88,6 +721,19 @@ int main(int argc, char **argv)
    struct command cmds[] = {
       {"create", create},
       {"dump", dump},
+      {"locate", locate},
+      {"extract", extract},
+      {"grep", grep},
+      {"suffix", suffix},
+      {"subset", subset},
+      {"verify", verify},
+      {"stats", stats},
+      {"merge", merge},
+      {"intersect", intersect},
+      {"diff", diff},
+      {"compact", compact},
+      {"embed", embed},
+      {"serve", serve},
       {0}
    };
    const char *help =
@@ -0,0 +1,229 @@
+#define _GNU_SOURCE  /* memrchr(). */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "cmd.h"
+#include "input.h"
+#include "../halva.h"
+
+enum format parse_format(const char *name)
+{
+   static const char *const names[] = {
+      [FORMAT_LINES] = "lines",
+      [FORMAT_NUL] = "nul",
+      [FORMAT_U8] = "u8",
+      [FORMAT_U16] = "u16",
+      [FORMAT_VARINT] = "varint",
+   };
+   for (size_t i = 0; i < sizeof names / sizeof *names; i++)
+      if (!strcmp(name, names[i]))
+         return i;
+   die("unknown format '%s'", name);
+}
+
+void *grow(void *ptr, size_t *alloc, size_t size)
+{
+   if (size <= *alloc)
+      return ptr;
+   size_t new_alloc = *alloc + (*alloc >> 1);
+   if (new_alloc < size)
+      new_alloc = size;
+   ptr = realloc(ptr, new_alloc);
+   if (!ptr)
+      die("out of memory");
+   *alloc = new_alloc;
+   return ptr;
+}
+
+/* Decodes the length prefix of a record into "*len". Returns the size of the
+ * prefix, or 0 if it is incomplete. Varints longer than two bytes can't
+ * encode a valid length, so they are not decoded further, and "*len" is set to
+ * SIZE_MAX.
+ */
+static size_t get_prefix(enum format fmt, const uint8_t *p, const uint8_t *end,
+                         size_t *len)
+{
+   switch (fmt) {
+   case FORMAT_U8:
+      if (end - p < 1)
+         return 0;
+      *len = p[0];
+      return 1;
+   case FORMAT_U16:
+      if (end - p < 2)
+         return 0;
+      *len = p[0] << 8 | p[1];
+      return 2;
+   case FORMAT_VARINT:
+      if (end - p < 1)
+         return 0;
+      if (!(p[0] & 0x80)) {
+         *len = p[0];
+         return 1;
+      }
+      if (end - p < 2)
+         return 0;
+      *len = p[1] & 0x80 ? SIZE_MAX : (size_t)(p[1] << 7 | (p[0] & 0x7f));
+      return 2;
+   default:
+      abort();
+   }
+}
+
+/* Returns the size of the longest sequence of complete records at the start
+ * of a block.
+ */
+static size_t complete_size(struct reader *rd, const char *data, size_t size)
+{
+   switch (rd->format) {
+   case FORMAT_LINES:
+   case FORMAT_NUL: {
+      const char *end = memrchr(data, rd->format == FORMAT_NUL ? '\0' : '\n',
+                                size);
+      return end ? (size_t)(end + 1 - data) : 0;
+   }
+   default: {
+      const uint8_t *p = (const uint8_t *)data, *end = p + size;
+      for (;;) {
+         size_t len, prefix = get_prefix(rd->format, p, end, &len);
+         if (!prefix)
+            break;
+         if (len > HV_MAX_WORD_LEN)
+            die("word too long at byte offset %zu (length limit is %d)",
+                rd->offset + ((const char *)p - data), HV_MAX_WORD_LEN);
+         if ((size_t)(end - p) - prefix < len)
+            break;
+         p += prefix + len;
+      }
+      return (const char *)p - data;
+   }
+   }
+}
+
+bool read_block(struct reader *rd, size_t min_size,
+                char **buf, size_t *size_p, size_t *alloc)
+{
+   char *data = grow(*buf, alloc, rd->tail_len + min_size);
+   if (rd->tail_len)
+      memcpy(data, rd->tail, rd->tail_len);
+   size_t size = rd->tail_len;
+   rd->tail_len = 0;
+
+   for (;;) {
+      while (!rd->eof && size < *alloc) {
+         ssize_t ret = read(STDIN_FILENO, &data[size], *alloc - size);
+         if (ret < 0) {
+            if (errno == EINTR)
+               continue;
+            die("IO error:");
+         }
+         if (!ret)
+            rd->eof = true;
+         size += ret;
+      }
+      size_t complete = complete_size(rd, data, size);
+      if (rd->eof) {
+         if (complete < size && rd->format > FORMAT_NUL)
+            die("truncated record at byte offset %zu",
+                rd->offset + complete);
+         *buf = data;
+         *size_p = size;
+         rd->offset += size;
+         return size > 0;
+      }
+      if (complete) {
+         *buf = data;
+         *size_p = complete;
+         rd->offset += complete;
+         rd->tail_len = size - complete;
+         rd->tail = grow(rd->tail, &rd->tail_alloc, rd->tail_len);
+         memcpy(rd->tail, &data[complete], rd->tail_len);
+         return true;
+      }
+      /* Not a single complete record yet. */
+      data = grow(data, alloc, size + min_size);
+   }
+}
+
+void reader_fini(struct reader *rd)
+{
+   free(rd->tail);
+}
+
+size_t split_records(enum format fmt, const char **pos, const char *end,
+                     const void **words, size_t *lens, size_t max,
+                     size_t *num_recs)
+{
+   const char *p = *pos;
+   size_t num = 0, recs = 0;
+
+   switch (fmt) {
+   case FORMAT_LINES:
+   case FORMAT_NUL: {
+      int delim = fmt == FORMAT_NUL ? '\0' : '\n';
+      while (num < max && p < end) {
+         const char *q = memchr(p, delim, end - p);
+         if (!q)
+            q = end;
+         if (q > p) {
+            words[num] = p;
+            lens[num++] = q - p;
+         }
+         p = q < end ? q + 1 : end;
+         recs++;
+      }
+      break;
+   }
+   default:
+      while (num < max && p < end) {
+         size_t len, prefix = get_prefix(fmt, (const uint8_t *)p,
+                                         (const uint8_t *)end, &len);
+         if (!prefix)
+            break;
+         p += prefix;
+         words[num] = p;
+         lens[num++] = len;
+         p += len;
+      }
+      recs = num;
+      break;
+   }
+   *pos = p;
+   *num_recs = recs;
+   return num;
+}
+
+size_t put_record(enum format fmt, char *buf, const void *word, size_t len)
+{
+   uint8_t *p = (uint8_t *)buf;
+
+   switch (fmt) {
+   case FORMAT_U8:
+      *p++ = len;
+      break;
+   case FORMAT_U16:
+      *p++ = len >> 8;
+      *p++ = len;
+      break;
+   case FORMAT_VARINT:
+      for (size_t n = len; ; n >>= 7) {
+         if (n < 0x80) {
+            *p++ = n;
+            break;
+         }
+         *p++ = n | 0x80;
+      }
+      break;
+   default:
+      break;
+   }
+   memcpy(p, word, len);
+   p += len;
+   if (fmt == FORMAT_LINES || fmt == FORMAT_NUL)
+      *p++ = fmt == FORMAT_NUL ? '\0' : '\n';
+   return (char *)p - buf;
+}
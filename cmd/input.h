@@ -0,0 +1,68 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Ways of delimiting words in a stream. */
+enum format {
+   FORMAT_LINES,     /* Terminated by a newline. */
+   FORMAT_NUL,       /* Terminated by a zero byte. */
+   FORMAT_U8,        /* Prefixed with their length, as a byte. */
+   FORMAT_U16,       /* Prefixed with their length, as a 16-bit integer in
+                        network order. */
+   FORMAT_VARINT,    /* Prefixed with their length, as an unsigned LEB128
+                        integer. */
+};
+
+/* Returns the format that has the given name. Exits on error. */
+enum format parse_format(const char *name);
+
+/* Reader of the standard input, by blocks of complete records. */
+struct reader {
+   enum format format;
+   char *tail;          /* Partial record at the end of the last block read. */
+   size_t tail_len;
+   size_t tail_alloc;
+   size_t offset;       /* Offset of the tail in the input. */
+   bool eof;
+};
+
+#define READER_INIT(fmt) {.format = (fmt)}
+
+/* Reads a block of at least "min_size" bytes, unless the end of the input is
+ * reached, into "*buf", which is reallocated as needed. "*alloc" is the
+ * current size of the buffer. The block only contains complete records,
+ * except that the terminator of the last one might be missing at the end of
+ * the input. Returns false at end of input. Exits if a length prefix is
+ * invalid, or if the input is truncated.
+ */
+bool read_block(struct reader *, size_t min_size,
+                char **buf, size_t *size, size_t *alloc);
+
+void reader_fini(struct reader *);
+
+/* Splits at most "max" records from a block read with read_block(), starting
+ * at "*pos". Stores pointers to their contents in "words", and their lengths
+ * in "lens". Empty records are skipped, except in length-prefixed formats.
+ * Returns the number of records stored, and updates "*pos". The number of
+ * records consumed, skipped ones included, is stored in "*num_recs".
+ */
+size_t split_records(enum format, const char **pos, const char *end,
+                     const void **words, size_t *lens, size_t max,
+                     size_t *num_recs);
+
+/* Maximum size of a record, given the length of its contents. */
+#define RECORD_MAX_SIZE(len) ((len) + 3)
+
+/* Encodes a record into "buf", which must be at least RECORD_MAX_SIZE(len)
+ * bytes large. Returns the size of the record.
+ */
+size_t put_record(enum format, char *buf, const void *word, size_t len);
+
+/* Reallocates "ptr" to at least "size" bytes, if it is smaller. "*alloc" is
+ * the current size. Exits on error.
+ */
+void *grow(void *ptr, size_t *alloc, size_t size);
+
+#endif
@@ -0,0 +1,267 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "cmd.h"
+#include "input.h"
+#include "lookup.h"
+
+/* Minimum size of the blocks read from the standard input. */
+#define BLOCK_SIZE (1 << 20)
+
+/* Number of items looked up at once. */
+#define BATCH_SIZE 256
+
+/* Number of blocks in flight per worker thread. */
+#define BLOCKS_PER_THREAD 4
+
+/* Maximum length of an ordinal in decimal, newline included. */
+#define ORD_MAX_LEN 11
+
+struct block {
+   char *in;            /* Complete lines. */
+   size_t in_size;
+   size_t in_alloc;
+   char *out;           /* Results, in the same order. */
+   size_t out_size;
+   size_t out_alloc;
+   bool done;           /* Whether results are ready. */
+};
+
+struct pipeline {
+   const struct halva *hv;
+   enum lookup_op op;
+   size_t cache_size;      /* Buckets cached per thread, 0 for none. */
+   struct block *blocks;   /* Ring of blocks, indexed by sequence number. */
+   size_t num_blocks;
+   size_t num_read;        /* Number of blocks read so far. */
+   size_t next_job;        /* Sequence number of the next block to process. */
+   bool stopping;
+   pthread_mutex_t lock;
+   pthread_cond_t job_cond;   /* A block was read, or we are stopping. */
+   pthread_cond_t done_cond;  /* A block was processed. */
+};
+
+static void write_all(const char *data, size_t size)
+{
+   while (size) {
+      ssize_t ret = write(STDOUT_FILENO, data, size);
+      if (ret < 0) {
+         if (errno == EINTR)
+            continue;
+         die("IO error:");
+      }
+      data += ret;
+      size -= ret;
+   }
+}
+
+/* Ordinals that are too large are mapped to 0, which is out of range. */
+static uint32_t parse_ordinal(const char *str, size_t len)
+{
+   uint64_t ord = 0;
+   for (size_t i = 0; i < len; i++) {
+      unsigned digit = (unsigned char)str[i] - '0';
+      if (digit > 9)
+         die("invalid ordinal '%.*s'", (int)len, str);
+      if (ord <= UINT32_MAX)
+         ord = ord * 10 + digit;
+   }
+   return ord <= UINT32_MAX ? ord : 0;
+}
+
+static char *format_ordinal(char *q, uint32_t ord)
+{
+   char buf[ORD_MAX_LEN];
+   char *p = &buf[sizeof buf];
+   do
+      *--p = '0' + ord % 10;
+   while (ord /= 10);
+   size_t len = &buf[sizeof buf] - p;
+   memcpy(q, p, len);
+   return q + len;
+}
+
+static struct halva_cache *new_cache(const struct halva *hv, size_t size)
+{
+   struct halva_cache *cache = NULL;
+   int ret;
+   if (size && (ret = hv_cache_new(&cache, hv, size)))
+      die("cannot create cache: %s", hv_strerror(ret));
+   return cache;
+}
+
+/* Without a cache, lookups are batched, so that their memory accesses
+ * overlap. With one, they are done one at a time, hoping that they hit it.
+ */
+static void process_block(const struct halva *hv, struct halva_cache *cache,
+                          enum lookup_op op, struct block *blk)
+{
+   const char *p = blk->in;
+   const char *end = p + blk->in_size;
+   size_t max_item = op == LOOKUP_EXTRACT ? HV_MAX_WORD_LEN + 1 : ORD_MAX_LEN;
+
+   const void *words[BATCH_SIZE];
+   size_t lens[BATCH_SIZE];
+   uint32_t ords[BATCH_SIZE];
+   char found[BATCH_SIZE][HV_MAX_WORD_LEN + 1];
+
+   blk->out_size = 0;
+   while (p < end) {
+      size_t cnt;
+      for (cnt = 0; cnt < BATCH_SIZE && p < end; cnt++) {
+         const char *nl = memchr(p, '\n', end - p);
+         if (!nl)
+            nl = end;
+         words[cnt] = p;
+         lens[cnt] = nl - p;
+         p = nl < end ? nl + 1 : end;
+      }
+
+      blk->out = grow(blk->out, &blk->out_alloc,
+                      blk->out_size + cnt * max_item);
+      char *q = &blk->out[blk->out_size];
+      switch (op) {
+      case LOOKUP_LOCATE:
+         if (cache)
+            for (size_t i = 0; i < cnt; i++)
+               ords[i] = hv_cache_locate(cache, words[i], lens[i]);
+         else
+            hv_locate_many(hv, cnt, words, lens, ords);
+         for (size_t i = 0; i < cnt; i++) {
+            q = format_ordinal(q, ords[i]);
+            *q++ = '\n';
+         }
+         break;
+      case LOOKUP_EXTRACT:
+         for (size_t i = 0; i < cnt; i++)
+            ords[i] = parse_ordinal(words[i], lens[i]);
+         if (cache)
+            for (size_t i = 0; i < cnt; i++)
+               lens[i] = hv_cache_extract(cache, ords[i], found[i]);
+         else
+            hv_extract_many(hv, cnt, ords, &found[0][0], lens);
+         for (size_t i = 0; i < cnt; i++) {
+            memcpy(q, found[i], lens[i]);
+            q += lens[i];
+            *q++ = '\n';
+         }
+         break;
+      }
+      blk->out_size = q - blk->out;
+   }
+}
+
+static void *worker(void *arg)
+{
+   struct pipeline *pl = arg;
+   struct halva_cache *cache = new_cache(pl->hv, pl->cache_size);
+
+   for (;;) {
+      pthread_mutex_lock(&pl->lock);
+      while (pl->next_job == pl->num_read && !pl->stopping)
+         pthread_cond_wait(&pl->job_cond, &pl->lock);
+      if (pl->next_job == pl->num_read) {
+         pthread_mutex_unlock(&pl->lock);
+         hv_cache_free(cache);
+         return NULL;
+      }
+      struct block *blk = &pl->blocks[pl->next_job++ % pl->num_blocks];
+      pthread_mutex_unlock(&pl->lock);
+
+      process_block(pl->hv, cache, pl->op, blk);
+
+      pthread_mutex_lock(&pl->lock);
+      blk->done = true;
+      pthread_cond_broadcast(&pl->done_cond);
+      pthread_mutex_unlock(&pl->lock);
+   }
+}
+
+/* Reads blocks on the calling thread, has them processed by workers, and
+ * writes their results back in input order.
+ */
+static void run_pipeline(struct pipeline *pl, struct reader *rd,
+                         size_t num_threads)
+{
+   pthread_t *threads = malloc(num_threads * sizeof *threads);
+   if (!threads)
+      die("out of memory");
+   for (size_t i = 0; i < num_threads; i++)
+      if ((errno = pthread_create(&threads[i], NULL, worker, pl)))
+         die("cannot create thread:");
+
+   size_t num_written = 0;
+   for (;;) {
+      while (pl->num_read - num_written < pl->num_blocks) {
+         struct block *blk = &pl->blocks[pl->num_read % pl->num_blocks];
+         if (!read_block(rd, BLOCK_SIZE, &blk->in, &blk->in_size,
+                         &blk->in_alloc))
+            break;
+         pthread_mutex_lock(&pl->lock);
+         blk->done = false;
+         pl->num_read++;
+         pthread_cond_signal(&pl->job_cond);
+         pthread_mutex_unlock(&pl->lock);
+      }
+      if (num_written == pl->num_read)
+         break;
+
+      struct block *blk = &pl->blocks[num_written % pl->num_blocks];
+      pthread_mutex_lock(&pl->lock);
+      while (!blk->done)
+         pthread_cond_wait(&pl->done_cond, &pl->lock);
+      pthread_mutex_unlock(&pl->lock);
+      write_all(blk->out, blk->out_size);
+      num_written++;
+   }
+
+   pthread_mutex_lock(&pl->lock);
+   pl->stopping = true;
+   pthread_cond_broadcast(&pl->job_cond);
+   pthread_mutex_unlock(&pl->lock);
+   for (size_t i = 0; i < num_threads; i++)
+      pthread_join(threads[i], NULL);
+   free(threads);
+}
+
+void lookup_stream(const struct halva *hv, enum lookup_op op,
+                   size_t num_threads, size_t cache_size)
+{
+   struct reader rd = READER_INIT(FORMAT_LINES);
+   struct pipeline pl = {
+      .hv = hv,
+      .op = op,
+      .cache_size = cache_size,
+      .num_blocks = num_threads > 1 ? num_threads * BLOCKS_PER_THREAD : 1,
+      .lock = PTHREAD_MUTEX_INITIALIZER,
+      .job_cond = PTHREAD_COND_INITIALIZER,
+      .done_cond = PTHREAD_COND_INITIALIZER,
+   };
+   pl.blocks = calloc(pl.num_blocks, sizeof *pl.blocks);
+   if (!pl.blocks)
+      die("out of memory");
+
+   if (num_threads > 1) {
+      run_pipeline(&pl, &rd, num_threads);
+   } else {
+      struct halva_cache *cache = new_cache(hv, cache_size);
+      while (read_block(&rd, BLOCK_SIZE, &pl.blocks->in, &pl.blocks->in_size,
+                        &pl.blocks->in_alloc)) {
+         process_block(hv, cache, op, pl.blocks);
+         write_all(pl.blocks->out, pl.blocks->out_size);
+      }
+      hv_cache_free(cache);
+   }
+
+   for (size_t i = 0; i < pl.num_blocks; i++) {
+      free(pl.blocks[i].in);
+      free(pl.blocks[i].out);
+   }
+   free(pl.blocks);
+   reader_fini(&rd);
+}
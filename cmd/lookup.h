@@ -0,0 +1,22 @@
+#ifndef LOOKUP_H
+#define LOOKUP_H
+
+#include <stddef.h>
+#include "../halva.h"
+
+enum lookup_op {
+   LOOKUP_LOCATE,    /* Words to ordinals. */
+   LOOKUP_EXTRACT,   /* Ordinals to words. */
+};
+
+/* Reads items from the standard input, one per line, and writes the result of
+ * their lookup to the standard output, one per line, in the same order.
+ * Unknown words are mapped to 0, out of range ordinals to the empty string.
+ * If "num_threads" is > 1, the input is split into blocks that are processed
+ * in parallel. If "cache_size" is not zero, each thread looks items up through
+ * a cache of that many buckets.
+ */
+void lookup_stream(const struct halva *hv, enum lookup_op op,
+                   size_t num_threads, size_t cache_size);
+
+#endif
@@ -0,0 +1,285 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "cmd.h"
+#include "optimize.h"
+
+/* Number of lookups timed per operation and candidate. */
+#define NUM_SAMPLES 10000
+
+/* One per blocking factor, and one trie. */
+#define MAX_CANDIDATES 16
+
+struct buffer {
+   uint8_t *data;
+   size_t size;
+   size_t alloc;
+};
+
+static int buffer_write(void *arg, const void *data, size_t size)
+{
+   struct buffer *buf = arg;
+   if (size > buf->alloc - buf->size) {
+      size_t alloc = buf->alloc ? buf->alloc : 1 << 16;
+      while (size > alloc - buf->size)
+         alloc *= 2;
+      void *tmp = realloc(buf->data, alloc);
+      if (!tmp)
+         return -1;
+      buf->data = tmp;
+      buf->alloc = alloc;
+   }
+   memcpy(&buf->data[buf->size], data, size);
+   buf->size += size;
+   return 0;
+}
+
+static void dump_to(struct halva_enc *enc, struct buffer *buf)
+{
+   int ret = hv_enc_dump(enc, buffer_write, buf);
+   if (ret)
+      die("cannot dump lexicon: %s", hv_strerror(ret));
+}
+
+static struct halva *load_from(const struct buffer *buf)
+{
+   struct halva *hv;
+   int ret = hv_load_buffer(&hv, buf->data, buf->size, HV_LOAD_TRUSTED);
+   if (ret)
+      die("cannot load lexicon: %s", hv_strerror(ret));
+   return hv;
+}
+
+struct candidate {
+   int engine;
+   uint32_t blocking_factor;
+   struct buffer file;     /* Encoded lexicon. */
+   int ret;                /* Outcome of the encoding. */
+   double locate_p99;      /* In nanoseconds. */
+   double extract_p99;
+};
+
+struct builder {
+   const struct halva *base;
+   struct candidate *cands;
+   size_t num_cands;
+   size_t next;            /* Index of the next candidate to build. */
+   pthread_mutex_t lock;
+};
+
+static void build(const struct halva *base, struct candidate *c)
+{
+   struct halva_enc enc = HV_ENC_INIT;
+   hv_enc_set_blocking_factor(&enc, c->blocking_factor);
+   hv_enc_set_engine(&enc, c->engine);
+   hv_enc_set_compression(&enc, hv_frame_size(base));
+   hv_enc_set_suffix_index(&enc, hv_has_suffix_index(base));
+   c->ret = hv_merge(&enc, &base, 1, NULL);
+   if (!c->ret)
+      c->ret = hv_enc_dump(&enc, buffer_write, &c->file);
+   hv_enc_fini(&enc);
+}
+
+static void *builder_run(void *arg)
+{
+   struct builder *b = arg;
+   for (;;) {
+      pthread_mutex_lock(&b->lock);
+      size_t i = b->next++;
+      pthread_mutex_unlock(&b->lock);
+      if (i >= b->num_cands)
+         return NULL;
+      build(b->base, &b->cands[i]);
+   }
+}
+
+static void build_all(struct builder *b, size_t num_threads)
+{
+   if (num_threads > b->num_cands)
+      num_threads = b->num_cands;
+   pthread_t *threads = malloc(num_threads * sizeof *threads);
+   if (!threads)
+      die("out of memory");
+   pthread_mutex_init(&b->lock, NULL);
+   for (size_t i = 1; i < num_threads; i++)
+      if ((errno = pthread_create(&threads[i], NULL, builder_run, b)))
+         die("cannot create thread:");
+   builder_run(b);
+   for (size_t i = 1; i < num_threads; i++)
+      pthread_join(threads[i], NULL);
+   pthread_mutex_destroy(&b->lock);
+   free(threads);
+}
+
+static uint64_t now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+   uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+   return (x > y) - (x < y);
+}
+
+static double p99(uint64_t *times, size_t num)
+{
+   if (!num)
+      return 0;
+   qsort(times, num, sizeof *times, cmp_u64);
+   return times[num * 99 / 100];
+}
+
+/* Words sampled from the lexicon, along with their ordinals. */
+struct samples {
+   uint32_t ords[NUM_SAMPLES];
+   char (*words)[HV_MAX_WORD_LEN + 1];
+   size_t lens[NUM_SAMPLES];
+   size_t num;
+};
+
+static void sample(const struct halva *hv, struct samples *s)
+{
+   s->num = hv_size(hv) ? NUM_SAMPLES : 0;
+   s->words = malloc(NUM_SAMPLES * sizeof *s->words);
+   if (!s->words)
+      die("out of memory");
+
+   /* Reproducible, uniform enough. */
+   uint64_t state = 88172645463325252;
+   for (size_t i = 0; i < s->num; i++) {
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      s->ords[i] = 1 + state % hv_size(hv);
+      s->lens[i] = hv_extract(hv, s->ords[i], s->words[i]);
+   }
+}
+
+/* Times lookups one by one, after a pass that warms up the caches. */
+static void measure(const struct halva *hv, const struct samples *s,
+                    struct candidate *c)
+{
+   static uint64_t times[NUM_SAMPLES];
+   char buf[HV_MAX_WORD_LEN + 1];
+   uint32_t sum = 0;
+
+   for (size_t i = 0; i < s->num; i++)
+      sum += hv_locate(hv, s->words[i], s->lens[i]);
+   for (size_t i = 0; i < s->num; i++) {
+      uint64_t start = now();
+      sum += hv_locate(hv, s->words[i], s->lens[i]);
+      times[i] = now() - start;
+   }
+   c->locate_p99 = p99(times, s->num);
+
+   for (size_t i = 0; i < s->num; i++) {
+      uint64_t start = now();
+      sum += hv_extract(hv, s->ords[i], buf);
+      times[i] = now() - start;
+   }
+   c->extract_p99 = p99(times, s->num);
+
+   /* Lookups must not be optimized away. */
+   if (sum == 42)
+      putchar('\0');
+}
+
+static double latency(const struct candidate *c)
+{
+   return c->locate_p99 > c->extract_p99 ? c->locate_p99 : c->extract_p99;
+}
+
+static bool meets(const struct candidate *c, const struct opt_target *t)
+{
+   return (!t->max_latency || latency(c) <= t->max_latency)
+       && (!t->max_size || c->file.size <= t->max_size);
+}
+
+/* Whether "c" is a better choice than "best", which meets the target. */
+static bool better(const struct candidate *c, const struct candidate *best,
+                   const struct opt_target *t)
+{
+   if (t->max_latency)
+      return c->file.size < best->file.size;
+   return latency(c) < latency(best);
+}
+
+void optimize_lexicon(struct halva_enc *enc, const struct opt_target *target,
+                      size_t num_threads, const char *path)
+{
+   struct buffer base_file = {0};
+   dump_to(enc, &base_file);
+   struct halva *base = load_from(&base_file);
+
+   /* Tries don't depend on the blocking factor. */
+   struct candidate cands[MAX_CANDIDATES];
+   size_t num_cands = 0;
+   for (uint32_t bf = HV_MIN_BLOCKING_FACTOR; bf <= HV_MAX_BLOCKING_FACTOR;
+        bf *= 2)
+      cands[num_cands++] = (struct candidate){
+         .engine = HV_ENGINE_FRONT_CODING,
+         .blocking_factor = bf,
+      };
+   cands[num_cands++] = (struct candidate){
+      .engine = HV_ENGINE_TRIE,
+      .blocking_factor = hv_blocking_factor(base),
+   };
+
+   struct builder b = {
+      .base = base,
+      .cands = cands,
+      .num_cands = num_cands,
+   };
+   build_all(&b, num_threads);
+
+   struct samples s;
+   sample(base, &s);
+   static const char *const engine_names[] = {
+      [HV_ENGINE_FRONT_CODING] = "front-coding",
+      [HV_ENGINE_TRIE] = "trie",
+   };
+   struct candidate *best = NULL;
+   printf("engine        blocking factor        size  locate p99  extract p99\n");
+   for (size_t i = 0; i < num_cands; i++) {
+      struct candidate *c = &cands[i];
+      if (c->ret)
+         die("cannot encode lexicon: %s", hv_strerror(c->ret));
+      struct halva *hv = load_from(&c->file);
+      measure(hv, &s, c);
+      hv_free(hv);
+      printf("%-13s %15" PRIu32 " %11zu %8.0f ns  %8.0f ns\n",
+             engine_names[c->engine], c->blocking_factor, c->file.size,
+             c->locate_p99, c->extract_p99);
+      if (meets(c, target) && (!best || better(c, best, target)))
+         best = c;
+   }
+   if (fflush(stdout))
+      die("IO error:");
+   if (!best)
+      die("no encoding meets the target");
+   printf("selected: %s, blocking factor %" PRIu32 "\n",
+          engine_names[best->engine], best->blocking_factor);
+   if (fflush(stdout))
+      die("IO error:");
+
+   FILE *fp = fopen(path, "wb");
+   if (!fp)
+      die("cannot open '%s' for writing:", path);
+   if (fwrite(best->file.data, 1, best->file.size, fp) != best->file.size
+       || fclose(fp))
+      die("IO error:");
+
+   for (size_t i = 0; i < num_cands; i++)
+      free(cands[i].file.data);
+   free(s.words);
+   hv_free(base);
+   free(base_file.data);
+}
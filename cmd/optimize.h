@@ -0,0 +1,24 @@
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+#include <stddef.h>
+#include "../halva.h"
+
+/* What an optimized lexicon must achieve. Zero fields are not constraints. */
+struct opt_target {
+   double max_latency;  /* Bound on p99 lookup latency, in nanoseconds. */
+   size_t max_size;     /* Bound on the file size, in bytes. */
+};
+
+/* Re-encodes the words of "enc" with each engine and blocking factor, on up to
+ * "num_threads" threads, and measures the size and the p99 latency of
+ * hv_locate() and hv_extract() of each candidate, one at a time. Compression
+ * and the suffix index are kept as set in "enc". Writes a report to the
+ * standard output, then saves to "path" the smallest candidate that meets the
+ * latency bound if there is one, or the fastest candidate that fits the size
+ * budget otherwise. Dies if no candidate meets the target.
+ */
+void optimize_lexicon(struct halva_enc *enc, const struct opt_target *target,
+                      size_t num_threads, const char *path);
+
+#endif
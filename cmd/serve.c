@@ -0,0 +1,477 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <arpa/inet.h>  /* htonl(), ntohl(). */
+
+#include "cmd.h"
+#include "serve.h"
+#include "../halva_client.h"
+
+/* Stop reading requests from a client while that many bytes of responses are
+ * waiting to be sent to it.
+ */
+#define OUT_LIMIT (1 << 24)
+
+/* Number of items looked up at once. */
+#define BATCH_SIZE 256
+
+struct buffer {
+   uint8_t *data;
+   size_t off;       /* Offset of the first byte not yet consumed. */
+   size_t size;
+   size_t alloc;
+};
+
+struct conn {
+   int fd;
+   struct buffer in;    /* Received requests. */
+   struct buffer out;   /* Responses to send. */
+   bool dead;           /* Whether the connection must be closed. */
+   bool eof;            /* Whether the client is done sending requests. */
+   struct conn *next;   /* Next connection in a queue. */
+   struct conn *prev_conn; /* Neighbours in the list of all connections. */
+   struct conn *next_conn;
+};
+
+struct server {
+   struct halva *const *hvs;
+   size_t num_hvs;
+   int epoll_fd;
+   int listen_fd;
+   int event_fd;        /* Signaled when a worker has finished a job. */
+   int signal_fd;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   struct conn *jobs;   /* Connections with pending requests, FIFO. */
+   struct conn *jobs_tail;
+   struct conn *done;   /* Connections processed by workers. */
+   struct conn *conns;  /* All open connections, only used by the main thread. */
+   bool stopping;
+};
+
+static bool buf_reserve(struct buffer *buf, size_t incr)
+{
+   if (buf->off && buf->off == buf->size)
+      buf->off = buf->size = 0;
+   if (buf->size + incr <= buf->alloc)
+      return true;
+   if (buf->off) {
+      memmove(buf->data, &buf->data[buf->off], buf->size - buf->off);
+      buf->size -= buf->off;
+      buf->off = 0;
+      if (buf->size + incr <= buf->alloc)
+         return true;
+   }
+
+   size_t alloc = buf->alloc + (buf->alloc >> 1) + 4096;
+   if (alloc < buf->size + incr)
+      alloc = buf->size + incr;
+   void *tmp = realloc(buf->data, alloc);
+   if (!tmp)
+      return false;
+   buf->data = tmp;
+   buf->alloc = alloc;
+   return true;
+}
+
+static void put32(uint8_t *p, uint32_t val)
+{
+   val = htonl(val);
+   memcpy(p, &val, sizeof val);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+   uint32_t val;
+   memcpy(&val, p, sizeof val);
+   return ntohl(val);
+}
+
+/* Returns the size of the first frame in the input buffer, size field
+ * included, 0 if it is not complete, or -1 if it is invalid.
+ */
+static ssize_t frame_size(const struct buffer *buf)
+{
+   size_t avail = buf->size - buf->off;
+   if (avail < 4)
+      return 0;
+   size_t size = get32(&buf->data[buf->off]);
+   if (size < HV_FRAME_HEADER_SIZE - 4 || size > HV_FRAME_MAX_SIZE)
+      return -1;
+   return avail - 4 < size ? 0 : (ssize_t)(size + 4);
+}
+
+/* Processes a single request. Returns false if it is invalid. */
+static bool process_frame(const struct server *srv, const uint8_t *req,
+                          size_t size, struct buffer *out)
+{
+   uint8_t op = req[8];
+   uint8_t lex = req[9];
+   size_t num = req[10] << 8 | req[11];
+   if (lex >= srv->num_hvs)
+      return false;
+   const struct halva *hv = srv->hvs[lex];
+
+   size_t max_item = op == HV_OP_EXTRACT ? HV_MAX_WORD_LEN + 1 : 4;
+   if (!buf_reserve(out, HV_FRAME_HEADER_SIZE + num * max_item))
+      return false;
+   uint8_t *resp = &out->data[out->size];
+   uint8_t *q = resp + HV_FRAME_HEADER_SIZE;
+   memcpy(resp + 4, req + 4, HV_FRAME_HEADER_SIZE - 4);
+
+   const uint8_t *p = req + HV_FRAME_HEADER_SIZE;
+   const uint8_t *end = req + size;
+
+   const void *words[BATCH_SIZE];
+   size_t lens[BATCH_SIZE];
+   uint32_t ords[BATCH_SIZE];
+   char found[BATCH_SIZE][HV_MAX_WORD_LEN + 1];
+
+   for (size_t base = 0; base < num; base += BATCH_SIZE) {
+      size_t cnt = num - base < BATCH_SIZE ? num - base : BATCH_SIZE;
+      for (size_t i = 0; i < cnt; i++) {
+         if (op == HV_OP_EXTRACT) {
+            if (end - p < 4)
+               return false;
+            ords[i] = get32(p);
+            p += 4;
+         } else {
+            if (p == end || *p >= end - p)
+               return false;
+            lens[i] = *p++;
+            words[i] = p;
+            p += lens[i];
+         }
+      }
+
+      switch (op) {
+      case HV_OP_LOCATE:
+         hv_locate_many(hv, cnt, words, lens, ords);
+         for (size_t i = 0; i < cnt; i++, q += 4)
+            put32(q, ords[i]);
+         break;
+      case HV_OP_COUNT_PREFIX:
+         for (size_t i = 0; i < cnt; i++, q += 4)
+            put32(q, hv_count_prefix(hv, words[i], lens[i]));
+         break;
+      case HV_OP_EXTRACT:
+         hv_extract_many(hv, cnt, ords, &found[0][0], lens);
+         for (size_t i = 0; i < cnt; i++) {
+            *q++ = lens[i];
+            memcpy(q, found[i], lens[i]);
+            q += lens[i];
+         }
+         break;
+      default:
+         return false;
+      }
+   }
+   if (p != end)
+      return false;
+
+   put32(resp, q - resp - 4);
+   out->size += q - resp;
+   return true;
+}
+
+/* Sends as much buffered output as possible without blocking. */
+static bool flush_output(struct conn *c)
+{
+   struct buffer *out = &c->out;
+   while (out->off < out->size) {
+      ssize_t ret = send(c->fd, &out->data[out->off], out->size - out->off,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (ret < 0) {
+         if (errno == EINTR)
+            continue;
+         return errno == EAGAIN || errno == EWOULDBLOCK;
+      }
+      out->off += ret;
+   }
+   return true;
+}
+
+static void *worker(void *arg)
+{
+   struct server *srv = arg;
+
+   for (;;) {
+      pthread_mutex_lock(&srv->lock);
+      while (!srv->jobs && !srv->stopping)
+         pthread_cond_wait(&srv->cond, &srv->lock);
+      if (srv->stopping) {
+         pthread_mutex_unlock(&srv->lock);
+         return NULL;
+      }
+      struct conn *c = srv->jobs;
+      srv->jobs = c->next;
+      pthread_mutex_unlock(&srv->lock);
+
+      ssize_t size = 0;
+      while (!c->dead && (size = frame_size(&c->in)) > 0) {
+         if (!process_frame(srv, &c->in.data[c->in.off], size, &c->out))
+            c->dead = true;
+         c->in.off += size;
+      }
+      if (size < 0 || !flush_output(c))
+         c->dead = true;
+
+      pthread_mutex_lock(&srv->lock);
+      c->next = srv->done;
+      srv->done = c;
+      pthread_mutex_unlock(&srv->lock);
+      uint64_t one = 1;
+      if (write(srv->event_fd, &one, sizeof one) != sizeof one)
+         die("cannot notify event loop:");
+   }
+}
+
+static void watch(struct server *srv, int op, int fd, uint32_t events,
+                  void *ptr)
+{
+   struct epoll_event ev = {.events = events, .data.ptr = ptr};
+   if (epoll_ctl(srv->epoll_fd, op, fd, &ev))
+      die("cannot watch file descriptor:");
+}
+
+/* "watched" tells whether the connection is registered in the event loop. */
+static void close_conn(struct server *srv, struct conn *c, bool watched)
+{
+   if (watched)
+      epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+   if (c->prev_conn)
+      c->prev_conn->next_conn = c->next_conn;
+   else
+      srv->conns = c->next_conn;
+   if (c->next_conn)
+      c->next_conn->prev_conn = c->prev_conn;
+   close(c->fd);
+   free(c->in.data);
+   free(c->out.data);
+   free(c);
+}
+
+/* Hands a connection over to the workers. */
+static void dispatch(struct server *srv, struct conn *c, bool watched)
+{
+   if (watched)
+      epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+   c->next = NULL;
+
+   pthread_mutex_lock(&srv->lock);
+   if (srv->jobs)
+      srv->jobs_tail->next = c;
+   else
+      srv->jobs = c;
+   srv->jobs_tail = c;
+   pthread_cond_signal(&srv->cond);
+   pthread_mutex_unlock(&srv->lock);
+}
+
+/* Decides what to do next with a connection no worker owns. */
+static void schedule(struct server *srv, struct conn *c, bool watched)
+{
+   ssize_t size = frame_size(&c->in);
+   if (c->dead || size < 0) {
+      close_conn(srv, c, watched);
+      return;
+   }
+
+   size_t pending = c->out.size - c->out.off;
+   if (size > 0 && pending < OUT_LIMIT) {
+      dispatch(srv, c, watched);
+      return;
+   }
+   /* After the client shut down its end, answer the complete requests, then
+    * close once the responses are sent.
+    */
+   if (c->eof && !pending) {
+      close_conn(srv, c, watched);
+      return;
+   }
+
+   uint32_t events = 0;
+   if (pending < OUT_LIMIT && !c->eof)
+      events |= EPOLLIN;
+   if (pending)
+      events |= EPOLLOUT;
+   watch(srv, watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->fd, events, c);
+}
+
+static void accept_conns(struct server *srv)
+{
+   for (;;) {
+      int fd = accept4(srv->listen_fd, NULL, NULL,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+         if (errno == EINTR)
+            continue;
+         if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED)
+            return;
+         die("cannot accept connection:");
+      }
+      struct conn *c = calloc(1, sizeof *c);
+      if (!c) {
+         close(fd);
+         continue;
+      }
+      c->fd = fd;
+      c->next_conn = srv->conns;
+      if (srv->conns)
+         srv->conns->prev_conn = c;
+      srv->conns = c;
+      watch(srv, EPOLL_CTL_ADD, fd, EPOLLIN, c);
+   }
+}
+
+/* Returns false if the connection must be closed. The end of the input is
+ * recorded in "c->eof", as pending requests must still be answered.
+ */
+static bool receive(struct conn *c)
+{
+   while (!c->eof) {
+      if (!buf_reserve(&c->in, 1 << 16))
+         return false;
+      ssize_t ret = read(c->fd, &c->in.data[c->in.size],
+                         c->in.alloc - c->in.size);
+      if (ret > 0) {
+         c->in.size += ret;
+      } else if (ret == 0) {
+         c->eof = true;
+      } else if (errno != EINTR) {
+         return errno == EAGAIN || errno == EWOULDBLOCK;
+      }
+   }
+   return true;
+}
+
+static void handle_done(struct server *srv)
+{
+   uint64_t cnt;
+   if (read(srv->event_fd, &cnt, sizeof cnt) != sizeof cnt)
+      return;
+
+   pthread_mutex_lock(&srv->lock);
+   struct conn *c = srv->done;
+   srv->done = NULL;
+   pthread_mutex_unlock(&srv->lock);
+
+   while (c) {
+      struct conn *next = c->next;
+      schedule(srv, c, false);
+      c = next;
+   }
+}
+
+static int listen_on(const char *path)
+{
+   struct sockaddr_un addr = {.sun_family = AF_UNIX};
+   if (strlen(path) >= sizeof addr.sun_path)
+      die("socket path too long: '%s'", path);
+   strcpy(addr.sun_path, path);
+
+   /* Remove a stale socket left by a previous instance. */
+   struct stat st;
+   if (!stat(path, &st) && S_ISSOCK(st.st_mode))
+      unlink(path);
+
+   int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   if (fd < 0)
+      die("cannot create socket:");
+   if (bind(fd, (struct sockaddr *)&addr, sizeof addr))
+      die("cannot bind socket to '%s':", path);
+   if (listen(fd, SOMAXCONN))
+      die("cannot listen on '%s':", path);
+   return fd;
+}
+
+void serve_lexicons(const char *path, struct halva *const *hvs,
+                    size_t num_hvs, size_t num_threads)
+{
+   struct server srv = {
+      .hvs = hvs,
+      .num_hvs = num_hvs,
+      .lock = PTHREAD_MUTEX_INITIALIZER,
+      .cond = PTHREAD_COND_INITIALIZER,
+   };
+
+   sigset_t mask;
+   sigemptyset(&mask);
+   sigaddset(&mask, SIGINT);
+   sigaddset(&mask, SIGTERM);
+   if (pthread_sigmask(SIG_BLOCK, &mask, NULL))
+      die("cannot block signals");
+   srv.signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+   srv.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   srv.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+   if (srv.signal_fd < 0 || srv.event_fd < 0 || srv.epoll_fd < 0)
+      die("cannot initialize event loop:");
+   srv.listen_fd = listen_on(path);
+
+   watch(&srv, EPOLL_CTL_ADD, srv.listen_fd, EPOLLIN, &srv.listen_fd);
+   watch(&srv, EPOLL_CTL_ADD, srv.event_fd, EPOLLIN, &srv.event_fd);
+   watch(&srv, EPOLL_CTL_ADD, srv.signal_fd, EPOLLIN, &srv.signal_fd);
+
+   pthread_t *threads = malloc(num_threads * sizeof *threads);
+   if (!threads)
+      die("out of memory");
+   for (size_t i = 0; i < num_threads; i++)
+      if (pthread_create(&threads[i], NULL, worker, &srv))
+         die("cannot create thread");
+
+   while (!srv.stopping) {
+      struct epoll_event evs[64];
+      int num = epoll_wait(srv.epoll_fd, evs, 64, -1);
+      if (num < 0) {
+         if (errno == EINTR)
+            continue;
+         die("cannot wait for events:");
+      }
+      for (int i = 0; i < num; i++) {
+         void *ptr = evs[i].data.ptr;
+         if (ptr == &srv.listen_fd) {
+            accept_conns(&srv);
+         } else if (ptr == &srv.event_fd) {
+            handle_done(&srv);
+         } else if (ptr == &srv.signal_fd) {
+            pthread_mutex_lock(&srv.lock);
+            srv.stopping = true;
+            pthread_cond_broadcast(&srv.cond);
+            pthread_mutex_unlock(&srv.lock);
+         } else {
+            struct conn *c = ptr;
+            if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+               c->dead |= !receive(c);
+            if (!c->dead && (evs[i].events & EPOLLOUT))
+               c->dead |= !flush_output(c);
+            schedule(&srv, c, true);
+         }
+      }
+   }
+
+   for (size_t i = 0; i < num_threads; i++)
+      pthread_join(threads[i], NULL);
+   free(threads);
+
+   /* Connections may still be queued, or watched. */
+   while (srv.conns)
+      close_conn(&srv, srv.conns, false);
+   close(srv.epoll_fd);
+   close(srv.event_fd);
+   close(srv.signal_fd);
+   close(srv.listen_fd);
+   unlink(path);
+}
@@ -0,0 +1,14 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stddef.h>
+#include "../halva.h"
+
+/* Serves lookups in the given lexicons on a Unix domain socket, using
+ * "num_threads" worker threads. Returns when SIGINT or SIGTERM is received.
+ * The protocol is described in halva_client.h.
+ */
+void serve_lexicons(const char *socket_path, struct halva *const *hvs,
+                    size_t num_hvs, size_t num_threads);
+
+#endif
@@ -1,17 +1,58 @@
+#define _DEFAULT_SOURCE  /* MAP_ANONYMOUS, madvise(). */
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <assert.h>
 #include <arpa/inet.h>  /* htonl(), ntohl(). */
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>     /* sysconf(). */
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
 #include "halva.h"
 
 /* Largest number that can be represented in a nibble. */
 #define HV_NIBBLE_SIZE 15
 
 static const uint32_t hv_magic = 1751938657;
-static const uint32_t hv_version = 1;
+static const uint32_t hv_version = 7;
 
-#define HV_DIV_ROUNDUP(a, b) (((a) + (b) - 1) / (b))
+/* Oldest data format version we can still load. Files in this format have no
+ * checksum.
+ */
+static const uint32_t hv_min_version = 1;
+
+/* Number of 32-bit fields in the file header, for each version. */
+#define HV_HEADER_FIELDS(version)                                              \
+   ((version) >= 7 ? 11 : (version) >= 6 ? 10 : (version) >= 5 ? 9            \
+    : (version) >= 4 ? 8 : (version) >= 3 ? 6 : (version) >= 2 ? 5 : 4)
+
+/* Size of the values section, given the number of words and the width of
+ * values. It is padded so that values can be read with 64-bit loads.
+ */
+#define HV_VALUES_SIZE(num_words, width)                                       \
+   ((width) ? ((uint64_t)(num_words) * (width) + 7) / 8 + 8 : 0)
+
+/* Number of lookups processed together by batched functions. */
+#define HV_BATCH_SIZE 16
+
+#ifdef __GNUC__
+#define HV_PREFETCH(addr) __builtin_prefetch(addr)
+#define HV_INLINE static inline __attribute__((always_inline))
+#else
+#define HV_PREFETCH(addr) ((void)(addr))
+#define HV_INLINE static inline
+#endif
+
+#ifdef HV_STATS
+#define HV_COUNT(field, n) hv_count(offsetof(struct hv_stats, field), (n))
+static void hv_count(size_t offset, uint64_t n);
+#else
+#define HV_COUNT(field, n) ((void)(n))
+#endif
 
 static int lmemcmp(const void *restrict str1, size_t len1,
                    const void *restrict str2, size_t len2)
@@ -22,6 +63,95 @@ static int lmemcmp(const void *restrict str1, size_t len1,
    return len1 < len2 ? -1 : len1 > len2;
 }
 
+/* Length of the longest common prefix of two strings. */
+static size_t hv_common_prefix(const uint8_t *str1, size_t len1,
+                               const uint8_t *str2, size_t len2)
+{
+   size_t min_len = len1 < len2 ? len1 : len2;
+   size_t i = 0;
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   for ( ; i + 8 <= min_len; i += 8) {
+      uint64_t word1, word2;
+      memcpy(&word1, &str1[i], sizeof word1);
+      memcpy(&word2, &str2[i], sizeof word2);
+      if (word1 != word2)
+         return i + (__builtin_ctzll(word1 ^ word2) >> 3);
+   }
+#endif
+   while (i < min_len && str1[i] == str2[i])
+      i++;
+   return i;
+}
+
+static uint64_t hv_load64(const uint8_t *p)
+{
+   uint64_t val;
+   memcpy(&val, p, sizeof val);
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+   val = __builtin_bswap64(val);
+#endif
+   return val;
+}
+
+/* Reads a value of "width" bits at bit offset "bit" in a little-endian bit
+ * stream, which must be padded with 8 bytes.
+ */
+static uint64_t hv_get_bits(const uint8_t *p, uint64_t bit, unsigned width)
+{
+   p += bit >> 3;
+   unsigned shift = bit & 7;
+   uint64_t val = hv_load64(p) >> shift;
+   if (shift + width > 64)
+      val |= (uint64_t)p[8] << (64 - shift);
+   return width < 64 ? val & ((UINT64_C(1) << width) - 1) : val;
+}
+
+/* Writes a value. The stream must be zeroed beforehand. */
+static void hv_put_bits(uint8_t *p, uint64_t bit, unsigned width,
+                        uint64_t val)
+{
+   for (unsigned i = 0; i < width; ) {
+      uint64_t pos = bit + i;
+      unsigned shift = pos & 7;
+      unsigned n = 8 - shift < width - i ? 8 - shift : width - i;
+      p[pos >> 3] |= ((val >> i) & ((1U << n) - 1)) << shift;
+      i += n;
+   }
+}
+
+/* CRC-32C (Castagnoli), which has hardware support on x86-64 and ARMv8. */
+static uint32_t hv_crc32c(uint32_t crc, const void *data, size_t size)
+{
+   const uint8_t *p = data;
+   crc = ~crc;
+
+#if defined(__SSE4_2__) && defined(__x86_64__)
+   for ( ; size >= 8; size -= 8, p += 8) {
+      uint64_t word;
+      memcpy(&word, p, sizeof word);
+      crc = _mm_crc32_u64(crc, word);
+   }
+   while (size--)
+      crc = _mm_crc32_u8(crc, *p++);
+#elif defined(__ARM_FEATURE_CRC32)
+   for ( ; size >= 8; size -= 8, p += 8) {
+      uint64_t word;
+      memcpy(&word, p, sizeof word);
+      crc = __crc32cd(crc, word);
+   }
+   while (size--)
+      crc = __crc32cb(crc, *p++);
+#else
+   while (size--) {
+      crc ^= *p++;
+      for (int i = 0; i < 8; i++)
+         crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+   }
+#endif
+
+   return ~crc;
+}
+
 const char *hv_strerror(int err)
 {
    static const char *const tbl[] = {
@@ -34,6 +164,8 @@ const char *hv_strerror(int err)
       [HV_E2BIG] = "lexicon has grown too large",
       [HV_EIO] = "IO error",
       [HV_ENOMEM] = "out of memory",
+      [HV_ECORRUPT] = "corrupted lexicon",
+      [HV_EINVAL] = "invalid argument",
    };
 
    if (err >= 0 && (size_t)err < sizeof tbl / sizeof *tbl)
@@ -43,440 +175,4847 @@ const char *hv_strerror(int err)
 
 
 /*******************************************************************************
- * Encoder
+ * Memory
  ******************************************************************************/
 
-#define HV_MAX_SIZE (3UL * 1024 * 1024 * 1024) /* Be conservative. */
-
-#define HV_DEF_GROW(NAME)                                                      \
-static int hv_enc_grow_##NAME(struct halva_enc *enc, size_t incr)              \
-{                                                                              \
-   size_t need = enc->NAME##_size + incr;                                      \
-   if (need < enc->NAME##_size)                                                \
-      return HV_ENOMEM;                                                        \
-   if (need <= enc->NAME##_alloc)                                              \
-      return HV_OK;                                                            \
-                                                                               \
-   size_t new_alloc = enc->NAME##_alloc + (enc->NAME##_alloc >> 1) + 16;       \
-   if (new_alloc < need)                                                       \
-      new_alloc = need;                                                        \
-   if (new_alloc > SIZE_MAX / sizeof *enc->NAME)                               \
-      return HV_ENOMEM;                                                        \
-                                                                               \
-   void *tmp = realloc(enc->NAME, new_alloc * sizeof *enc->NAME);              \
-   if (!tmp)                                                                   \
-      return HV_ENOMEM;                                                        \
-                                                                               \
-   enc->NAME = tmp;                                                            \
-   enc->NAME##_alloc = new_alloc;                                              \
-   return HV_OK;                                                               \
+/* Allocation functions, which use the standard allocator if "a" is NULL. */
+static void *hv_alloc(const struct halva_allocator *a, size_t size)
+{
+   return a ? a->alloc(a->ctx, size) : malloc(size);
 }
 
-HV_DEF_GROW(header)
-HV_DEF_GROW(body)
+static void *hv_realloc(const struct halva_allocator *a, void *ptr,
+                        size_t old_size, size_t size)
+{
+   if (!a)
+      return realloc(ptr, size);
+   if (!ptr)
+      return a->alloc(a->ctx, size);
+   return a->realloc(a->ctx, ptr, old_size, size);
+}
 
-int hv_enc_add(struct halva_enc *enc, const void *word, size_t len)
+static void hv_dealloc(const struct halva_allocator *a, void *ptr, size_t size)
 {
-   if (enc->finished)
-      return HV_EFREEZED;
+   if (!a)
+      free(ptr);
+   else if (ptr)
+      a->free(a->ctx, ptr, size);
+}
 
-   if (enc->header_size * sizeof *enc->header + enc->body_size > HV_MAX_SIZE)
-      return HV_E2BIG;
+/* Alignment of the blocks of an arena, as that of malloc(). */
+#define HV_ARENA_ALIGN 16
+#define HV_ARENA_ROUND(size) (((size) + HV_ARENA_ALIGN - 1) & -HV_ARENA_ALIGN)
 
-   if (len == 0 || len > HV_MAX_WORD_LEN)
-      return HV_EWORD;
+#define HV_HUGE_PAGE_SIZE ((size_t)1 << 21)
 
-   if (lmemcmp(enc->prev, enc->prev_len, word, len) >= 0)
-      return HV_EORDER;
+/* A mapped region of an arena. Blocks follow this header. */
+struct hv_region {
+   struct hv_region *next;
+   size_t size;               /* Mapped size, header included. */
+};
 
-   if (!(enc->num_words & (HV_BLOCKING_FACTOR - 1))) {
-      if (hv_enc_grow_header(enc, 1) || hv_enc_grow_body(enc, 1 + len))
-         return HV_ENOMEM;
-      uint32_t pos = enc->body_size;
-      enc->header[enc->header_size++] = pos;
-      enc->body[enc->body_size++] = len;
-      memcpy(&enc->body[enc->body_size], word, len);
-      enc->body_size += len;
-   } else {
-      const uint8_t *wordp = word;
-      const uint8_t *prevp = enc->prev;
-      size_t pref_len = 0;
-      size_t min_len = len < enc->prev_len ? len : enc->prev_len;
-      if (min_len > HV_NIBBLE_SIZE)
-         min_len = HV_NIBBLE_SIZE;
-      while (pref_len < min_len && *wordp == *prevp) {
-         prevp++;
-         wordp++;
-         pref_len++;
-      }
-      size_t suff_len = len - pref_len;
-      if (hv_enc_grow_body(enc, 2 + suff_len))
-         return HV_ENOMEM;
-      if (suff_len > HV_NIBBLE_SIZE) {
-         enc->body[enc->body_size++] = pref_len;
-         enc->body[enc->body_size++] = suff_len;
-      } else {
-         enc->body[enc->body_size++] = pref_len | (suff_len << 4);
-      }
-      memcpy(&enc->body[enc->body_size], wordp, suff_len);
-      enc->body_size += suff_len;
-   }
-   memcpy(enc->prev, word, len);
-   enc->prev_len = len;
-   enc->num_words++;
+#define HV_REGION_HEADER HV_ARENA_ROUND(sizeof(struct hv_region))
 
-   return HV_OK;
-}
+struct halva_arena {
+   struct halva_allocator allocator;
+   pthread_mutex_t lock;
+   size_t region_size;
+   bool huge_pages;
+   struct hv_region *regions; /* Most recently mapped first. */
+   struct hv_region *first;   /* First region of small blocks. */
+   uint8_t *top;              /* Free space of the current region. */
+   uint8_t *end;
+   size_t mapped;
+};
 
-int hv_enc_dump(struct halva_enc *enc,
-                int (*write)(void *arg, const void *data, size_t size),
-                void *arg)
+/* Maps "size" bytes, which must be a multiple of the page size, or of the
+ * huge page size if "huge" is set.
+ */
+static void *hv_map(size_t size, bool huge)
 {
-   if (!enc->finished) {
-      for (size_t i = 0; i < enc->header_size; i++)
-         enc->header[i] = htonl(enc->header[i]);
-      enc->finished = true;
+   const int prot = PROT_READ | PROT_WRITE;
+   const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_HUGETLB
+   if (huge) {
+      void *p = mmap(NULL, size, prot, flags | MAP_HUGETLB, -1, 0);
+      if (p != MAP_FAILED)
+         return p;
+   }
+#endif
+   if (!huge) {
+      void *p = mmap(NULL, size, prot, flags, -1, 0);
+      return p == MAP_FAILED ? NULL : p;
    }
 
-   uint32_t header[] = {
-      htonl(hv_magic),
-      htonl(hv_version),
-      htonl(enc->num_words),
-      htonl(enc->body_size),
-   };
-   if (write(arg, header, sizeof header)
-      || write(arg, enc->header, enc->header_size * sizeof *enc->header)
-      || write(arg, enc->body, enc->body_size))
-      return HV_EIO;
-   return HV_OK;
+   /* Transparent huge pages need aligned regions, so map more, and trim. */
+   if (size > SIZE_MAX - HV_HUGE_PAGE_SIZE)
+      return NULL;
+   uint8_t *p = mmap(NULL, size + HV_HUGE_PAGE_SIZE, prot, flags, -1, 0);
+   if (p == MAP_FAILED)
+      return NULL;
+   size_t head = -(uintptr_t)p & (HV_HUGE_PAGE_SIZE - 1);
+   if (head)
+      munmap(p, head);
+   munmap(p + head + size, HV_HUGE_PAGE_SIZE - head);
+   p += head;
+#ifdef MADV_HUGEPAGE
+   madvise(p, size, MADV_HUGEPAGE);
+#endif
+   return p;
 }
 
-static int hv_write(void *fp, const void *data, size_t size)
+/* Maps a region with room for "size" bytes of blocks. */
+static struct hv_region *hv_region_new(struct halva_arena *a, size_t size)
 {
-   if (fwrite(data, 1, size, fp) == size)
-      return 0;
-   return -1;
+   size_t page = a->huge_pages ? HV_HUGE_PAGE_SIZE
+                               : (size_t)sysconf(_SC_PAGESIZE);
+   if (size > SIZE_MAX - HV_REGION_HEADER - page)
+      return NULL;
+   size = (size + HV_REGION_HEADER + page - 1) / page * page;
+   struct hv_region *r = hv_map(size, a->huge_pages);
+   if (!r)
+      return NULL;
+   r->size = size;
+   r->next = a->regions;
+   a->regions = r;
+   a->mapped += size;
+   return r;
 }
 
-int hv_enc_dump_file(struct halva_enc *enc, FILE *fp)
+/* Blocks larger than that get a region of their own, which is unmapped when
+ * they are freed.
+ */
+static size_t hv_arena_max_small(const struct halva_arena *a)
 {
-   int ret = hv_enc_dump(enc, hv_write, fp);
-   if (ret)
-      return ret;
-
-   return fflush(fp) ? HV_EIO : HV_OK;
+   return a->region_size / 4;
 }
 
-void hv_enc_clear(struct halva_enc *enc)
+static void *hv_arena_alloc_locked(struct halva_arena *a, size_t size)
 {
-   enc->num_words = enc->header_size = enc->body_size = 0;
-   enc->prev_len = 0;
-   enc->finished = false;
+   if (size > SIZE_MAX - HV_ARENA_ALIGN)
+      return NULL;
+   size = HV_ARENA_ROUND(size ? size : 1);
+   if (size > hv_arena_max_small(a)) {
+      struct hv_region *r = hv_region_new(a, size);
+      return r ? (uint8_t *)r + HV_REGION_HEADER : NULL;
+   }
+   if (size > (size_t)(a->end - a->top)) {
+      struct hv_region *r = hv_region_new(a, a->region_size);
+      if (!r)
+         return NULL;
+      if (!a->first)
+         a->first = r;
+      a->top = (uint8_t *)r + HV_REGION_HEADER;
+      a->end = (uint8_t *)r + r->size;
+   }
+   void *p = a->top;
+   a->top += size;
+   return p;
 }
 
-void hv_enc_fini(struct halva_enc *enc)
+static void hv_arena_free_locked(struct halva_arena *a, void *ptr, size_t size)
 {
-   free(enc->header);
-   free(enc->body);
+   size = HV_ARENA_ROUND(size ? size : 1);
+   if (size <= hv_arena_max_small(a)) {
+      if ((uint8_t *)ptr + size == a->top)
+         a->top = ptr;
+      return;
+   }
+   for (struct hv_region **rp = &a->regions; *rp; rp = &(*rp)->next) {
+      struct hv_region *r = *rp;
+      if ((uint8_t *)r + HV_REGION_HEADER == ptr) {
+         *rp = r->next;
+         a->mapped -= r->size;
+         munmap(r, r->size);
+         return;
+      }
+   }
 }
 
+static void *hv_arena_alloc(void *ctx, size_t size)
+{
+   struct halva_arena *a = ctx;
+   pthread_mutex_lock(&a->lock);
+   void *p = hv_arena_alloc_locked(a, size);
+   pthread_mutex_unlock(&a->lock);
+   return p;
+}
 
-/*******************************************************************************
- * Decoder
- ******************************************************************************/
-
-struct halva {
-   uint32_t num_words;     /* Number of words. */
-   uint32_t num_bkts;      /* Number of buckets. */
-   const uint8_t *body;    /* Body section. */
-   uint32_t header[];      /* Bucket pointers. */
-};
-
-/* Number of words in a bucket. */
-static uint32_t hv_limit(const struct halva *hv, uint32_t bkt)
+static void *hv_arena_realloc(void *ctx, void *ptr, size_t old_size,
+                              size_t size)
 {
-   assert(bkt < hv->num_bkts);
+   struct halva_arena *a = ctx;
+   size_t old_len = HV_ARENA_ROUND(old_size ? old_size : 1);
+   size_t max_small = hv_arena_max_small(a);
+   pthread_mutex_lock(&a->lock);
 
-   if (bkt + 1 == hv->num_bkts) {
-      uint32_t high = hv->num_words & (HV_BLOCKING_FACTOR - 1);
-      if (high)
-         return high;
+   /* The last block is resized in place if it can, others are moved. */
+   void *p = ptr;
+   if (size > SIZE_MAX - HV_ARENA_ALIGN) {
+      p = NULL;
+   } else {
+      size_t len = HV_ARENA_ROUND(size ? size : 1);
+      if (old_len <= max_small && len <= max_small
+          && (uint8_t *)ptr + old_len == a->top
+          && len <= (size_t)(a->end - (uint8_t *)ptr))
+         a->top = (uint8_t *)ptr + len;
+      else if (len > old_len || (old_len > max_small) != (len > max_small))
+         p = hv_arena_alloc_locked(a, size);
    }
-   return HV_BLOCKING_FACTOR;
+   if (p && p != ptr) {
+      memcpy(p, ptr, old_size < size ? old_size : size);
+      hv_arena_free_locked(a, ptr, old_size);
+   }
+   pthread_mutex_unlock(&a->lock);
+   return p;
 }
 
-int hv_load(struct halva **hvp, int (*read)(void *arg, void *buf, size_t size),
-            void *arg)
+static void hv_arena_dealloc(void *ctx, void *ptr, size_t size)
 {
-   *hvp = NULL;
-
-   uint32_t header[4];
-   if (read(arg, header, sizeof header))
-      return HV_EIO;
-   for (size_t i = 0; i < sizeof header / sizeof *header; i++)
-      header[i] = ntohl(header[i]);
-
-   if (header[0] != hv_magic)
-      return HV_EMAGIC;
-   if (header[1] != hv_version)
-      return HV_EVERSION;
-
-   uint32_t num_words = header[2];
-   uint32_t body_size = header[3];
-   uint32_t num_bkts = HV_DIV_ROUNDUP(num_words, HV_BLOCKING_FACTOR);
+   struct halva_arena *a = ctx;
+   pthread_mutex_lock(&a->lock);
+   hv_arena_free_locked(a, ptr, size);
+   pthread_mutex_unlock(&a->lock);
+}
 
-   size_t to_read = num_bkts * sizeof(uint32_t) + body_size;
-   struct halva *hv = malloc(offsetof(struct halva, header) + to_read);
-   if (!hv)
+int hv_arena_new(struct halva_arena **ap, size_t region_size, int flags)
+{
+   struct halva_arena *a = *ap = malloc(sizeof *a);
+   if (!a)
+      return HV_ENOMEM;
+   *a = (struct halva_arena){
+      .allocator = {
+         .alloc = hv_arena_alloc,
+         .realloc = hv_arena_realloc,
+         .free = hv_arena_dealloc,
+         .ctx = a,
+      },
+      .region_size = region_size ? region_size : HV_ARENA_REGION_SIZE,
+      .huge_pages = flags & HV_ARENA_HUGE_PAGES,
+   };
+   if (pthread_mutex_init(&a->lock, NULL)) {
+      free(a);
+      *ap = NULL;
       return HV_ENOMEM;
-   if (to_read && read(arg, hv->header, to_read)) {
-      free(hv);
-      return HV_EIO;
    }
-
-   hv->num_words = num_words;
-   hv->num_bkts = num_bkts;
-   for (uint32_t i = 0; i < num_bkts; i++)
-      hv->header[i] = ntohl(hv->header[i]);
-   hv->body = (const uint8_t *)(&hv->header[hv->num_bkts]);
-
-   *hvp = hv;
    return HV_OK;
 }
 
-static int hv_read(void *fp, void *buf, size_t size)
+void hv_arena_reset(struct halva_arena *a)
 {
-   if (fread(buf, 1, size, fp) == size)
-      return 0;
-   return -1;
+   struct hv_region *r = a->regions;
+   while (r) {
+      struct hv_region *next = r->next;
+      if (r != a->first) {
+         a->mapped -= r->size;
+         munmap(r, r->size);
+      }
+      r = next;
+   }
+   a->regions = a->first;
+   a->top = a->end = NULL;
+   if (a->first) {
+      a->first->next = NULL;
+      a->top = (uint8_t *)a->first + HV_REGION_HEADER;
+      a->end = (uint8_t *)a->first + a->first->size;
+   }
 }
 
-int hv_load_file(struct halva **hv, FILE *fp)
+void hv_arena_free(struct halva_arena *a)
 {
-   return hv_load(hv, hv_read, fp);
+   if (!a)
+      return;
+   a->first = NULL;
+   hv_arena_reset(a);
+   pthread_mutex_destroy(&a->lock);
+   free(a);
 }
 
-size_t hv_size(const struct halva *hv)
+const struct halva_allocator *hv_arena_allocator(struct halva_arena *a)
 {
-   return hv->num_words;
+   return &a->allocator;
 }
 
-static uint32_t hv_find_bkt(const struct halva *hv,
-                            const uint8_t *term1, size_t len1)
+size_t hv_arena_size(const struct halva_arena *a)
 {
-   uint32_t low = 0, high = hv->num_bkts;
-
-   while (low < high) {
-      uint32_t mid = (low + high) >> 1;
-      const uint8_t *term2 = hv->body + hv->header[mid];
-      size_t len2 = *term2++;
-      if (lmemcmp(term1, len1, term2, len2) < 0)
-         high = mid;
-      else
-         low = mid + 1;
-   }
-   return low;
+   return a->mapped;
 }
 
-uint32_t hv_locate(const struct halva *hv, const void *term, size_t len1)
-{
-   const uint8_t *term1 = term;
-   uint32_t bkt = hv_find_bkt(hv, term1, len1);
-   if (!bkt)
-      return 0;
 
-   const uint8_t *term2 = hv->body + hv->header[--bkt];
-   size_t len2 = *term2++;
+/*******************************************************************************
+ * Compression
+ ******************************************************************************/
 
-   if (!lmemcmp(term1, len1, term2, len2))
-      return bkt * HV_BLOCKING_FACTOR + 1;
+/* Compressed lexicons are split in frames that are compressed independently,
+ * in the LZ4 block format: a series of sequences, each made of a token byte
+ * holding the number of literals in its high nibble, and the length of a match
+ * minus HV_LZ_MIN_MATCH in its low nibble, then extra length bytes if the
+ * number of literals is >= 15, the literals, the offset of the match as a
+ * 16-bit little-endian integer, and extra length bytes if the match is long.
+ * The last sequence only has literals.
+ */
+#define HV_LZ_MIN_MATCH 4
+#define HV_LZ_MAX_OFFSET 65535
+#define HV_LZ_HASH_BITS 13
 
-   uint8_t term2b[HV_MAX_WORD_LEN + 1];
-   memcpy(term2b, term2, len2);
-   term2 += len2;
+/* As in LZ4, the last bytes of a block are always literals. */
+#define HV_LZ_LAST_LITERALS 5
+#define HV_LZ_MATCH_LIMIT 12
 
-   uint32_t high = hv_limit(hv, bkt);
-   for (uint32_t pos = 1; pos < high; pos++) {
-      size_t pref_len = *term2 & HV_NIBBLE_SIZE;
-      size_t suff_len = *term2++ >> 4;
-      if (!suff_len)
-         suff_len = *term2++;
-      memcpy(&term2b[pref_len], term2, suff_len);
+static uint32_t hv_load32(const uint8_t *p)
+{
+   uint32_t val;
+   memcpy(&val, p, sizeof val);
+   return val;
+}
 
-      int cmp = lmemcmp(term2b, pref_len + suff_len, term1, len1);
-      if (cmp < 0)
-         term2 += suff_len;
-      else if (cmp == 0)
-         return bkt * HV_BLOCKING_FACTOR + pos + 1;
-      else
-         break;
-   }
-   return 0;
+static uint8_t *hv_lz_put_len(uint8_t *op, size_t len)
+{
+   for (; len >= 255; len -= 255)
+      *op++ = 255;
+   *op++ = len;
+   return op;
 }
 
-size_t hv_extract(const struct halva *hv, uint32_t pos, void *buf)
+/* Size of an encoded sequence. Sequences without a match have no offset. */
+static size_t hv_lz_seq_size(size_t lit_len, size_t match_len)
 {
-   if (!pos || pos > hv->num_words) {
-      *(uint8_t *)buf = '\0';
-      return 0;
+   size_t size = 1 + lit_len + (lit_len >= 15 ? (lit_len - 15) / 255 + 1 : 0);
+   if (match_len) {
+      match_len -= HV_LZ_MIN_MATCH;
+      size += 2 + (match_len >= 15 ? (match_len - 15) / 255 + 1 : 0);
    }
+   return size;
+}
 
-   pos--;
-   uint32_t bkt = pos / HV_BLOCKING_FACTOR;
-   uint32_t rest = pos & (HV_BLOCKING_FACTOR - 1);
-
-   const uint8_t *target = hv->body + hv->header[bkt];
-   size_t pref_len = *target++;
-   size_t suff_len = 0;
-
-   memcpy(buf, target, pref_len);
-   if (rest) {
-      target += pref_len;
-      do {
-         pref_len = *target & HV_NIBBLE_SIZE;
-         suff_len = *target++ >> 4;
-         if (!suff_len)
-            suff_len = *target++;
-         memcpy((uint8_t *)buf + pref_len, target, suff_len);
-         target += suff_len;
-      } while (--rest);
-   }
+/* Writes a sequence at "op", which must have room for it. */
+static uint8_t *hv_lz_put_seq(uint8_t *op, const uint8_t *lit, size_t lit_len,
+                              size_t offset, size_t match_len)
+{
+   uint8_t *token = op++;
+   *token = (lit_len < 15 ? lit_len : 15) << 4;
+   if (lit_len >= 15)
+      op = hv_lz_put_len(op, lit_len - 15);
+   memcpy(op, lit, lit_len);
+   op += lit_len;
+   if (!match_len)
+      return op;
 
-   ((uint8_t *)buf)[pref_len += suff_len] = '\0';
-   return pref_len;
+   *op++ = offset & 255;
+   *op++ = offset >> 8;
+   match_len -= HV_LZ_MIN_MATCH;
+   *token |= match_len < 15 ? match_len : 15;
+   if (match_len >= 15)
+      op = hv_lz_put_len(op, match_len - 15);
+   return op;
 }
 
-void hv_free(struct halva *hv)
+/* Compresses a block into at most "cap" bytes. Returns the compressed size, or
+ * 0 if it doesn't fit.
+ */
+static size_t hv_lz_compress(const uint8_t *src, size_t size,
+                             uint8_t *dst, size_t cap)
 {
-   free(hv);
-}
+   uint32_t table[1 << HV_LZ_HASH_BITS] = {0};
+   const uint8_t *ip = src, *anchor = src, *end = src + size;
+   const uint8_t *limit = size > HV_LZ_MATCH_LIMIT ?
+                          end - HV_LZ_MATCH_LIMIT : src;
+   uint8_t *op = dst, *oend = dst + cap;
+   size_t misses = 0;
 
+   while (ip < limit) {
+      uint32_t seq = hv_load32(ip);
+      uint32_t h = (seq * UINT32_C(2654435761)) >> (32 - HV_LZ_HASH_BITS);
+      const uint8_t *ref = src + table[h];
+      table[h] = ip - src;
+      if (ref >= ip || ip - ref > HV_LZ_MAX_OFFSET || hv_load32(ref) != seq) {
+         /* Move faster through data that doesn't compress. */
+         ip += 1 + (misses++ >> 6);
+         continue;
+      }
+      misses = 0;
 
-/*******************************************************************************
- * Iterator
- ******************************************************************************/
+      size_t len = HV_LZ_MIN_MATCH;
+      while (ip + len < end - HV_LZ_LAST_LITERALS && ref[len] == ip[len])
+         len++;
+      size_t lit_len = ip - anchor;
+      if (hv_lz_seq_size(lit_len, len) > (size_t)(oend - op))
+         return 0;
+      op = hv_lz_put_seq(op, anchor, lit_len, ip - ref, len);
+      ip += len;
+      anchor = ip;
+   }
 
-uint32_t hv_iter_init(struct halva_iter *it, const struct halva *hv)
-{
-   it->hv = hv;
-   it->pos = 0;
-   it->p = hv->body;
-   return it->pos < hv->num_words ? 1 : 0;
+   size_t lit_len = end - anchor;
+   if (hv_lz_seq_size(lit_len, 0) > (size_t)(oend - op))
+      return 0;
+   op = hv_lz_put_seq(op, anchor, lit_len, 0, 0);
+   return op - dst;
 }
 
-uint32_t hv_iter_inits(struct halva_iter *it, const struct halva *hv,
-                       const void *term, size_t len1)
+/* Decompresses a block that must expand to exactly "size" bytes. Returns
+ * false if the block is malformed.
+ */
+static bool hv_lz_decompress(const uint8_t *src, size_t csize,
+                             uint8_t *dst, size_t size)
 {
-   const uint8_t *term1 = term;
+   const uint8_t *ip = src, *iend = src + csize;
+   uint8_t *op = dst, *oend = dst + size;
 
-   uint32_t bkt = hv_find_bkt(hv, term1, len1);
-   if (!bkt)
-      return hv_iter_init(it, hv);
-
-   it->hv = hv;
-
-   const uint8_t *cur = hv->body + hv->header[--bkt];
-   const uint8_t *term2 = cur;
-   size_t pref_len, suff_len = *term2++;
-
-   if (!lmemcmp(term1, len1, term2, suff_len)) {
-      it->pos = bkt * HV_BLOCKING_FACTOR;
-      it->p = cur;
-      return it->pos + 1;
-   }
+   for (;;) {
+      if (ip == iend)
+         return false;
+      unsigned token = *ip++;
+      size_t len = token >> 4;
+      if (len == 15) {
+         uint8_t b;
+         do {
+            if (ip == iend)
+               return false;
+            b = *ip++;
+            len += b;
+         } while (b == 255);
+      }
+      if (len > (size_t)(iend - ip) || len > (size_t)(oend - op))
+         return false;
+      memcpy(op, ip, len);
+      op += len;
+      ip += len;
+      if (ip == iend)
+         return op == oend;
 
-   memcpy(it->word, term2, suff_len);
-   term2 += suff_len;
+      if (iend - ip < 2)
+         return false;
+      size_t offset = ip[0] | ip[1] << 8;
+      ip += 2;
+      if (!offset || offset > (size_t)(op - dst))
+         return false;
+      len = token & 15;
+      if (len == 15) {
+         uint8_t b;
+         do {
+            if (ip == iend)
+               return false;
+            b = *ip++;
+            len += b;
+         } while (b == 255);
+      }
+      len += HV_LZ_MIN_MATCH;
+      if (len > (size_t)(oend - op))
+         return false;
 
-   uint32_t high = hv_limit(hv, bkt);
-   for (uint32_t pos = 1; pos < high; pos++) {
-      cur = term2;
-      pref_len = *term2 & HV_NIBBLE_SIZE;
-      suff_len = *term2++ >> 4;
-      if (!suff_len)
-         suff_len = *term2++;
-      memcpy(&it->word[pref_len], term2, suff_len);
-      if (lmemcmp(term1, len1, it->word, pref_len + suff_len) > 0) {
-         term2 += suff_len;
-         continue;
+      const uint8_t *ref = op - offset;
+      if (offset >= len) {
+         memcpy(op, ref, len);
+         op += len;
+      } else {
+         while (len--)
+            *op++ = *ref++;
       }
-      it->pos = bkt * HV_BLOCKING_FACTOR + pos;
-      it->p = cur;
-      return it->pos + 1;
    }
+}
 
-   it->pos = (bkt + 1) * HV_BLOCKING_FACTOR;
-   it->p = term2;
-   if (it->pos > hv->num_words)
-      return 0;
-   return it->pos + 1;
+/* A section of the data of a lexicon. */
+struct hv_section {
+   const void *data;
+   size_t size;
+};
+
+/* Size of the frame at index "i", given the total size of the data. */
+static uint32_t hv_frame_len(uint64_t size, uint32_t frame_size, uint64_t i)
+{
+   uint64_t rest = size - i * frame_size;
+   return rest < frame_size ? rest : frame_size;
 }
 
-uint32_t hv_iter_initn(struct halva_iter *it, const struct halva *hv,
-                       uint32_t pos)
+/* Compresses the concatenation of the given sections by frames. "*out" is made
+ * to point to an allocated buffer holding the table of the compressed size of
+ * each frame, as 32-bit integers in network order, followed by the frames.
+ * Frames that don't compress are stored as is, with their original size.
+ * The buffer is obtained from the given allocator, and is "*out_size + 1" bytes
+ * long.
+ */
+static int hv_compress(const struct halva_allocator *a,
+                       const struct hv_section *secs, size_t num_secs,
+                       uint32_t frame_size, uint8_t **out,
+                       size_t *table_size, size_t *out_size)
+{
+   size_t size = 0;
+   for (size_t i = 0; i < num_secs; i++)
+      size += secs[i].size;
+   size_t num_frames = (size + frame_size - 1) / frame_size;
+   *table_size = num_frames * sizeof(uint32_t);
+   size_t alloc = *table_size + size + 1;
+   uint8_t *data = hv_alloc(a, size ? size : 1);
+   *out = data ? hv_alloc(a, alloc) : NULL;
+   if (!*out) {
+      hv_dealloc(a, data, size ? size : 1);
+      return HV_ENOMEM;
+   }
+   size_t pos = 0;
+   for (size_t i = 0; i < num_secs; i++) {
+      if (secs[i].size)
+         memcpy(&data[pos], secs[i].data, secs[i].size);
+      pos += secs[i].size;
+   }
+
+   uint8_t *op = *out + *table_size;
+   for (size_t i = 0; i < num_frames; i++) {
+      const uint8_t *src = &data[i * frame_size];
+      uint32_t len = hv_frame_len(size, frame_size, i);
+      size_t csize = hv_lz_compress(src, len, op, len - 1);
+      if (!csize) {
+         memcpy(op, src, len);
+         csize = len;
+      }
+      uint32_t raw = htonl(csize);
+      memcpy(*out + i * sizeof raw, &raw, sizeof raw);
+      op += csize;
+   }
+   *out_size = op - *out;
+   hv_dealloc(a, data, size ? size : 1);
+   uint8_t *tmp = hv_realloc(a, *out, alloc, *out_size + 1);
+   if (!tmp) {
+      hv_dealloc(a, *out, alloc);
+      *out = NULL;
+      return HV_ENOMEM;
+   }
+   *out = tmp;
+   return HV_OK;
+}
+
+
+/*******************************************************************************
+ * Encoder
+ ******************************************************************************/
+
+#define HV_MAX_SIZE (3UL * 1024 * 1024 * 1024) /* Be conservative. */
+
+#define HV_DEF_GROW(NAME)                                                      \
+static int hv_enc_grow_##NAME(struct halva_enc *enc, size_t incr)              \
+{                                                                              \
+   size_t need = enc->NAME##_size + incr;                                      \
+   if (need < enc->NAME##_size)                                                \
+      return HV_ENOMEM;                                                        \
+   if (need <= enc->NAME##_alloc)                                              \
+      return HV_OK;                                                            \
+                                                                               \
+   size_t new_alloc = enc->NAME##_alloc + (enc->NAME##_alloc >> 1) + 16;       \
+   if (new_alloc < need)                                                       \
+      new_alloc = need;                                                        \
+   if (new_alloc > SIZE_MAX / sizeof *enc->NAME)                               \
+      return HV_ENOMEM;                                                        \
+                                                                               \
+   void *tmp = hv_realloc(enc->allocator, enc->NAME,                           \
+                          enc->NAME##_alloc * sizeof *enc->NAME,               \
+                          new_alloc * sizeof *enc->NAME);                      \
+   if (!tmp)                                                                   \
+      return HV_ENOMEM;                                                        \
+                                                                               \
+   enc->NAME = tmp;                                                            \
+   enc->NAME##_alloc = new_alloc;                                              \
+   return HV_OK;                                                               \
+}
+
+HV_DEF_GROW(header)
+HV_DEF_GROW(body)
+HV_DEF_GROW(values)
+HV_DEF_GROW(blob_ends)
+HV_DEF_GROW(blobs)
+
+static uint32_t hv_enc_blocking_factor(const struct halva_enc *enc)
+{
+   return enc->blocking_factor ? enc->blocking_factor : HV_BLOCKING_FACTOR;
+}
+
+int hv_enc_set_blocking_factor(struct halva_enc *enc, uint32_t bf)
+{
+   if (enc->num_words || enc->finished)
+      return HV_EFREEZED;
+   if (bf < HV_MIN_BLOCKING_FACTOR || bf > HV_MAX_BLOCKING_FACTOR
+       || (bf & (bf - 1)))
+      return HV_EINVAL;
+   enc->blocking_factor = bf;
+   return HV_OK;
+}
+
+int hv_enc_set_engine(struct halva_enc *enc, int engine)
+{
+   if (enc->finished)
+      return HV_EFREEZED;
+   if (engine != HV_ENGINE_FRONT_CODING && engine != HV_ENGINE_TRIE)
+      return HV_EINVAL;
+   enc->engine = engine;
+   return HV_OK;
+}
+
+int hv_enc_set_compression(struct halva_enc *enc, uint32_t frame_size)
+{
+   if (enc->finished)
+      return HV_EFREEZED;
+   if (frame_size && (frame_size < HV_MIN_FRAME_SIZE
+                      || frame_size > HV_MAX_FRAME_SIZE))
+      return HV_EINVAL;
+   enc->frame_size = frame_size;
+   return HV_OK;
+}
+
+int hv_enc_set_allocator(struct halva_enc *enc,
+                         const struct halva_allocator *allocator)
+{
+   /* Buffers can't change hands. */
+   if (enc->header_alloc || enc->finished)
+      return HV_EFREEZED;
+   enc->allocator = allocator;
+   return HV_OK;
+}
+
+int hv_enc_set_suffix_index(struct halva_enc *enc, int enable)
+{
+   if (enc->finished)
+      return HV_EFREEZED;
+   enc->suffix_index = !!enable;
+   return HV_OK;
+}
+
+int hv_enc_add(struct halva_enc *enc, const void *word, size_t len)
+{
+   return hv_enc_add_many(enc, 1, &word, &len);
+}
+
+int hv_enc_add_many(struct halva_enc *enc, size_t num,
+                    const void *const *words, const size_t *lens)
+{
+   if (enc->finished)
+      return HV_EFREEZED;
+
+   /* Reserve space for the whole batch upfront. Invalid words are rejected
+    * below, so don't count them.
+    */
+   size_t body_incr = 0;
+   for (size_t i = 0; i < num; i++)
+      body_incr += 2 + (lens[i] <= HV_MAX_WORD_LEN ? lens[i] : 0);
+   const uint32_t bf = hv_enc_blocking_factor(enc);
+   if (hv_enc_grow_header(enc, num / bf + 1)
+       || hv_enc_grow_body(enc, body_incr))
+      return HV_ENOMEM;
+
+   /* Words are compared with the previous one of the batch in place. Only the
+    * last one is copied.
+    */
+   const uint8_t *prev = enc->prev;
+   size_t prev_len = enc->prev_len;
+   int ret = HV_OK;
+
+   for (size_t i = 0; i < num; i++) {
+      const uint8_t *word = words[i];
+      size_t len = lens[i];
+
+      if (enc->header_size * sizeof *enc->header + enc->body_size > HV_MAX_SIZE) {
+         ret = HV_E2BIG;
+         break;
+      }
+      if (len == 0 || len > HV_MAX_WORD_LEN) {
+         ret = HV_EWORD;
+         break;
+      }
+      size_t pref_len = hv_common_prefix(prev, prev_len, word, len);
+      if (pref_len == len
+          || (pref_len < prev_len && word[pref_len] < prev[pref_len])) {
+         ret = HV_EORDER;
+         break;
+      }
+
+      if (!(enc->num_words & (bf - 1))) {
+         enc->header[enc->header_size++] = enc->body_size;
+         enc->body[enc->body_size++] = len;
+         memcpy(&enc->body[enc->body_size], word, len);
+         enc->body_size += len;
+      } else {
+         if (pref_len > HV_NIBBLE_SIZE)
+            pref_len = HV_NIBBLE_SIZE;
+         size_t suff_len = len - pref_len;
+         if (suff_len > HV_NIBBLE_SIZE) {
+            enc->body[enc->body_size++] = pref_len;
+            enc->body[enc->body_size++] = suff_len;
+         } else {
+            enc->body[enc->body_size++] = pref_len | (suff_len << 4);
+         }
+         memcpy(&enc->body[enc->body_size], &word[pref_len], suff_len);
+         enc->body_size += suff_len;
+      }
+      prev = word;
+      prev_len = len;
+      enc->num_words++;
+   }
+
+   if (prev != enc->prev) {
+      memcpy(enc->prev, prev, prev_len);
+      enc->prev_len = prev_len;
+   }
+   return ret;
+}
+
+/* Columns are only materialized once a word has a value != 0 or a non-empty
+ * blob. Afterwards, words added without a value are not recorded in them, so
+ * they are padded with default entries up to the given number of words when
+ * needed.
+ */
+static void hv_enc_pad_columns(struct halva_enc *enc, size_t num)
+{
+   if (enc->values_size)
+      while (enc->values_size < num)
+         enc->values[enc->values_size++] = 0;
+   if (enc->blob_ends_size)
+      while (enc->blob_ends_size < num)
+         enc->blob_ends[enc->blob_ends_size++] = enc->blobs_size;
+}
+
+int hv_enc_add_value(struct halva_enc *enc, const void *word, size_t len,
+                     uint64_t value, const void *blob, size_t blob_size)
+{
+   if (enc->finished)
+      return HV_EFREEZED;
+
+   /* Reserve memory first, so that we don't have to roll back. */
+   bool has_values = value || enc->values_size;
+   bool has_blobs = blob_size || enc->blob_ends_size;
+   size_t num = enc->num_words + 1;
+   if (has_blobs && blob_size > UINT32_MAX - enc->blobs_size)
+      return HV_E2BIG;
+   if ((has_values && hv_enc_grow_values(enc, num - enc->values_size))
+       || (has_blobs && hv_enc_grow_blob_ends(enc, num - enc->blob_ends_size))
+       || hv_enc_grow_blobs(enc, blob_size))
+      return HV_ENOMEM;
+
+   int ret = hv_enc_add(enc, word, len);
+   if (ret)
+      return ret;
+
+   if (has_values) {
+      while (enc->values_size < num - 1)
+         enc->values[enc->values_size++] = 0;
+      enc->values[enc->values_size++] = value;
+   }
+   if (has_blobs) {
+      while (enc->blob_ends_size < num - 1)
+         enc->blob_ends[enc->blob_ends_size++] = enc->blobs_size;
+      if (blob_size)
+         memcpy(&enc->blobs[enc->blobs_size], blob, blob_size);
+      enc->blobs_size += blob_size;
+      enc->blob_ends[enc->blob_ends_size++] = enc->blobs_size;
+   }
+   return HV_OK;
+}
+
+/* Number of bits needed to represent an integer. */
+static unsigned hv_bit_width(uint64_t n)
+{
+   unsigned width = 0;
+   while (n) {
+      n >>= 1;
+      width++;
+   }
+   return width;
+}
+
+/* Width of the ordinals stored in the suffix index of a lexicon. */
+static unsigned hv_perm_width(uint32_t num_words)
+{
+   return hv_bit_width(num_words ? num_words - 1 : 0);
+}
+
+/* Decodes the words added to an encoder. "*data" is made to point to their
+ * concatenation, and "*ends" to the offset where each of them ends in it.
+ */
+static int hv_enc_decode(const struct halva_enc *enc, uint8_t **data,
+                         size_t **ends)
+{
+   size_t num = enc->num_words;
+   const uint32_t bf = hv_enc_blocking_factor(enc);
+
+   /* Their lengths are needed first. */
+   *data = NULL;
+   *ends = hv_alloc(enc->allocator, (num ? num : 1) * sizeof **ends);
+   if (!*ends)
+      return HV_ENOMEM;
+   const uint8_t *p = enc->body;
+   size_t total = 0;
+   for (size_t i = 0; i < num; i++) {
+      size_t pref_len = 0, suff_len = *p++;
+      if (i & (bf - 1)) {
+         pref_len = suff_len & HV_NIBBLE_SIZE;
+         suff_len >>= 4;
+         if (!suff_len)
+            suff_len = *p++;
+      }
+      p += suff_len;
+      total += pref_len + suff_len;
+      (*ends)[i] = total;
+   }
+
+   uint8_t *words = *data = hv_alloc(enc->allocator, total ? total : 1);
+   if (!words) {
+      hv_dealloc(enc->allocator, *ends, (num ? num : 1) * sizeof **ends);
+      *ends = NULL;
+      return HV_ENOMEM;
+   }
+   p = enc->body;
+   for (size_t i = 0; i < num; i++) {
+      size_t start = i ? (*ends)[i - 1] : 0;
+      size_t pref_len = 0, suff_len = *p++;
+      if (i & (bf - 1)) {
+         pref_len = suff_len & HV_NIBBLE_SIZE;
+         suff_len >>= 4;
+         if (!suff_len)
+            suff_len = *p++;
+         memcpy(&words[start], &words[i > 1 ? (*ends)[i - 2] : 0], pref_len);
+      }
+      memcpy(&words[start + pref_len], p, suff_len);
+      p += suff_len;
+   }
+   return HV_OK;
+}
+
+/* Releases the buffers of hv_enc_decode(). Words are not empty. */
+static void hv_enc_decode_fini(const struct halva_enc *enc, uint8_t *data,
+                               size_t *ends)
+{
+   size_t num = enc->num_words;
+   hv_dealloc(enc->allocator, data, num ? ends[num - 1] : 1);
+   hv_dealloc(enc->allocator, ends, (num ? num : 1) * sizeof *ends);
+}
+
+/* Builds the trie of the words added so far. Defined with the trie engine. */
+static int hv_trie_build(const struct halva_enc *, uint8_t **trie,
+                         size_t *size);
+
+/* Builds the suffix index of the words added so far: a reversed lexicon of
+ * "*lex_size" bytes, followed by the permutation, "*size" bytes in total.
+ * Defined with suffix queries.
+ */
+static int hv_suffix_build(const struct halva_enc *, uint8_t **index,
+                           size_t *lex_size, size_t *size);
+
+int hv_enc_dump(struct halva_enc *enc,
+                int (*write)(void *arg, const void *data, size_t size),
+                void *arg)
+{
+   if (!enc->finished) {
+      if ((enc->values_size
+           && hv_enc_grow_values(enc, enc->num_words - enc->values_size))
+          || (enc->blob_ends_size
+           && hv_enc_grow_blob_ends(enc, enc->num_words - enc->blob_ends_size)))
+         return HV_ENOMEM;
+      hv_enc_pad_columns(enc, enc->num_words);
+      for (size_t i = 0; i < enc->header_size; i++)
+         enc->header[i] = htonl(enc->header[i]);
+      for (size_t i = 0; i < enc->blob_ends_size; i++)
+         enc->blob_ends[i] = htonl(enc->blob_ends[i]);
+      enc->finished = true;
+   }
+
+   uint64_t max_value = 0;
+   for (size_t i = 0; i < enc->values_size; i++)
+      if (enc->values[i] > max_value)
+         max_value = enc->values[i];
+   unsigned width = hv_bit_width(max_value);
+   size_t values_size = HV_VALUES_SIZE(enc->num_words, width);
+   uint8_t *values = NULL;
+   if (values_size) {
+      values = hv_alloc(enc->allocator, values_size);
+      if (!values)
+         return HV_ENOMEM;
+      memset(values, 0, values_size);
+      for (size_t i = 0; i < enc->values_size; i++)
+         hv_put_bits(values, (uint64_t)i * width, width, enc->values[i]);
+   }
+   size_t blob_ends_size = enc->blobs_size ?
+                           enc->num_words * sizeof *enc->blob_ends : 0;
+
+   /* Tries have no bucket pointers. */
+   const uint8_t *body = enc->body;
+   size_t body_size = enc->body_size;
+   size_t header_size = enc->header_size * sizeof *enc->header;
+   uint8_t *trie = NULL;
+   if (enc->engine == HV_ENGINE_TRIE) {
+      int ret = hv_trie_build(enc, &trie, &body_size);
+      if (ret) {
+         hv_dealloc(enc->allocator, values, values_size);
+         return ret;
+      }
+      body = trie;
+      header_size = 0;
+   }
+
+   uint8_t *suffix = NULL;
+   size_t suffix_lex_size = 0, suffix_size = 0;
+   if (enc->suffix_index) {
+      int ret = hv_suffix_build(enc, &suffix, &suffix_lex_size, &suffix_size);
+      if (ret) {
+         hv_dealloc(enc->allocator, values, values_size);
+         hv_dealloc(enc->allocator, trie, body_size);
+         return ret;
+      }
+   }
+
+   const struct hv_section secs[] = {
+      {enc->header, header_size},
+      {body, body_size},
+      {values, values_size},
+      {enc->blob_ends, blob_ends_size},
+      {enc->blobs, blob_ends_size ? enc->blobs_size : 0},
+      {suffix, suffix_size},
+   };
+   const size_t num_secs = sizeof secs / sizeof *secs;
+
+   uint8_t *frames = NULL;
+   size_t table_size = 0, frames_size = 0;
+   if (enc->frame_size) {
+      int ret = hv_compress(enc->allocator, secs, num_secs, enc->frame_size,
+                            &frames, &table_size, &frames_size);
+      if (ret) {
+         hv_dealloc(enc->allocator, values, values_size);
+         hv_dealloc(enc->allocator, trie, body_size);
+         hv_dealloc(enc->allocator, suffix, suffix_size);
+         return ret;
+      }
+   }
+
+   uint32_t header[] = {
+      htonl(hv_magic),
+      htonl(hv_version),
+      htonl(enc->num_words),
+      htonl(body_size),
+      0,
+      htonl(hv_enc_blocking_factor(enc)),
+      htonl(width),
+      htonl(enc->blobs_size),
+      htonl(enc->engine),
+      htonl(enc->frame_size),
+      htonl(suffix_lex_size),
+   };
+   const size_t num_fields = sizeof header / sizeof *header;
+   /* The checksum covers everything but itself. Compressed data is covered
+    * in its original form, after the table of frame sizes.
+    */
+   uint32_t crc = hv_crc32c(0, header, 4 * sizeof *header);
+   crc = hv_crc32c(crc, &header[5], (num_fields - 5) * sizeof *header);
+   crc = hv_crc32c(crc, frames, table_size);
+   for (size_t i = 0; i < num_secs; i++)
+      crc = hv_crc32c(crc, secs[i].data, secs[i].size);
+   header[4] = htonl(crc);
+
+   int ret = HV_OK;
+   if (write(arg, header, sizeof header))
+      ret = HV_EIO;
+   else if (frames && write(arg, frames, frames_size))
+      ret = HV_EIO;
+   for (size_t i = 0; !ret && !frames && i < num_secs; i++)
+      if (secs[i].size && write(arg, secs[i].data, secs[i].size))
+         ret = HV_EIO;
+   hv_dealloc(enc->allocator, values, values_size);
+   hv_dealloc(enc->allocator, trie, body_size);
+   hv_dealloc(enc->allocator, suffix, suffix_size);
+   hv_dealloc(enc->allocator, frames, frames_size + 1);
+   return ret;
+}
+
+static int hv_write(void *fp, const void *data, size_t size)
+{
+   if (fwrite(data, 1, size, fp) == size)
+      return 0;
+   return -1;
+}
+
+int hv_enc_dump_file(struct halva_enc *enc, FILE *fp)
+{
+   int ret = hv_enc_dump(enc, hv_write, fp);
+   if (ret)
+      return ret;
+
+   return fflush(fp) ? HV_EIO : HV_OK;
+}
+
+void hv_enc_clear(struct halva_enc *enc)
+{
+   enc->num_words = enc->header_size = enc->body_size = 0;
+   enc->values_size = enc->blob_ends_size = enc->blobs_size = 0;
+   enc->prev_len = 0;
+   enc->finished = false;
+}
+
+void hv_enc_fini(struct halva_enc *enc)
+{
+   const struct halva_allocator *a = enc->allocator;
+   hv_dealloc(a, enc->header, enc->header_alloc * sizeof *enc->header);
+   hv_dealloc(a, enc->body, enc->body_alloc * sizeof *enc->body);
+   hv_dealloc(a, enc->values, enc->values_alloc * sizeof *enc->values);
+   hv_dealloc(a, enc->blob_ends,
+              enc->blob_ends_alloc * sizeof *enc->blob_ends);
+   hv_dealloc(a, enc->blobs, enc->blobs_alloc * sizeof *enc->blobs);
+}
+
+
+/*******************************************************************************
+ * Decoder
+ ******************************************************************************/
+
+struct hv_decoder;
+
+struct halva {
+   uint32_t num_words;     /* Number of words. */
+   uint32_t num_bkts;      /* Number of buckets. */
+   const uint8_t *body;    /* Body section. */
+   uint32_t body_size;     /* Size of the body section, in bytes. */
+   uint32_t version;       /* Data format version. */
+   unsigned bkt_shift;     /* Log2 of the blocking factor. */
+   const struct hv_decoder *dec; /* Decoders for this blocking factor. */
+   const uint8_t *values;  /* Bit-packed values. */
+   unsigned value_width;   /* Width of values, in bits, 0 if none. */
+   const uint8_t *blob_ends; /* End offsets of blobs, in network order. */
+   const uint8_t *blobs;   /* Blobs contents. */
+   uint32_t blobs_size;    /* 0 if there are no blobs. */
+   uint32_t *maxima;       /* Tree of bucket maxima, NULL if no values. */
+   int engine;             /* HV_ENGINE_* constant. */
+   uint32_t frame_size;    /* 0 if the file was not compressed. */
+   uint64_t stored_size;   /* Size of the file. */
+   const uint8_t *header;  /* Bucket pointers, in network order. */
+   struct halva *rev;      /* Reversed words, NULL if no suffix index. */
+   const uint8_t *perm;    /* Bit-packed ordinals of reversed words. */
+   unsigned perm_width;    /* Width of these ordinals, in bits. */
+   const struct halva_allocator *allocator; /* NULL for the standard one. */
+   size_t mem_size;        /* Size of the allocation holding the handle. */
+};
+
+/* Offset of the first word of a bucket in the body section. Bucket pointers
+ * are kept as stored, so that lexicons can be used in place.
+ */
+HV_INLINE uint32_t hv_bkt_ptr(const struct halva *hv, uint32_t bkt)
+{
+   uint32_t ptr;
+   memcpy(&ptr, &hv->header[bkt * sizeof ptr], sizeof ptr);
+   return ntohl(ptr);
+}
+
+#define HV_BKT_MASK(hv) ((UINT32_C(1) << (hv)->bkt_shift) - 1)
+
+/* Number of words in a bucket, given the blocking factor. */
+HV_INLINE uint32_t hv_bkt_size(const struct halva *hv, uint32_t bkt,
+                               uint32_t bf)
+{
+   assert(bkt < hv->num_bkts);
+
+   if (bkt + 1 == hv->num_bkts) {
+      uint32_t high = hv->num_words & (bf - 1);
+      if (high)
+         return high;
+   }
+   return bf;
+}
+
+static uint32_t hv_limit(const struct halva *hv, uint32_t bkt)
+{
+   return hv_bkt_size(hv, bkt, HV_BKT_MASK(hv) + 1);
+}
+
+/* Decodes the bucket entry at "p", which is not the first one of its bucket.
+ * "word" must hold the previous word of the bucket. Stores the lengths of the
+ * prefix shared with that word and of the rest of the new word in "*pref_len"
+ * and "*suff_len", and returns a pointer to the next entry.
+ */
+HV_INLINE const uint8_t *hv_decode(const uint8_t *p, uint8_t *word,
+                                   size_t *pref_len, size_t *suff_len)
+{
+   *pref_len = *p & HV_NIBBLE_SIZE;
+   *suff_len = *p++ >> 4;
+   if (!*suff_len)
+      *suff_len = *p++;
+   memcpy(&word[*pref_len], p, *suff_len);
+   return p + *suff_len;
+}
+
+/* The functions below are written once, as inline templates taking the
+ * blocking factor as a parameter, and instantiated for each supported
+ * blocking factor by HV_DEF_DECODER(). With a constant blocking factor, bucket
+ * offsets are computed with shifts and masks, and loops over buckets have a
+ * known trip count. The instance matching a lexicon is chosen when loading it.
+ */
+
+/* Finishes a lookup, given the value returned by hv_find_bkt(). */
+HV_INLINE uint32_t hv_locate_in_tpl(const struct halva *hv, uint32_t bkt,
+                                    const uint8_t *term1, size_t len1,
+                                    const uint32_t bf)
+{
+   if (!bkt) {
+      HV_COUNT(locate_misses, 1);
+      return 0;
+   }
+
+   const uint8_t *term2 = hv->body + hv_bkt_ptr(hv, --bkt);
+   size_t len2 = *term2++;
+
+   if (!lmemcmp(term1, len1, term2, len2)) {
+      HV_COUNT(locate_hits, 1);
+      HV_COUNT(entries_decoded, 1);
+      return bkt * bf + 1;
+   }
+
+   uint8_t word[HV_MAX_WORD_LEN + 1];
+   memcpy(word, term2, len2);
+   term2 += len2;
+
+   uint32_t high = hv_bkt_size(hv, bkt, bf);
+   for (uint32_t pos = 1; pos < high; pos++) {
+      size_t pref_len, suff_len;
+      term2 = hv_decode(term2, word, &pref_len, &suff_len);
+
+      int cmp = lmemcmp(word, pref_len + suff_len, term1, len1);
+      if (cmp == 0) {
+         HV_COUNT(locate_hits, 1);
+         HV_COUNT(entries_decoded, pos + 1);
+         return bkt * bf + pos + 1;
+      } else if (cmp > 0) {
+         HV_COUNT(entries_decoded, pos + 1);
+         break;
+      }
+   }
+   HV_COUNT(locate_misses, 1);
+   return 0;
+}
+
+/* Counts the words < the given one, given the value returned by hv_find_bkt(),
+ * and sets "*found" if the word is in the lexicon. Words are compared in
+ * place: "match" is the length of the prefix the word shares with the current
+ * entry, which is smaller than it, and the prefix length of the next entry
+ * tells on its own how it compares, unless both are equal. Prefix lengths are
+ * capped, and then only give a lower bound.
+ */
+HV_INLINE uint32_t hv_rank_in_tpl(const struct halva *hv, uint32_t bkt,
+                                  const uint8_t *term1, size_t len1,
+                                  bool *found, const uint32_t bf)
+{
+   *found = false;
+   if (!bkt)
+      return 0;
+
+   const uint8_t *p = hv->body + hv_bkt_ptr(hv, --bkt);
+   size_t len2 = *p++;
+   size_t match = hv_common_prefix(term1, len1, p, len2);
+   p += len2;
+   if (match == len1 && match == len2) {
+      *found = true;
+      HV_COUNT(entries_decoded, 1);
+      return bkt * bf;
+   }
+
+   uint32_t high = hv_bkt_size(hv, bkt, bf);
+   for (uint32_t pos = 1; pos < high; pos++) {
+      size_t pref_len = *p & HV_NIBBLE_SIZE;
+      size_t suff_len = *p++ >> 4;
+      if (!suff_len)
+         suff_len = *p++;
+      if (pref_len < match && pref_len < HV_NIBBLE_SIZE) {
+         HV_COUNT(entries_decoded, pos + 1);
+         return bkt * bf + pos;
+      }
+      if (pref_len <= match) {
+         match = pref_len;
+         size_t n = hv_common_prefix(&term1[match], len1 - match, p, suff_len);
+         if (n == suff_len && match + n == len1) {
+            *found = true;
+            HV_COUNT(entries_decoded, pos + 1);
+            return bkt * bf + pos;
+         }
+         if (match + n == len1 || (n < suff_len && p[n] > term1[match + n])) {
+            HV_COUNT(entries_decoded, pos + 1);
+            return bkt * bf + pos;
+         }
+         match += n;
+      }
+      p += suff_len;
+   }
+   HV_COUNT(entries_decoded, high);
+   return bkt * bf + high;
+}
+
+/* Extracts the word at the given zero-based position, which must be valid. */
+HV_INLINE size_t hv_extract_tpl(const struct halva *hv, uint32_t pos,
+                                void *buf, const uint32_t bf)
+{
+   uint32_t bkt = pos / bf;
+   uint32_t rest = pos & (bf - 1);
+   uint8_t *word = buf;
+
+   const uint8_t *p = hv->body + hv_bkt_ptr(hv, bkt);
+   size_t len = *p++;
+   memcpy(word, p, len);
+   p += len;
+
+   HV_COUNT(entries_decoded, rest + 1);
+   for (uint32_t i = 0; i < rest; i++) {
+      size_t pref_len, suff_len;
+      p = hv_decode(p, word, &pref_len, &suff_len);
+      len = pref_len + suff_len;
+   }
+
+   word[len] = '\0';
+   return len;
+}
+
+/* Positions an iterator on the word at the given zero-based position, which
+ * must be valid.
+ */
+HV_INLINE void hv_iter_seek_tpl(struct halva_iter *it, uint32_t pos,
+                                const uint32_t bf)
+{
+   const struct halva *hv = it->hv;
+   uint32_t bkt = pos / bf;
+   uint32_t rest = pos & (bf - 1);
+
+   const uint8_t *p = hv->body + hv_bkt_ptr(hv, bkt);
+   if (rest) {
+      size_t len = *p++;
+      memcpy(it->word, p, len);
+      p += len;
+      for (uint32_t i = 1; i < rest; i++) {
+         size_t pref_len, suff_len;
+         p = hv_decode(p, (uint8_t *)it->word, &pref_len, &suff_len);
+      }
+   }
+   it->pos = pos;
+   it->p = p;
+}
+
+/* Positions an iterator on the first word >= the given one, given the value
+ * returned by hv_find_bkt(), which must be > 0. Returns the ordinal of that
+ * word, or 0 if there is none.
+ */
+HV_INLINE uint32_t hv_iter_find_tpl(struct halva_iter *it, uint32_t bkt,
+                                    const uint8_t *term1, size_t len1,
+                                    const uint32_t bf)
+{
+   const struct halva *hv = it->hv;
+   const uint8_t *cur = hv->body + hv_bkt_ptr(hv, --bkt);
+   const uint8_t *term2 = cur;
+   size_t suff_len = *term2++;
+
+   if (!lmemcmp(term1, len1, term2, suff_len)) {
+      it->pos = bkt * bf;
+      it->p = cur;
+      return it->pos + 1;
+   }
+
+   memcpy(it->word, term2, suff_len);
+   term2 += suff_len;
+
+   uint32_t high = hv_bkt_size(hv, bkt, bf);
+   for (uint32_t pos = 1; pos < high; pos++) {
+      size_t pref_len;
+      cur = term2;
+      term2 = hv_decode(term2, (uint8_t *)it->word, &pref_len, &suff_len);
+      if (lmemcmp(term1, len1, it->word, pref_len + suff_len) > 0)
+         continue;
+      it->pos = bkt * bf + pos;
+      it->p = cur;
+      return it->pos + 1;
+   }
+
+   it->pos = (bkt + 1) * bf;
+   it->p = term2;
+   if (it->pos >= hv->num_words)
+      return 0;
+   return it->pos + 1;
+}
+
+struct hv_decoder {
+   uint32_t (*locate_in)(const struct halva *, uint32_t bkt,
+                         const uint8_t *term, size_t len);
+   uint32_t (*rank_in)(const struct halva *, uint32_t bkt,
+                       const uint8_t *term, size_t len, bool *found);
+   size_t (*extract)(const struct halva *, uint32_t pos, void *buf);
+   void (*iter_seek)(struct halva_iter *, uint32_t pos);
+   uint32_t (*iter_find)(struct halva_iter *, uint32_t bkt,
+                         const uint8_t *term, size_t len);
+};
+
+#define HV_DEF_DECODER(BF)                                                     \
+static uint32_t hv_locate_in_##BF(const struct halva *hv, uint32_t bkt,        \
+                                  const uint8_t *term, size_t len)             \
+{                                                                              \
+   return hv_locate_in_tpl(hv, bkt, term, len, BF);                            \
+}                                                                              \
+                                                                               \
+static uint32_t hv_rank_in_##BF(const struct halva *hv, uint32_t bkt,          \
+                                const uint8_t *term, size_t len, bool *found)  \
+{                                                                              \
+   return hv_rank_in_tpl(hv, bkt, term, len, found, BF);                       \
+}                                                                              \
+                                                                               \
+static size_t hv_extract_##BF(const struct halva *hv, uint32_t pos, void *buf) \
+{                                                                              \
+   return hv_extract_tpl(hv, pos, buf, BF);                                    \
+}                                                                              \
+                                                                               \
+static void hv_iter_seek_##BF(struct halva_iter *it, uint32_t pos)             \
+{                                                                              \
+   hv_iter_seek_tpl(it, pos, BF);                                              \
+}                                                                              \
+                                                                               \
+static uint32_t hv_iter_find_##BF(struct halva_iter *it, uint32_t bkt,         \
+                                  const uint8_t *term, size_t len)             \
+{                                                                              \
+   return hv_iter_find_tpl(it, bkt, term, len, BF);                            \
+}                                                                              \
+                                                                               \
+static const struct hv_decoder hv_decoder_##BF = {                             \
+   .locate_in = hv_locate_in_##BF,                                             \
+   .rank_in = hv_rank_in_##BF,                                                 \
+   .extract = hv_extract_##BF,                                                 \
+   .iter_seek = hv_iter_seek_##BF,                                             \
+   .iter_find = hv_iter_find_##BF,                                             \
+};
+
+HV_DEF_DECODER(4)
+HV_DEF_DECODER(8)
+HV_DEF_DECODER(16)
+HV_DEF_DECODER(32)
+HV_DEF_DECODER(64)
+
+/* Indexed by the log2 of the blocking factor. */
+static const struct hv_decoder *const hv_decoders[] = {
+   [2] = &hv_decoder_4,
+   [3] = &hv_decoder_8,
+   [4] = &hv_decoder_16,
+   [5] = &hv_decoder_32,
+   [6] = &hv_decoder_64,
+};
+
+
+/*******************************************************************************
+ * Trie engine
+ ******************************************************************************/
+
+/* A trie is stored as its nodes in preorder. Each node is made of:
+ * - A byte whose 3 low bits are the flags below, and whose 5 high bits are the
+ *   length of the label of the node if it is < HV_TRIE_LONG_LABEL.
+ * - Otherwise, a byte holding the length of the label.
+ * - The label.
+ * - If the node has children, the total size of their subtrees, in bytes, and
+ *   the number of words they hold, as LEB128 varints.
+ * The label of the root is the prefix shared by all words. Other labels are not
+ * empty, and siblings are sorted by the first byte of their label. Children
+ * directly follow their parent, and a node directly follows the subtree of its
+ * previous sibling. Leaves are all terminal.
+ */
+#define HV_TRIE_TERMINAL 1      /* The path to the node is a word. */
+#define HV_TRIE_CHILDREN 2      /* The node has children. */
+#define HV_TRIE_LAST 4          /* The node is the last child of its parent. */
+#define HV_TRIE_FLAGS 7
+#define HV_TRIE_LEN_SHIFT 3
+#define HV_TRIE_LONG_LABEL 31
+
+/* Maximum size of a varint. */
+#define HV_VARINT_MAX 5
+
+struct hv_trie_node {
+   unsigned flags;
+   const uint8_t *label;
+   size_t label_len;
+   uint32_t size;          /* Size of the subtrees of the children. */
+   uint32_t words;         /* Number of words in these subtrees. */
+   const uint8_t *next;    /* First child, or next sibling if none. */
+};
+
+/* Number of words in the subtree of a node. */
+#define HV_TRIE_WORDS(n) (((n)->flags & HV_TRIE_TERMINAL) + (n)->words)
+
+HV_INLINE const uint8_t *hv_varint_get(const uint8_t *p, uint32_t *n)
+{
+   uint32_t val = 0;
+   for (unsigned shift = 0; shift < 7 * HV_VARINT_MAX; shift += 7) {
+      uint8_t b = *p++;
+      val |= (uint32_t)(b & 127) << shift;
+      if (!(b & 128))
+         break;
+   }
+   *n = val;
+   return p;
+}
+
+static size_t hv_varint_size(uint64_t n)
+{
+   size_t size = 1;
+   while (n >= 128) {
+      n >>= 7;
+      size++;
+   }
+   return size;
+}
+
+static uint8_t *hv_varint_put(uint8_t *p, uint32_t n)
+{
+   while (n >= 128) {
+      *p++ = (n & 127) | 128;
+      n >>= 7;
+   }
+   *p++ = n;
+   return p;
+}
+
+HV_INLINE void hv_trie_parse(const uint8_t *p, struct hv_trie_node *n)
+{
+   unsigned b = *p++;
+   n->flags = b & HV_TRIE_FLAGS;
+   n->label_len = b >> HV_TRIE_LEN_SHIFT;
+   if (n->label_len == HV_TRIE_LONG_LABEL)
+      n->label_len = *p++;
+   n->label = p;
+   p += n->label_len;
+   n->size = n->words = 0;
+   if (n->flags & HV_TRIE_CHILDREN) {
+      p = hv_varint_get(p, &n->size);
+      p = hv_varint_get(p, &n->words);
+   }
+   n->next = p;
+}
+
+struct hv_trie_builder {
+   const uint8_t *data;    /* Words, concatenated. */
+   const size_t *ends;     /* End of each word in "data". */
+   uint32_t *counts;       /* Size and word count of the children of each
+                            * inner node, in preorder.
+                            */
+   size_t num_inner;
+};
+
+HV_INLINE const uint8_t *hv_trie_word(const struct hv_trie_builder *b,
+                                      size_t i, size_t *len)
+{
+   size_t start = i ? b->ends[i - 1] : 0;
+   *len = b->ends[i] - start;
+   return &b->data[start];
+}
+
+/* The node holding words [low, high) has a label that starts at "depth".
+ * Returns where it ends.
+ */
+static size_t hv_trie_label_end(const struct hv_trie_builder *b,
+                                size_t low, size_t high, size_t depth)
+{
+   size_t len1, len2;
+   const uint8_t *word1 = hv_trie_word(b, low, &len1);
+   const uint8_t *word2 = hv_trie_word(b, high - 1, &len2);
+   return depth + hv_common_prefix(&word1[depth], len1 - depth,
+                                   &word2[depth], len2 - depth);
+}
+
+/* Returns the end of the run of words starting at "low" that have the same
+ * byte at "depth". All words in [low, high) must be longer than "depth".
+ */
+static size_t hv_trie_child_end(const struct hv_trie_builder *b,
+                                size_t low, size_t high, size_t depth)
+{
+   size_t len;
+   uint8_t c = hv_trie_word(b, low, &len)[depth];
+   low++;
+   while (low < high) {
+      size_t mid = low + ((high - low) >> 1);
+      if (hv_trie_word(b, mid, &len)[depth] == c)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   return low;
+}
+
+/* Returns the size of the subtree holding words [low, high), whose root label
+ * starts at "depth". Records the counts of its inner nodes on the way.
+ */
+static uint64_t hv_trie_measure(struct hv_trie_builder *b,
+                                size_t low, size_t high, size_t depth)
+{
+   size_t end = hv_trie_label_end(b, low, high, depth);
+   size_t len;
+   hv_trie_word(b, low, &len);
+   size_t first = low + (len == end);
+
+   uint64_t size = 1 + (end - depth >= HV_TRIE_LONG_LABEL) + end - depth;
+   if (first == high)
+      return size;
+
+   size_t idx = b->num_inner++;
+   uint64_t children = 0;
+   for (size_t i = first; i < high; ) {
+      size_t j = hv_trie_child_end(b, i, high, end);
+      children += hv_trie_measure(b, i, j, end);
+      i = j;
+   }
+   /* Sizes that don't fit are rejected once the whole trie is measured. */
+   b->counts[2 * idx] = children;
+   b->counts[2 * idx + 1] = high - first;
+   return size + hv_varint_size(children) + hv_varint_size(high - first)
+        + children;
+}
+
+/* Writes the subtree holding words [low, high) at "p". Returns the end of it.
+ */
+static uint8_t *hv_trie_write(struct hv_trie_builder *b, uint8_t *p,
+                              size_t low, size_t high, size_t depth, bool last)
+{
+   size_t end = hv_trie_label_end(b, low, high, depth);
+   size_t len;
+   const uint8_t *word = hv_trie_word(b, low, &len);
+   size_t first = low + (len == end);
+
+   size_t label_len = end - depth;
+   unsigned flags = (len == end ? HV_TRIE_TERMINAL : 0)
+                  | (first < high ? HV_TRIE_CHILDREN : 0)
+                  | (last ? HV_TRIE_LAST : 0);
+   if (label_len < HV_TRIE_LONG_LABEL) {
+      *p++ = flags | label_len << HV_TRIE_LEN_SHIFT;
+   } else {
+      *p++ = flags | HV_TRIE_LONG_LABEL << HV_TRIE_LEN_SHIFT;
+      *p++ = label_len;
+   }
+   memcpy(p, &word[depth], label_len);
+   p += label_len;
+   if (first == high)
+      return p;
+
+   size_t idx = b->num_inner++;
+   p = hv_varint_put(p, b->counts[2 * idx]);
+   p = hv_varint_put(p, b->counts[2 * idx + 1]);
+   for (size_t i = first; i < high; ) {
+      size_t j = hv_trie_child_end(b, i, high, end);
+      p = hv_trie_write(b, p, i, j, end, j == high);
+      i = j;
+   }
+   return p;
+}
+
+static int hv_trie_build(const struct halva_enc *enc, uint8_t **trie,
+                         size_t *size)
+{
+   *trie = NULL;
+   size_t num = enc->num_words;
+
+   uint8_t *data;
+   size_t *ends;
+   if (hv_enc_decode(enc, &data, &ends))
+      return HV_ENOMEM;
+   /* A trie has fewer inner nodes than words. */
+   size_t counts_size = (num ? 2 * num : 1) * sizeof(uint32_t);
+   uint32_t *counts = hv_alloc(enc->allocator, counts_size);
+   if (!counts) {
+      hv_enc_decode_fini(enc, data, ends);
+      return HV_ENOMEM;
+   }
+
+   struct hv_trie_builder b = {
+      .data = data,
+      .ends = ends,
+      .counts = counts,
+   };
+   /* The trie of an empty lexicon is a root without label. */
+   uint64_t trie_size = num ? hv_trie_measure(&b, 0, num, 0) : 1;
+   uint8_t *out = NULL;
+   int ret = HV_OK;
+   if (trie_size > HV_MAX_SIZE)
+      ret = HV_E2BIG;
+   else if (!(out = hv_alloc(enc->allocator, trie_size)))
+      ret = HV_ENOMEM;
+   else if (num) {
+      b.num_inner = 0;
+      hv_trie_write(&b, out, 0, num, 0, true);
+   } else {
+      out[0] = HV_TRIE_LAST;
+   }
+   hv_enc_decode_fini(enc, data, ends);
+   hv_dealloc(enc->allocator, counts, counts_size);
+   *trie = out;
+   *size = trie_size;
+   return ret;
+}
+
+static uint32_t hv_trie_locate(const struct halva *hv, const uint8_t *word,
+                               size_t len)
+{
+   struct hv_trie_node n;
+   hv_trie_parse(hv->body, &n);
+   size_t depth = 0;
+   uint32_t ord = 0, nodes = 1;
+
+   for (;;) {
+      if (n.label_len > len - depth
+          || memcmp(n.label, &word[depth], n.label_len))
+         break;
+      depth += n.label_len;
+      if (depth == len) {
+         if (!(n.flags & HV_TRIE_TERMINAL))
+            break;
+         HV_COUNT(locate_hits, 1);
+         HV_COUNT(entries_decoded, nodes);
+         return ord + 1;
+      }
+      ord += n.flags & HV_TRIE_TERMINAL;
+      if (!(n.flags & HV_TRIE_CHILDREN))
+         break;
+
+      /* Find the child that starts with the next byte. */
+      const uint8_t *p = n.next;
+      for (;;) {
+         hv_trie_parse(p, &n);
+         nodes++;
+         if (n.label[0] >= word[depth] || (n.flags & HV_TRIE_LAST))
+            break;
+         ord += HV_TRIE_WORDS(&n);
+         p = n.next + n.size;
+      }
+      if (n.label[0] != word[depth])
+         break;
+   }
+   HV_COUNT(locate_misses, 1);
+   HV_COUNT(entries_decoded, nodes);
+   return 0;
+}
+
+/* Number of words < the given one. Sets "*found" if the word is in the trie. */
+static uint32_t hv_trie_rank(const struct halva *hv, const uint8_t *word,
+                             size_t len, bool *found)
+{
+   *found = false;
+   struct hv_trie_node n;
+   hv_trie_parse(hv->body, &n);
+   size_t depth = 0;
+   uint32_t ord = 0;
+
+   for (;;) {
+      size_t rest = len - depth;
+      size_t pref_len = hv_common_prefix(n.label, n.label_len,
+                                         &word[depth], rest);
+      if (pref_len < n.label_len) {
+         /* The whole subtree is either before or after the word. */
+         if (pref_len == rest || n.label[pref_len] > word[depth + pref_len])
+            return ord;
+         return ord + HV_TRIE_WORDS(&n);
+      }
+      depth += n.label_len;
+      if (depth == len) {
+         *found = n.flags & HV_TRIE_TERMINAL;
+         return ord;
+      }
+      if (!(n.flags & HV_TRIE_CHILDREN))
+         return ord + (n.flags & HV_TRIE_TERMINAL);
+      ord += n.flags & HV_TRIE_TERMINAL;
+
+      const uint8_t *p = n.next;
+      for (;;) {
+         hv_trie_parse(p, &n);
+         if (n.label[0] >= word[depth])
+            break;
+         ord += HV_TRIE_WORDS(&n);
+         if (n.flags & HV_TRIE_LAST)
+            return ord;
+         p = n.next + n.size;
+      }
+   }
+}
+
+/* Extracts the word at the given zero-based position, which must be valid. */
+static size_t hv_trie_extract(const struct halva *hv, uint32_t pos,
+                              uint8_t *buf)
+{
+   struct hv_trie_node n;
+   hv_trie_parse(hv->body, &n);
+   size_t len = 0;
+   uint32_t nodes = 1;
+
+   for (;;) {
+      memcpy(&buf[len], n.label, n.label_len);
+      len += n.label_len;
+      if (n.flags & HV_TRIE_TERMINAL) {
+         if (!pos)
+            break;
+         pos--;
+      }
+      if (!(n.flags & HV_TRIE_CHILDREN))
+         break;
+
+      const uint8_t *p = n.next;
+      for (;;) {
+         hv_trie_parse(p, &n);
+         nodes++;
+         if (pos < HV_TRIE_WORDS(&n) || (n.flags & HV_TRIE_LAST))
+            break;
+         pos -= HV_TRIE_WORDS(&n);
+         p = n.next + n.size;
+      }
+   }
+   HV_COUNT(entries_decoded, nodes);
+   buf[len] = '\0';
+   return len;
+}
+
+/* Iterators keep the nodes on the path to the next one on a stack, as bitmaps
+ * indexed by the offset where each node starts in the current word. The root
+ * is not on it.
+ */
+static void hv_trie_push(struct halva_iter *it, size_t start, bool last)
+{
+   uint64_t bit = (uint64_t)1 << (start & 63);
+   it->starts[start >> 6] |= bit;
+   if (last)
+      it->lasts[start >> 6] |= bit;
+}
+
+static unsigned hv_high_bit(uint64_t n)
+{
+#ifdef __GNUC__
+   return 63 - __builtin_clzll(n);
+#else
+   unsigned i = 0;
+   while (n >>= 1)
+      i++;
+   return i;
+#endif
+}
+
+/* Pops the nodes whose subtree ends with the current node, up to the first
+ * one that has a next sibling. The next node starts where this one does.
+ */
+static void hv_trie_pop(struct halva_iter *it)
+{
+   for (size_t i = 4; i-- > 0; ) {
+      while (it->starts[i]) {
+         unsigned b = hv_high_bit(it->starts[i]);
+         uint64_t bit = (uint64_t)1 << b;
+         bool last = it->lasts[i] & bit;
+         it->starts[i] &= ~bit;
+         it->lasts[i] &= ~bit;
+         if (!last) {
+            it->depth = 64 * i + b;
+            return;
+         }
+      }
+   }
+}
+
+static void hv_trie_iter_reset(struct halva_iter *it)
+{
+   it->p = it->hv->body;
+   it->depth = 0;
+   memset(it->starts, 0, sizeof it->starts);
+   memset(it->lasts, 0, sizeof it->lasts);
+}
+
+/* Reads the node an iterator is on, and appends its label to "word". */
+HV_INLINE void hv_trie_enter(const struct halva_iter *it, char *word,
+                             struct hv_trie_node *n)
+{
+   hv_trie_parse(it->p, n);
+   memcpy(&word[it->depth], n->label, n->label_len);
+}
+
+/* Moves an iterator past the node it is on, either to its first child if
+ * "descend" is set and it has some, or past its subtree.
+ */
+HV_INLINE void hv_trie_leave(struct halva_iter *it,
+                             const struct hv_trie_node *n, bool descend)
+{
+   if (descend && (n->flags & HV_TRIE_CHILDREN)) {
+      if (it->p != it->hv->body)
+         hv_trie_push(it, it->depth, n->flags & HV_TRIE_LAST);
+      it->depth += n->label_len;
+      it->p = n->next;
+      return;
+   }
+   it->p = n->next + n->size;
+   if (n->flags & HV_TRIE_LAST)
+      hv_trie_pop(it);
+}
+
+/* Positions an iterator on the word at the given zero-based position, which
+ * must be valid.
+ */
+static void hv_trie_iter_seek(struct halva_iter *it, uint32_t pos)
+{
+   hv_trie_iter_reset(it);
+   it->pos = pos;
+
+   struct hv_trie_node n;
+   hv_trie_parse(it->p, &n);
+   for (;;) {
+      if (n.flags & HV_TRIE_TERMINAL) {
+         if (!pos)
+            break;
+         pos--;
+      }
+      if (!(n.flags & HV_TRIE_CHILDREN))
+         break;
+      memcpy(&it->word[it->depth], n.label, n.label_len);
+      hv_trie_leave(it, &n, true);
+
+      for (;;) {
+         hv_trie_parse(it->p, &n);
+         if (pos < HV_TRIE_WORDS(&n) || (n.flags & HV_TRIE_LAST))
+            break;
+         pos -= HV_TRIE_WORDS(&n);
+         it->p = n.next + n.size;
+      }
+   }
+}
+
+/* Moves an iterator to the next word, which must exist. Returns its length. */
+static size_t hv_trie_iter_next(struct halva_iter *it)
+{
+   for (;;) {
+      struct hv_trie_node n;
+      hv_trie_enter(it, it->word, &n);
+      size_t len = it->depth + n.label_len;
+      hv_trie_leave(it, &n, true);
+      if (n.flags & HV_TRIE_TERMINAL)
+         return len;
+   }
+}
+
+/* Checks the list of sibling nodes that spans [p, end), and the subtrees of
+ * these nodes. "depth" is the length of the path to their parent. Adds the
+ * number of words they hold to "*num_words".
+ */
+static bool hv_trie_verify_nodes(const uint8_t *p, const uint8_t *end,
+                                 size_t depth, bool root, uint64_t *num_words)
+{
+   int prev = -1;
+   for (;;) {
+      if (p == end)
+         return false;
+      unsigned flags = *p & HV_TRIE_FLAGS;
+      size_t label_len = *p++ >> HV_TRIE_LEN_SHIFT;
+      if (label_len == HV_TRIE_LONG_LABEL) {
+         if (p == end)
+            return false;
+         label_len = *p++;
+      }
+      if (label_len > (size_t)(end - p)
+          || depth + label_len > HV_MAX_WORD_LEN
+          || (!root && (!label_len || *p <= prev)))
+         return false;
+      if (!root)
+         prev = *p;
+      p += label_len;
+
+      bool terminal = flags & HV_TRIE_TERMINAL;
+      if (terminal && !(depth + label_len))
+         return false;
+      *num_words += terminal;
+      if (flags & HV_TRIE_CHILDREN) {
+         uint32_t counts[2];
+         for (size_t i = 0; i < 2; i++) {
+            const uint8_t *start = p;
+            while (p < end && p - start < HV_VARINT_MAX && (*p & 128))
+               p++;
+            if (p == end || p - start == HV_VARINT_MAX)
+               return false;
+            hv_varint_get(start, &counts[i]);
+            p++;
+         }
+         uint64_t words = 0;
+         if (counts[0] > (size_t)(end - p)
+             || !hv_trie_verify_nodes(p, p + counts[0], depth + label_len,
+                                      false, &words)
+             || words != counts[1])
+            return false;
+         p += counts[0];
+         *num_words += words;
+      } else if (!terminal && !root) {
+         return false;
+      }
+
+      if (flags & HV_TRIE_LAST)
+         return p == end;
+      if (root)
+         return false;
+   }
+}
+
+static bool hv_trie_verify(const struct halva *hv)
+{
+   uint64_t num_words = 0;
+   return hv_trie_verify_nodes(hv->body, hv->body + hv->body_size, 0, true,
+                               &num_words)
+       && num_words == hv->num_words;
+}
+
+
+/*******************************************************************************
+ * Loading and lookups
+ ******************************************************************************/
+
+/* Checks that bucket pointers are in bounds, in order, and don't leave room
+ * for empty buckets.
+ */
+static bool hv_check_header(const struct halva *hv, uint32_t body_size)
+{
+   if (hv->num_bkts && hv_bkt_ptr(hv, 0) != 0)
+      return false;
+   for (uint32_t i = 1; i < hv->num_bkts; i++)
+      if (hv_bkt_ptr(hv, i) <= hv_bkt_ptr(hv, i - 1)
+          || hv_bkt_ptr(hv, i) - hv_bkt_ptr(hv, i - 1) < 2)
+         return false;
+   return !hv->num_bkts ||
+          (body_size >= 2 && hv_bkt_ptr(hv, hv->num_bkts - 1) <= body_size - 2);
+}
+
+/* Returns whether the word at index "i" comes before the word at index "j" in
+ * top-k queries: it has a larger value, or the same value and a smaller index.
+ */
+static bool hv_ranks_before(const struct halva *hv, uint32_t i, uint32_t j)
+{
+   unsigned w = hv->value_width;
+   if (!w)
+      return i < j;
+   uint64_t vi = hv_get_bits(hv->values, (uint64_t)i * w, w);
+   uint64_t vj = hv_get_bits(hv->values, (uint64_t)j * w, w);
+   return vi > vj || (vi == vj && i < j);
+}
+
+static size_t hv_maxima_size(const struct halva *hv)
+{
+   return 2 * (size_t)hv->num_bkts * sizeof *hv->maxima;
+}
+
+/* Builds a segment tree over the best word of each bucket. Leaves are at
+ * indexes [num_bkts, 2 * num_bkts), and inner nodes hold the best word of their
+ * two children.
+ */
+static int hv_build_maxima(struct halva *hv)
+{
+   hv->maxima = NULL;
+   uint32_t num_bkts = hv->num_bkts;
+   if (!hv->value_width || !num_bkts)
+      return HV_OK;
+
+   uint32_t *tree = hv_alloc(hv->allocator, hv_maxima_size(hv));
+   if (!tree)
+      return HV_ENOMEM;
+   for (uint32_t bkt = 0; bkt < num_bkts; bkt++) {
+      uint32_t best = bkt << hv->bkt_shift;
+      uint32_t end = best + hv_limit(hv, bkt);
+      for (uint32_t i = best + 1; i < end; i++)
+         if (hv_ranks_before(hv, i, best))
+            best = i;
+      tree[num_bkts + bkt] = best;
+   }
+   for (uint32_t i = num_bkts - 1; i > 0; i--) {
+      uint32_t left = tree[2 * i], right = tree[2 * i + 1];
+      tree[i] = hv_ranks_before(hv, right, left) ? right : left;
+   }
+   hv->maxima = tree;
+   return HV_OK;
+}
+
+/* State shared by the threads that decompress a lexicon. Frames are read in
+ * order by the loading thread, and decoded by whichever thread claims them
+ * first. Frames stored as is are read directly at their final location.
+ */
+struct hv_unpack {
+   const uint8_t *src;        /* Compressed frames. */
+   const uint64_t *starts;    /* Offset of each frame in "src". */
+   const uint32_t *csizes;    /* Compressed size of each frame. */
+   uint8_t *dst;              /* Decompressed data. */
+   uint64_t size;             /* Size of the decompressed data. */
+   uint32_t frame_size;
+   size_t num_frames;
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;       /* Signaled when a frame has been read. */
+   size_t num_read;           /* Number of frames read so far. */
+   size_t next;               /* Next frame to decode. */
+   int failed;                /* HV_* error code, or HV_OK. */
+};
+
+static void *hv_unpack_worker(void *arg)
+{
+   struct hv_unpack *u = arg;
+
+   pthread_mutex_lock(&u->mutex);
+   while (!u->failed && u->next < u->num_frames) {
+      size_t i = u->next++;
+      while (!u->failed && u->num_read <= i)
+         pthread_cond_wait(&u->cond, &u->mutex);
+      if (u->failed)
+         break;
+      pthread_mutex_unlock(&u->mutex);
+
+      uint32_t len = hv_frame_len(u->size, u->frame_size, i);
+      bool ok = u->csizes[i] == len
+             || hv_lz_decompress(&u->src[u->starts[i]], u->csizes[i],
+                                 &u->dst[(uint64_t)i * u->frame_size], len);
+
+      pthread_mutex_lock(&u->mutex);
+      if (!ok && !u->failed) {
+         u->failed = HV_ECORRUPT;
+         pthread_cond_broadcast(&u->cond);
+      }
+   }
+   pthread_mutex_unlock(&u->mutex);
+   return NULL;
+}
+
+/* Reads the frames of a compressed lexicon, given their compressed sizes, and
+ * decompresses them into "dst", which must have room for "size" bytes.
+ */
+static int hv_unpack(int (*read)(void *arg, void *buf, size_t size), void *arg,
+                     struct hv_unpack *u, unsigned num_threads)
+{
+   uint64_t total = 0, max_csize = 0;
+   uint64_t *starts = malloc(u->num_frames * sizeof *starts + 1);
+   if (!starts)
+      return HV_ENOMEM;
+   for (size_t i = 0; i < u->num_frames; i++) {
+      uint32_t csize = u->csizes[i];
+      if (!csize || csize > hv_frame_len(u->size, u->frame_size, i)) {
+         free(starts);
+         return HV_ECORRUPT;
+      }
+      starts[i] = total;
+      total += csize;
+      if (csize > max_csize)
+         max_csize = csize;
+   }
+   if (num_threads > u->num_frames)
+      num_threads = u->num_frames;
+   /* Decoding one frame at a time only takes a buffer for one frame. */
+   uint64_t src_size = num_threads > 1 ? total : max_csize;
+   if (src_size > SIZE_MAX) {
+      free(starts);
+      return HV_ENOMEM;
+   }
+   uint8_t *src = malloc(src_size + 1);
+   if (!src) {
+      free(starts);
+      return HV_ENOMEM;
+   }
+   HV_COUNT(bytes_loaded, total);
+
+   if (num_threads <= 1) {
+      int ret = HV_OK;
+      for (size_t i = 0; !ret && i < u->num_frames; i++) {
+         uint32_t len = hv_frame_len(u->size, u->frame_size, i);
+         uint8_t *dst = &u->dst[(uint64_t)i * u->frame_size];
+         if (u->csizes[i] == len)
+            ret = read(arg, dst, len) ? HV_EIO : HV_OK;
+         else if (read(arg, src, u->csizes[i]))
+            ret = HV_EIO;
+         else if (!hv_lz_decompress(src, u->csizes[i], dst, len))
+            ret = HV_ECORRUPT;
+      }
+      free(src);
+      free(starts);
+      return ret;
+   }
+
+   u->src = src;
+   u->starts = starts;
+   u->num_read = u->next = 0;
+   u->failed = HV_OK;
+   pthread_mutex_init(&u->mutex, NULL);
+   pthread_cond_init(&u->cond, NULL);
+
+   /* If a thread can't be started, the others do its share. */
+   pthread_t *threads = malloc((num_threads - 1) * sizeof *threads);
+   unsigned num_started = 0;
+   while (threads && num_started < num_threads - 1
+          && !pthread_create(&threads[num_started], NULL, hv_unpack_worker, u))
+      num_started++;
+
+   for (size_t i = 0; i < u->num_frames; i++) {
+      uint32_t len = hv_frame_len(u->size, u->frame_size, i);
+      uint8_t *dst = u->csizes[i] == len ? &u->dst[(uint64_t)i * u->frame_size]
+                                         : &src[starts[i]];
+      int ret = read(arg, dst, u->csizes[i]) ? HV_EIO : HV_OK;
+
+      pthread_mutex_lock(&u->mutex);
+      if (ret && !u->failed)
+         u->failed = ret;
+      bool stop = u->failed;
+      u->num_read = i + 1;
+      pthread_cond_broadcast(&u->cond);
+      pthread_mutex_unlock(&u->mutex);
+      if (stop)
+         break;
+   }
+   hv_unpack_worker(u);
+
+   for (unsigned i = 0; i < num_started; i++)
+      pthread_join(threads[i], NULL);
+   free(threads);
+   pthread_cond_destroy(&u->cond);
+   pthread_mutex_destroy(&u->mutex);
+   free(src);
+   free(starts);
+   return u->failed;
+}
+
+/* Reads the data of a lexicon into "dst", which must have room for "size"
+ * bytes, decompressing it if needed, and updates the checksum "crc" with it.
+ */
+static int hv_load_data(int (*read)(void *arg, void *buf, size_t size),
+                        void *arg, uint32_t frame_size, void *dst,
+                        uint64_t size, unsigned num_threads, uint32_t *crc,
+                        uint64_t *stored_size)
+{
+   if (!frame_size) {
+      if (size && read(arg, dst, size))
+         return HV_EIO;
+      HV_COUNT(bytes_loaded, size);
+      *crc = hv_crc32c(*crc, dst, size);
+      *stored_size += size;
+      return HV_OK;
+   }
+
+   uint64_t num_frames = (size + frame_size - 1) / frame_size;
+   if (num_frames > SIZE_MAX / sizeof(uint32_t))
+      return HV_ENOMEM;
+   uint32_t *csizes = malloc(num_frames * sizeof *csizes + 1);
+   if (!csizes)
+      return HV_ENOMEM;
+   if (num_frames && read(arg, csizes, num_frames * sizeof *csizes)) {
+      free(csizes);
+      return HV_EIO;
+   }
+   HV_COUNT(bytes_loaded, num_frames * sizeof *csizes);
+   *crc = hv_crc32c(*crc, csizes, num_frames * sizeof *csizes);
+   *stored_size += num_frames * sizeof *csizes;
+   for (size_t i = 0; i < num_frames; i++) {
+      csizes[i] = ntohl(csizes[i]);
+      *stored_size += csizes[i];
+   }
+
+   struct hv_unpack u = {
+      .csizes = csizes,
+      .dst = dst,
+      .size = size,
+      .frame_size = frame_size,
+      .num_frames = num_frames,
+   };
+   int ret = hv_unpack(read, arg, &u, num_threads);
+   free(csizes);
+   if (!ret)
+      *crc = hv_crc32c(*crc, dst, size);
+   return ret;
+}
+
+int hv_load(struct halva **hvp, int (*read)(void *arg, void *buf, size_t size),
+            void *arg)
+{
+   return hv_load_parallel(hvp, read, arg, 1);
+}
+
+/* Layout of a lexicon, as described by its header. */
+struct hv_layout {
+   uint32_t raw[11];          /* Header fields, as stored. */
+   uint32_t header[11];       /* Header fields, in host order. */
+   size_t num_fields;
+   unsigned bkt_shift;
+   uint32_t num_bkts;
+   uint32_t num_ptrs;         /* Number of bucket pointers. */
+   uint32_t engine;
+   uint32_t frame_size;
+   uint64_t values_size;
+   uint64_t blob_ends_size;
+   uint32_t suffix_size;      /* Size of the reversed lexicon. */
+   uint64_t perm_size;        /* Size of the permutation. */
+   uint64_t data_size;        /* Size of the data following the header. */
+};
+
+/* Reads the header of a lexicon, and works out its layout. */
+static int hv_read_layout(int (*read)(void *arg, void *buf, size_t size),
+                          void *arg, struct hv_layout *l)
+{
+   uint32_t *raw = l->raw, *header = l->header;
+   if (read(arg, raw, 4 * sizeof *raw))
+      return HV_EIO;
+   for (size_t i = 0; i < 4; i++)
+      header[i] = ntohl(raw[i]);
+
+   if (header[0] != hv_magic)
+      return HV_EMAGIC;
+   if (header[1] < hv_min_version || header[1] > hv_version)
+      return HV_EVERSION;
+   size_t num_fields = l->num_fields = HV_HEADER_FIELDS(header[1]);
+   if (num_fields > 4) {
+      if (read(arg, &raw[4], (num_fields - 4) * sizeof *raw))
+         return HV_EIO;
+      for (size_t i = 4; i < num_fields; i++)
+         header[i] = ntohl(raw[i]);
+   }
+   HV_COUNT(bytes_loaded, num_fields * sizeof *raw);
+
+   /* Older versions have a fixed blocking factor. */
+   uint32_t bf = num_fields > 5 ? header[5] : 16;
+   unsigned bkt_shift = 0;
+   while (bkt_shift < 32 && (UINT32_C(1) << bkt_shift) < bf)
+      bkt_shift++;
+   if (bf < HV_MIN_BLOCKING_FACTOR || bf > HV_MAX_BLOCKING_FACTOR
+       || (UINT32_C(1) << bkt_shift) != bf)
+      return HV_ECORRUPT;
+   l->bkt_shift = bkt_shift;
+
+   uint32_t num_words = header[2];
+   uint32_t body_size = header[3];
+   l->num_bkts = (num_words >> bkt_shift) + !!(num_words & (bf - 1));
+
+   /* Older versions have no values. */
+   uint32_t value_width = num_fields > 6 ? header[6] : 0;
+   uint32_t blobs_size = num_fields > 7 ? header[7] : 0;
+   if (value_width > 64)
+      return HV_ECORRUPT;
+   l->values_size = HV_VALUES_SIZE(num_words, value_width);
+   l->blob_ends_size = blobs_size ? num_words * UINT64_C(4) : 0;
+
+   /* Older versions are front coded. Tries have no bucket pointers, but we
+    * still count buckets, which top-k queries work with.
+    */
+   l->engine = num_fields > 8 ? header[8] : HV_ENGINE_FRONT_CODING;
+   if (l->engine != HV_ENGINE_FRONT_CODING && l->engine != HV_ENGINE_TRIE)
+      return HV_EVERSION;
+   l->num_ptrs = l->engine == HV_ENGINE_TRIE ? 0 : l->num_bkts;
+
+   /* Older versions are not compressed. */
+   l->frame_size = num_fields > 9 ? header[9] : 0;
+   if (l->frame_size && (l->frame_size < HV_MIN_FRAME_SIZE
+                         || l->frame_size > HV_MAX_FRAME_SIZE))
+      return HV_ECORRUPT;
+
+   /* Older versions have no suffix index. */
+   l->suffix_size = num_fields > 10 ? header[10] : 0;
+   l->perm_size = l->suffix_size ?
+                  HV_VALUES_SIZE(num_words, hv_perm_width(num_words)) : 0;
+
+   l->data_size = l->num_ptrs * UINT64_C(4) + body_size + l->values_size
+                + l->blob_ends_size + blobs_size + l->suffix_size
+                + l->perm_size;
+   return HV_OK;
+}
+
+/* Checksum of the header of a lexicon, without the checksum field. */
+static uint32_t hv_layout_crc(const struct hv_layout *l)
+{
+   if (l->num_fields <= 4)
+      return 0;
+   uint32_t crc = hv_crc32c(0, l->raw, 4 * sizeof *l->raw);
+   return hv_crc32c(crc, &l->raw[5], (l->num_fields - 5) * sizeof *l->raw);
+}
+
+/* Loads the reversed lexicon of a suffix index, of "size" bytes at "data".
+ * Defined with suffix queries.
+ */
+static int hv_suffix_init(struct halva *hv, const uint8_t *data, size_t size);
+
+/* Initializes a lexicon whose data, laid out as described, is at "data". */
+static int hv_init(struct halva *hv, const struct hv_layout *l,
+                   const uint8_t *data)
+{
+   const uint32_t *header = l->header;
+   size_t num_fields = l->num_fields;
+
+   hv->num_words = header[2];
+   hv->num_bkts = l->num_bkts;
+   hv->header = data;
+   hv->body = data + l->num_ptrs * UINT64_C(4);
+   hv->body_size = header[3];
+   hv->values = hv->body + hv->body_size;
+   hv->value_width = num_fields > 6 ? header[6] : 0;
+   hv->blob_ends = hv->values + l->values_size;
+   hv->blobs = hv->blob_ends + l->blob_ends_size;
+   hv->blobs_size = num_fields > 7 ? header[7] : 0;
+   hv->version = header[1];
+   hv->bkt_shift = l->bkt_shift;
+   hv->dec = hv_decoders[l->bkt_shift];
+   hv->engine = l->engine;
+   hv->frame_size = l->frame_size;
+   hv->maxima = NULL;
+   hv->rev = NULL;
+
+   /* Tries are only checked by hv_verify(), beyond having a root. */
+   bool valid = hv->engine == HV_ENGINE_TRIE
+              ? hv->body_size > 0 : hv_check_header(hv, hv->body_size);
+   if (!valid)
+      return HV_ECORRUPT;
+   if (hv_build_maxima(hv))
+      return HV_ENOMEM;
+   if (!l->suffix_size)
+      return HV_OK;
+
+   const uint8_t *suffix = hv->blobs + hv->blobs_size;
+   hv->perm = suffix + l->suffix_size;
+   hv->perm_width = hv_perm_width(hv->num_words);
+   int ret = hv_suffix_init(hv, suffix, l->suffix_size);
+   if (ret) {
+      hv_dealloc(hv->allocator, hv->maxima, hv_maxima_size(hv));
+      hv->maxima = NULL;
+   }
+   return ret;
+}
+
+int hv_load_parallel(struct halva **hvp,
+                     int (*read)(void *arg, void *buf, size_t size),
+                     void *arg, unsigned num_threads)
+{
+   return hv_load_with_allocator(hvp, read, arg, num_threads, NULL);
+}
+
+int hv_load_with_allocator(struct halva **hvp,
+                           int (*read)(void *arg, void *buf, size_t size),
+                           void *arg, unsigned num_threads,
+                           const struct halva_allocator *allocator)
+{
+   *hvp = NULL;
+
+   struct hv_layout l;
+   int ret = hv_read_layout(read, arg, &l);
+   if (ret)
+      return ret;
+
+   /* The data is stored right after the handle. */
+   if (l.data_size > SIZE_MAX - sizeof(struct halva))
+      return HV_ENOMEM;
+   struct halva *hv = hv_alloc(allocator, sizeof *hv + l.data_size);
+   if (!hv)
+      return HV_ENOMEM;
+   hv->allocator = allocator;
+   hv->mem_size = sizeof *hv + l.data_size;
+   uint8_t *data = (uint8_t *)(hv + 1);
+   uint32_t crc = hv_layout_crc(&l);
+   hv->stored_size = l.num_fields * sizeof *l.raw;
+   ret = hv_load_data(read, arg, l.frame_size, data, l.data_size,
+                      num_threads, &crc, &hv->stored_size);
+   if (!ret && l.num_fields > 4 && crc != l.header[4])
+      ret = HV_ECORRUPT;
+   if (!ret)
+      ret = hv_init(hv, &l, data);
+   if (ret) {
+      hv_dealloc(allocator, hv, hv->mem_size);
+      return ret;
+   }
+
+   *hvp = hv;
+   return HV_OK;
+}
+
+static int hv_read(void *fp, void *buf, size_t size)
+{
+   if (fread(buf, 1, size, fp) == size)
+      return 0;
+   return -1;
+}
+
+int hv_load_file(struct halva **hv, FILE *fp)
+{
+   return hv_load(hv, hv_read, fp);
+}
+
+/* A buffer, read by hv_mem_read(). */
+struct hv_mem {
+   const uint8_t *data;
+   size_t size;
+   size_t pos;
+};
+
+static int hv_mem_read(void *arg, void *buf, size_t size)
+{
+   struct hv_mem *mem = arg;
+   if (size > mem->size - mem->pos)
+      return -1;
+   memcpy(buf, &mem->data[mem->pos], size);
+   mem->pos += size;
+   return 0;
+}
+
+/* Same as hv_load_buffer(), with the given allocator. */
+static int hv_load_buffer_with(struct halva **hvp, const void *buf, size_t size,
+                               int flags,
+                               const struct halva_allocator *allocator)
+{
+   *hvp = NULL;
+
+   /* Compressed data can't be used in place. */
+   struct hv_mem mem = {.data = buf, .size = size};
+   struct hv_layout l;
+   int ret = hv_read_layout(hv_mem_read, &mem, &l);
+   if (!ret && l.frame_size) {
+      mem.pos = 0;
+      ret = hv_load_with_allocator(hvp, hv_mem_read, &mem, 1, allocator);
+   } else if (!ret) {
+      if (l.data_size > size - mem.pos)
+         return HV_ECORRUPT;
+      const uint8_t *data = &mem.data[mem.pos];
+      uint32_t crc = hv_layout_crc(&l);
+      if (l.num_fields > 4 && !(flags & HV_LOAD_TRUSTED)
+          && hv_crc32c(crc, data, l.data_size) != l.header[4])
+         return HV_ECORRUPT;
+
+      struct halva *hv = hv_alloc(allocator, sizeof *hv);
+      if (!hv)
+         return HV_ENOMEM;
+      hv->allocator = allocator;
+      hv->mem_size = sizeof *hv;
+      hv->stored_size = mem.pos + l.data_size;
+      ret = hv_init(hv, &l, data);
+      if (ret) {
+         hv_free(hv);
+         return ret;
+      }
+      *hvp = hv;
+   }
+   if (!ret && (flags & HV_LOAD_VERIFY) && hv_verify(*hvp)) {
+      hv_free(*hvp);
+      *hvp = NULL;
+      ret = HV_ECORRUPT;
+   }
+   return ret;
+}
+
+int hv_load_buffer(struct halva **hvp, const void *buf, size_t size,
+                   int flags)
+{
+   return hv_load_buffer_with(hvp, buf, size, flags, NULL);
+}
+
+size_t hv_size(const struct halva *hv)
+{
+   return hv->num_words;
+}
+
+uint32_t hv_blocking_factor(const struct halva *hv)
+{
+   return UINT32_C(1) << hv->bkt_shift;
+}
+
+int hv_engine(const struct halva *hv)
+{
+   return hv->engine;
+}
+
+uint32_t hv_frame_size(const struct halva *hv)
+{
+   return hv->frame_size;
+}
+
+static uint32_t hv_find_bkt(const struct halva *hv,
+                            const uint8_t *term1, size_t len1)
+{
+   uint32_t low = 0, high = hv->num_bkts;
+
+   uint32_t probes = 0;
+   while (low < high) {
+      uint32_t mid = (low + high) >> 1;
+      const uint8_t *term2 = hv->body + hv_bkt_ptr(hv, mid);
+      size_t len2 = *term2++;
+      if (lmemcmp(term1, len1, term2, len2) < 0)
+         high = mid;
+      else
+         low = mid + 1;
+      probes++;
+   }
+   HV_COUNT(bkt_probes, probes);
+   return low;
+}
+
+uint32_t hv_locate(const struct halva *hv, const void *term, size_t len1)
+{
+   if (hv->engine == HV_ENGINE_TRIE)
+      return hv_trie_locate(hv, term, len1);
+   return hv->dec->locate_in(hv, hv_find_bkt(hv, term, len1), term, len1);
+}
+
+/* Number of words < the given one. Sets "*found" if the word is in the
+ * lexicon.
+ */
+static uint32_t hv_rank_found(const struct halva *hv, const void *term,
+                              size_t len, bool *found)
+{
+   if (hv->engine == HV_ENGINE_TRIE)
+      return hv_trie_rank(hv, term, len, found);
+   return hv->dec->rank_in(hv, hv_find_bkt(hv, term, len), term, len, found);
+}
+
+uint32_t hv_rank(const struct halva *hv, const void *term, size_t len)
+{
+   bool found;
+   return hv_rank_found(hv, term, len, &found);
+}
+
+uint32_t hv_floor(const struct halva *hv, const void *term, size_t len)
+{
+   bool found;
+   uint32_t rank = hv_rank_found(hv, term, len, &found);
+   return found ? rank + 1 : rank;
+}
+
+uint32_t hv_ceil(const struct halva *hv, const void *term, size_t len)
+{
+   uint32_t rank = hv_rank(hv, term, len);
+   return rank < hv->num_words ? rank + 1 : 0;
+}
+
+uint32_t hv_count_range(const struct halva *hv, const void *lo, size_t lo_len,
+                        const void *hi, size_t hi_len)
+{
+   uint32_t low = hv_rank(hv, lo, lo_len), high = hv_rank(hv, hi, hi_len);
+   return high > low ? high - low : 0;
+}
+
+void hv_locate_many(const struct halva *hv, size_t num,
+                    const void *const *words, const size_t *lens,
+                    uint32_t *ords)
+{
+   /* Trie lookups have no independent steps to interleave. */
+   if (hv->engine == HV_ENGINE_TRIE) {
+      for (size_t i = 0; i < num; i++)
+         ords[i] = hv_trie_locate(hv, words[i], lens[i]);
+      return;
+   }
+
+   for (size_t base = 0; base < num; base += HV_BATCH_SIZE) {
+      size_t cnt = num - base < HV_BATCH_SIZE ? num - base : HV_BATCH_SIZE;
+      const void *const *terms = &words[base];
+      uint32_t low[HV_BATCH_SIZE], high[HV_BATCH_SIZE];
+      for (size_t k = 0; k < cnt; k++) {
+         low[k] = 0;
+         high[k] = hv->num_bkts;
+      }
+
+      /* Run all binary searches in lockstep, so that the memory accesses of
+       * a round can proceed in parallel.
+       */
+      for (bool active = true; active; ) {
+         for (size_t k = 0; k < cnt; k++)
+            if (low[k] < high[k])
+               HV_PREFETCH(hv->body + hv_bkt_ptr(hv, (low[k] + high[k]) >> 1));
+
+         active = false;
+         for (size_t k = 0; k < cnt; k++) {
+            if (low[k] >= high[k])
+               continue;
+            uint32_t mid = (low[k] + high[k]) >> 1;
+            const uint8_t *term2 = hv->body + hv_bkt_ptr(hv, mid);
+            size_t len2 = *term2++;
+            if (lmemcmp(terms[k], lens[base + k], term2, len2) < 0)
+               high[k] = mid;
+            else
+               low[k] = mid + 1;
+            HV_COUNT(bkt_probes, 1);
+            active |= low[k] < high[k];
+         }
+      }
+
+      for (size_t k = 0; k < cnt; k++)
+         ords[base + k] = hv->dec->locate_in(hv, low[k], terms[k],
+                                             lens[base + k]);
+   }
+}
+
+size_t hv_extract(const struct halva *hv, uint32_t pos, void *buf)
+{
+   if (!pos || pos > hv->num_words) {
+      *(uint8_t *)buf = '\0';
+      return 0;
+   }
+   if (hv->engine == HV_ENGINE_TRIE)
+      return hv_trie_extract(hv, pos - 1, buf);
+   return hv->dec->extract(hv, pos - 1, buf);
+}
+
+void hv_extract_many(const struct halva *hv, size_t num, const uint32_t *ords,
+                     char *words, size_t *lens)
+{
+   /* How far ahead to prefetch buckets. */
+   const size_t dist = 8;
+
+   for (size_t i = 0; i < num; i++) {
+      if (i + dist < num && hv->engine == HV_ENGINE_FRONT_CODING) {
+         uint32_t pos = ords[i + dist];
+         if (pos && pos <= hv->num_words)
+            HV_PREFETCH(hv->body
+                        + hv_bkt_ptr(hv, (pos - 1) >> hv->bkt_shift));
+      }
+      lens[i] = hv_extract(hv, ords[i], &words[i * (HV_MAX_WORD_LEN + 1)]);
+   }
+}
+
+uint64_t hv_value(const struct halva *hv, uint32_t pos)
+{
+   if (!pos || pos > hv->num_words || !hv->value_width)
+      return 0;
+   return hv_get_bits(hv->values, (uint64_t)(pos - 1) * hv->value_width,
+                      hv->value_width);
+}
+
+static uint32_t hv_blob_end(const struct halva *hv, uint32_t pos)
+{
+   uint32_t end;
+   memcpy(&end, &hv->blob_ends[pos * sizeof end], sizeof end);
+   return ntohl(end);
+}
+
+const void *hv_blob(const struct halva *hv, uint32_t pos, size_t *size)
+{
+   *size = 0;
+   if (!pos || pos > hv->num_words)
+      return NULL;
+   if (!hv->blobs_size)
+      return hv->blobs;
+
+   pos--;
+   uint32_t start = pos ? hv_blob_end(hv, pos - 1) : 0;
+   uint32_t end = hv_blob_end(hv, pos);
+   /* The index is not checked when loading. */
+   if (start > end || end > hv->blobs_size)
+      return NULL;
+   *size = end - start;
+   return hv->blobs + start;
+}
+
+void hv_free(struct halva *hv)
+{
+   if (hv) {
+      hv_dealloc(hv->allocator, hv->maxima, hv_maxima_size(hv));
+      hv_free(hv->rev);
+      hv_dealloc(hv->allocator, hv, hv->mem_size);
+   }
+}
+
+/* Checks that a bucket can be decoded without reading past its end, and that
+ * it only contains valid words, in order. "prev" holds the last word of the
+ * previous bucket.
+ */
+static bool hv_verify_bkt(const struct halva *hv, uint32_t bkt,
+                          uint8_t *prev, size_t *prev_len)
+{
+   const uint8_t *p = hv->body + hv_bkt_ptr(hv, bkt);
+   const uint8_t *end = bkt + 1 < hv->num_bkts ?
+                        hv->body + hv_bkt_ptr(hv, bkt + 1) :
+                        hv->body + hv->body_size;
+
+   uint8_t word[HV_MAX_WORD_LEN];
+   size_t len = *p++;
+   if (!len || len > (size_t)(end - p))
+      return false;
+   memcpy(word, p, len);
+   p += len;
+   if (lmemcmp(prev, *prev_len, word, len) >= 0)
+      return false;
+
+   uint32_t high = hv_limit(hv, bkt);
+   for (uint32_t pos = 1; pos < high; pos++) {
+      uint8_t *cur = pos & 1 ? prev : word;
+      const uint8_t *last = pos & 1 ? word : prev;
+
+      if (p == end)
+         return false;
+      size_t pref_len = *p & HV_NIBBLE_SIZE;
+      size_t suff_len = *p++ >> 4;
+      if (!suff_len) {
+         if (p == end)
+            return false;
+         suff_len = *p++;
+      }
+      if (pref_len > len || !suff_len || suff_len > (size_t)(end - p)
+          || pref_len + suff_len > HV_MAX_WORD_LEN)
+         return false;
+
+      memcpy(cur, last, pref_len);
+      memcpy(&cur[pref_len], p, suff_len);
+      p += suff_len;
+      if (lmemcmp(last, len, cur, pref_len + suff_len) >= 0)
+         return false;
+      len = pref_len + suff_len;
+   }
+
+   if (high & 1)
+      memcpy(prev, word, len);
+   *prev_len = len;
+   return p == end;
+}
+
+/* Checks the suffix index of a lexicon. Defined with suffix queries. */
+static int hv_suffix_verify(const struct halva *hv);
+
+int hv_verify(const struct halva *hv)
+{
+   uint8_t prev[HV_MAX_WORD_LEN];
+   size_t prev_len = 0;
+
+   if (hv->engine == HV_ENGINE_TRIE) {
+      if (!hv_trie_verify(hv))
+         return HV_ECORRUPT;
+   } else {
+      if (!hv_check_header(hv, hv->body_size))
+         return HV_ECORRUPT;
+      for (uint32_t bkt = 0; bkt < hv->num_bkts; bkt++)
+         if (!hv_verify_bkt(hv, bkt, prev, &prev_len))
+            return HV_ECORRUPT;
+   }
+   if (hv->blobs_size) {
+      uint32_t start = 0;
+      for (uint32_t pos = 0; pos < hv->num_words; pos++) {
+         uint32_t end = hv_blob_end(hv, pos);
+         if (end < start || end > hv->blobs_size)
+            return HV_ECORRUPT;
+         start = end;
+      }
+      if (start != hv->blobs_size)
+         return HV_ECORRUPT;
+   }
+   return hv->rev ? hv_suffix_verify(hv) : HV_OK;
+}
+
+
+/*******************************************************************************
+ * Iterator
+ ******************************************************************************/
+
+uint32_t hv_iter_init(struct halva_iter *it, const struct halva *hv)
+{
+   it->hv = hv;
+   it->pos = 0;
+   it->end = hv->num_words;
+   hv_trie_iter_reset(it);
+   return it->pos < hv->num_words ? 1 : 0;
+}
+
+uint32_t hv_iter_inits(struct halva_iter *it, const struct halva *hv,
+                       const void *term, size_t len)
+{
+   if (hv->engine == HV_ENGINE_TRIE)
+      return hv_iter_initn(it, hv, hv_rank(hv, term, len) + 1);
+
+   uint32_t bkt = hv_find_bkt(hv, term, len);
+   if (!bkt)
+      return hv_iter_init(it, hv);
+
+   it->hv = hv;
+   it->end = hv->num_words;
+   return hv->dec->iter_find(it, bkt, term, len);
+}
+
+uint32_t hv_iter_initn(struct halva_iter *it, const struct halva *hv,
+                       uint32_t pos)
+{
+   it->hv = hv;
+   it->end = hv->num_words;
+
+   if (pos == 0 || pos > hv->num_words) {
+      it->pos = hv->num_words;
+      it->p = NULL;
+      return 0;
+   }
+
+   if (hv->engine == HV_ENGINE_TRIE)
+      hv_trie_iter_seek(it, pos - 1);
+   else
+      hv->dec->iter_seek(it, pos - 1);
+   return pos;
+}
+
+uint32_t hv_iter_init_bucket_range(struct halva_iter *it, const struct halva *hv,
+                                   uint32_t first_bkt, uint32_t end_bkt)
+{
+   if (end_bkt > hv->num_bkts)
+      end_bkt = hv->num_bkts;
+   if (first_bkt >= end_bkt)
+      return hv_iter_initn(it, hv, 0);
+
+   uint32_t pos = hv_iter_initn(it, hv, (first_bkt << hv->bkt_shift) + 1);
+   if (end_bkt < hv->num_bkts)
+      it->end = end_bkt << hv->bkt_shift;
+   return pos;
+}
+
+const char *hv_iter_next(struct halva_iter *it, size_t *len)
+{
+   if (it->pos >= it->end) {
+      if (len)
+         *len = 0;
+      return NULL;
+   }
+
+   size_t word_len;
+   if (it->hv->engine == HV_ENGINE_TRIE) {
+      word_len = hv_trie_iter_next(it);
+   } else if (!(it->pos & HV_BKT_MASK(it->hv))) {
+      word_len = *it->p++;
+      memcpy(it->word, it->p, word_len);
+      it->p += word_len;
+   } else {
+      size_t pref_len, suff_len;
+      it->p = hv_decode(it->p, (uint8_t *)it->word, &pref_len, &suff_len);
+      word_len = pref_len + suff_len;
+   }
+   it->word[word_len] = '\0';
+   if (len)
+      *len = word_len;
+
+   it->pos++;
+   HV_COUNT(iter_words, 1);
+   return it->word;
+}
+
+/* Returns the number of words that are < the smallest word that is greater
+ * than all words starting with the given prefix.
+ */
+static uint32_t hv_prefix_end(const struct halva *hv,
+                              const uint8_t *prefix, size_t len)
+{
+   /* No word can start with the prefix. */
+   if (len > HV_MAX_WORD_LEN)
+      return hv_rank(hv, prefix, len);
+
+   while (len && prefix[len - 1] == UINT8_MAX)
+      len--;
+   if (!len)
+      return hv->num_words;
+
+   uint8_t succ[HV_MAX_WORD_LEN + 1];
+   memcpy(succ, prefix, len);
+   succ[len - 1]++;
+   return hv_rank(hv, succ, len);
+}
+
+uint32_t hv_count_prefix(const struct halva *hv, const void *prefix,
+                         size_t len)
+{
+   return hv_prefix_end(hv, prefix, len) - hv_rank(hv, prefix, len);
+}
+
+/*******************************************************************************
+ * Parallel scans
+ ******************************************************************************/
+
+/* Number of chunks per thread in hv_parallel_for(). Having more chunks than
+ * threads evens out differences in decoding speed between chunks.
+ */
+#define HV_CHUNKS_PER_THREAD 16
+
+uint32_t hv_num_buckets(const struct halva *hv)
+{
+   return hv->num_bkts;
+}
+
+/* Returns the first bucket of the ith of "num" ranges of buckets. */
+static uint32_t hv_split_point(const struct halva *hv, uint32_t i, uint32_t num)
+{
+   if (i >= num)
+      return hv->num_bkts;
+   if (hv->engine == HV_ENGINE_TRIE)
+      return (uint64_t)hv->num_bkts * i / num;
+
+   /* First bucket that starts at or after the ith fraction of the body. */
+   uint32_t target = (uint64_t)hv->body_size * i / num;
+   uint32_t low = 0, high = hv->num_bkts;
+   while (low < high) {
+      uint32_t mid = (low + high) >> 1;
+      if (hv_bkt_ptr(hv, mid) < target)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   return low;
+}
+
+void hv_split_buckets(const struct halva *hv, uint32_t num, uint32_t *bounds)
+{
+   for (uint32_t i = 0; i <= num; i++)
+      bounds[i] = hv_split_point(hv, i, num);
+}
+
+/* State shared by the threads of hv_parallel_for(). */
+struct hv_scan {
+   const struct halva *hv;
+   int (*fn)(void *arg, unsigned thread, uint32_t pos,
+             const char *word, size_t len);
+   void *arg;
+   uint32_t num_chunks;
+   pthread_mutex_t mutex;
+   uint32_t next;             /* Next chunk to process. */
+   int ret;                   /* Value that stopped the scan, or 0. */
+};
+
+struct hv_scan_thread {
+   struct hv_scan *scan;
+   unsigned index;
+   pthread_t thread;
+};
+
+static void *hv_scan_worker(void *arg)
+{
+   struct hv_scan_thread *t = arg;
+   struct hv_scan *scan = t->scan;
+
+   for (;;) {
+      pthread_mutex_lock(&scan->mutex);
+      uint32_t chunk = scan->next;
+      bool done = scan->ret || chunk == scan->num_chunks;
+      if (!done)
+         scan->next++;
+      pthread_mutex_unlock(&scan->mutex);
+      if (done)
+         return NULL;
+
+      struct halva_iter it;
+      uint32_t first = hv_split_point(scan->hv, chunk, scan->num_chunks);
+      uint32_t end = hv_split_point(scan->hv, chunk + 1, scan->num_chunks);
+      uint32_t pos = hv_iter_init_bucket_range(&it, scan->hv, first, end);
+      const char *word;
+      size_t len;
+      int ret = 0;
+      while (!ret && (word = hv_iter_next(&it, &len)))
+         ret = scan->fn(scan->arg, t->index, pos++, word, len);
+      if (ret) {
+         pthread_mutex_lock(&scan->mutex);
+         if (!scan->ret)
+            scan->ret = ret;
+         pthread_mutex_unlock(&scan->mutex);
+         return NULL;
+      }
+   }
+}
+
+int hv_parallel_for(const struct halva *hv, unsigned num_threads,
+                    int (*fn)(void *arg, unsigned thread, uint32_t pos,
+                              const char *word, size_t len),
+                    void *arg)
+{
+   if (!num_threads)
+      num_threads = 1;
+   if (num_threads > hv->num_bkts)
+      num_threads = hv->num_bkts ? hv->num_bkts : 1;
+   uint64_t num_chunks = (uint64_t)num_threads * HV_CHUNKS_PER_THREAD;
+   if (num_chunks > hv->num_bkts)
+      num_chunks = hv->num_bkts;
+
+   struct hv_scan scan = {
+      .hv = hv,
+      .fn = fn,
+      .arg = arg,
+      .num_chunks = num_chunks,
+   };
+   pthread_mutex_init(&scan.mutex, NULL);
+
+   /* If threads can't be created, the others do their share. */
+   struct hv_scan_thread self = {.scan = &scan};
+   struct hv_scan_thread *threads = NULL;
+   if (num_threads > 1)
+      threads = malloc((num_threads - 1) * sizeof *threads);
+   unsigned num_started = 0;
+   while (threads && num_started < num_threads - 1) {
+      struct hv_scan_thread *t = &threads[num_started];
+      *t = (struct hv_scan_thread){.scan = &scan, .index = num_started + 1};
+      if (pthread_create(&t->thread, NULL, hv_scan_worker, t))
+         break;
+      num_started++;
+   }
+   hv_scan_worker(&self);
+
+   for (unsigned i = 0; i < num_started; i++)
+      pthread_join(threads[i].thread, NULL);
+   free(threads);
+   pthread_mutex_destroy(&scan.mutex);
+   return scan.ret;
+}
+
+
+/*******************************************************************************
+ * Top-k queries
+ ******************************************************************************/
+
+/* A range of word indexes [low, high), and the best word it contains. */
+struct hv_topk_range {
+   uint32_t low;
+   uint32_t high;
+   uint32_t best;
+};
+
+/* Returns the index of the best word in [low, high), which must not be empty.
+ * Partial buckets at both ends are scanned, and the full ones in between are
+ * looked up in the tree of bucket maxima.
+ */
+static uint32_t hv_range_best(const struct halva *hv, uint32_t low,
+                              uint32_t high)
+{
+   /* All values are 0. */
+   if (!hv->maxima)
+      return low;
+
+   unsigned shift = hv->bkt_shift;
+   uint32_t first = (low >> shift) + !!(low & HV_BKT_MASK(hv));
+   uint32_t last = high >> shift;
+   /* Words before the first full bucket, or all of them if there is none.
+    * Bucket numbers are shifted only when valid, so this can't overflow.
+    */
+   uint32_t head_end = first < last ? first << shift : high;
+
+   uint32_t best = low;
+   for (uint32_t i = low + 1; i < head_end; i++)
+      if (hv_ranks_before(hv, i, best))
+         best = i;
+   for (uint32_t i = last << shift; first < last && i < high; i++)
+      if (hv_ranks_before(hv, i, best))
+         best = i;
+
+   const uint32_t *tree = hv->maxima;
+   if (first < last) {
+      for (uint32_t l = first + hv->num_bkts, r = last + hv->num_bkts;
+           l < r; l >>= 1, r >>= 1) {
+         if (l & 1 && hv_ranks_before(hv, tree[l++], best))
+            best = tree[l - 1];
+         if (r & 1 && hv_ranks_before(hv, tree[--r], best))
+            best = tree[r];
+      }
+   }
+   return best;
+}
+
+static bool hv_topk_before(const struct halva *hv,
+                           const struct hv_topk_range *a,
+                           const struct hv_topk_range *b)
+{
+   return hv_ranks_before(hv, a->best, b->best);
+}
+
+/* Pushes a range on a binary heap ordered by best word. */
+static void hv_topk_push(const struct halva *hv, struct hv_topk_range *heap,
+                         size_t *num, uint32_t low, uint32_t high)
+{
+   if (low >= high)
+      return;
+
+   struct hv_topk_range range = {low, high, hv_range_best(hv, low, high)};
+   size_t i = (*num)++;
+   while (i && hv_topk_before(hv, &range, &heap[(i - 1) / 2])) {
+      heap[i] = heap[(i - 1) / 2];
+      i = (i - 1) / 2;
+   }
+   heap[i] = range;
+}
+
+static struct hv_topk_range hv_topk_pop(const struct halva *hv,
+                                        struct hv_topk_range *heap,
+                                        size_t *num)
+{
+   struct hv_topk_range top = heap[0];
+   struct hv_topk_range last = heap[--*num];
+   size_t i = 0;
+   for (;;) {
+      size_t child = 2 * i + 1;
+      if (child >= *num)
+         break;
+      if (child + 1 < *num
+          && hv_topk_before(hv, &heap[child + 1], &heap[child]))
+         child++;
+      if (!hv_topk_before(hv, &heap[child], &last))
+         break;
+      heap[i] = heap[child];
+      i = child;
+   }
+   heap[i] = last;
+   return top;
+}
+
+int hv_topk_prefix(const struct halva *hv, const void *prefix, size_t len,
+                   size_t k, uint32_t *ords, size_t *num)
+{
+   *num = 0;
+
+   uint32_t low = hv_rank(hv, prefix, len);
+   uint32_t high = hv_prefix_end(hv, prefix, len);
+   if (low >= high || !k)
+      return HV_OK;
+   if (k > high - low)
+      k = high - low;
+
+   /* Each pop removes one range and pushes at most two. */
+   struct hv_topk_range *heap = malloc((k + 1) * sizeof *heap);
+   if (!heap)
+      return HV_ENOMEM;
+   size_t heap_size = 0;
+   hv_topk_push(hv, heap, &heap_size, low, high);
+
+   while (*num < k) {
+      struct hv_topk_range top = hv_topk_pop(hv, heap, &heap_size);
+      ords[(*num)++] = top.best + 1;
+      hv_topk_push(hv, heap, &heap_size, top.low, top.best);
+      hv_topk_push(hv, heap, &heap_size, top.best + 1, top.high);
+   }
+   free(heap);
+   return HV_OK;
+}
+
+/*******************************************************************************
+ * Bucket cache
+ ******************************************************************************/
+
+#define HV_CACHE_EMPTY UINT32_MAX
+
+/* Words shorter than this are copied with a constant size, which is much
+ * cheaper than a variable one. Copies can then write this many bytes past the
+ * end of a word, so each slot is padded with as many bytes.
+ */
+#define HV_CACHE_COPY 32
+
+HV_INLINE void hv_cache_copy(uint8_t *restrict dst,
+                             const uint8_t *restrict src, size_t len)
+{
+   if (len <= HV_CACHE_COPY)
+      memcpy(dst, src, HV_CACHE_COPY);
+   else
+      memcpy(dst, src, len);
+}
+
+struct hv_cache_slot {
+   uint32_t bkt;        /* Cached bucket, or HV_CACHE_EMPTY. */
+   bool ref;            /* Whether the slot was used since the hand passed. */
+   uint16_t ends[HV_MAX_BLOCKING_FACTOR]; /* End of each word in the data. */
+};
+
+struct halva_cache {
+   const struct halva *hv;
+   size_t num_slots;
+   size_t hand;                  /* CLOCK hand. */
+   struct hv_cache_slot *slots;
+   uint8_t *data;                /* Decoded words, "stride" bytes per slot. */
+   size_t stride;
+   uint32_t *index;              /* Bucket to slot + 1, or 0 if free. */
+   size_t index_mask;
+   struct hv_cache_stats stats;
+};
+
+/* Home position of a bucket in the index. */
+static size_t hv_cache_home(const struct halva_cache *c, uint32_t bkt)
+{
+   return (bkt * UINT32_C(2654435761)) & c->index_mask;
+}
+
+int hv_cache_new(struct halva_cache **cp, const struct halva *hv,
+                 size_t num_slots)
+{
+   *cp = NULL;
+   if (!num_slots || num_slots >= UINT32_MAX)
+      return HV_EINVAL;
+   size_t stride = (size_t)hv_blocking_factor(hv) * HV_MAX_WORD_LEN
+                 + HV_CACHE_COPY;
+   if (num_slots > SIZE_MAX / 2 / stride)
+      return HV_ENOMEM;
+
+   size_t index_size = 2;
+   while (index_size < 2 * num_slots)
+      index_size *= 2;
+
+   struct halva_cache *c = calloc(1, sizeof *c);
+   if (!c)
+      return HV_ENOMEM;
+   c->hv = hv;
+   c->num_slots = num_slots;
+   c->stride = stride;
+   c->index_mask = index_size - 1;
+   c->slots = malloc(num_slots * sizeof *c->slots);
+   c->data = malloc(num_slots * c->stride);
+   c->index = calloc(index_size, sizeof *c->index);
+   if (!c->slots || !c->data || !c->index) {
+      hv_cache_free(c);
+      return HV_ENOMEM;
+   }
+   for (size_t i = 0; i < num_slots; i++) {
+      c->slots[i].bkt = HV_CACHE_EMPTY;
+      c->slots[i].ref = false;
+   }
+   *cp = c;
+   return HV_OK;
+}
+
+void hv_cache_free(struct halva_cache *c)
+{
+   if (!c)
+      return;
+   free(c->slots);
+   free(c->data);
+   free(c->index);
+   free(c);
+}
+
+/* Removes the entry at index position "i", shifting back the entries that
+ * follow it in the same probe sequence.
+ */
+static void hv_cache_unlink(struct halva_cache *c, size_t i)
+{
+   for (size_t j = i; ; ) {
+      j = (j + 1) & c->index_mask;
+      if (!c->index[j])
+         break;
+      size_t home = hv_cache_home(c, c->slots[c->index[j] - 1].bkt);
+      /* Move the entry if its home is not in (i, j], cyclically. */
+      if (((j - home) & c->index_mask) >= ((j - i) & c->index_mask)) {
+         c->index[i] = c->index[j];
+         i = j;
+      }
+   }
+   c->index[i] = 0;
+}
+
+static void hv_cache_decode(struct halva_cache *c, struct hv_cache_slot *slot,
+                            uint32_t bkt)
+{
+   const struct halva *hv = c->hv;
+   uint8_t *data = &c->data[(slot - c->slots) * c->stride];
+   const uint8_t *p = hv->body + hv_bkt_ptr(hv, bkt);
+
+   uint8_t word[HV_MAX_WORD_LEN + 1];
+   size_t len = *p++;
+   memcpy(word, p, len);
+   p += len;
+   hv_cache_copy(data, word, len);
+   size_t end = len;
+   slot->ends[0] = end;
+
+   uint32_t limit = hv_limit(hv, bkt);
+   HV_COUNT(entries_decoded, limit);
+   for (uint32_t i = 1; i < limit; i++) {
+      size_t pref_len, suff_len;
+      p = hv_decode(p, word, &pref_len, &suff_len);
+      len = pref_len + suff_len;
+      hv_cache_copy(&data[end], word, len);
+      end += len;
+      slot->ends[i] = end;
+   }
+}
+
+/* Returns the slot holding the decoded words of a bucket, decoding it if it is
+ * not already cached.
+ */
+static struct hv_cache_slot *hv_cache_get(struct halva_cache *c, uint32_t bkt)
+{
+   size_t i = hv_cache_home(c, bkt);
+   for (; c->index[i]; i = (i + 1) & c->index_mask) {
+      struct hv_cache_slot *slot = &c->slots[c->index[i] - 1];
+      if (slot->bkt == bkt) {
+         slot->ref = true;
+         c->stats.hits++;
+         return slot;
+      }
+   }
+   c->stats.misses++;
+
+   /* Evict the first slot that was not used since the hand last passed. */
+   struct hv_cache_slot *slot;
+   for (;;) {
+      slot = &c->slots[c->hand];
+      c->hand = c->hand + 1 < c->num_slots ? c->hand + 1 : 0;
+      if (!slot->ref)
+         break;
+      slot->ref = false;
+   }
+   if (slot->bkt != HV_CACHE_EMPTY) {
+      size_t j = hv_cache_home(c, slot->bkt);
+      while (c->index[j] - 1 != (uint32_t)(slot - c->slots))
+         j = (j + 1) & c->index_mask;
+      hv_cache_unlink(c, j);
+      c->stats.evictions++;
+      /* The entry we were going to use might have moved. */
+      for (i = hv_cache_home(c, bkt); c->index[i];
+           i = (i + 1) & c->index_mask)
+         ;
+   }
+
+   hv_cache_decode(c, slot, bkt);
+   slot->bkt = bkt;
+   slot->ref = true;
+   c->index[i] = slot - c->slots + 1;
+   return slot;
+}
+
+uint32_t hv_cache_locate(struct halva_cache *c, const void *word, size_t len)
+{
+   const struct halva *hv = c->hv;
+   /* Trie lookups don't decode buckets. */
+   if (hv->engine == HV_ENGINE_TRIE)
+      return hv_locate(hv, word, len);
+
+   uint32_t bkt = hv_find_bkt(hv, word, len);
+   if (!bkt)
+      return 0;
+   bkt--;
+
+   const struct hv_cache_slot *slot = hv_cache_get(c, bkt);
+   const uint8_t *data = &c->data[(slot - c->slots) * c->stride];
+   uint32_t low = 0, high = hv_limit(hv, bkt);
+   while (low < high) {
+      uint32_t mid = (low + high) >> 1;
+      size_t start = mid ? slot->ends[mid - 1] : 0;
+      int cmp = lmemcmp(&data[start], slot->ends[mid] - start, word, len);
+      if (cmp == 0)
+         return (bkt << hv->bkt_shift) + mid + 1;
+      if (cmp < 0)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   return 0;
+}
+
+size_t hv_cache_extract(struct halva_cache *c, uint32_t pos, void *buf)
+{
+   const struct halva *hv = c->hv;
+   if (!pos || pos > hv->num_words || hv->engine == HV_ENGINE_TRIE)
+      return hv_extract(hv, pos, buf);
+
+   pos--;
+   const struct hv_cache_slot *slot = hv_cache_get(c, pos >> hv->bkt_shift);
+   const uint8_t *data = &c->data[(slot - c->slots) * c->stride];
+   uint32_t i = pos & HV_BKT_MASK(hv);
+   size_t start = i ? slot->ends[i - 1] : 0;
+   size_t len = slot->ends[i] - start;
+   hv_cache_copy(buf, &data[start], len);
+   ((uint8_t *)buf)[len] = '\0';
+   return len;
+}
+
+void hv_cache_get_stats(const struct halva_cache *c, struct hv_cache_stats *st)
+{
+   *st = c->stats;
+}
+
+/*******************************************************************************
+ * Set operations
+ ******************************************************************************/
+
+enum hv_set_op {
+   HV_UNION,
+   HV_INTERSECTION,
+   HV_DIFFERENCE,
+};
+
+struct hv_set_cursor {
+   struct halva_iter it;
+   const char *word;
+   size_t len;
+};
+
+/* Adds the word of the cursor "cur" of lexicon "hv" to an encoder, with its
+ * value and its blob.
+ */
+static int hv_combine_add(struct halva_enc *enc, const struct halva *hv,
+                          const struct hv_set_cursor *cur)
+{
+   if (!hv->value_width && !hv->blobs_size)
+      return hv_enc_add(enc, cur->word, cur->len);
+
+   uint32_t pos = cur->it.pos;
+   size_t blob_size;
+   const void *blob = hv_blob(hv, pos, &blob_size);
+   return hv_enc_add_value(enc, cur->word, cur->len, hv_value(hv, pos),
+                           blob, blob ? blob_size : 0);
+}
+
+static int hv_combine(struct halva_enc *enc, const struct halva *const *hvs,
+                      size_t num, uint32_t *const *remaps, enum hv_set_op op)
+{
+   if (remaps) {
+      for (size_t i = 0; i < num; i++)
+         if (remaps[i])
+            memset(remaps[i], 0, hv_size(hvs[i]) * sizeof *remaps[i]);
+   }
+   if (!num)
+      return HV_OK;
+
+   struct hv_set_cursor *curs = malloc(num * sizeof *curs);
+   if (!curs)
+      return HV_ENOMEM;
+
+   size_t live = 0;
+   for (size_t i = 0; i < num; i++) {
+      hv_iter_init(&curs[i].it, hvs[i]);
+      curs[i].word = hv_iter_next(&curs[i].it, &curs[i].len);
+      live += curs[i].word != NULL;
+   }
+
+   int ret = HV_OK;
+   while (live) {
+      /* Words can only be emitted if all lexicons are still active (for the
+       * intersection), or if the first one is (for the difference).
+       */
+      if (op == HV_INTERSECTION && live < num)
+         break;
+      if (op == HV_DIFFERENCE && !curs[0].word)
+         break;
+
+      /* Ties keep the first cursor, so "min" is that of the first lexicon
+       * that holds the word, whose value and blob are kept.
+       */
+      struct hv_set_cursor *min = NULL;
+      size_t cnt = 0;
+      for (size_t i = 0; i < num; i++) {
+         if (!curs[i].word)
+            continue;
+         int cmp = min ? lmemcmp(curs[i].word, curs[i].len,
+                                 min->word, min->len) : -1;
+         if (cmp < 0) {
+            min = &curs[i];
+            cnt = 1;
+         } else if (cmp == 0) {
+            cnt++;
+         }
+      }
+
+      bool emit;
+      switch (op) {
+      case HV_UNION:
+         emit = true;
+         break;
+      case HV_INTERSECTION:
+         emit = cnt == num;
+         break;
+      default:
+         emit = cnt == 1 && min == &curs[0];
+         break;
+      }
+      if (emit && (ret = hv_combine_add(enc, hvs[min - curs], min)))
+         break;
+
+      /* Advance the cursor holding "min" last, since it owns the buffer we
+       * compare against.
+       */
+      size_t min_idx = min - curs;
+      for (size_t j = 1; j <= num; j++) {
+         size_t i = (min_idx + j) % num;
+         struct hv_set_cursor *cur = &curs[i];
+         if (!cur->word || lmemcmp(cur->word, cur->len, min->word, min->len))
+            continue;
+         if (emit && remaps && remaps[i])
+            remaps[i][cur->it.pos - 1] = enc->num_words;
+         cur->word = hv_iter_next(&cur->it, &cur->len);
+         live -= cur->word == NULL;
+      }
+   }
+
+   free(curs);
+   return ret;
+}
+
+int hv_merge(struct halva_enc *enc, const struct halva *const *hvs, size_t num,
+             uint32_t *const *remaps)
+{
+   return hv_combine(enc, hvs, num, remaps, HV_UNION);
+}
+
+int hv_intersect(struct halva_enc *enc, const struct halva *const *hvs,
+                 size_t num, uint32_t *const *remaps)
+{
+   return hv_combine(enc, hvs, num, remaps, HV_INTERSECTION);
+}
+
+int hv_diff(struct halva_enc *enc, const struct halva *const *hvs, size_t num,
+            uint32_t *const *remaps)
+{
+   return hv_combine(enc, hvs, num, remaps, HV_DIFFERENCE);
+}
+
+
+/*******************************************************************************
+ * Layered lexicon
+ ******************************************************************************/
+
+size_t hv_layers_size(const struct halva_layers *hl)
+{
+   return hv_size(hl->base) + hv_size(hl->delta);
+}
+
+uint32_t hv_layers_locate(const struct halva_layers *hl,
+                          const void *word, size_t len)
+{
+   uint32_t pos = hv_locate(hl->base, word, len);
+   if (pos)
+      return pos + hv_rank(hl->delta, word, len);
+
+   pos = hv_locate(hl->delta, word, len);
+   if (pos)
+      return pos + hv_rank(hl->base, word, len);
+   return 0;
+}
+
+size_t hv_layers_extract(const struct halva_layers *hl, uint32_t pos,
+                         void *buf)
+{
+   if (!pos || pos > hv_layers_size(hl)) {
+      *(uint8_t *)buf = '\0';
+      return 0;
+   }
+
+   /* Find the number of delta words that come at or before the requested
+    * position. The position of the ith delta word in the union is i plus
+    * the number of base words that are smaller than it.
+    */
+   uint32_t low = 0, high = hl->delta->num_words;
+   while (low < high) {
+      uint32_t mid = low + ((high - low + 1) >> 1);
+      size_t len = hv_extract(hl->delta, mid, buf);
+      uint32_t upos = mid + hv_rank(hl->base, buf, len);
+      if (upos == pos)
+         return len;
+      if (upos < pos)
+         low = mid;
+      else
+         high = mid - 1;
+   }
+   return hv_extract(hl->base, pos - low, buf);
+}
+
+static void hv_layers_iter_fetch(struct halva_layers_iter *it)
+{
+   it->base_word = hv_iter_next(&it->base, &it->base_len);
+   it->delta_word = hv_iter_next(&it->delta, &it->delta_len);
+   it->last = NULL;
+}
+
+uint32_t hv_layers_iter_init(struct halva_layers_iter *it,
+                             const struct halva_layers *hl)
+{
+   hv_iter_init(&it->base, hl->base);
+   hv_iter_init(&it->delta, hl->delta);
+   hv_layers_iter_fetch(it);
+   return it->base_word || it->delta_word;
+}
+
+uint32_t hv_layers_iter_inits(struct halva_layers_iter *it,
+                              const struct halva_layers *hl,
+                              const void *word, size_t len)
+{
+   uint32_t bpos = hv_iter_inits(&it->base, hl->base, word, len);
+   uint32_t dpos = hv_iter_inits(&it->delta, hl->delta, word, len);
+   hv_layers_iter_fetch(it);
+   if (!it->base_word && !it->delta_word)
+      return 0;
+
+   uint32_t pos = bpos ? bpos - 1 : hl->base->num_words;
+   pos += dpos ? dpos - 1 : hl->delta->num_words;
+   return pos + 1;
+}
+
+const char *hv_layers_iter_next(struct halva_layers_iter *it, size_t *len)
+{
+   /* The word returned last time lives in the buffer of its iterator, so we
+    * only advance this iterator now.
+    */
+   if (it->last == &it->base_word)
+      it->base_word = hv_iter_next(&it->base, &it->base_len);
+   else if (it->last == &it->delta_word)
+      it->delta_word = hv_iter_next(&it->delta, &it->delta_len);
+
+   size_t word_len;
+   if (it->base_word && (!it->delta_word ||
+       lmemcmp(it->base_word, it->base_len,
+               it->delta_word, it->delta_len) < 0)) {
+      it->last = &it->base_word;
+      word_len = it->base_len;
+   } else if (it->delta_word) {
+      it->last = &it->delta_word;
+      word_len = it->delta_len;
+   } else {
+      it->last = NULL;
+      word_len = 0;
+   }
+   if (len)
+      *len = word_len;
+   return it->last ? *it->last : NULL;
+}
+
+
+/*******************************************************************************
+ * Pattern matching
+ ******************************************************************************/
+
+#define HV_NO_ROW SIZE_MAX
+
+/* Length of the prefix shared by all words of a bucket, as far as we can tell
+ * without decoding it. This is the prefix its head shares with the head of the
+ * next bucket.
+ */
+static size_t hv_bkt_prefix(const struct halva *hv, uint32_t bkt)
+{
+   if (bkt + 1 >= hv->num_bkts)
+      return 0;
+
+   const uint8_t *head1 = hv->body + hv_bkt_ptr(hv, bkt);
+   const uint8_t *head2 = hv->body + hv_bkt_ptr(hv, bkt + 1);
+   return hv_common_prefix(head1 + 1, *head1, head2 + 1, *head2);
+}
+
+struct hv_scan_ops {
+   /* Computes the row for the given prefix length of the current word.
+    * Returns false if no word that starts with this prefix can match.
+    */
+   bool (*row)(struct halva_scan *, size_t depth);
+   /* Checks whether the current word matches, once all its rows are
+    * computed.
+    */
+   bool (*accept)(struct halva_scan *);
+};
+
+static void hv_scan_init(struct halva_scan *sc, const struct halva *hv)
+{
+   sc->hv = hv;
+   sc->pos = 0;
+   sc->end = hv->num_words;
+   sc->p = hv->body;
+   sc->word_len = 0;
+   sc->valid_rows = 0;
+   sc->dead_row = HV_NO_ROW;
+   hv_iter_init(&sc->it, hv);
+}
+
+/* Invalidates the rows past the given shared prefix length. */
+static void hv_scan_truncate(struct halva_scan *sc, size_t pref_len)
+{
+   if (sc->valid_rows > pref_len)
+      sc->valid_rows = pref_len;
+   if (sc->dead_row != HV_NO_ROW && sc->dead_row > pref_len)
+      sc->dead_row = HV_NO_ROW;
+}
+
+/* Computes the rows up to the given depth of the current word.
+ * Returns false if no word starting with the first "depth" bytes of the
+ * current word can match.
+ */
+static bool hv_scan_fill(struct halva_scan *sc, const struct hv_scan_ops *ops,
+                         size_t depth)
+{
+   if (sc->dead_row <= depth)
+      return false;
+
+   for (size_t i = sc->valid_rows + 1; i <= depth; i++) {
+      sc->valid_rows = i;
+      if (!ops->row(sc, i)) {
+         sc->dead_row = i;
+         return false;
+      }
+   }
+   return true;
+}
+
+/* With tries, the rows of a node are computed once for its whole subtree, and
+ * the subtree is skipped if no word in it can match.
+ */
+static const char *hv_trie_scan_next(struct halva_scan *sc,
+                                     const struct hv_scan_ops *ops,
+                                     size_t *len)
+{
+   struct halva_iter *it = &sc->it;
+
+   while (sc->pos < sc->end) {
+      struct hv_trie_node n;
+      size_t start = it->depth;
+      hv_trie_enter(it, sc->word, &n);
+      sc->word_len = start + n.label_len;
+      hv_scan_truncate(sc, start);
+
+      if (!hv_scan_fill(sc, ops, sc->word_len)) {
+         sc->pos += HV_TRIE_WORDS(&n);
+         hv_trie_leave(it, &n, false);
+         continue;
+      }
+      hv_trie_leave(it, &n, true);
+      if (!(n.flags & HV_TRIE_TERMINAL))
+         continue;
+      sc->pos++;
+      if (!ops->accept(sc))
+         continue;
+
+      sc->word[sc->word_len] = '\0';
+      if (len)
+         *len = sc->word_len;
+      return sc->word;
+   }
+
+   if (len)
+      *len = 0;
+   return NULL;
+}
+
+static const char *hv_scan_next(struct halva_scan *sc,
+                                const struct hv_scan_ops *ops, size_t *len)
+{
+   const struct halva *hv = sc->hv;
+   if (hv->engine == HV_ENGINE_TRIE)
+      return hv_trie_scan_next(sc, ops, len);
+
+   while (sc->pos < sc->end) {
+      if (!(sc->pos & HV_BKT_MASK(hv))) {
+         uint32_t bkt = sc->pos >> hv->bkt_shift;
+         const uint8_t *head = hv->body + hv_bkt_ptr(hv, bkt);
+         size_t head_len = *head++;
+         size_t pref_len = hv_common_prefix((const uint8_t *)sc->word,
+                                            sc->word_len, head, head_len);
+         memcpy(&sc->word[pref_len], &head[pref_len], head_len - pref_len);
+         sc->word_len = head_len;
+         sc->p = head + head_len;
+         hv_scan_truncate(sc, pref_len);
+
+         if (!hv_scan_fill(sc, ops, hv_bkt_prefix(hv, bkt))) {
+            sc->pos = (bkt + 1) << hv->bkt_shift;
+            continue;
+         }
+      } else {
+         size_t pref_len, suff_len;
+         sc->p = hv_decode(sc->p, (uint8_t *)sc->word, &pref_len, &suff_len);
+         sc->word_len = pref_len + suff_len;
+         hv_scan_truncate(sc, pref_len);
+      }
+      sc->pos++;
+
+      if (!hv_scan_fill(sc, ops, sc->word_len) || !ops->accept(sc))
+         continue;
+
+      sc->word[sc->word_len] = '\0';
+      if (len)
+         *len = sc->word_len;
+      return sc->word;
+   }
+
+   if (len)
+      *len = 0;
+   return NULL;
+}
+
+static bool hv_fuzzy_row(struct halva_scan *sc, size_t i)
+{
+   struct halva_fuzzy_iter *it = (struct halva_fuzzy_iter *)sc;
+   const size_t width = it->query_len + 1;
+   const uint8_t *prev = &it->rows[(i - 1) * width];
+   uint8_t *row = &it->rows[i * width];
+   uint8_t c = sc->word[i - 1];
+
+   unsigned min = row[0] = i;
+   for (size_t j = 1; j < width; j++) {
+      unsigned d = prev[j - 1] + (it->query[j - 1] != c);
+      if (prev[j] + 1U < d)
+         d = prev[j] + 1U;
+      if (row[j - 1] + 1U < d)
+         d = row[j - 1] + 1U;
+      row[j] = d;
+      if (d < min)
+         min = d;
+   }
+   return min <= it->max_dist;
+}
+
+static unsigned hv_fuzzy_dist(const struct halva_fuzzy_iter *it)
+{
+   const struct halva_scan *sc = &it->scan;
+   return it->rows[sc->word_len * (it->query_len + 1) + it->query_len];
+}
+
+static bool hv_fuzzy_accept(struct halva_scan *sc)
+{
+   const struct halva_fuzzy_iter *it = (const struct halva_fuzzy_iter *)sc;
+   return hv_fuzzy_dist(it) <= it->max_dist;
+}
+
+int hv_fuzzy_iter_init(struct halva_fuzzy_iter *it, const struct halva *hv,
+                       const void *word, size_t len, unsigned max_dist)
+{
+   if (len > HV_MAX_WORD_LEN)
+      return HV_EWORD;
+
+   it->rows = malloc((HV_MAX_WORD_LEN + 1) * (len + 1));
+   if (!it->rows)
+      return HV_ENOMEM;
+   for (size_t j = 0; j <= len; j++)
+      it->rows[j] = j;
+
+   hv_scan_init(&it->scan, hv);
+   it->query = word;
+   it->query_len = len;
+   it->max_dist = max_dist;
+   return HV_OK;
+}
+
+const char *hv_fuzzy_iter_next(struct halva_fuzzy_iter *it, size_t *len,
+                               unsigned *dist)
+{
+   static const struct hv_scan_ops ops = {
+      .row = hv_fuzzy_row,
+      .accept = hv_fuzzy_accept,
+   };
+
+   const char *word = hv_scan_next(&it->scan, &ops, len);
+   if (word && dist)
+      *dist = hv_fuzzy_dist(it);
+   return word;
+}
+
+void hv_fuzzy_iter_fini(struct halva_fuzzy_iter *it)
+{
+   free(it->rows);
+}
+
+/* A pattern is compiled to a sequence of tokens, each of which either matches
+ * a set of bytes, or any sequence of bytes. It is then evaluated as a
+ * non-deterministic automaton where state i means that the first i tokens
+ * have been matched.
+ */
+struct hv_glob_token {
+   bool star;
+   uint8_t set[32];
+};
+
+#define HV_SET_ADD(set, c) ((set)[(c) >> 3] |= 1 << ((c) & 7))
+#define HV_SET_HAS(set, c) ((set)[(c) >> 3] & (1 << ((c) & 7)))
+
+#define HV_STATE_ADD(row, i) ((row)[(i) >> 6] |= (uint64_t)1 << ((i) & 63))
+#define HV_STATE_HAS(row, i) ((row)[(i) >> 6] & ((uint64_t)1 << ((i) & 63)))
+
+/* Parses a bracket expression starting just after the opening bracket.
+ * Returns the number of bytes consumed, closing bracket included, or 0 if the
+ * expression is not terminated, in which case the bracket is taken literally.
+ */
+static size_t hv_glob_parse_set(const uint8_t *pat, size_t len, uint8_t *set)
+{
+   size_t i = 0;
+   bool negate = i < len && (pat[i] == '!' || pat[i] == '^');
+   if (negate)
+      i++;
+
+   uint8_t tmp[32] = {0};
+   for (size_t first = i; i < len; i++) {
+      if (pat[i] == ']' && i > first)
+         break;
+      unsigned lo = pat[i], hi = lo;
+      if (i + 2 < len && pat[i + 1] == '-' && pat[i + 2] != ']') {
+         hi = pat[i + 2];
+         i += 2;
+      }
+      for (unsigned c = lo; c <= hi; c++)
+         HV_SET_ADD(tmp, c);
+   }
+   if (i == len)
+      return 0;
+
+   for (size_t j = 0; j < sizeof tmp; j++)
+      set[j] = negate ? ~tmp[j] : tmp[j];
+   return i + 1;
+}
+
+/* Compiles a pattern. Returns the number of tokens. "toks" must be large
+ * enough to hold one token per byte of the pattern. The literal prefix of the
+ * pattern is written to "prefix".
+ */
+static size_t hv_glob_compile(const uint8_t *pat, size_t len,
+                              struct hv_glob_token *toks,
+                              uint8_t *prefix, size_t *prefix_len)
+{
+   size_t num = 0;
+   bool literal = true;
+   *prefix_len = 0;
+
+   for (size_t i = 0; i < len; i++) {
+      struct hv_glob_token *tok = &toks[num];
+      memset(tok, 0, sizeof *tok);
+
+      size_t n;
+      if (pat[i] == '*') {
+         /* Consecutive stars are redundant. */
+         if (num && toks[num - 1].star)
+            continue;
+         tok->star = true;
+         literal = false;
+      } else if (pat[i] == '?') {
+         memset(tok->set, 0xff, sizeof tok->set);
+         literal = false;
+      } else if (pat[i] == '[' && (n = hv_glob_parse_set(&pat[i + 1],
+                                                         len - i - 1,
+                                                         tok->set))) {
+         i += n;
+         literal = false;
+      } else {
+         if (pat[i] == '\\' && i + 1 < len)
+            i++;
+         HV_SET_ADD(tok->set, pat[i]);
+         if (literal && *prefix_len < HV_MAX_WORD_LEN + 1)
+            prefix[(*prefix_len)++] = pat[i];
+      }
+      num++;
+   }
+   return num;
+}
+
+/* Adds to a set of states all states reachable through stars. */
+static void hv_glob_closure(const struct halva_glob_iter *it, uint64_t *row)
+{
+   for (size_t i = 0; i < it->num_tokens; i++)
+      if (it->tokens[i].star && HV_STATE_HAS(row, i))
+         HV_STATE_ADD(row, i + 1);
+}
+
+static bool hv_glob_row(struct halva_scan *sc, size_t depth)
+{
+   const struct halva_glob_iter *it = (const struct halva_glob_iter *)sc;
+   const size_t width = it->row_width;
+   const uint64_t *prev = &it->rows[(depth - 1) * width];
+   uint64_t *row = &it->rows[depth * width];
+   uint8_t c = sc->word[depth - 1];
+
+   memset(row, 0, width * sizeof *row);
+   for (size_t i = 0; i < it->num_tokens; i++) {
+      if (!HV_STATE_HAS(prev, i))
+         continue;
+      const struct hv_glob_token *tok = &it->tokens[i];
+      if (tok->star)
+         HV_STATE_ADD(row, i);
+      else if (HV_SET_HAS(tok->set, c))
+         HV_STATE_ADD(row, i + 1);
+   }
+   hv_glob_closure(it, row);
+
+   for (size_t i = 0; i < width; i++)
+      if (row[i])
+         return true;
+   return false;
+}
+
+static bool hv_glob_accept(struct halva_scan *sc)
+{
+   const struct halva_glob_iter *it = (const struct halva_glob_iter *)sc;
+   const uint64_t *row = &it->rows[sc->word_len * it->row_width];
+   return HV_STATE_HAS(row, it->num_tokens);
+}
+
+int hv_glob_iter_init(struct halva_glob_iter *it, const struct halva *hv,
+                      const void *pattern, size_t len)
+{
+   it->tokens = malloc((len ? len : 1) * sizeof *it->tokens);
+   if (!it->tokens)
+      return HV_ENOMEM;
+
+   uint8_t prefix[HV_MAX_WORD_LEN + 1];
+   size_t prefix_len;
+   it->num_tokens = hv_glob_compile(pattern, len, it->tokens,
+                                    prefix, &prefix_len);
+   it->row_width = (it->num_tokens + 1 + 63) / 64;
+   it->rows = calloc((HV_MAX_WORD_LEN + 1) * it->row_width, sizeof *it->rows);
+   if (!it->rows) {
+      free(it->tokens);
+      return HV_ENOMEM;
+   }
+   HV_STATE_ADD(it->rows, 0);
+   hv_glob_closure(it, it->rows);
+
+   struct halva_scan *sc = &it->scan;
+   hv_scan_init(sc, hv);
+   if (prefix_len > HV_MAX_WORD_LEN) {
+      sc->end = 0;
+   } else if (prefix_len) {
+      struct halva_iter pit;
+      if (hv_iter_inits(&pit, hv, prefix, prefix_len)) {
+         sc->pos = pit.pos;
+         sc->p = pit.p;
+         memcpy(sc->word, pit.word, sizeof sc->word);
+         sc->it = pit;
+      } else {
+         sc->pos = hv->num_words;
+      }
+      sc->end = hv_prefix_end(hv, prefix, prefix_len);
+   }
+   return HV_OK;
+}
+
+const char *hv_glob_iter_next(struct halva_glob_iter *it, size_t *len)
+{
+   static const struct hv_scan_ops ops = {
+      .row = hv_glob_row,
+      .accept = hv_glob_accept,
+   };
+
+   return hv_scan_next(&it->scan, &ops, len);
+}
+
+void hv_glob_iter_fini(struct halva_glob_iter *it)
+{
+   free(it->tokens);
+   free(it->rows);
+}
+
+
+/*******************************************************************************
+ * Suffix index
+ ******************************************************************************/
+
+/* The suffix index of a lexicon is a complete lexicon of its words spelled
+ * backwards, with the same engine and blocking factor, followed by the
+ * bit-packed zero-based ordinal of each of them in the main lexicon.
+ */
+
+/* A growable buffer, written by hv_buf_write(). */
+struct hv_buf {
+   const struct halva_allocator *allocator;
+   uint8_t *data;
+   size_t size;
+   size_t alloc;
+};
+
+static int hv_buf_write(void *arg, const void *data, size_t size)
+{
+   struct hv_buf *buf = arg;
+   if (size > buf->alloc - buf->size) {
+      size_t alloc = buf->alloc ? buf->alloc : 4096;
+      while (size > alloc - buf->size)
+         alloc *= 2;
+      void *tmp = hv_realloc(buf->allocator, buf->data, buf->alloc, alloc);
+      if (!tmp)
+         return -1;
+      buf->data = tmp;
+      buf->alloc = alloc;
+   }
+   memcpy(&buf->data[buf->size], data, size);
+   buf->size += size;
+   return 0;
+}
+
+/* Sorts the indexes of words in "ords" by comparing them as stored at "data",
+ * with a bottom-up merge sort. "tmp" must have room for "num" indexes.
+ * Returns the array that holds the result, one of "ords" and "tmp".
+ */
+static uint32_t *hv_suffix_sort(const uint8_t *data, const size_t *ends,
+                                uint32_t *ords, uint32_t *tmp, size_t num)
+{
+   for (size_t width = 1; width < num; width *= 2) {
+      for (size_t low = 0; low < num; low += 2 * width) {
+         size_t mid = num - low > width ? low + width : num;
+         size_t high = num - mid > width ? mid + width : num;
+         size_t i = low, j = mid, k = low;
+         while (i < mid && j < high) {
+            size_t si = ords[i] ? ends[ords[i] - 1] : 0;
+            size_t sj = ords[j] ? ends[ords[j] - 1] : 0;
+            if (lmemcmp(&data[sj], ends[ords[j]] - sj,
+                        &data[si], ends[ords[i]] - si) < 0)
+               tmp[k++] = ords[j++];
+            else
+               tmp[k++] = ords[i++];
+         }
+         while (i < mid)
+            tmp[k++] = ords[i++];
+         while (j < high)
+            tmp[k++] = ords[j++];
+      }
+      uint32_t *swap = ords;
+      ords = tmp;
+      tmp = swap;
+   }
+   return ords;
+}
+
+static int hv_suffix_build(const struct halva_enc *enc, uint8_t **index,
+                           size_t *lex_size, size_t *size)
+{
+   *index = NULL;
+   size_t num = enc->num_words;
+
+   uint8_t *data;
+   size_t *ends;
+   if (hv_enc_decode(enc, &data, &ends))
+      return HV_ENOMEM;
+   size_t ords_size = (num ? 2 * num : 1) * sizeof(uint32_t);
+   uint32_t *ords = hv_alloc(enc->allocator, ords_size);
+   if (!ords) {
+      hv_enc_decode_fini(enc, data, ends);
+      return HV_ENOMEM;
+   }
+   for (size_t i = 0, start = 0; i < num; start = ends[i++]) {
+      for (size_t l = start, r = ends[i] - 1; l < r; l++, r--) {
+         uint8_t c = data[l];
+         data[l] = data[r];
+         data[r] = c;
+      }
+      ords[i] = i;
+   }
+   const uint32_t *sorted = hv_suffix_sort(data, ends, ords, &ords[num], num);
+
+   struct halva_enc rev = HV_ENC_INIT;
+   rev.blocking_factor = enc->blocking_factor;
+   rev.engine = enc->engine;
+   rev.allocator = enc->allocator;
+   int ret = HV_OK;
+   for (size_t i = 0; !ret && i < num; i++) {
+      size_t start = sorted[i] ? ends[sorted[i] - 1] : 0;
+      ret = hv_enc_add(&rev, &data[start], ends[sorted[i]] - start);
+   }
+   struct hv_buf buf = {.allocator = enc->allocator};
+   if (!ret)
+      ret = hv_enc_dump(&rev, hv_buf_write, &buf);
+   hv_enc_fini(&rev);
+   hv_enc_decode_fini(enc, data, ends);
+
+   /* The permutation follows. */
+   unsigned width = hv_perm_width(num);
+   size_t perm_size = HV_VALUES_SIZE(num, width);
+   uint8_t *out = NULL;
+   if (!ret) {
+      out = hv_realloc(enc->allocator, buf.data, buf.alloc,
+                       buf.size + perm_size);
+      if (out)
+         buf.data = NULL;
+      else
+         ret = HV_ENOMEM;
+   }
+   if (ret) {
+      hv_dealloc(enc->allocator, buf.data, buf.alloc);
+      hv_dealloc(enc->allocator, ords, ords_size);
+      /* Writes can only fail for lack of memory. */
+      return ret == HV_EIO ? HV_ENOMEM : ret;
+   }
+   memset(&out[buf.size], 0, perm_size);
+   for (size_t i = 0; i < num; i++)
+      hv_put_bits(&out[buf.size], (uint64_t)i * width, width, sorted[i]);
+   hv_dealloc(enc->allocator, ords, ords_size);
+
+   *index = out;
+   *lex_size = buf.size;
+   *size = buf.size + perm_size;
+   return HV_OK;
+}
+
+static int hv_suffix_init(struct halva *hv, const uint8_t *data, size_t size)
+{
+   /* The reversed lexicon must be stored as is, and can't have a suffix index
+    * itself, which also bounds recursion.
+    */
+   struct hv_mem mem = {.data = data, .size = size};
+   struct hv_layout l;
+   if (hv_read_layout(hv_mem_read, &mem, &l) || l.frame_size || l.suffix_size
+       || l.header[2] != hv->num_words || l.data_size != size - mem.pos)
+      return HV_ECORRUPT;
+
+   int ret = hv_load_buffer_with(&hv->rev, data, size, HV_LOAD_TRUSTED,
+                                 hv->allocator);
+   return ret == HV_ENOMEM ? ret : ret ? HV_ECORRUPT : HV_OK;
+}
+
+/* Zero-based ordinal in the main lexicon of the reversed word at the given
+ * zero-based ordinal.
+ */
+static uint32_t hv_suffix_ord(const struct halva *hv, uint32_t i)
+{
+   unsigned w = hv->perm_width;
+   return w ? hv_get_bits(hv->perm, (uint64_t)i * w, w) : 0;
+}
+
+static int hv_suffix_verify(const struct halva *hv)
+{
+   int ret = hv_verify(hv->rev);
+   if (ret)
+      return ret;
+
+   /* Reversed words are unique, so if each of them is the reverse of the word
+    * it maps to, the mapping is a permutation.
+    */
+   struct halva_iter it;
+   hv_iter_init(&it, hv->rev);
+   char word[HV_MAX_WORD_LEN + 1];
+   const char *rev;
+   size_t len;
+   for (uint32_t i = 0; (rev = hv_iter_next(&it, &len)); i++) {
+      uint32_t pos = hv_suffix_ord(hv, i);
+      if (pos >= hv->num_words || hv_extract(hv, pos + 1, word) != len)
+         return HV_ECORRUPT;
+      for (size_t k = 0; k < len; k++)
+         if (word[k] != rev[len - 1 - k])
+            return HV_ECORRUPT;
+   }
+   return HV_OK;
+}
+
+int hv_has_suffix_index(const struct halva *hv)
+{
+   return hv->rev != NULL;
+}
+
+uint32_t hv_suffix_iter_init(struct halva_suffix_iter *it,
+                             const struct halva *hv,
+                             const void *suffix, size_t len)
 {
    it->hv = hv;
+   it->rev.pos = it->rev.end = 0;
+   if (!hv->rev || len > HV_MAX_WORD_LEN)
+      return 0;
 
-   if (pos == 0 || pos > hv->num_words) {
-      it->pos = hv->num_words;
-      it->p = NULL;
+   /* Words that end with the suffix are those whose reverse starts with its
+    * reverse.
+    */
+   uint8_t rev[HV_MAX_WORD_LEN];
+   for (size_t k = 0; k < len; k++)
+      rev[k] = ((const uint8_t *)suffix)[len - 1 - k];
+   uint32_t start = hv_rank(hv->rev, rev, len);
+   uint32_t end = hv_prefix_end(hv->rev, rev, len);
+   if (start >= end)
       return 0;
+
+   hv_iter_initn(&it->rev, hv->rev, start + 1);
+   it->rev.end = end;
+   return end - start;
+}
+
+const char *hv_suffix_iter_next(struct halva_suffix_iter *it, size_t *len,
+                                uint32_t *pos)
+{
+   size_t word_len;
+   const char *rev = hv_iter_next(&it->rev, &word_len);
+   if (len)
+      *len = word_len;
+   if (!rev)
+      return NULL;
+
+   for (size_t k = 0; k < word_len; k++)
+      it->word[k] = rev[word_len - 1 - k];
+   it->word[word_len] = '\0';
+   if (pos)
+      *pos = hv_suffix_ord(it->hv, it->rev.pos - 1) + 1;
+   return it->word;
+}
+
+
+/*******************************************************************************
+ * Subsets
+ ******************************************************************************/
+
+static const uint32_t hv_subset_magic = 1752593267;  /* "hvss" */
+static const uint32_t hv_subset_version = 1;
+
+/* Number of ordinals per chunk, as a power of two. */
+#define HV_CHUNK_SHIFT 16
+#define HV_CHUNK_SIZE (UINT32_C(1) << HV_CHUNK_SHIFT)
+
+/* Chunks with more members than that are stored as bitmaps, which are then
+ * smaller than arrays.
+ */
+#define HV_ARRAY_MAX 4096
+
+/* Size of a bitmap, in 64-bit words. */
+#define HV_BITMAP_WORDS (HV_CHUNK_SIZE / 64)
+
+/* The members of a chunk, as offsets from its first ordinal. */
+struct hv_chunk {
+   uint32_t size;          /* Number of members. */
+   uint32_t alloc;         /* Capacity of "array". */
+   union {
+      uint16_t *array;     /* Sorted members, if size <= HV_ARRAY_MAX. */
+      uint64_t *bits;      /* Bitmap, otherwise. */
+   };
+};
+
+struct halva_subset {
+   uint32_t num_words;     /* Number of words of the lexicon. */
+   uint32_t size;          /* Number of members. */
+   uint32_t num_chunks;
+   struct hv_chunk *chunks;
+};
+
+static unsigned hv_low_bit(uint64_t n)
+{
+#ifdef __GNUC__
+   return __builtin_ctzll(n);
+#else
+   unsigned i = 0;
+   while (!(n & 1)) {
+      n >>= 1;
+      i++;
+   }
+   return i;
+#endif
+}
+
+static unsigned hv_pop_count(uint64_t n)
+{
+#ifdef __GNUC__
+   return __builtin_popcountll(n);
+#else
+   unsigned cnt = 0;
+   for ( ; n; n &= n - 1)
+      cnt++;
+   return cnt;
+#endif
+}
+
+/* Index of the first member of an array chunk that is >= "low". */
+static uint32_t hv_chunk_search(const struct hv_chunk *c, uint32_t low)
+{
+   uint32_t i = 0, j = c->size;
+   while (i < j) {
+      uint32_t mid = (i + j) >> 1;
+      if (c->array[mid] < low)
+         i = mid + 1;
+      else
+         j = mid;
+   }
+   return i;
+}
+
+/* Number of ordinals in a chunk. The last one may be shorter. */
+static uint32_t hv_chunk_len(const struct halva_subset *sub, uint32_t i)
+{
+   return i + 1 < sub->num_chunks ? HV_CHUNK_SIZE
+          : sub->num_words - (i << HV_CHUNK_SHIFT);
+}
+
+int hv_subset_new(struct halva_subset **subp, const struct halva *hv)
+{
+   struct halva_subset *sub = *subp = malloc(sizeof *sub);
+   if (!sub)
+      return HV_ENOMEM;
+   sub->num_words = hv->num_words;
+   sub->size = 0;
+   sub->num_chunks = (hv->num_words >> HV_CHUNK_SHIFT)
+                   + !!(hv->num_words & (HV_CHUNK_SIZE - 1));
+   sub->chunks = calloc(sub->num_chunks ? sub->num_chunks : 1,
+                        sizeof *sub->chunks);
+   if (!sub->chunks) {
+      free(sub);
+      *subp = NULL;
+      return HV_ENOMEM;
    }
+   return HV_OK;
+}
+
+void hv_subset_free(struct halva_subset *sub)
+{
+   if (!sub)
+      return;
+   for (uint32_t i = 0; i < sub->num_chunks; i++)
+      free(sub->chunks[i].array);
+   free(sub->chunks);
+   free(sub);
+}
+
+/* Turns an array chunk into a bitmap. */
+static int hv_chunk_to_bitmap(struct hv_chunk *c)
+{
+   uint64_t *bits = calloc(HV_BITMAP_WORDS, sizeof *bits);
+   if (!bits)
+      return HV_ENOMEM;
+   for (uint32_t i = 0; i < c->size; i++)
+      bits[c->array[i] >> 6] |= UINT64_C(1) << (c->array[i] & 63);
+   free(c->array);
+   c->bits = bits;
+   c->alloc = 0;
+   return HV_OK;
+}
 
+int hv_subset_add(struct halva_subset *sub, uint32_t pos)
+{
+   if (!pos || pos > sub->num_words)
+      return HV_EINVAL;
    pos--;
-   uint32_t bkt = pos / HV_BLOCKING_FACTOR;
-   uint32_t rest = pos & (HV_BLOCKING_FACTOR - 1);
+   struct hv_chunk *c = &sub->chunks[pos >> HV_CHUNK_SHIFT];
+   uint32_t low = pos & (HV_CHUNK_SIZE - 1);
+
+   uint32_t i = 0;
+   if (c->size <= HV_ARRAY_MAX) {
+      i = hv_chunk_search(c, low);
+      if (i < c->size && c->array[i] == low)
+         return HV_OK;
+      if (c->size == HV_ARRAY_MAX && hv_chunk_to_bitmap(c))
+         return HV_ENOMEM;
+   }
 
-   if (!rest) {
-      it->pos = pos;
-      it->p = hv->body + hv->header[bkt];
+   if (c->size >= HV_ARRAY_MAX) {
+      uint64_t bit = UINT64_C(1) << (low & 63);
+      if (c->bits[low >> 6] & bit)
+         return HV_OK;
+      c->bits[low >> 6] |= bit;
    } else {
-      const uint8_t *target = hv->body + hv->header[bkt];
-      size_t pref_len = *target++;
-      memcpy(it->word, target, pref_len);
-      target += pref_len;
-      while (--rest) {
-         pref_len = *target & HV_NIBBLE_SIZE;
-         size_t suff_len = *target++ >> 4;
-         if (!suff_len)
-            suff_len = *target++;
-         memcpy(&it->word[pref_len], target, suff_len);
-         target += suff_len;
+      if (c->size == c->alloc) {
+         uint32_t alloc = c->alloc ? 2 * c->alloc : 4;
+         if (alloc > HV_ARRAY_MAX)
+            alloc = HV_ARRAY_MAX;
+         void *tmp = realloc(c->array, alloc * sizeof *c->array);
+         if (!tmp)
+            return HV_ENOMEM;
+         c->array = tmp;
+         c->alloc = alloc;
       }
-      it->pos = pos;
-      it->p = target;
+      memmove(&c->array[i + 1], &c->array[i],
+              (c->size - i) * sizeof *c->array);
+      c->array[i] = low;
    }
-   return it->pos + 1;
+   c->size++;
+   sub->size++;
+   return HV_OK;
 }
 
-const char *hv_iter_next(struct halva_iter *it, size_t *len)
+uint32_t hv_subset_size(const struct halva_subset *sub)
+{
+   return sub->size;
+}
+
+int hv_subset_has(const struct halva_subset *sub, uint32_t pos)
+{
+   if (!pos || pos > sub->num_words)
+      return 0;
+   pos--;
+   const struct hv_chunk *c = &sub->chunks[pos >> HV_CHUNK_SHIFT];
+   uint32_t low = pos & (HV_CHUNK_SIZE - 1);
+   if (c->size > HV_ARRAY_MAX)
+      return c->bits[low >> 6] >> (low & 63) & 1;
+   uint32_t i = hv_chunk_search(c, low);
+   return i < c->size && c->array[i] == low;
+}
+
+int hv_subset_contains(const struct halva_subset *sub, const struct halva *hv,
+                       const void *word, size_t len)
+{
+   if (sub->num_words != hv->num_words)
+      return 0;
+   return hv_subset_has(sub, hv_locate(hv, word, len));
+}
+
+/* Returns the smallest member that is >= "pos", or 0 if there is none. */
+static uint32_t hv_subset_next(const struct halva_subset *sub, uint32_t pos)
+{
+   if (!pos || pos > sub->num_words)
+      return 0;
+   pos--;
+   uint32_t low = pos & (HV_CHUNK_SIZE - 1);
+   for (uint32_t i = pos >> HV_CHUNK_SHIFT; i < sub->num_chunks; i++, low = 0) {
+      const struct hv_chunk *c = &sub->chunks[i];
+      uint32_t base = i << HV_CHUNK_SHIFT;
+      if (!c->size)
+         continue;
+      if (c->size <= HV_ARRAY_MAX) {
+         uint32_t j = hv_chunk_search(c, low);
+         if (j < c->size)
+            return base + c->array[j] + 1;
+         continue;
+      }
+      uint64_t bits = c->bits[low >> 6] & (~UINT64_C(0) << (low & 63));
+      for (uint32_t j = low >> 6; ; bits = c->bits[j]) {
+         if (bits)
+            return base + (j << 6) + hv_low_bit(bits) + 1;
+         if (++j == HV_BITMAP_WORDS)
+            break;
+      }
+   }
+   return 0;
+}
+
+/* The file format is described in README.md. Chunks are serialized in a
+ * single buffer, so that the checksum can be written first.
+ */
+int hv_subset_dump(const struct halva_subset *sub,
+                   int (*write)(void *arg, const void *data, size_t size),
+                   void *arg)
+{
+   size_t size = sub->num_chunks * sizeof(uint32_t);
+   for (uint32_t i = 0; i < sub->num_chunks; i++) {
+      const struct hv_chunk *c = &sub->chunks[i];
+      size += c->size > HV_ARRAY_MAX ? HV_CHUNK_SIZE / 8
+                                     : c->size * sizeof *c->array;
+   }
+   uint8_t *data = malloc(size ? size : 1);
+   if (!data)
+      return HV_ENOMEM;
+
+   uint8_t *p = data;
+   for (uint32_t i = 0; i < sub->num_chunks; i++) {
+      uint32_t cnt = htonl(sub->chunks[i].size);
+      memcpy(p, &cnt, sizeof cnt);
+      p += sizeof cnt;
+   }
+   for (uint32_t i = 0; i < sub->num_chunks; i++) {
+      const struct hv_chunk *c = &sub->chunks[i];
+      if (c->size > HV_ARRAY_MAX) {
+         for (uint32_t j = 0; j < HV_BITMAP_WORDS; j++)
+            for (unsigned k = 0; k < 8; k++)
+               *p++ = c->bits[j] >> (8 * k);
+      } else {
+         for (uint32_t j = 0; j < c->size; j++) {
+            *p++ = c->array[j] >> 8;
+            *p++ = c->array[j];
+         }
+      }
+   }
+
+   uint32_t header[] = {
+      htonl(hv_subset_magic),
+      htonl(hv_subset_version),
+      htonl(sub->num_words),
+      htonl(sub->size),
+      0,
+   };
+   uint32_t crc = hv_crc32c(0, header, 4 * sizeof *header);
+   header[4] = htonl(hv_crc32c(crc, data, size));
+
+   int ret = HV_OK;
+   if (write(arg, header, sizeof header) || (size && write(arg, data, size)))
+      ret = HV_EIO;
+   free(data);
+   return ret;
+}
+
+int hv_subset_dump_file(const struct halva_subset *sub, FILE *fp)
+{
+   int ret = hv_subset_dump(sub, hv_write, fp);
+   if (ret)
+      return ret;
+
+   return fflush(fp) ? HV_EIO : HV_OK;
+}
+
+/* Reads the members of a chunk, and checks that they are valid. */
+static int hv_chunk_load(const struct halva_subset *sub, uint32_t i,
+                         int (*read)(void *arg, void *buf, size_t size),
+                         void *arg, uint32_t *crc)
+{
+   struct hv_chunk *c = &sub->chunks[i];
+   uint32_t len = hv_chunk_len(sub, i);
+   uint8_t buf[HV_CHUNK_SIZE / 8];
+
+   if (c->size > HV_ARRAY_MAX) {
+      if (read(arg, buf, HV_CHUNK_SIZE / 8))
+         return HV_EIO;
+      *crc = hv_crc32c(*crc, buf, HV_CHUNK_SIZE / 8);
+      if (!(c->bits = malloc(HV_BITMAP_WORDS * sizeof *c->bits)))
+         return HV_ENOMEM;
+      uint32_t cnt = 0;
+      for (uint32_t j = 0; j < HV_BITMAP_WORDS; j++) {
+         c->bits[j] = hv_load64(&buf[8 * j]);
+         cnt += hv_pop_count(c->bits[j]);
+      }
+      if (cnt != c->size)
+         return HV_ECORRUPT;
+      /* Bits past the end of the lexicon must be clear. */
+      if (len < HV_CHUNK_SIZE && c->bits[len >> 6] >> (len & 63))
+         return HV_ECORRUPT;
+      for (uint32_t j = (len >> 6) + 1; len < HV_CHUNK_SIZE
+                                        && j < HV_BITMAP_WORDS; j++)
+         if (c->bits[j])
+            return HV_ECORRUPT;
+      return HV_OK;
+   }
+
+   size_t size = c->size * sizeof *c->array;
+   if (size && read(arg, buf, size))
+      return HV_EIO;
+   *crc = hv_crc32c(*crc, buf, size);
+   c->alloc = c->size;
+   if (c->size && !(c->array = malloc(size)))
+      return HV_ENOMEM;
+   for (uint32_t j = 0; j < c->size; j++) {
+      c->array[j] = buf[2 * j] << 8 | buf[2 * j + 1];
+      if (c->array[j] >= len || (j && c->array[j] <= c->array[j - 1]))
+         return HV_ECORRUPT;
+   }
+   return HV_OK;
+}
+
+int hv_subset_load(struct halva_subset **subp, const struct halva *hv,
+                   int (*read)(void *arg, void *buf, size_t size), void *arg)
+{
+   *subp = NULL;
+
+   uint32_t header[5];
+   if (read(arg, header, sizeof header))
+      return HV_EIO;
+   uint32_t crc = hv_crc32c(0, header, 4 * sizeof *header);
+   for (size_t i = 0; i < 5; i++)
+      header[i] = ntohl(header[i]);
+   if (header[0] != hv_subset_magic)
+      return HV_EMAGIC;
+   if (header[1] != hv_subset_version)
+      return HV_EVERSION;
+   if (header[2] != hv->num_words)
+      return HV_EINVAL;
+
+   struct halva_subset *sub;
+   int ret = hv_subset_new(&sub, hv);
+   if (ret)
+      return ret;
+   sub->size = header[3];
+
+   size_t table_size = sub->num_chunks * sizeof(uint32_t);
+   uint32_t *table = malloc(table_size ? table_size : 1);
+   if (!table) {
+      hv_subset_free(sub);
+      return HV_ENOMEM;
+   }
+   if (table_size && read(arg, table, table_size))
+      ret = HV_EIO;
+   crc = hv_crc32c(crc, table, table_size);
+   uint64_t total = 0;
+   for (uint32_t i = 0; !ret && i < sub->num_chunks; i++) {
+      sub->chunks[i].size = ntohl(table[i]);
+      if (sub->chunks[i].size > hv_chunk_len(sub, i))
+         ret = HV_ECORRUPT;
+      total += sub->chunks[i].size;
+   }
+   free(table);
+   if (!ret && total != sub->size)
+      ret = HV_ECORRUPT;
+
+   for (uint32_t i = 0; !ret && i < sub->num_chunks; i++)
+      ret = hv_chunk_load(sub, i, read, arg, &crc);
+   if (!ret && crc != header[4])
+      ret = HV_ECORRUPT;
+   if (ret) {
+      hv_subset_free(sub);
+      return ret;
+   }
+
+   *subp = sub;
+   return HV_OK;
+}
+
+int hv_subset_load_file(struct halva_subset **sub, const struct halva *hv,
+                        FILE *fp)
+{
+   return hv_subset_load(sub, hv, hv_read, fp);
+}
+
+uint32_t hv_subset_iter_init(struct halva_subset_iter *it,
+                             const struct halva_subset *sub,
+                             const struct halva *hv)
+{
+   it->sub = sub;
+   it->next = sub->num_words == hv->num_words ? hv_subset_next(sub, 1) : 0;
+   hv_iter_initn(&it->it, hv, it->next);
+   return it->next ? sub->size : 0;
+}
+
+const char *hv_subset_iter_next(struct halva_subset_iter *it, size_t *len,
+                                uint32_t *pos)
 {
-   if (it->pos >= it->hv->num_words) {
+   uint32_t next = it->next;
+   if (!next) {
       if (len)
          *len = 0;
       return NULL;
    }
 
-   if (!(it->pos & (HV_BLOCKING_FACTOR - 1))) {
-      size_t pref_len = *it->p++;
-      memcpy(it->word, it->p, pref_len);
-      it->word[pref_len] = '\0';
-      if (len)
-         *len = pref_len;
-      it->p += pref_len;
-   } else {
-      size_t pref_len = *it->p & HV_NIBBLE_SIZE;
-      size_t suff_len = *it->p++ >> 4;
-      if (!suff_len)
-         suff_len = *it->p++;
-      memcpy(&it->word[pref_len], it->p, suff_len);
-      pref_len += suff_len;
-      it->word[pref_len] = '\0';
-      if (len)
-         *len = pref_len;
-      it->p += suff_len;
+   /* Members in the current bucket are reached by decoding the words in
+    * between, others by seeking to their bucket.
+    */
+   struct halva_iter *iter = &it->it;
+   const struct halva *hv = iter->hv;
+   if ((next - 1) >> hv->bkt_shift != iter->pos >> hv->bkt_shift)
+      hv_iter_initn(iter, hv, next);
+   else
+      while (iter->pos < next - 1)
+         hv_iter_next(iter, NULL);
+
+   if (pos)
+      *pos = next;
+   it->next = hv_subset_next(it->sub, next + 1);
+   return hv_iter_next(iter, len);
+}
+
+
+/*******************************************************************************
+ * Statistics
+ ******************************************************************************/
+
+#ifdef HV_STATS
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define HV_NUM_STATS (sizeof(struct hv_stats) / sizeof(uint64_t))
+
+/* Counters of a single thread. They are only written by their owner, so
+ * relaxed loads and stores are enough, and cheaper than atomic increments.
+ */
+struct hv_counters {
+   _Atomic uint64_t vals[HV_NUM_STATS];
+   struct hv_counters *prev, *next;
+   bool registered;
+};
+
+static _Thread_local struct hv_counters hv_local;
+
+/* Live threads counters, and sum of the counters of exited threads. */
+static struct hv_counters *hv_threads;
+static uint64_t hv_retired[HV_NUM_STATS];
+static pthread_mutex_t hv_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t hv_stats_key;
+static pthread_once_t hv_stats_once = PTHREAD_ONCE_INIT;
+
+static void hv_retire(void *arg)
+{
+   struct hv_counters *c = arg;
+
+   pthread_mutex_lock(&hv_stats_lock);
+   for (size_t i = 0; i < HV_NUM_STATS; i++)
+      hv_retired[i] += atomic_load_explicit(&c->vals[i], memory_order_relaxed);
+   if (c->prev)
+      c->prev->next = c->next;
+   else
+      hv_threads = c->next;
+   if (c->next)
+      c->next->prev = c->prev;
+   pthread_mutex_unlock(&hv_stats_lock);
+}
+
+static void hv_stats_init(void)
+{
+   pthread_key_create(&hv_stats_key, hv_retire);
+}
+
+static void hv_register(struct hv_counters *c)
+{
+   pthread_once(&hv_stats_once, hv_stats_init);
+   pthread_setspecific(hv_stats_key, c);
+
+   pthread_mutex_lock(&hv_stats_lock);
+   c->prev = NULL;
+   c->next = hv_threads;
+   if (hv_threads)
+      hv_threads->prev = c;
+   hv_threads = c;
+   pthread_mutex_unlock(&hv_stats_lock);
+   c->registered = true;
+}
+
+static void hv_count(size_t offset, uint64_t n)
+{
+   struct hv_counters *c = &hv_local;
+   if (!c->registered)
+      hv_register(c);
+
+   _Atomic uint64_t *val = &c->vals[offset / sizeof(uint64_t)];
+   atomic_store_explicit(val, atomic_load_explicit(val, memory_order_relaxed)
+                              + n, memory_order_relaxed);
+}
+
+void hv_get_stats(struct hv_stats *stats)
+{
+   uint64_t sums[HV_NUM_STATS];
+
+   pthread_mutex_lock(&hv_stats_lock);
+   memcpy(sums, hv_retired, sizeof sums);
+   for (struct hv_counters *c = hv_threads; c; c = c->next)
+      for (size_t i = 0; i < HV_NUM_STATS; i++)
+         sums[i] += atomic_load_explicit(&c->vals[i], memory_order_relaxed);
+   pthread_mutex_unlock(&hv_stats_lock);
+
+   memcpy(stats, sums, sizeof sums);
+}
+
+void hv_reset_stats(void)
+{
+   pthread_mutex_lock(&hv_stats_lock);
+   memset(hv_retired, 0, sizeof hv_retired);
+   for (struct hv_counters *c = hv_threads; c; c = c->next)
+      for (size_t i = 0; i < HV_NUM_STATS; i++)
+         atomic_store_explicit(&c->vals[i], 0, memory_order_relaxed);
+   pthread_mutex_unlock(&hv_stats_lock);
+}
+
+#else
+
+void hv_get_stats(struct hv_stats *stats)
+{
+   memset(stats, 0, sizeof *stats);
+}
+
+void hv_reset_stats(void)
+{
+}
+
+#endif
+
+static unsigned hv_log2(size_t n)
+{
+   unsigned i = 0;
+   while (n >>= 1)
+      i++;
+   return i;
+}
+
+void hv_report(const struct halva *hv, struct hv_report *rep)
+{
+   memset(rep, 0, sizeof *rep);
+   rep->num_words = hv->num_words;
+   rep->engine = hv->engine;
+   rep->body_size = hv->body_size;
+   rep->blocking_factor = hv_blocking_factor(hv);
+   if (hv->engine == HV_ENGINE_FRONT_CODING) {
+      rep->num_bkts = hv->num_bkts;
+      rep->header_size = hv->num_bkts * sizeof(uint32_t);
    }
+   rep->values_size = hv->blobs - hv->values + hv->blobs_size;
+   rep->value_width = hv->value_width;
+   if (hv->rev)
+      rep->suffix_size = hv->rev->stored_size
+                       + HV_VALUES_SIZE(hv->num_words, hv->perm_width);
+   rep->total_size = HV_HEADER_FIELDS(hv->version) * sizeof(uint32_t)
+                   + rep->header_size + rep->body_size + rep->values_size
+                   + rep->suffix_size;
+   rep->frame_size = hv->frame_size;
+   rep->stored_size = hv->stored_size;
 
-   it->pos++;
-   return it->word;
+   if (hv->engine == HV_ENGINE_TRIE) {
+      /* Children follow their parent, so nodes can be read in a row. */
+      for (const uint8_t *p = hv->body; p < hv->body + hv->body_size; ) {
+         struct hv_trie_node n;
+         hv_trie_parse(p, &n);
+         p = n.next;
+         rep->num_nodes++;
+      }
+      struct halva_iter it;
+      char prev[HV_MAX_WORD_LEN];
+      size_t prev_len = 0, len;
+      hv_iter_init(&it, hv);
+      for (const char *word; (word = hv_iter_next(&it, &len)); ) {
+         rep->prefix_lens[hv_common_prefix((const uint8_t *)prev, prev_len,
+                                           (const uint8_t *)word, len)]++;
+         rep->word_lens[len]++;
+         memcpy(prev, word, len);
+         prev_len = len;
+      }
+      return;
+   }
+
+   uint8_t word[HV_MAX_WORD_LEN];
+   size_t len = 0;
+   for (uint32_t bkt = 0; bkt < hv->num_bkts; bkt++) {
+      uint32_t end = bkt + 1 < hv->num_bkts ? hv_bkt_ptr(hv, bkt + 1)
+                                            : hv->body_size;
+      unsigned bin = hv_log2(end - hv_bkt_ptr(hv, bkt));
+      rep->bkt_sizes[bin < 32 ? bin : 31]++;
+
+      const uint8_t *p = hv->body + hv_bkt_ptr(hv, bkt);
+      size_t head_len = *p++;
+      size_t pref_len = hv_common_prefix(word, len, p, head_len);
+      memcpy(&word[pref_len], &p[pref_len], head_len - pref_len);
+      p += head_len;
+      len = head_len;
+      rep->prefix_lens[pref_len]++;
+      rep->word_lens[len]++;
+
+      uint32_t high = hv_limit(hv, bkt);
+      for (uint32_t pos = 1; pos < high; pos++) {
+         pref_len = *p & HV_NIBBLE_SIZE;
+         size_t suff_len = *p++ >> 4;
+         if (!suff_len) {
+            suff_len = *p++;
+            rep->byte_entries++;
+         }
+         /* The encoded prefix length is capped, find the real one. */
+         size_t real_len = pref_len + hv_common_prefix(&word[pref_len],
+                                                       len - pref_len,
+                                                       p, suff_len);
+         memcpy(&word[pref_len], p, suff_len);
+         p += suff_len;
+         len = pref_len + suff_len;
+         rep->prefix_lens[real_len]++;
+         rep->word_lens[len]++;
+      }
+   }
 }
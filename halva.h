@@ -12,11 +12,42 @@
  */
 #define HV_MAX_WORD_LEN 255
 
-/* Size of a group of words in a lexicon. Must be a power of two. This can be
- * tweaked to get better compression (with a large blocking factor) or to
- * increase processing speed (with a smaller blocking factor).
+/* Default size of a group of words in a lexicon. Another power of two in the
+ * range [HV_MIN_BLOCKING_FACTOR, HV_MAX_BLOCKING_FACTOR] can be chosen per
+ * lexicon with hv_enc_set_blocking_factor(), to get better compression (with a
+ * large blocking factor) or to increase processing speed (with a smaller
+ * blocking factor).
  */
 #define HV_BLOCKING_FACTOR 16
+#define HV_MIN_BLOCKING_FACTOR 4
+#define HV_MAX_BLOCKING_FACTOR 64
+
+/* Frame size of compressed lexicons.
+ * Lexicons can be compressed at rest, see hv_enc_set_compression(). Their data
+ * is then split into frames of this many bytes, which are compressed
+ * independently, so that they can be decompressed in parallel.
+ */
+#define HV_FRAME_SIZE (1 << 20)
+#define HV_MIN_FRAME_SIZE 4096
+#define HV_MAX_FRAME_SIZE (1 << 30)
+
+/* Data structures a lexicon can be encoded with. The engine is chosen when the
+ * lexicon is created, with hv_enc_set_engine(), and recorded in its header.
+ * All functions below work with both, transparently.
+ * - Front coding: words are stored in order, each one as the prefix length it
+ *   shares with the previous word plus the rest of it, by buckets of a few
+ *   words. Usually the most compact. Lookups decode part of a bucket.
+ * - Trie: a path-compressed trie, stored in preorder, where each internal
+ *   node records the size and word count of its subtree, so that lookups skip
+ *   the siblings of the nodes they go through instead of scanning them. The
+ *   cost of a lookup is bounded by the length of the word and the fan-out of
+ *   the nodes on its path, and doesn't depend on the position of the word in
+ *   a bucket.
+ */
+enum {
+   HV_ENGINE_FRONT_CODING,
+   HV_ENGINE_TRIE,
+};
 
 /* Error codes.
  * All functions below that return an int return one of these.
@@ -31,12 +62,78 @@ enum {
    HV_E2BIG,      /* Lexicon has grown too large. */
    HV_EIO,        /* IO error. */
    HV_ENOMEM,     /* Out of memory. */
+   HV_ECORRUPT,   /* Lexicon is corrupted. */
+   HV_EINVAL,     /* Invalid argument. */
 };
 
 /* Returns a string describing an error code. */
 const char *hv_strerror(int err);
 
 
+/*******************************************************************************
+ * Memory
+ ******************************************************************************/
+
+/* A memory allocator, which encoders and loaded lexicons can be given instead
+ * of the standard one. Blocks must be aligned like those of malloc(). Sizes
+ * given to "realloc" and "free" are those of the blocks, as last requested.
+ * "realloc" returns NULL on failure, and then leaves the block as is.
+ * "ctx" is passed to each function.
+ */
+struct halva_allocator {
+   void *(*alloc)(void *ctx, size_t size);
+   void *(*realloc)(void *ctx, void *ptr, size_t old_size, size_t new_size);
+   void (*free)(void *ctx, void *ptr, size_t size);
+   void *ctx;
+};
+
+/* An arena: a region of memory where blocks are allocated one after the
+ * other, and released all at once. Freeing a block only reclaims its memory
+ * if it is the last one allocated. This packs many lexicons together, and
+ * makes the scratch memory of encoders cheap to allocate and to release.
+ * Arenas can be used from several threads.
+ */
+struct halva_arena;
+
+/* Flags of hv_arena_new(). */
+enum {
+   /* Back the arena with 2 MiB pages, which cuts TLB misses when looking up
+    * large lexicons. Explicit huge pages are used if the system has some
+    * reserved, and transparent huge pages are requested otherwise. The arena
+    * falls back to regular pages if neither is available.
+    */
+   HV_ARENA_HUGE_PAGES = 1,
+};
+
+/* Default size of the regions an arena maps at once. Blocks larger than a
+ * quarter of this get a region of their own.
+ */
+#define HV_ARENA_REGION_SIZE (1 << 24)
+
+/* Creates an arena, which maps memory by regions of at least "region_size"
+ * bytes, or HV_ARENA_REGION_SIZE if it is zero.
+ * On success, makes the provided struct pointer point to the allocated arena.
+ * On failure, makes it point to NULL.
+ */
+int hv_arena_new(struct halva_arena **, size_t region_size, int flags);
+
+/* Destructor. Releases all the memory allocated in the arena. Lexicons and
+ * encoders that use it must not be used afterwards, and need not be freed.
+ */
+void hv_arena_free(struct halva_arena *);
+
+/* Releases all the memory allocated in an arena, but keeps its first region
+ * mapped, for reuse. Same caveats as hv_arena_free().
+ */
+void hv_arena_reset(struct halva_arena *);
+
+/* Returns the allocator of an arena. It is valid as long as the arena is. */
+const struct halva_allocator *hv_arena_allocator(struct halva_arena *);
+
+/* Returns the number of bytes mapped by an arena. */
+size_t hv_arena_size(const struct halva_arena *);
+
+
 /*******************************************************************************
  * Encoder
  ******************************************************************************/
@@ -52,6 +149,20 @@ struct halva_enc {
    uint8_t prev[HV_MAX_WORD_LEN + 1];  /* Previous word added. */
    size_t prev_len;
    int finished;                       /* Whether the encoder is freezed. */
+   uint32_t blocking_factor;           /* 0 for the default one. */
+   int engine;                         /* HV_ENGINE_* constant. */
+   uint32_t frame_size;                /* 0 if not compressed. */
+   int suffix_index;                   /* Whether to build a suffix index. */
+   const struct halva_allocator *allocator; /* NULL for the standard one. */
+   uint64_t *values;                   /* Values, once one is != 0. */
+   size_t values_size;
+   size_t values_alloc;
+   uint32_t *blob_ends;                /* End offsets of blobs, once one is */
+   size_t blob_ends_size;              /* not empty. */
+   size_t blob_ends_alloc;
+   uint8_t *blobs;                     /* Blobs contents. */
+   size_t blobs_size;
+   size_t blobs_alloc;
 };
 
 /* Initializer. */
@@ -60,12 +171,74 @@ struct halva_enc {
 /* Destructor. */
 void hv_enc_fini(struct halva_enc *);
 
+/* Sets the blocking factor of the lexicon to create.
+ * This must be called before adding any word. The setting is retained when
+ * the encoder is cleared. Returns HV_EINVAL if the blocking factor is not a
+ * power of two in the range [HV_MIN_BLOCKING_FACTOR, HV_MAX_BLOCKING_FACTOR].
+ */
+int hv_enc_set_blocking_factor(struct halva_enc *, uint32_t);
+
+/* Sets the engine of the lexicon to create, one of the HV_ENGINE_* constants.
+ * The default is HV_ENGINE_FRONT_CODING. The setting is retained when the
+ * encoder is cleared, and must be made before the lexicon is dumped. With the
+ * trie engine, the blocking factor only matters for top-k queries. Returns
+ * HV_EINVAL if the engine is unknown.
+ */
+int hv_enc_set_engine(struct halva_enc *, int engine);
+
+/* Makes the lexicon compressed at rest, by frames of "frame_size" bytes, or
+ * uncompressed if "frame_size" is zero, which is the default. Compression is
+ * done with a fast LZ77 codec; it mostly pays off for lexicons whose words
+ * share long infixes (URLs, paths) or that hold repetitive blobs. Lexicons are
+ * decompressed when they are loaded, so this doesn't affect lookups. The
+ * setting is retained when the encoder is cleared. Returns HV_EINVAL if
+ * "frame_size" is not zero and outside of the range
+ * [HV_MIN_FRAME_SIZE, HV_MAX_FRAME_SIZE]. HV_FRAME_SIZE is a good default.
+ */
+int hv_enc_set_compression(struct halva_enc *, uint32_t frame_size);
+
+/* Sets whether the lexicon to create has a suffix index, which allows finding
+ * the words that end with a given suffix, see hv_suffix_iter_init(). The index
+ * is built when the lexicon is dumped, and is usually larger than the lexicon
+ * itself, because words share shorter prefixes once reversed. The default is
+ * not to build it. The setting is retained when the encoder is cleared.
+ */
+int hv_enc_set_suffix_index(struct halva_enc *, int enable);
+
+/* Makes an encoder allocate memory with the given allocator, or with the
+ * standard one if it is NULL, which is the default. This covers the buffers
+ * of the encoder and the temporary ones of hv_enc_dump(). This must be called
+ * before adding any word. The setting is retained when the encoder is
+ * cleared, and the allocator must be valid until hv_enc_fini() is called.
+ */
+int hv_enc_set_allocator(struct halva_enc *, const struct halva_allocator *);
+
 /* Adds a new word.
  * Words must be added in lexicographical order (memcmp() order), must be
  * unique, and their length must be > 0 and <= HV_MAX_WORD_LEN.
  */
 int hv_enc_add(struct halva_enc *, const void *word, size_t len);
 
+/* Adds a batch of words.
+ * Same as calling hv_enc_add() on each word, but faster, because memory is
+ * reserved once for the whole batch and words are not copied. On error, the
+ * words that precede the offending one are added, so the index of the
+ * offending word is the number of words added by this call.
+ */
+int hv_enc_add_many(struct halva_enc *, size_t num,
+                    const void *const *words, const size_t *lens);
+
+/* Adds a new word, together with an integer value and a blob of binary data,
+ * which can be retrieved with hv_value() and hv_blob(). "blob" can be NULL if
+ * "blob_size" is zero. Words added with the functions above have the value 0
+ * and an empty blob.
+ * Values are bit-packed on as many bits as the largest one requires. Blobs are
+ * stored one after the other, with an index of their offsets. Lexicons that
+ * only have zero values and empty blobs take no extra space.
+ */
+int hv_enc_add_value(struct halva_enc *, const void *word, size_t len,
+                     uint64_t value, const void *blob, size_t blob_size);
+
 /* Dumps a lexicon to a file.
  * The provided callback will be called several times for writing the lexicon
  * to some file or memory location. It must return zero on success, non-zero on
@@ -102,29 +275,109 @@ struct halva;
  * The provided callback will be called several times for reading the lexicon.
  * It should return zero on success, non-zero on failure. A short read must be
  * considered as an error.
+ * The lexicon checksum is verified while loading it. If it doesn't match,
+ * HV_ECORRUPT is returned. Files written with data format version 1 have no
+ * checksum, and are loaded without this check. Compressed lexicons are
+ * decompressed as they are read, one frame at a time, directly into the memory
+ * of the lexicon.
  * On success, makes the provided struct pointer point to the allocated lexicon.
  * On failure, makes it point to NULL.
  */
 int hv_load(struct halva **, int (*read)(void *arg, void *buf, size_t size),
             void *arg);
 
+/* Same as hv_load(), but compressed lexicons are decompressed with up to
+ * "num_threads" threads, which decode frames while the next ones are being
+ * read. The callback is only ever called from the calling thread.
+ * Uncompressed lexicons are loaded as with hv_load().
+ */
+int hv_load_parallel(struct halva **,
+                     int (*read)(void *arg, void *buf, size_t size),
+                     void *arg, unsigned num_threads);
+
+/* Same as hv_load_parallel(), but the memory of the lexicon is allocated with
+ * the given allocator, which must remain valid until hv_free() is called.
+ * Temporary buffers still come from the standard allocator.
+ */
+int hv_load_with_allocator(struct halva **,
+                           int (*read)(void *arg, void *buf, size_t size),
+                           void *arg, unsigned num_threads,
+                           const struct halva_allocator *);
+
 /* Loads a lexicon from a file.
  * The provided file must be opened in binary mode, for reading.
  */
 int hv_load_file(struct halva **, FILE *);
 
+/* Flags of hv_load_buffer(). */
+enum {
+   /* Skip the checksum verification, which reads the whole buffer. This is
+    * only safe if the buffer is known to hold a valid lexicon, like one
+    * compiled in with "halva embed".
+    */
+   HV_LOAD_TRUSTED = 1 << 0,
+   /* Check the structure of the lexicon with hv_verify() before returning it.
+    * This is needed for safely using buffers that come from an untrusted
+    * source.
+    */
+   HV_LOAD_VERIFY = 1 << 1,
+};
+
+/* Loads a lexicon from a buffer holding a lexicon file, without copying it.
+ * The lexicon is used in place: only a small handle is allocated, plus, if
+ * words have values, an index of the best value of each bucket, for top-k
+ * queries. The buffer must thus outlive the lexicon. It needs no particular
+ * alignment. "flags" is a combination of the HV_LOAD_* constants, or zero.
+ * Compressed lexicons can't be used in place; they are decompressed into a
+ * copy, as with hv_load().
+ */
+int hv_load_buffer(struct halva **, const void *buf, size_t size, int flags);
+
 /* Destructor. */
 void hv_free(struct halva *);
 
+/* Checks the structure of a lexicon.
+ * The checksum of a lexicon is verified when it is loaded, which catches
+ * truncated or damaged files. This function additionally decodes all its
+ * words with bounds checks, and makes sure they are valid and ordered, so that
+ * the other functions can be safely used on lexicons that come from an
+ * untrusted source. Returns HV_OK or HV_ECORRUPT.
+ */
+int hv_verify(const struct halva *);
+
 /* Returns the number of words in a lexicon. */
 size_t hv_size(const struct halva *);
 
+/* Returns the blocking factor a lexicon was encoded with. */
+uint32_t hv_blocking_factor(const struct halva *);
+
+/* Returns the engine a lexicon was encoded with. */
+int hv_engine(const struct halva *);
+
+/* Returns the frame size a lexicon was compressed with, 0 if it was stored
+ * uncompressed.
+ */
+uint32_t hv_frame_size(const struct halva *);
+
 /* Returns the ordinal associated to a word.
  * If the word doesn't exist in the lexicon, the return value is 0, otherwise a
  * positive integer.
  */
 uint32_t hv_locate(const struct halva *, const void *word, size_t len);
 
+/* Ordered set queries, which also work on words that are not in the lexicon,
+ * and don't decode words. hv_rank() returns the number of words < the given
+ * one. hv_floor() returns the ordinal of the largest word <= the given one,
+ * hv_ceil() that of the smallest word >= the given one, or 0 if there is no
+ * such word. hv_count_range() returns the number of words that are >= "lo"
+ * and < "hi".
+ */
+uint32_t hv_rank(const struct halva *, const void *word, size_t len);
+uint32_t hv_floor(const struct halva *, const void *word, size_t len);
+uint32_t hv_ceil(const struct halva *, const void *word, size_t len);
+uint32_t hv_count_range(const struct halva *, const void *lo, size_t lo_len,
+                        const void *hi, size_t hi_len);
+
 /* Retrieves a word given its corresponding ordinal.
  * If the provided position is valid, fills "buf" with the corresponding word,
  * and return its length. Otherwise, add a nul character at the beginning of
@@ -132,6 +385,82 @@ uint32_t hv_locate(const struct halva *, const void *word, size_t len);
  */
 size_t hv_extract(const struct halva *, uint32_t pos, void *buf);
 
+/* Batched versions of hv_locate() and hv_extract().
+ * These process "num" items at once, overlapping the memory accesses of
+ * independent lookups, which is faster than calling the above functions in a
+ * loop when the lexicon doesn't fit in the CPU cache. hv_extract_many() stores
+ * words at "words + i * (HV_MAX_WORD_LEN + 1)".
+ */
+void hv_locate_many(const struct halva *, size_t num,
+                    const void *const *words, const size_t *lens,
+                    uint32_t *ords);
+void hv_extract_many(const struct halva *, size_t num, const uint32_t *ords,
+                     char *words, size_t *lens);
+
+/* Returns the value associated with the word that has the given ordinal, or 0
+ * if the ordinal is out of range.
+ */
+uint64_t hv_value(const struct halva *, uint32_t pos);
+
+/* Returns a pointer to the blob associated with the word that has the given
+ * ordinal, and stores its size into "*size". The blob points into the lexicon,
+ * and remains valid until it is freed. Returns NULL if the ordinal is out of
+ * range.
+ */
+const void *hv_blob(const struct halva *, uint32_t pos, size_t *size);
+
+/* Returns the number of words that start with a given prefix. */
+uint32_t hv_count_prefix(const struct halva *, const void *prefix, size_t len);
+
+/* Finds the "k" words starting with a given prefix that have the largest
+ * values, and stores their ordinals into "ords", best first. Words with equal
+ * values are ranked by ordinal. The number of ordinals stored, which is less
+ * than "k" if fewer words match, is stored into "*num".
+ * Words are not scanned: a tree of the largest value of each bucket is built
+ * when the lexicon is loaded, and each result costs a lookup in this tree
+ * plus the decoding of the values of two buckets. Returns HV_OK or HV_ENOMEM.
+ */
+int hv_topk_prefix(const struct halva *, const void *prefix, size_t len,
+                   size_t k, uint32_t *ords, size_t *num);
+
+
+/*******************************************************************************
+ * Bucket cache
+ ******************************************************************************/
+
+/* A cache of decoded buckets.
+ * hv_locate() and hv_extract() decode the bucket of the requested word from its
+ * start on every call. When lookups are concentrated on a few buckets, a cache
+ * holding the decoded words of recently used buckets avoids this work: lookups
+ * that hit it only do a binary search or a copy. Buckets are evicted with the
+ * CLOCK algorithm.
+ * A cache is attached to a lexicon, which must outlive it, and must not be
+ * used by several threads at once. Give each thread its own cache.
+ */
+struct halva_cache;
+
+struct hv_cache_stats {
+   uint64_t hits;       /* Lookups of a bucket that was cached. */
+   uint64_t misses;     /* Lookups of a bucket that had to be decoded. */
+   uint64_t evictions;  /* Buckets removed to make room for another one. */
+};
+
+/* Creates a cache holding up to "num_bkts" buckets of a lexicon. Each bucket
+ * takes the blocking factor times HV_MAX_WORD_LEN bytes.
+ * Returns HV_OK, HV_EINVAL if "num_bkts" is zero, or HV_ENOMEM.
+ */
+int hv_cache_new(struct halva_cache **, const struct halva *, size_t num_bkts);
+
+/* Destructor. */
+void hv_cache_free(struct halva_cache *);
+
+/* Like hv_locate() and hv_extract(), but going through a cache. */
+uint32_t hv_cache_locate(struct halva_cache *, const void *word, size_t len);
+size_t hv_cache_extract(struct halva_cache *, uint32_t pos, void *buf);
+
+/* Retrieves the hit counters of a cache. */
+void hv_cache_get_stats(const struct halva_cache *, struct hv_cache_stats *);
+
 
 /*******************************************************************************
  * Iterator
@@ -140,8 +469,16 @@ size_t hv_extract(const struct halva *, uint32_t pos, void *buf);
 struct halva_iter {
    const struct halva *hv;          /* Associated lexicon. */
    uint32_t pos;                    /* Position of the current word. */
+   uint32_t end;                    /* Position where iteration stops. */
    const uint8_t *p;                /* Memory region being traversed. */
    char word[HV_MAX_WORD_LEN + 1];  /* Current word. */
+   /* Trie engine: the nodes on the path to the current one, as a set of
+    * offsets in the current word where they start, and whether each of them
+    * is the last child of its parent.
+    */
+   size_t depth;                    /* Where the next node starts. */
+   uint64_t starts[4];
+   uint64_t lasts[4];
 };
 
 /* Initializes an iterator for iterating over all words in a lexicon,
@@ -166,10 +503,413 @@ uint32_t hv_iter_inits(struct halva_iter *, const struct halva *,
 uint32_t hv_iter_initn(struct halva_iter *, const struct halva *,
                        uint32_t pos);
 
+/* Initializes an iterator for iterating over the words of the buckets in the
+ * range [first_bkt, end_bkt) of a lexicon, where a bucket is a group of as
+ * many consecutive words as the blocking factor. Buckets can be decoded
+ * independently, so that several iterators can process disjoint ranges in
+ * parallel, as split by hv_split_buckets().
+ * Returns the position of the word at which iteration will start, or 0 if
+ * there is nothing to iterate on.
+ */
+uint32_t hv_iter_init_bucket_range(struct halva_iter *, const struct halva *,
+                                   uint32_t first_bkt, uint32_t end_bkt);
+
 /* Fetches the next word from an initialized iterator.
  * If "len" is not NULL, it will be assigned the length of the current word.
  * On end of iteration, NULL is returned, and "len", if not NULL, is set to 0.
  */
 const char *hv_iter_next(struct halva_iter *, size_t *len);
 
+
+/*******************************************************************************
+ * Parallel scans
+ ******************************************************************************/
+
+/* Returns the number of buckets of a lexicon. */
+uint32_t hv_num_buckets(const struct halva *);
+
+/* Splits the buckets of a lexicon into "num" consecutive ranges of about the
+ * same size in bytes, so that they take about the same time to decode. Range i
+ * is [bounds[i], bounds[i + 1]), so "bounds" must have room for "num + 1"
+ * integers. Ranges can be empty if there are fewer buckets than ranges. With
+ * the trie engine, words are not stored by buckets, and ranges hold about the
+ * same number of words instead.
+ */
+void hv_split_buckets(const struct halva *, uint32_t num, uint32_t *bounds);
+
+/* Calls "fn" on each word of a lexicon, using up to "num_threads" threads,
+ * the calling one included. The lexicon is split into more chunks than there
+ * are threads, each thread processing one chunk after the other, so words are
+ * passed in order within a chunk, but chunks are processed concurrently.
+ * "thread" is the index of the calling thread, in [0, num_threads), which
+ * allows keeping per-thread state without locking. "pos" is the ordinal of
+ * the word.
+ * If "fn" returns non-zero, the thread that called it stops, and the others
+ * stop after their current chunk. Returns that value, or 0 if all words were
+ * processed. If threads can't be created, the work is done by fewer threads.
+ */
+int hv_parallel_for(const struct halva *, unsigned num_threads,
+                    int (*fn)(void *arg, unsigned thread, uint32_t pos,
+                              const char *word, size_t len),
+                    void *arg);
+
+
+/*******************************************************************************
+ * Set operations
+ ******************************************************************************/
+
+/* Combines several lexicons.
+ * These functions stream the words of "num" lexicons in lockstep and add the
+ * result to an encoder, in order, without going through an intermediate text
+ * representation:
+ * - hv_merge() adds the words that are present in at least one lexicon.
+ * - hv_intersect() adds the words that are present in all lexicons.
+ * - hv_diff() adds the words of the first lexicon that are not present in any
+ *   of the others.
+ * If "remaps" is not NULL, remaps[i] must either be NULL or point to an array
+ * of hv_size(hvs[i]) integers. For each word of the ith lexicon, the array is
+ * filled with the ordinal of this word in the lexicon being built, or with 0
+ * if the word was not added to it.
+ * Ordinals are those of the encoder, so it should usually be empty when one of
+ * these functions is called.
+ * Words keep their value and their blob. A word present in several lexicons
+ * gets those it has in the first one that holds it.
+ */
+int hv_merge(struct halva_enc *, const struct halva *const *hvs, size_t num,
+             uint32_t *const *remaps);
+int hv_intersect(struct halva_enc *, const struct halva *const *hvs,
+                 size_t num, uint32_t *const *remaps);
+int hv_diff(struct halva_enc *, const struct halva *const *hvs, size_t num,
+            uint32_t *const *remaps);
+
+
+/*******************************************************************************
+ * Layered lexicon
+ ******************************************************************************/
+
+/* A frozen base lexicon plus a small delta lexicon.
+ * This allows adding words to a large lexicon at a cost proportional to the
+ * number of new words: the delta is encoded separately, and queries are
+ * answered as if both lexicons had been merged. The ordinal of a word is its
+ * position in the union of both lexicons. When the delta grows too large, it
+ * can be folded into the base with hv_merge().
+ * The delta must not contain words that are already present in the base. Such
+ * a delta can be obtained from a set of new words with hv_diff().
+ */
+struct halva_layers {
+   const struct halva *base;
+   const struct halva *delta;
+};
+
+/* Returns the number of words in a layered lexicon. */
+size_t hv_layers_size(const struct halva_layers *);
+
+/* Like hv_locate(), for a layered lexicon. */
+uint32_t hv_layers_locate(const struct halva_layers *,
+                          const void *word, size_t len);
+
+/* Like hv_extract(), for a layered lexicon. */
+size_t hv_layers_extract(const struct halva_layers *, uint32_t pos, void *buf);
+
+struct halva_layers_iter {
+   struct halva_iter base;    /* Iterator over the base lexicon. */
+   struct halva_iter delta;   /* Iterator over the delta lexicon. */
+   const char *base_word;     /* Current word of each iterator, if any. */
+   const char *delta_word;
+   size_t base_len;
+   size_t delta_len;
+   const char **last;         /* Word returned by the last call, if any. */
+};
+
+/* Initializes an iterator for iterating over all words of a layered lexicon,
+ * in ascending order.
+ * Returns 1 if there is something to iterate on, 0 otherwise.
+ */
+uint32_t hv_layers_iter_init(struct halva_layers_iter *,
+                             const struct halva_layers *);
+
+/* Initializes an iterator for iterating over all words of a layered lexicon
+ * that are >= some given word, in ascending order.
+ * Returns the position of the word at which iteration will start, or 0 if there
+ * is nothing to iterate on.
+ */
+uint32_t hv_layers_iter_inits(struct halva_layers_iter *,
+                              const struct halva_layers *,
+                              const void *word, size_t len);
+
+/* Fetches the next word from an initialized iterator.
+ * Works like hv_iter_next().
+ */
+const char *hv_layers_iter_next(struct halva_layers_iter *, size_t *len);
+
+
+/*******************************************************************************
+ * Pattern matching
+ ******************************************************************************/
+
+/* State shared by the iterators below.
+ * These iterators evaluate a predicate incrementally, one row per byte of the
+ * current word. Rows computed for the prefix a word shares with the previous
+ * one are reused, and a whole bucket is skipped when the prefix common to all
+ * its words already rules out a match.
+ */
+struct halva_scan {
+   const struct halva *hv;          /* Associated lexicon. */
+   uint32_t pos;                    /* Position of the current word. */
+   uint32_t end;                    /* Position at which iteration stops. */
+   const uint8_t *p;                /* Memory region being traversed. */
+   char word[HV_MAX_WORD_LEN + 1];  /* Current word. */
+   size_t word_len;
+   size_t valid_rows;               /* Number of up-to-date rows - 1. */
+   size_t dead_row;                 /* First row that rules out a match. */
+   struct halva_iter it;            /* Trie engine: words being scanned. */
+};
+
+struct halva_fuzzy_iter {
+   struct halva_scan scan;
+   const uint8_t *query;            /* Word to match, and its length. */
+   size_t query_len;
+   unsigned max_dist;               /* Maximum allowed edit distance. */
+   uint8_t *rows;                   /* Edit distance matrix. */
+};
+
+/* Initializes an iterator for iterating over all words of a lexicon that are
+ * within a given Levenshtein distance of some word, in ascending order.
+ * The length of the provided word must be <= HV_MAX_WORD_LEN. It is not copied,
+ * and must remain valid as long as the iterator is in use.
+ * On success, hv_fuzzy_iter_fini() must be called to release the iterator.
+ */
+int hv_fuzzy_iter_init(struct halva_fuzzy_iter *, const struct halva *,
+                       const void *word, size_t len, unsigned max_dist);
+
+/* Fetches the next matching word.
+ * Works like hv_iter_next(). Additionally, if "dist" is not NULL, it will be
+ * assigned the edit distance between the current word and the query. The
+ * ordinal of the current word is given by the field "scan.pos" of the
+ * iterator.
+ */
+const char *hv_fuzzy_iter_next(struct halva_fuzzy_iter *, size_t *len,
+                               unsigned *dist);
+
+/* Destructor. */
+void hv_fuzzy_iter_fini(struct halva_fuzzy_iter *);
+
+struct hv_glob_token;
+
+struct halva_glob_iter {
+   struct halva_scan scan;
+   struct hv_glob_token *tokens;    /* Compiled pattern. */
+   size_t num_tokens;
+   size_t row_width;                /* Size of a set of states, in words. */
+   uint64_t *rows;                  /* Set of states for each prefix. */
+};
+
+/* Initializes an iterator for iterating over all words of a lexicon that match
+ * a shell wildcard pattern, in ascending order.
+ * The following constructs are recognized:
+ *    *        Matches any sequence of bytes, including the empty one.
+ *    ?        Matches any single byte.
+ *    [...]    Matches any single byte in a set. Ranges like "a-z" are
+ *             allowed. If the first character of the set is "!" or "^",
+ *             matches any byte not in the set.
+ *    \c       Matches the character "c" literally.
+ * Other characters match themselves. Matching is done byte-wise.
+ * The literal prefix of the pattern is used to restrict iteration to the range
+ * of words that start with it.
+ * On success, hv_glob_iter_fini() must be called to release the iterator.
+ */
+int hv_glob_iter_init(struct halva_glob_iter *, const struct halva *,
+                      const void *pattern, size_t len);
+
+/* Fetches the next matching word.
+ * Works like hv_iter_next(). The ordinal of the current word is given by the
+ * field "scan.pos" of the iterator.
+ */
+const char *hv_glob_iter_next(struct halva_glob_iter *, size_t *len);
+
+/* Destructor. */
+void hv_glob_iter_fini(struct halva_glob_iter *);
+
+
+/*******************************************************************************
+ * Suffix index
+ ******************************************************************************/
+
+/* Lexicons created with hv_enc_set_suffix_index() embed a second lexicon of
+ * their words spelled backwards, and a permutation that maps each of its
+ * ordinals to the ordinal of the same word in the main lexicon. Words that end
+ * with a given suffix are then a range of this lexicon, found in logarithmic
+ * time.
+ */
+struct halva_suffix_iter {
+   struct halva_iter rev;           /* Iterator over the reversed words. */
+   const struct halva *hv;          /* Associated lexicon. */
+   char word[HV_MAX_WORD_LEN + 1];  /* Current word. */
+};
+
+/* Returns whether a lexicon has a suffix index. */
+int hv_has_suffix_index(const struct halva *);
+
+/* Initializes an iterator for iterating over all words of a lexicon that end
+ * with a given suffix. Words are produced in the order of their reversed
+ * spelling, not in ascending order.
+ * Returns the number of words to iterate on, which is 0 if the lexicon has no
+ * suffix index.
+ */
+uint32_t hv_suffix_iter_init(struct halva_suffix_iter *, const struct halva *,
+                             const void *suffix, size_t len);
+
+/* Fetches the next matching word.
+ * Works like hv_iter_next(). Additionally, if "pos" is not NULL, it will be
+ * assigned the ordinal of the current word in the lexicon.
+ */
+const char *hv_suffix_iter_next(struct halva_suffix_iter *, size_t *len,
+                                uint32_t *pos);
+
+
+/*******************************************************************************
+ * Subsets
+ ******************************************************************************/
+
+/* A subset of the words of a lexicon, e.g. those that have some tag, stored as
+ * a compressed bitmap of their ordinals. Ordinals are split into chunks of
+ * 65536; the members of a chunk are stored as a sorted array of 16-bit integers
+ * if there are few of them, and as a bitmap otherwise. A subset thus takes at
+ * most about one bit per word of the lexicon, and much less if it is sparse.
+ * A subset is only meaningful for the lexicon it was built for. Functions that
+ * take both check that the lexicon has the expected number of words, but can't
+ * detect other mismatches.
+ */
+struct halva_subset;
+
+/* Creates an empty subset of a lexicon.
+ * On success, makes the provided struct pointer point to the allocated subset.
+ * On failure, makes it point to NULL.
+ */
+int hv_subset_new(struct halva_subset **, const struct halva *);
+
+/* Destructor. */
+void hv_subset_free(struct halva_subset *);
+
+/* Adds the word at a given ordinal to a subset. Adding ordinals in ascending
+ * order is fastest. Returns HV_EINVAL if the ordinal is out of range.
+ */
+int hv_subset_add(struct halva_subset *, uint32_t pos);
+
+/* Returns the number of words in a subset. */
+uint32_t hv_subset_size(const struct halva_subset *);
+
+/* Returns whether the word at a given ordinal is in a subset. */
+int hv_subset_has(const struct halva_subset *, uint32_t pos);
+
+/* Returns whether a word is in a subset of a lexicon. This costs a call to
+ * hv_locate(), plus a lookup in a single chunk of the subset.
+ */
+int hv_subset_contains(const struct halva_subset *, const struct halva *,
+                       const void *word, size_t len);
+
+/* Dumps a subset.
+ * Works like hv_enc_dump().
+ */
+int hv_subset_dump(const struct halva_subset *,
+                   int (*write)(void *arg, const void *data, size_t size),
+                   void *arg);
+
+/* Dumps a subset to a file.
+ * Works like hv_enc_dump_file().
+ */
+int hv_subset_dump_file(const struct halva_subset *, FILE *);
+
+/* Loads a subset of a lexicon.
+ * Works like hv_load(). Returns HV_EINVAL if the subset was not built for a
+ * lexicon of the same size.
+ */
+int hv_subset_load(struct halva_subset **, const struct halva *,
+                   int (*read)(void *arg, void *buf, size_t size), void *arg);
+
+/* Loads a subset of a lexicon from a file.
+ * Works like hv_load_file().
+ */
+int hv_subset_load_file(struct halva_subset **, const struct halva *, FILE *);
+
+struct halva_subset_iter {
+   struct halva_iter it;               /* Iterator over the lexicon. */
+   const struct halva_subset *sub;     /* Subset to iterate on. */
+   uint32_t next;                      /* Next member, 0 if none. */
+};
+
+/* Initializes an iterator for iterating over the words of a subset of a
+ * lexicon, in lexicographical order. Buckets that hold no member are skipped
+ * without being decoded.
+ * Returns the number of words to iterate on.
+ */
+uint32_t hv_subset_iter_init(struct halva_subset_iter *,
+                             const struct halva_subset *,
+                             const struct halva *);
+
+/* Fetches the next word of a subset.
+ * Works like hv_iter_next(). Additionally, if "pos" is not NULL, it will be
+ * assigned the ordinal of the current word in the lexicon.
+ */
+const char *hv_subset_iter_next(struct halva_subset_iter *, size_t *len,
+                                uint32_t *pos);
+
+
+/*******************************************************************************
+ * Statistics
+ ******************************************************************************/
+
+/* Runtime counters.
+ * They are only maintained if halva.c is compiled with HV_STATS defined.
+ * Otherwise, the instrumentation has no cost, and all counters are always zero.
+ * Counters are kept per thread, and summed when they are read.
+ */
+struct hv_stats {
+   uint64_t locate_hits;      /* Calls of hv_locate() that found the word. */
+   uint64_t locate_misses;    /* Calls of hv_locate() that didn't. */
+   uint64_t bkt_probes;       /* Bucket heads compared during binary search. */
+   uint64_t entries_decoded;  /* Entries or trie nodes decoded by lookups. */
+   uint64_t iter_words;       /* Words yielded by hv_iter_next(). */
+   uint64_t bytes_loaded;     /* Bytes read by hv_load(). */
+};
+
+/* Fills "stats" with the sum of the counters of all threads. */
+void hv_get_stats(struct hv_stats *stats);
+
+/* Resets all counters to zero.
+ * Counters of threads that are concurrently using lexicons might not be reset.
+ */
+void hv_reset_stats(void);
+
+/* Structure of a lexicon. */
+struct hv_report {
+   uint32_t num_words;                 /* Number of words. */
+   uint32_t num_bkts;                  /* Number of buckets. */
+   uint32_t blocking_factor;           /* Words per bucket. */
+   int engine;                         /* HV_ENGINE_* constant. */
+   uint32_t num_nodes;                 /* Number of trie nodes. */
+   size_t total_size;                  /* Size of the lexicon, in bytes. */
+   size_t header_size;                 /* Size of the bucket pointers array. */
+   size_t body_size;                   /* Size of the buckets region or trie. */
+   size_t values_size;                 /* Size of the values and blobs. */
+   size_t suffix_size;                 /* Size of the suffix index. */
+   uint32_t frame_size;                /* 0 if stored uncompressed. */
+   size_t stored_size;                 /* Size of the file. */
+   unsigned value_width;               /* Width of values, in bits. */
+   /* Number of buckets of each size. The ith entry counts buckets that are
+    * >= 2^i and < 2^(i + 1) bytes.
+    */
+   uint32_t bkt_sizes[32];
+   /* Number of words of each length. */
+   uint32_t word_lens[HV_MAX_WORD_LEN + 1];
+   /* Number of words that share a prefix of each length with the previous
+    * word. Bucket heads are counted too, although their prefix is not encoded.
+    */
+   uint32_t prefix_lens[HV_MAX_WORD_LEN + 1];
+   uint32_t byte_entries;              /* Entries with two length bytes. */
+};
+
+/* Computes the structure report of a lexicon. */
+void hv_report(const struct halva *, struct hv_report *);
+
 #endif
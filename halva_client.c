@@ -0,0 +1,264 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>  /* htonl(), ntohl(). */
+#include "halva_client.h"
+
+/* Number of items per request. Large enough to amortize the cost of a round
+ * trip, small enough to keep buffers small.
+ */
+#define HV_CLIENT_BATCH 1024
+
+/* Number of requests that can be sent before reading a response. */
+#define HV_CLIENT_WINDOW 4
+
+#define HV_CLIENT_BUF_SIZE \
+   (HV_FRAME_HEADER_SIZE + HV_CLIENT_BATCH * (HV_MAX_WORD_LEN + 1))
+
+struct hv_client {
+   int fd;
+   uint32_t next_id;
+   uint8_t buf[HV_CLIENT_BUF_SIZE];
+};
+
+/* A batch of items, and where to store the results. */
+struct hv_client_batch {
+   uint8_t op;
+   uint8_t lex;
+   const char *const *strs;   /* Input strings. */
+   const size_t *lens;
+   const uint32_t *ords;      /* Input ordinals. */
+   uint32_t *nums;            /* Output integers. */
+   char *words;               /* Output strings. */
+   size_t *word_lens;
+};
+
+int hv_client_connect(struct hv_client **cp, const char *path)
+{
+   *cp = NULL;
+
+   struct sockaddr_un addr = {.sun_family = AF_UNIX};
+   if (strlen(path) >= sizeof addr.sun_path) {
+      errno = ENAMETOOLONG;
+      return HV_EIO;
+   }
+   strcpy(addr.sun_path, path);
+
+   struct hv_client *c = malloc(sizeof *c);
+   if (!c)
+      return HV_ENOMEM;
+   c->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (c->fd < 0) {
+      free(c);
+      return HV_EIO;
+   }
+   if (connect(c->fd, (struct sockaddr *)&addr, sizeof addr)) {
+      int my_errno = errno;
+      close(c->fd);
+      free(c);
+      errno = my_errno;
+      return HV_EIO;
+   }
+   c->next_id = 0;
+
+   *cp = c;
+   return HV_OK;
+}
+
+void hv_client_close(struct hv_client *c)
+{
+   if (c) {
+      close(c->fd);
+      free(c);
+   }
+}
+
+static int hv_client_write(int fd, const uint8_t *data, size_t size)
+{
+   while (size) {
+      ssize_t ret = send(fd, data, size, MSG_NOSIGNAL);
+      if (ret < 0) {
+         if (errno == EINTR)
+            continue;
+         return HV_EIO;
+      }
+      data += ret;
+      size -= ret;
+   }
+   return HV_OK;
+}
+
+static int hv_client_read(int fd, uint8_t *data, size_t size)
+{
+   while (size) {
+      ssize_t ret = read(fd, data, size);
+      if (ret <= 0) {
+         if (ret < 0 && errno == EINTR)
+            continue;
+         return HV_EIO;
+      }
+      data += ret;
+      size -= ret;
+   }
+   return HV_OK;
+}
+
+static void hv_put32(uint8_t *p, uint32_t val)
+{
+   val = htonl(val);
+   memcpy(p, &val, sizeof val);
+}
+
+static uint32_t hv_get32(const uint8_t *p)
+{
+   uint32_t val;
+   memcpy(&val, p, sizeof val);
+   return ntohl(val);
+}
+
+static int hv_client_send(struct hv_client *c,
+                          const struct hv_client_batch *b,
+                          size_t start, size_t num)
+{
+   uint8_t *p = &c->buf[HV_FRAME_HEADER_SIZE];
+   for (size_t i = start; i < start + num; i++) {
+      if (b->op == HV_OP_EXTRACT) {
+         hv_put32(p, b->ords[i]);
+         p += 4;
+      } else {
+         size_t len = b->lens[i];
+         *p++ = len;
+         memcpy(p, b->strs[i], len);
+         p += len;
+      }
+   }
+
+   size_t size = p - c->buf;
+   hv_put32(c->buf, size - 4);
+   hv_put32(&c->buf[4], c->next_id++);
+   c->buf[8] = b->op;
+   c->buf[9] = b->lex;
+   c->buf[10] = num >> 8;
+   c->buf[11] = num & 0xff;
+   return hv_client_write(c->fd, c->buf, size);
+}
+
+static int hv_client_recv(struct hv_client *c,
+                          const struct hv_client_batch *b,
+                          size_t start, size_t num, uint32_t id)
+{
+   if (hv_client_read(c->fd, c->buf, 4))
+      return HV_EIO;
+   size_t size = hv_get32(c->buf);
+   if (size < HV_FRAME_HEADER_SIZE - 4 || size > sizeof c->buf - 4
+       || hv_client_read(c->fd, &c->buf[4], size))
+      return HV_EIO;
+   if (hv_get32(&c->buf[4]) != id || c->buf[8] != b->op
+       || (size_t)(c->buf[10] << 8 | c->buf[11]) != num)
+      return HV_EIO;
+
+   const uint8_t *p = &c->buf[HV_FRAME_HEADER_SIZE];
+   const uint8_t *end = c->buf + 4 + size;
+   for (size_t i = start; i < start + num; i++) {
+      if (b->op == HV_OP_EXTRACT) {
+         if (p == end || *p >= end - p)
+            return HV_EIO;
+         size_t len = *p++;
+         char *word = &b->words[i * (HV_MAX_WORD_LEN + 1)];
+         memcpy(word, p, len);
+         word[len] = '\0';
+         b->word_lens[i] = len;
+         p += len;
+      } else {
+         if (end - p < 4)
+            return HV_EIO;
+         b->nums[i] = hv_get32(p);
+         p += 4;
+      }
+   }
+   return p == end ? HV_OK : HV_EIO;
+}
+
+static int hv_client_run(struct hv_client *c, const struct hv_client_batch *b,
+                         size_t num)
+{
+   /* Requests in flight, in the order they were sent. */
+   size_t starts[HV_CLIENT_WINDOW];
+   uint32_t ids[HV_CLIENT_WINDOW];
+   size_t head = 0, pending = 0;
+
+   if (b->op != HV_OP_EXTRACT) {
+      for (size_t i = 0; i < num; i++)
+         if (b->lens[i] > HV_MAX_WORD_LEN)
+            return HV_EWORD;
+   }
+
+   for (size_t sent = 0; sent < num || pending; ) {
+      if (sent < num && pending < HV_CLIENT_WINDOW) {
+         size_t slot = (head + pending++) % HV_CLIENT_WINDOW;
+         starts[slot] = sent;
+         ids[slot] = c->next_id;
+         size_t cnt = num - sent < HV_CLIENT_BATCH ? num - sent
+                                                   : HV_CLIENT_BATCH;
+         if (hv_client_send(c, b, sent, cnt))
+            return HV_EIO;
+         sent += cnt;
+      } else {
+         size_t start = starts[head];
+         size_t end = pending > 1 ? starts[(head + 1) % HV_CLIENT_WINDOW]
+                                  : sent;
+         if (hv_client_recv(c, b, start, end - start, ids[head]))
+            return HV_EIO;
+         head = (head + 1) % HV_CLIENT_WINDOW;
+         pending--;
+      }
+   }
+   return HV_OK;
+}
+
+int hv_client_locate(struct hv_client *c, unsigned lex, size_t num,
+                     const char *const *words, const size_t *lens,
+                     uint32_t *ords)
+{
+   struct hv_client_batch b = {
+      .op = HV_OP_LOCATE,
+      .lex = lex,
+      .strs = words,
+      .lens = lens,
+      .nums = ords,
+   };
+   return hv_client_run(c, &b, num);
+}
+
+int hv_client_extract(struct hv_client *c, unsigned lex, size_t num,
+                      const uint32_t *ords, char *words, size_t *lens)
+{
+   struct hv_client_batch b = {
+      .op = HV_OP_EXTRACT,
+      .lex = lex,
+      .ords = ords,
+      .words = words,
+      .word_lens = lens,
+   };
+   return hv_client_run(c, &b, num);
+}
+
+int hv_client_count_prefix(struct hv_client *c, unsigned lex, size_t num,
+                           const char *const *prefixes, const size_t *lens,
+                           uint32_t *counts)
+{
+   struct hv_client_batch b = {
+      .op = HV_OP_COUNT_PREFIX,
+      .lex = lex,
+      .strs = prefixes,
+      .lens = lens,
+      .nums = counts,
+   };
+   return hv_client_run(c, &b, num);
+}
@@ -0,0 +1,78 @@
+#ifndef HALVA_CLIENT_H
+#define HALVA_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "halva.h"
+
+/* Client of the lookup server started with "halva serve".
+ *
+ * Requests and responses are framed as follows. All integers are encoded in
+ * network order.
+ *
+ *    byte offset   field
+ *    ---           ---
+ *    0             size in bytes of the frame, not including this field (32 bits)
+ *    4             request identifier, echoed in the response (32 bits)
+ *    8             operation (8 bits)
+ *    9             lexicon index, in the order given to the server (8 bits)
+ *    10            number of items in the frame (16 bits)
+ *    12            items
+ *
+ * For HV_OP_LOCATE and HV_OP_COUNT_PREFIX requests, each item is a string,
+ * encoded as a length byte followed by the string bytes. For HV_OP_EXTRACT
+ * requests, each item is a 32-bit ordinal. Responses to HV_OP_LOCATE and
+ * HV_OP_COUNT_PREFIX requests hold one 32-bit integer per item, and responses
+ * to HV_OP_EXTRACT requests one string per item, encoded as above.
+ *
+ * Several requests can be sent without waiting for a response. Responses are
+ * sent in the order requests were received. The server closes the connection
+ * if it receives an invalid request.
+ */
+
+enum {
+   HV_OP_LOCATE = 1,
+   HV_OP_EXTRACT = 2,
+   HV_OP_COUNT_PREFIX = 3,
+};
+
+/* Size of a frame header, including the size field. */
+#define HV_FRAME_HEADER_SIZE 12
+
+/* Maximum number of items in a frame. */
+#define HV_FRAME_MAX_ITEMS UINT16_MAX
+
+/* Maximum size of a frame, not including its size field. */
+#define HV_FRAME_MAX_SIZE (HV_FRAME_HEADER_SIZE - 4 \
+                           + HV_FRAME_MAX_ITEMS * (HV_MAX_WORD_LEN + 1))
+
+struct hv_client;
+
+/* Connects to a server listening on a Unix domain socket.
+ * On success, makes the provided struct pointer point to the allocated client.
+ * On failure, makes it point to NULL, and returns HV_EIO or HV_ENOMEM. errno is
+ * set in the former case.
+ */
+int hv_client_connect(struct hv_client **, const char *socket_path);
+
+/* Closes the connection and frees the client. */
+void hv_client_close(struct hv_client *);
+
+/* Batched versions of hv_locate(), hv_extract() and hv_count_prefix().
+ * "lex" is the index of the lexicon to query. These functions process "num"
+ * items, which are split into as many requests as necessary. Strings lengths
+ * must be <= HV_MAX_WORD_LEN. hv_client_extract() stores words at
+ * "words + i * (HV_MAX_WORD_LEN + 1)", nul-terminated.
+ * Return HV_OK on success, HV_EWORD if a string is too long, otherwise HV_EIO,
+ * in which case the client should be closed.
+ */
+int hv_client_locate(struct hv_client *, unsigned lex, size_t num,
+                     const char *const *words, const size_t *lens,
+                     uint32_t *ords);
+int hv_client_extract(struct hv_client *, unsigned lex, size_t num,
+                      const uint32_t *ords, char *words, size_t *lens);
+int hv_client_count_prefix(struct hv_client *, unsigned lex, size_t num,
+                           const char *const *prefixes, const size_t *lens,
+                           uint32_t *counts);
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <string.h>
 #include "../halva.h"
 
@@ -27,17 +28,136 @@ static void luaL_setfuncs (lua_State *L, const luaL_Reg *l, int nup) {
 
 #define luaL_newlib(L,l)   (luaL_newlibtable(L,l), luaL_setfuncs(L,l,0))
 
+#define lua_rawlen lua_objlen
+
 #endif
 /* End compatibility code. */
 
 #define HV_MT "halva"
 #define HV_ENC_MT "halva.enc"
 #define HV_ITER_MT "halva.iter"
+#define HV_GLOB_MT "halva.glob"
+#define HV_FUZZY_MT "halva.fuzzy"
+#define HV_SUFFIX_MT "halva.suffix"
+#define HV_SUBSET_MT "halva.subset"
+#define HV_CACHE_MT "halva.cache"
+#define HV_LAYERS_MT "halva.layers"
+#define HV_ARENA_MT "halva.arena"
+
+/* Encoders and lexicons allocated on an arena hold a reference to it, and are
+ * counted, so that the arena is not reset under them. Lua finalizes objects in
+ * the reverse order of their creation, so they are finalized before it even
+ * when the state is closed.
+ */
+struct halva_lua_arena {
+   struct halva_arena *arena;
+   int num_users;
+};
+
+static int hv_lua_arena_new(lua_State *lua)
+{
+   int flags = lua_toboolean(lua, 1) ? HV_ARENA_HUGE_PAGES : 0;
+   lua_Integer region_size = luaL_optinteger(lua, 2, 0);
+   if (region_size < 0)
+      return luaL_argerror(lua, 2, "invalid region size");
+   struct halva_lua_arena *a = lua_newuserdata(lua, sizeof *a);
+   int ret = hv_arena_new(&a->arena, region_size, flags);
+   if (ret)
+      return luaL_error(lua, "%s", hv_strerror(ret));
+   a->num_users = 0;
+   luaL_getmetatable(lua, HV_ARENA_MT);
+   lua_setmetatable(lua, -2);
+   return 1;
+}
+
+static int hv_lua_arena_size(lua_State *lua)
+{
+   struct halva_lua_arena *a = luaL_checkudata(lua, 1, HV_ARENA_MT);
+   lua_pushnumber(lua, hv_arena_size(a->arena));
+   return 1;
+}
+
+static int hv_lua_arena_reset(lua_State *lua)
+{
+   struct halva_lua_arena *a = luaL_checkudata(lua, 1, HV_ARENA_MT);
+   if (a->num_users)
+      return luaL_error(lua, "arena still used by %d objects", a->num_users);
+   hv_arena_reset(a->arena);
+   return 0;
+}
+
+static int hv_lua_arena_free(lua_State *lua)
+{
+   struct halva_lua_arena *a = luaL_checkudata(lua, 1, HV_ARENA_MT);
+   hv_arena_free(a->arena);
+   return 0;
+}
+
+/* Returns the arena passed as argument "idx", or NULL if it is absent. */
+static struct halva_lua_arena *hv_lua_opt_arena(lua_State *lua, int idx)
+{
+   if (lua_isnoneornil(lua, idx))
+      return NULL;
+   return luaL_checkudata(lua, idx, HV_ARENA_MT);
+}
+
+/* Registers a new user of the arena passed as argument "idx", if any, and
+ * returns a reference to it, to be given to hv_lua_arena_release().
+ */
+static int hv_lua_arena_use(lua_State *lua, int idx, struct halva_lua_arena *a)
+{
+   if (!a)
+      return LUA_NOREF;
+   a->num_users++;
+   lua_pushvalue(lua, idx);
+   return luaL_ref(lua, LUA_REGISTRYINDEX);
+}
+
+static void hv_lua_arena_release(lua_State *lua, struct halva_lua_arena *a,
+                                 int ref)
+{
+   if (!a)
+      return;
+   a->num_users--;
+   luaL_unref(lua, LUA_REGISTRYINDEX, ref);
+}
+
+struct halva_lua_enc {
+   struct halva_enc enc;
+   struct halva_lua_arena *arena;
+   int arena_ref;
+};
+
+static struct halva_enc *check_enc(lua_State *lua)
+{
+   struct halva_lua_enc *e = luaL_checkudata(lua, 1, HV_ENC_MT);
+   return &e->enc;
+}
 
 static int hv_lua_enc_new(lua_State *lua)
 {
-   struct halva_enc *enc = lua_newuserdata(lua, sizeof *enc);
+   static const char *const engines[] = {
+      [HV_ENGINE_FRONT_CODING] = "front-coding",
+      [HV_ENGINE_TRIE] = "trie",
+      NULL,
+   };
+   lua_Integer bf = luaL_optinteger(lua, 1, HV_BLOCKING_FACTOR);
+   int engine = luaL_checkoption(lua, 2, "front-coding", engines);
+   int compress = lua_toboolean(lua, 3);
+   int suffixes = lua_toboolean(lua, 4);
+   struct halva_lua_arena *arena = hv_lua_opt_arena(lua, 5);
+   struct halva_lua_enc *e = lua_newuserdata(lua, sizeof *e);
+   struct halva_enc *enc = &e->enc;
    *enc = (struct halva_enc)HV_ENC_INIT;
+   if (bf < 0 || bf > UINT32_MAX || hv_enc_set_blocking_factor(enc, bf))
+      return luaL_argerror(lua, 1, "invalid blocking factor");
+   hv_enc_set_engine(enc, engine);
+   hv_enc_set_compression(enc, compress ? HV_FRAME_SIZE : 0);
+   hv_enc_set_suffix_index(enc, suffixes);
+   if (arena)
+      hv_enc_set_allocator(enc, hv_arena_allocator(arena->arena));
+   e->arena = arena;
+   e->arena_ref = hv_lua_arena_use(lua, 5, arena);
    luaL_getmetatable(lua, HV_ENC_MT);
    lua_setmetatable(lua, -2);
    return 1;
@@ -45,11 +165,20 @@ static int hv_lua_enc_new(lua_State *lua)
 
 static int hv_lua_enc_add(lua_State *lua)
 {
-   struct halva_enc *enc = luaL_checkudata(lua, 1, HV_ENC_MT);
+   struct halva_enc *enc = check_enc(lua);
    size_t len;
    const void *word = luaL_checklstring(lua, 2, &len);
+   lua_Number value = luaL_optnumber(lua, 3, 0);
+   size_t blob_size;
+   const char *blob = luaL_optlstring(lua, 4, NULL, &blob_size);
+   /* Also rejects NaN, before the conversion could overflow. */
+   if (!(value >= 0 && value < 0x1p64) || value != (uint64_t)value)
+      return luaL_argerror(lua, 3, "value must be a non-negative integer "
+                                   "less than 2^64");
 
-   int ret = hv_enc_add(enc, word, len);
+   int ret = blob || value ?
+             hv_enc_add_value(enc, word, len, value, blob, blob ? blob_size : 0) :
+             hv_enc_add(enc, word, len);
    if (ret) {
       /* Programming error. */
       lua_pushstring(lua, hv_strerror(ret));
@@ -60,7 +189,7 @@ static int hv_lua_enc_add(lua_State *lua)
 
 static int hv_lua_enc_dump(lua_State *lua)
 {
-   struct halva_enc *enc = luaL_checkudata(lua, 1, HV_ENC_MT);
+   struct halva_enc *enc = check_enc(lua);
    const char *path = luaL_checkstring(lua, 2);
 
    FILE *fp = fopen(path, "wb");
@@ -95,15 +224,16 @@ static int hv_lua_enc_dump(lua_State *lua)
 
 static int hv_lua_enc_clear(lua_State *lua)
 {
-   struct halva_enc *enc = luaL_checkudata(lua, 1, HV_ENC_MT);
+   struct halva_enc *enc = check_enc(lua);
    hv_enc_clear(enc);
    return 0;
 }
 
 static int hv_lua_enc_free(lua_State *lua)
 {
-   struct halva_enc *enc = luaL_checkudata(lua, 1, HV_ENC_MT);
-   hv_enc_fini(enc);
+   struct halva_lua_enc *e = luaL_checkudata(lua, 1, HV_ENC_MT);
+   hv_enc_fini(&e->enc);
+   hv_lua_arena_release(lua, e->arena, e->arena_ref);
    return 0;
 }
 
@@ -111,11 +241,22 @@ struct halva_lua {
    struct halva *hv;
    int lua_ref;
    int ref_cnt;
+   int buf_ref;   /* String the lexicon was loaded from, if any. */
+   struct halva_lua_arena *arena;
+   int arena_ref;
 };
 
+static int hv_lua_read(void *fp, void *buf, size_t size)
+{
+   if (fread(buf, 1, size, fp) == size)
+      return 0;
+   return -1;
+}
+
 static int hv_lua_load(lua_State *lua)
 {
    const char *path = luaL_checkstring(lua, 1);
+   struct halva_lua_arena *arena = hv_lua_opt_arena(lua, 2);
    struct halva_lua *hv = lua_newuserdata(lua, sizeof *hv);
 
    FILE *fp = fopen(path, "rb");
@@ -125,7 +266,9 @@ static int hv_lua_load(lua_State *lua)
       return 2;
    }
 
-   int ret = hv_load_file(&hv->hv, fp);
+   int ret = hv_load_with_allocator(&hv->hv, hv_lua_read, fp, 1,
+                                    arena ? hv_arena_allocator(arena->arena)
+                                          : NULL);
    fclose(fp);
    if (ret) {
       lua_pushnil(lua);
@@ -135,6 +278,36 @@ static int hv_lua_load(lua_State *lua)
 
    hv->lua_ref = LUA_NOREF;
    hv->ref_cnt = 0;
+   hv->buf_ref = LUA_NOREF;
+   hv->arena = arena;
+   hv->arena_ref = hv_lua_arena_use(lua, 2, arena);
+   luaL_getmetatable(lua, HV_MT);
+   lua_setmetatable(lua, -2);
+   return 1;
+}
+
+/* The lexicon is used in place, so it holds a reference to the string. */
+static int hv_lua_load_buffer(lua_State *lua)
+{
+   size_t size;
+   const char *buf = luaL_checklstring(lua, 1, &size);
+   int flags = (lua_toboolean(lua, 2) ? HV_LOAD_TRUSTED : 0)
+             | (lua_toboolean(lua, 3) ? HV_LOAD_VERIFY : 0);
+   struct halva_lua *hv = lua_newuserdata(lua, sizeof *hv);
+
+   int ret = hv_load_buffer(&hv->hv, buf, size, flags);
+   if (ret) {
+      lua_pushnil(lua);
+      lua_pushstring(lua, hv_strerror(ret));
+      return 2;
+   }
+
+   hv->lua_ref = LUA_NOREF;
+   hv->ref_cnt = 0;
+   lua_pushvalue(lua, 1);
+   hv->buf_ref = luaL_ref(lua, LUA_REGISTRYINDEX);
+   hv->arena = NULL;
+   hv->arena_ref = LUA_NOREF;
    luaL_getmetatable(lua, HV_MT);
    lua_setmetatable(lua, -2);
    return 1;
@@ -144,6 +317,8 @@ static int hv_lua_free(lua_State *lua)
 {
    struct halva_lua *hv = luaL_checkudata(lua, 1, HV_MT);
    hv_free(hv->hv);
+   luaL_unref(lua, LUA_REGISTRYINDEX, hv->buf_ref);
+   hv_lua_arena_release(lua, hv->arena, hv->arena_ref);
    assert(hv->ref_cnt == 0 && hv->lua_ref == LUA_NOREF);
    return 0;
 }
@@ -154,6 +329,92 @@ static const struct halva *check_hv(lua_State *lua)
    return hv->hv;
 }
 
+/* Like luaL_checkudata(), for values that are not arguments. Returns NULL if
+ * the value at the given index is not a lexicon.
+ */
+static struct halva_lua *hv_lua_test_hv(lua_State *lua, int idx)
+{
+   struct halva_lua *hv = lua_touserdata(lua, idx);
+   if (!hv || !lua_getmetatable(lua, idx))
+      return NULL;
+   luaL_getmetatable(lua, HV_MT);
+   if (!lua_rawequal(lua, -1, -2))
+      hv = NULL;
+   lua_pop(lua, 2);
+   return hv;
+}
+
+/* Shared by merge(), intersect() and diff(). The lexicons are kept alive by the
+ * table at index 2 for the duration of the call.
+ */
+static int hv_lua_enc_combine(lua_State *lua,
+                              int (*combine)(struct halva_enc *,
+                                             const struct halva *const *,
+                                             size_t, uint32_t *const *))
+{
+   struct halva_enc *enc = check_enc(lua);
+   luaL_checktype(lua, 2, LUA_TTABLE);
+   int want_remaps = lua_toboolean(lua, 3);
+   size_t num = lua_rawlen(lua, 2);
+
+   /* Collected by Lua if we raise an error. */
+   const struct halva **hvs = lua_newuserdata(lua, (num ? num : 1) * sizeof *hvs);
+   uint32_t **remaps = lua_newuserdata(lua, (num ? num : 1) * sizeof *remaps);
+   size_t total = 0;
+   for (size_t i = 0; i < num; i++) {
+      lua_rawgeti(lua, 2, i + 1);
+      const struct halva_lua *hv = hv_lua_test_hv(lua, -1);
+      lua_pop(lua, 1);
+      if (!hv)
+         return luaL_error(lua, "bad value at index %d (expect lexicon)", (int)i + 1);
+      hvs[i] = hv->hv;
+      total += hv_size(hv->hv);
+   }
+   if (want_remaps) {
+      uint32_t *ords = lua_newuserdata(lua, (total ? total : 1) * sizeof *ords);
+      for (size_t i = 0; i < num; i++) {
+         remaps[i] = ords;
+         ords += hv_size(hvs[i]);
+      }
+   }
+
+   int ret = combine(enc, hvs, num, want_remaps ? remaps : NULL);
+   if (ret) {
+      /* Programming error. */
+      lua_pushstring(lua, hv_strerror(ret));
+      return lua_error(lua);
+   }
+   if (!want_remaps)
+      return 0;
+
+   lua_createtable(lua, num, 0);
+   for (size_t i = 0; i < num; i++) {
+      size_t size = hv_size(hvs[i]);
+      lua_createtable(lua, size, 0);
+      for (size_t j = 0; j < size; j++) {
+         lua_pushnumber(lua, remaps[i][j]);
+         lua_rawseti(lua, -2, j + 1);
+      }
+      lua_rawseti(lua, -2, i + 1);
+   }
+   return 1;
+}
+
+static int hv_lua_enc_merge(lua_State *lua)
+{
+   return hv_lua_enc_combine(lua, hv_merge);
+}
+
+static int hv_lua_enc_intersect(lua_State *lua)
+{
+   return hv_lua_enc_combine(lua, hv_intersect);
+}
+
+static int hv_lua_enc_diff(lua_State *lua)
+{
+   return hv_lua_enc_combine(lua, hv_diff);
+}
+
 static uint32_t hv_abs_index(lua_State *lua, int idx, const struct halva *hv)
 {
    int64_t num = luaL_checknumber(lua, idx);
@@ -179,6 +440,32 @@ static int hv_lua_extract(lua_State *lua)
    return 1;
 }
 
+static int hv_lua_value(lua_State *lua)
+{
+   const struct halva *hv = check_hv(lua);
+   uint32_t pos = hv_abs_index(lua, 2, hv);
+
+   if (pos && pos <= hv_size(hv))
+      lua_pushnumber(lua, hv_value(hv, pos));
+   else
+      lua_pushnil(lua);
+   return 1;
+}
+
+static int hv_lua_blob(lua_State *lua)
+{
+   const struct halva *hv = check_hv(lua);
+   uint32_t pos = hv_abs_index(lua, 2, hv);
+
+   size_t size;
+   const void *blob = hv_blob(hv, pos, &size);
+   if (blob)
+      lua_pushlstring(lua, blob, size);
+   else
+      lua_pushnil(lua);
+   return 1;
+}
+
 static int hv_lua_locate(lua_State *lua)
 {
    const struct halva *hv = check_hv(lua);
@@ -193,6 +480,148 @@ static int hv_lua_locate(lua_State *lua)
    return 1;
 }
 
+/* Returns the table at the given index if there is one, otherwise pushes a
+ * new table of the given size. The table is left on top of the stack.
+ */
+static void hv_lua_out_table(lua_State *lua, int idx, size_t size)
+{
+   if (lua_isnoneornil(lua, idx)) {
+      lua_createtable(lua, size, 0);
+   } else {
+      luaL_checktype(lua, idx, LUA_TTABLE);
+      lua_pushvalue(lua, idx);
+   }
+}
+
+static int hv_lua_locate_many(lua_State *lua)
+{
+   const struct halva *hv = check_hv(lua);
+   luaL_checktype(lua, 2, LUA_TTABLE);
+   size_t num = lua_rawlen(lua, 2);
+   hv_lua_out_table(lua, 3, num);
+
+   for (size_t i = 1; i <= num; i++) {
+      lua_rawgeti(lua, 2, i);
+      size_t len;
+      const char *word = lua_tolstring(lua, -1, &len);
+      if (!word)
+         return luaL_error(lua, "bad value at index %d (expect string)", (int)i);
+      uint32_t pos = hv_locate(hv, word, len);
+      lua_pop(lua, 1);
+      if (pos)
+         lua_pushnumber(lua, pos);
+      else
+         lua_pushboolean(lua, 0);
+      lua_rawseti(lua, -2, i);
+   }
+   return 1;
+}
+
+static int hv_lua_extract_many(lua_State *lua)
+{
+   const struct halva *hv = check_hv(lua);
+   luaL_checktype(lua, 2, LUA_TTABLE);
+   size_t num = lua_rawlen(lua, 2);
+   hv_lua_out_table(lua, 3, num);
+
+   char word[HV_MAX_WORD_LEN + 1];
+   for (size_t i = 1; i <= num; i++) {
+      lua_rawgeti(lua, 2, i);
+      if (lua_type(lua, -1) != LUA_TNUMBER)
+         return luaL_error(lua, "bad value at index %d (expect number)", (int)i);
+      size_t len = hv_extract(hv, hv_abs_index(lua, -1, hv), word);
+      lua_pop(lua, 1);
+      if (len)
+         lua_pushlstring(lua, word, len);
+      else
+         lua_pushboolean(lua, 0);
+      lua_rawseti(lua, -2, i);
+   }
+   return 1;
+}
+
+static int hv_lua_count_prefix(lua_State *lua)
+{
+   const struct halva *hv = check_hv(lua);
+   size_t len;
+   const char *prefix = luaL_checklstring(lua, 2, &len);
+   lua_pushnumber(lua, hv_count_prefix(hv, prefix, len));
+   return 1;
+}
+
+static int hv_lua_rank(lua_State *lua)
+{
+   const struct halva *hv = check_hv(lua);
+   size_t len;
+   const char *word = luaL_checklstring(lua, 2, &len);
+   lua_pushnumber(lua, hv_rank(hv, word, len));
+   return 1;
+}
+
+/* Shared by floor() and ceil(), which return nil when there is no such word. */
+static int hv_lua_nearest(lua_State *lua,
+                          uint32_t (*find)(const struct halva *,
+                                           const void *, size_t))
+{
+   const struct halva *hv = check_hv(lua);
+   size_t len;
+   const char *word = luaL_checklstring(lua, 2, &len);
+
+   uint32_t pos = find(hv, word, len);
+   if (pos)
+      lua_pushnumber(lua, pos);
+   else
+      lua_pushnil(lua);
+   return 1;
+}
+
+static int hv_lua_floor(lua_State *lua)
+{
+   return hv_lua_nearest(lua, hv_floor);
+}
+
+static int hv_lua_ceil(lua_State *lua)
+{
+   return hv_lua_nearest(lua, hv_ceil);
+}
+
+static int hv_lua_count_range(lua_State *lua)
+{
+   const struct halva *hv = check_hv(lua);
+   size_t lo_len, hi_len;
+   const char *lo = luaL_checklstring(lua, 2, &lo_len);
+   const char *hi = luaL_checklstring(lua, 3, &hi_len);
+   lua_pushnumber(lua, hv_count_range(hv, lo, lo_len, hi, hi_len));
+   return 1;
+}
+
+static int hv_lua_topk_prefix(lua_State *lua)
+{
+   const struct halva *hv = check_hv(lua);
+   size_t len;
+   const char *prefix = luaL_checklstring(lua, 2, &len);
+   lua_Integer k = luaL_checkinteger(lua, 3);
+   if (k < 0)
+      return luaL_argerror(lua, 3, "must be >= 0");
+
+   size_t max = hv_count_prefix(hv, prefix, len);
+   if ((size_t)k > max)
+      k = max;
+   /* Collected by Lua if we raise an error. */
+   uint32_t *ords = lua_newuserdata(lua, (k ? k : 1) * sizeof *ords);
+   size_t num;
+   int ret = hv_topk_prefix(hv, prefix, len, k, ords, &num);
+   if (ret)
+      return luaL_error(lua, "%s", hv_strerror(ret));
+
+   lua_createtable(lua, num, 0);
+   for (size_t i = 0; i < num; i++) {
+      lua_pushnumber(lua, ords[i]);
+      lua_rawseti(lua, -2, i + 1);
+   }
+   return 1;
+}
+
 static int hv_lua_size(lua_State *lua)
 {
    const struct halva *hv = check_hv(lua);
@@ -207,15 +636,31 @@ struct halva_lua_iter {
 
 static int hv_lua_iter_next(lua_State *lua);
 
-static struct halva_iter *hv_lua_iter_new(lua_State *lua, struct halva **hvp)
+/* Prevents a lexicon (at index 1) from being collected while there are
+ * iterators pointing to it.
+ */
+static void hv_lua_ref(lua_State *lua, struct halva_lua *hv)
 {
-   struct halva_lua *hv = luaL_checkudata(lua, 1, HV_MT);
-   struct halva_lua_iter *it = lua_newuserdata(lua, sizeof *it);
-
    if (hv->ref_cnt++ == 0) {
       lua_pushvalue(lua, 1);
       hv->lua_ref = luaL_ref(lua, LUA_REGISTRYINDEX);
    }
+}
+
+static void hv_lua_unref(lua_State *lua, struct halva_lua *hv)
+{
+   if (--hv->ref_cnt == 0) {
+      luaL_unref(lua, LUA_REGISTRYINDEX, hv->lua_ref);
+      hv->lua_ref = LUA_NOREF;
+   }
+}
+
+static struct halva_iter *hv_lua_iter_new(lua_State *lua, struct halva **hvp)
+{
+   struct halva_lua *hv = luaL_checkudata(lua, 1, HV_MT);
+   struct halva_lua_iter *it = lua_newuserdata(lua, sizeof *it);
+
+   hv_lua_ref(lua, hv);
    it->hv = hv;
 
    luaL_getmetatable(lua, HV_ITER_MT);
@@ -225,35 +670,37 @@ static struct halva_iter *hv_lua_iter_new(lua_State *lua, struct halva **hvp)
    return &it->it;
 }
 
-static int hv_lua_iter_init(lua_State *lua)
+/* Initializes an iterator given the starting point at the given index. */
+static uint32_t hv_lua_iter_start(lua_State *lua, int idx,
+                                  struct halva_iter *it, struct halva *hv)
 {
-   lua_pushnil(lua);
-
-   struct halva *hv;
-   struct halva_iter *it = hv_lua_iter_new(lua, &hv);
-
-   uint32_t pos;
-   switch (lua_type(lua, 2)) {
+   switch (lua_type(lua, idx)) {
    case LUA_TNUMBER: {
-      uint32_t num = hv_abs_index(lua, 2, hv);
-      pos = hv_iter_initn(it, hv, num);
-      break;
+      uint32_t num = hv_abs_index(lua, idx, hv);
+      return hv_iter_initn(it, hv, num);
    }
    case LUA_TSTRING: {
       size_t len;
-      const char *str = lua_tolstring(lua, 2, &len);
-      pos = hv_iter_inits(it, hv, str, len);
-      break;
+      const char *str = lua_tolstring(lua, idx, &len);
+      return hv_iter_inits(it, hv, str, len);
    }
    case LUA_TNIL:
    case LUA_TNONE:
-      pos = hv_iter_init(it, hv);
-      break;
+      return hv_iter_init(it, hv);
    default: {
-      const char *type = lua_typename(lua, lua_type(lua, 2));
-      return luaL_error(lua, "bad value at #2 (expect string, number, or nil, have %s)", type);
+      const char *type = lua_typename(lua, lua_type(lua, idx));
+      return luaL_error(lua, "bad value at #%d (expect string, number, or nil, have %s)", idx, type);
    }
    }
+}
+
+static int hv_lua_iter_init(lua_State *lua)
+{
+   lua_pushnil(lua);
+
+   struct halva *hv;
+   struct halva_iter *it = hv_lua_iter_new(lua, &hv);
+   uint32_t pos = hv_lua_iter_start(lua, 2, it, hv);
 
    lua_pushcclosure(lua, hv_lua_iter_next, 1);
    if (pos)
@@ -275,53 +722,765 @@ static int hv_lua_iter_next(lua_State *lua)
    return 0;
 }
 
-static int hv_lua_iter_fini(lua_State *lua)
+static int hv_lua_batches_next(lua_State *lua)
 {
-   struct halva_lua_iter *it = luaL_checkudata(lua, 1, HV_ITER_MT);
-   struct halva_lua *hv = it->hv;
-   if (--hv->ref_cnt == 0) {
-      luaL_unref(lua, LUA_REGISTRYINDEX, hv->lua_ref);
-      hv->lua_ref = LUA_NOREF;
+   struct halva_iter *it = lua_touserdata(lua, lua_upvalueindex(1));
+   int max = lua_tonumber(lua, lua_upvalueindex(3));
+   lua_pushvalue(lua, lua_upvalueindex(2));
+
+   int num = 0;
+   const char *word;
+   size_t len;
+   while (num < max && (word = hv_iter_next(it, &len))) {
+      lua_pushlstring(lua, word, len);
+      lua_rawseti(lua, -2, ++num);
    }
-   return 0;
+   if (!num)
+      return 0;
+
+   /* Clear the remains of the previous batch, if any. */
+   for (int i = num + 1; i <= max; i++) {
+      lua_rawgeti(lua, -1, i);
+      int stale = !lua_isnil(lua, -1);
+      lua_pop(lua, 1);
+      if (!stale)
+         break;
+      lua_pushnil(lua);
+      lua_rawseti(lua, -2, i);
+   }
+   lua_pushnumber(lua, num);
+   return 2;
 }
 
-int luaopen_halva(lua_State *lua)
+static int hv_lua_batches_init(lua_State *lua)
 {
-   const luaL_Reg enc_fns[] = {
-      {"__gc", hv_lua_enc_free},
-      {"add", hv_lua_enc_add},
-      {"clear", hv_lua_enc_clear},
-      {"dump", hv_lua_enc_dump},
-      {NULL, NULL},
-   };
-   luaL_newmetatable(lua, HV_ENC_MT);
-   lua_pushvalue(lua, -1);
-   lua_setfield(lua, -2, "__index");
-   luaL_setfuncs(lua, enc_fns, 0);
+   int max = luaL_checknumber(lua, 2);
+   if (max < 1)
+      return luaL_error(lua, "batch size must be > 0");
+   lua_settop(lua, 3);
 
-   const luaL_Reg fns[] = {
-      {"__gc", hv_lua_free},
-      {"__len", hv_lua_size},
-      {"locate", hv_lua_locate},
-      {"extract", hv_lua_extract},
-      {"size", hv_lua_size},
-      {"iter", hv_lua_iter_init},
-      {NULL, NULL},
-   };
-   luaL_newmetatable(lua, HV_MT);
-   lua_pushvalue(lua, -1);
-   lua_setfield(lua, -2, "__index");
-   luaL_setfuncs(lua, fns, 0);
+   struct halva *hv;
+   struct halva_iter *it = hv_lua_iter_new(lua, &hv);
+   hv_lua_iter_start(lua, 3, it, hv);
 
-   luaL_newmetatable(lua, HV_ITER_MT);
-   lua_pushliteral(lua, "__gc");
-   lua_pushcfunction(lua, hv_lua_iter_fini);
-   lua_settable(lua, -3);
+   lua_createtable(lua, max, 0);
+   lua_pushnumber(lua, max);
+   lua_pushcclosure(lua, hv_lua_batches_next, 3);
+   return 1;
+}
+
+static int hv_lua_num_buckets(lua_State *lua)
+{
+   const struct halva *hv = check_hv(lua);
+   lua_pushnumber(lua, hv_num_buckets(hv));
+   return 1;
+}
+
+static int hv_lua_split_buckets(lua_State *lua)
+{
+   const struct halva *hv = check_hv(lua);
+   lua_Integer num = luaL_checkinteger(lua, 2);
+   if (num < 1 || num >= UINT32_MAX)
+      return luaL_argerror(lua, 2, "must be > 0");
+
+   /* Collected by Lua if we raise an error. */
+   uint32_t *bounds = lua_newuserdata(lua, (num + 1) * sizeof *bounds);
+   hv_split_buckets(hv, num, bounds);
+   lua_createtable(lua, num + 1, 0);
+   for (lua_Integer i = 0; i <= num; i++) {
+      lua_pushnumber(lua, bounds[i]);
+      lua_rawseti(lua, -2, i + 1);
+   }
+   return 1;
+}
+
+/* Buckets are numbered from 0, as in the C API. */
+static int hv_lua_iter_buckets(lua_State *lua)
+{
+   lua_Number first = luaL_checknumber(lua, 2);
+   lua_Number end = luaL_checknumber(lua, 3);
+   if (first < 0 || first > UINT32_MAX)
+      return luaL_argerror(lua, 2, "invalid bucket");
+   if (end < 0 || end > UINT32_MAX)
+      return luaL_argerror(lua, 3, "invalid bucket");
+   lua_settop(lua, 1);
+
+   struct halva *hv;
+   struct halva_iter *it = hv_lua_iter_new(lua, &hv);
+   uint32_t pos = hv_iter_init_bucket_range(it, hv, first, end);
+
+   lua_pushcclosure(lua, hv_lua_iter_next, 1);
+   if (pos)
+      lua_pushnumber(lua, pos);
+   else
+      lua_pushnil(lua);
+   return 2;
+}
+
+/* State of parallel_for(). Threads take turns calling the Lua function, which
+ * is at index 3 of the stack of the calling thread.
+ */
+struct halva_lua_scan {
+   lua_State *lua;
+   pthread_mutex_t mutex;
+   int failed;          /* The error is then on top of the stack. */
+};
+
+struct halva_lua_scan_call {
+   unsigned thread;
+   uint32_t pos;
+   const char *word;
+   size_t len;
+};
+
+/* Called in protected mode, so that errors, including memory errors, don't
+ * escape to the threads of hv_parallel_for().
+ */
+static int hv_lua_scan_call(lua_State *lua)
+{
+   const struct halva_lua_scan_call *c = lua_touserdata(lua, 2);
+   lua_pushvalue(lua, 1);
+   lua_pushnumber(lua, c->thread + 1);
+   lua_pushnumber(lua, c->pos);
+   lua_pushlstring(lua, c->word, c->len);
+   lua_call(lua, 3, 1);
+   return 1;
+}
+
+static int hv_lua_scan_fn(void *arg, unsigned thread, uint32_t pos,
+                          const char *word, size_t len)
+{
+   struct halva_lua_scan *scan = arg;
+   lua_State *lua = scan->lua;
+   int ret = -1;
+
+   pthread_mutex_lock(&scan->mutex);
+   if (!scan->failed) {
+      struct halva_lua_scan_call c = {thread, pos, word, len};
+      lua_pushcfunction(lua, hv_lua_scan_call);
+      lua_pushvalue(lua, 3);
+      lua_pushlightuserdata(lua, &c);
+      if (lua_pcall(lua, 2, 1, 0)) {
+         scan->failed = 1;
+      } else {
+         ret = lua_tointeger(lua, -1);
+         lua_pop(lua, 1);
+      }
+   }
+   pthread_mutex_unlock(&scan->mutex);
+   return ret;
+}
+
+static int hv_lua_parallel_for(lua_State *lua)
+{
+   const struct halva *hv = check_hv(lua);
+   lua_Integer num_threads = luaL_checkinteger(lua, 2);
+   luaL_checktype(lua, 3, LUA_TFUNCTION);
+   if (num_threads < 1 || num_threads > 1024)
+      return luaL_argerror(lua, 2, "invalid number of threads");
+   lua_settop(lua, 3);
+
+   struct halva_lua_scan scan = {.lua = lua};
+   pthread_mutex_init(&scan.mutex, NULL);
+   int ret = hv_parallel_for(hv, num_threads, hv_lua_scan_fn, &scan);
+   pthread_mutex_destroy(&scan.mutex);
+   if (scan.failed)
+      return lua_error(lua);
+   lua_pushnumber(lua, ret);
+   return 1;
+}
+
+static int hv_lua_iter_fini(lua_State *lua)
+{
+   struct halva_lua_iter *it = luaL_checkudata(lua, 1, HV_ITER_MT);
+   hv_lua_unref(lua, it->hv);
+   return 0;
+}
+
+struct halva_lua_glob {
+   struct halva_glob_iter it;
+   struct halva_lua *hv;
+};
+
+static int hv_lua_glob_next(lua_State *lua)
+{
+   struct halva_glob_iter *it = lua_touserdata(lua, lua_upvalueindex(1));
+   size_t len;
+   const char *word = hv_glob_iter_next(it, &len);
+   if (word) {
+      lua_pushlstring(lua, word, len);
+      return 1;
+   }
+   return 0;
+}
+
+static int hv_lua_glob_init(lua_State *lua)
+{
+   struct halva_lua *hv = luaL_checkudata(lua, 1, HV_MT);
+   size_t len;
+   const char *pattern = luaL_checklstring(lua, 2, &len);
+
+   struct halva_lua_glob *it = lua_newuserdata(lua, sizeof *it);
+   int ret = hv_glob_iter_init(&it->it, hv->hv, pattern, len);
+   if (ret)
+      return luaL_error(lua, "%s", hv_strerror(ret));
+
+   hv_lua_ref(lua, hv);
+   it->hv = hv;
+   luaL_getmetatable(lua, HV_GLOB_MT);
+   lua_setmetatable(lua, -2);
+
+   lua_pushcclosure(lua, hv_lua_glob_next, 1);
+   return 1;
+}
+
+static int hv_lua_glob_fini(lua_State *lua)
+{
+   struct halva_lua_glob *it = luaL_checkudata(lua, 1, HV_GLOB_MT);
+   hv_glob_iter_fini(&it->it);
+   hv_lua_unref(lua, it->hv);
+   return 0;
+}
+
+struct halva_lua_fuzzy {
+   struct halva_fuzzy_iter it;
+   struct halva_lua *hv;
+};
+
+static int hv_lua_fuzzy_next(lua_State *lua)
+{
+   struct halva_fuzzy_iter *it = lua_touserdata(lua, lua_upvalueindex(1));
+   size_t len;
+   unsigned dist;
+   const char *word = hv_fuzzy_iter_next(it, &len, &dist);
+   if (word) {
+      lua_pushlstring(lua, word, len);
+      lua_pushnumber(lua, it->scan.pos);
+      lua_pushnumber(lua, dist);
+      return 3;
+   }
+   return 0;
+}
+
+/* The query is not copied, so the closure keeps it alive. */
+static int hv_lua_fuzzy_init(lua_State *lua)
+{
+   struct halva_lua *hv = luaL_checkudata(lua, 1, HV_MT);
+   size_t len;
+   const char *word = luaL_checklstring(lua, 2, &len);
+   lua_Integer max_dist = luaL_checkinteger(lua, 3);
+   if (max_dist < 0 || max_dist > HV_MAX_WORD_LEN)
+      return luaL_argerror(lua, 3, "invalid distance");
+
+   struct halva_lua_fuzzy *it = lua_newuserdata(lua, sizeof *it);
+   int ret = hv_fuzzy_iter_init(&it->it, hv->hv, word, len, max_dist);
+   if (ret)
+      return luaL_error(lua, "%s", hv_strerror(ret));
+
+   hv_lua_ref(lua, hv);
+   it->hv = hv;
+   luaL_getmetatable(lua, HV_FUZZY_MT);
+   lua_setmetatable(lua, -2);
+
+   lua_pushvalue(lua, 2);
+   lua_pushcclosure(lua, hv_lua_fuzzy_next, 2);
+   return 1;
+}
+
+static int hv_lua_fuzzy_fini(lua_State *lua)
+{
+   struct halva_lua_fuzzy *it = luaL_checkudata(lua, 1, HV_FUZZY_MT);
+   hv_fuzzy_iter_fini(&it->it);
+   hv_lua_unref(lua, it->hv);
+   return 0;
+}
+
+struct halva_lua_suffix {
+   struct halva_suffix_iter it;
+   struct halva_lua *hv;
+};
+
+static int hv_lua_suffix_next(lua_State *lua)
+{
+   struct halva_suffix_iter *it = lua_touserdata(lua, lua_upvalueindex(1));
+   size_t len;
+   uint32_t pos;
+   const char *word = hv_suffix_iter_next(it, &len, &pos);
+   if (word) {
+      lua_pushlstring(lua, word, len);
+      lua_pushnumber(lua, pos);
+      return 2;
+   }
+   return 0;
+}
+
+static int hv_lua_suffix_init(lua_State *lua)
+{
+   struct halva_lua *hv = luaL_checkudata(lua, 1, HV_MT);
+   size_t len;
+   const char *suffix = luaL_checklstring(lua, 2, &len);
+   if (!hv_has_suffix_index(hv->hv))
+      return luaL_error(lua, "lexicon has no suffix index");
+
+   struct halva_lua_suffix *it = lua_newuserdata(lua, sizeof *it);
+   hv_suffix_iter_init(&it->it, hv->hv, suffix, len);
+
+   hv_lua_ref(lua, hv);
+   it->hv = hv;
+   luaL_getmetatable(lua, HV_SUFFIX_MT);
+   lua_setmetatable(lua, -2);
+
+   lua_pushcclosure(lua, hv_lua_suffix_next, 1);
+   return 1;
+}
+
+static int hv_lua_suffix_fini(lua_State *lua)
+{
+   struct halva_lua_suffix *it = luaL_checkudata(lua, 1, HV_SUFFIX_MT);
+   hv_lua_unref(lua, it->hv);
+   return 0;
+}
+
+struct halva_lua_subset {
+   struct halva_subset *sub;
+   struct halva_lua *hv;
+};
+
+static int hv_lua_subset_new(lua_State *lua)
+{
+   struct halva_lua *hv = luaL_checkudata(lua, 1, HV_MT);
+   const char *path = luaL_optstring(lua, 2, NULL);
+   struct halva_lua_subset *sub = lua_newuserdata(lua, sizeof *sub);
+   sub->sub = NULL;
+
+   int ret;
+   if (path) {
+      FILE *fp = fopen(path, "rb");
+      if (!fp) {
+         lua_pushnil(lua);
+         lua_pushstring(lua, strerror(errno));
+         return 2;
+      }
+      ret = hv_subset_load_file(&sub->sub, hv->hv, fp);
+      fclose(fp);
+   } else {
+      ret = hv_subset_new(&sub->sub, hv->hv);
+   }
+   if (ret) {
+      lua_pushnil(lua);
+      lua_pushstring(lua, hv_strerror(ret));
+      return 2;
+   }
+
+   hv_lua_ref(lua, hv);
+   sub->hv = hv;
+   luaL_getmetatable(lua, HV_SUBSET_MT);
+   lua_setmetatable(lua, -2);
+   return 1;
+}
+
+/* Ordinal of the word or position at index 2. */
+static uint32_t hv_lua_subset_pos(lua_State *lua,
+                                  const struct halva_lua_subset *sub)
+{
+   if (lua_type(lua, 2) == LUA_TNUMBER)
+      return hv_abs_index(lua, 2, sub->hv->hv);
+   size_t len;
+   const char *word = luaL_checklstring(lua, 2, &len);
+   return hv_locate(sub->hv->hv, word, len);
+}
+
+static int hv_lua_subset_add(lua_State *lua)
+{
+   struct halva_lua_subset *sub = luaL_checkudata(lua, 1, HV_SUBSET_MT);
+   int ret = hv_subset_add(sub->sub, hv_lua_subset_pos(lua, sub));
+   if (ret == HV_ENOMEM)
+      return luaL_error(lua, "%s", hv_strerror(ret));
+   lua_pushboolean(lua, !ret);
+   return 1;
+}
+
+static int hv_lua_subset_contains(lua_State *lua)
+{
+   struct halva_lua_subset *sub = luaL_checkudata(lua, 1, HV_SUBSET_MT);
+   lua_pushboolean(lua, hv_subset_has(sub->sub, hv_lua_subset_pos(lua, sub)));
+   return 1;
+}
+
+static int hv_lua_subset_size(lua_State *lua)
+{
+   struct halva_lua_subset *sub = luaL_checkudata(lua, 1, HV_SUBSET_MT);
+   lua_pushnumber(lua, hv_subset_size(sub->sub));
+   return 1;
+}
+
+static int hv_lua_subset_dump(lua_State *lua)
+{
+   struct halva_lua_subset *sub = luaL_checkudata(lua, 1, HV_SUBSET_MT);
+   const char *path = luaL_checkstring(lua, 2);
+
+   FILE *fp = fopen(path, "wb");
+   if (!fp) {
+      lua_pushnil(lua);
+      lua_pushstring(lua, strerror(errno));
+      return 2;
+   }
+   int ret = hv_subset_dump_file(sub->sub, fp);
+   if (fclose(fp) && !ret)
+      ret = HV_EIO;
+   if (ret) {
+      lua_pushnil(lua);
+      lua_pushstring(lua, ret == HV_EIO ? strerror(errno) : hv_strerror(ret));
+      return 2;
+   }
+   lua_pushboolean(lua, 1);
+   return 1;
+}
+
+static int hv_lua_subset_next(lua_State *lua)
+{
+   struct halva_subset_iter *it = lua_touserdata(lua, lua_upvalueindex(1));
+   size_t len;
+   uint32_t pos;
+   const char *word = hv_subset_iter_next(it, &len, &pos);
+   if (word) {
+      lua_pushlstring(lua, word, len);
+      lua_pushnumber(lua, pos);
+      return 2;
+   }
+   return 0;
+}
+
+/* The iterator keeps the subset alive, which keeps the lexicon alive. */
+static int hv_lua_subset_iter(lua_State *lua)
+{
+   struct halva_lua_subset *sub = luaL_checkudata(lua, 1, HV_SUBSET_MT);
+   struct halva_subset_iter *it = lua_newuserdata(lua, sizeof *it);
+   hv_subset_iter_init(it, sub->sub, sub->hv->hv);
+   lua_pushvalue(lua, 1);
+   lua_pushcclosure(lua, hv_lua_subset_next, 2);
+   return 1;
+}
+
+static int hv_lua_subset_free(lua_State *lua)
+{
+   struct halva_lua_subset *sub = luaL_checkudata(lua, 1, HV_SUBSET_MT);
+   if (sub->sub) {
+      hv_subset_free(sub->sub);
+      hv_lua_unref(lua, sub->hv);
+   }
+   return 0;
+}
+
+struct halva_lua_cache {
+   struct halva_cache *cache;
+   struct halva_lua *hv;
+};
+
+static int hv_lua_cache_new(lua_State *lua)
+{
+   struct halva_lua *hv = luaL_checkudata(lua, 1, HV_MT);
+   lua_Integer num_bkts = luaL_checkinteger(lua, 2);
+   if (num_bkts < 1)
+      return luaL_argerror(lua, 2, "must be > 0");
+
+   struct halva_lua_cache *c = lua_newuserdata(lua, sizeof *c);
+   int ret = hv_cache_new(&c->cache, hv->hv, num_bkts);
+   if (ret)
+      return luaL_error(lua, "%s", hv_strerror(ret));
+
+   hv_lua_ref(lua, hv);
+   c->hv = hv;
+   luaL_getmetatable(lua, HV_CACHE_MT);
+   lua_setmetatable(lua, -2);
+   return 1;
+}
+
+static int hv_lua_cache_locate(lua_State *lua)
+{
+   struct halva_lua_cache *c = luaL_checkudata(lua, 1, HV_CACHE_MT);
+   size_t len;
+   const char *word = luaL_checklstring(lua, 2, &len);
+
+   uint32_t pos = hv_cache_locate(c->cache, word, len);
+   if (pos)
+      lua_pushnumber(lua, pos);
+   else
+      lua_pushnil(lua);
+   return 1;
+}
+
+static int hv_lua_cache_extract(lua_State *lua)
+{
+   struct halva_lua_cache *c = luaL_checkudata(lua, 1, HV_CACHE_MT);
+   uint32_t pos = hv_abs_index(lua, 2, c->hv->hv);
+
+   char word[HV_MAX_WORD_LEN + 1];
+   size_t len = hv_cache_extract(c->cache, pos, word);
+   if (len)
+      lua_pushlstring(lua, word, len);
+   else
+      lua_pushnil(lua);
+   return 1;
+}
+
+static int hv_lua_cache_stats(lua_State *lua)
+{
+   struct halva_lua_cache *c = luaL_checkudata(lua, 1, HV_CACHE_MT);
+   struct hv_cache_stats stats;
+   hv_cache_get_stats(c->cache, &stats);
+
+   lua_createtable(lua, 0, 3);
+   lua_pushnumber(lua, stats.hits);
+   lua_setfield(lua, -2, "hits");
+   lua_pushnumber(lua, stats.misses);
+   lua_setfield(lua, -2, "misses");
+   lua_pushnumber(lua, stats.evictions);
+   lua_setfield(lua, -2, "evictions");
+   return 1;
+}
+
+static int hv_lua_cache_free(lua_State *lua)
+{
+   struct halva_lua_cache *c = luaL_checkudata(lua, 1, HV_CACHE_MT);
+   hv_cache_free(c->cache);
+   hv_lua_unref(lua, c->hv);
+   return 0;
+}
+
+struct halva_lua_layers {
+   struct halva_layers hl;
+   int base_ref;
+   int delta_ref;
+};
+
+/* References to both lexicons prevent them from being collected before the
+ * layered lexicon.
+ */
+static int hv_lua_layers_new(lua_State *lua)
+{
+   const struct halva_lua *base = luaL_checkudata(lua, 1, HV_MT);
+   const struct halva_lua *delta = luaL_checkudata(lua, 2, HV_MT);
+   struct halva_lua_layers *hl = lua_newuserdata(lua, sizeof *hl);
+   hl->hl.base = base->hv;
+   hl->hl.delta = delta->hv;
+   lua_pushvalue(lua, 1);
+   hl->base_ref = luaL_ref(lua, LUA_REGISTRYINDEX);
+   lua_pushvalue(lua, 2);
+   hl->delta_ref = luaL_ref(lua, LUA_REGISTRYINDEX);
+   luaL_getmetatable(lua, HV_LAYERS_MT);
+   lua_setmetatable(lua, -2);
+   return 1;
+}
+
+static int hv_lua_layers_free(lua_State *lua)
+{
+   struct halva_lua_layers *hl = luaL_checkudata(lua, 1, HV_LAYERS_MT);
+   luaL_unref(lua, LUA_REGISTRYINDEX, hl->base_ref);
+   luaL_unref(lua, LUA_REGISTRYINDEX, hl->delta_ref);
+   return 0;
+}
+
+static int hv_lua_layers_size(lua_State *lua)
+{
+   struct halva_lua_layers *hl = luaL_checkudata(lua, 1, HV_LAYERS_MT);
+   lua_pushnumber(lua, hv_layers_size(&hl->hl));
+   return 1;
+}
+
+static int hv_lua_layers_locate(lua_State *lua)
+{
+   struct halva_lua_layers *hl = luaL_checkudata(lua, 1, HV_LAYERS_MT);
+   size_t len;
+   const char *word = luaL_checklstring(lua, 2, &len);
+
+   uint32_t pos = hv_layers_locate(&hl->hl, word, len);
+   if (pos)
+      lua_pushnumber(lua, pos);
+   else
+      lua_pushnil(lua);
+   return 1;
+}
+
+static int hv_lua_layers_extract(lua_State *lua)
+{
+   struct halva_lua_layers *hl = luaL_checkudata(lua, 1, HV_LAYERS_MT);
+   int64_t pos = luaL_checknumber(lua, 2);
+   if (pos < 0)
+      pos += hv_layers_size(&hl->hl) + 1;
+
+   char word[HV_MAX_WORD_LEN + 1];
+   size_t len = pos > 0 && pos <= UINT32_MAX ?
+                hv_layers_extract(&hl->hl, pos, word) : 0;
+   if (len)
+      lua_pushlstring(lua, word, len);
+   else
+      lua_pushnil(lua);
+   return 1;
+}
+
+static int hv_lua_layers_next(lua_State *lua)
+{
+   struct halva_layers_iter *it = lua_touserdata(lua, lua_upvalueindex(1));
+   size_t len;
+   const char *word = hv_layers_iter_next(it, &len);
+   if (word) {
+      lua_pushlstring(lua, word, len);
+      return 1;
+   }
+   return 0;
+}
+
+/* The iterator keeps the layered lexicon alive, which keeps both lexicons
+ * alive.
+ */
+static int hv_lua_layers_iter(lua_State *lua)
+{
+   struct halva_lua_layers *hl = luaL_checkudata(lua, 1, HV_LAYERS_MT);
+   size_t len;
+   const char *word = luaL_optlstring(lua, 2, NULL, &len);
+
+   struct halva_layers_iter *it = lua_newuserdata(lua, sizeof *it);
+   uint32_t pos = word ? hv_layers_iter_inits(it, &hl->hl, word, len)
+                       : hv_layers_iter_init(it, &hl->hl);
+   lua_pushvalue(lua, 1);
+   lua_pushcclosure(lua, hv_lua_layers_next, 2);
+   if (pos)
+      lua_pushnumber(lua, pos);
+   else
+      lua_pushnil(lua);
+   return 2;
+}
+
+int luaopen_halva(lua_State *lua)
+{
+   const luaL_Reg enc_fns[] = {
+      {"__gc", hv_lua_enc_free},
+      {"add", hv_lua_enc_add},
+      {"clear", hv_lua_enc_clear},
+      {"dump", hv_lua_enc_dump},
+      {"merge", hv_lua_enc_merge},
+      {"intersect", hv_lua_enc_intersect},
+      {"diff", hv_lua_enc_diff},
+      {NULL, NULL},
+   };
+   luaL_newmetatable(lua, HV_ENC_MT);
+   lua_pushvalue(lua, -1);
+   lua_setfield(lua, -2, "__index");
+   luaL_setfuncs(lua, enc_fns, 0);
+
+   const luaL_Reg fns[] = {
+      {"__gc", hv_lua_free},
+      {"__len", hv_lua_size},
+      {"locate", hv_lua_locate},
+      {"extract", hv_lua_extract},
+      {"value", hv_lua_value},
+      {"blob", hv_lua_blob},
+      {"size", hv_lua_size},
+      {"iter", hv_lua_iter_init},
+      {"glob", hv_lua_glob_init},
+      {"fuzzy", hv_lua_fuzzy_init},
+      {"suffix", hv_lua_suffix_init},
+      {"subset", hv_lua_subset_new},
+      {"cache", hv_lua_cache_new},
+      {"batches", hv_lua_batches_init},
+      {"num_buckets", hv_lua_num_buckets},
+      {"split_buckets", hv_lua_split_buckets},
+      {"iter_buckets", hv_lua_iter_buckets},
+      {"parallel_for", hv_lua_parallel_for},
+      {"locate_many", hv_lua_locate_many},
+      {"extract_many", hv_lua_extract_many},
+      {"count_prefix", hv_lua_count_prefix},
+      {"rank", hv_lua_rank},
+      {"floor", hv_lua_floor},
+      {"ceil", hv_lua_ceil},
+      {"count_range", hv_lua_count_range},
+      {"topk_prefix", hv_lua_topk_prefix},
+      {NULL, NULL},
+   };
+   luaL_newmetatable(lua, HV_MT);
+   lua_pushvalue(lua, -1);
+   lua_setfield(lua, -2, "__index");
+   luaL_setfuncs(lua, fns, 0);
+
+   luaL_newmetatable(lua, HV_ITER_MT);
+   lua_pushliteral(lua, "__gc");
+   lua_pushcfunction(lua, hv_lua_iter_fini);
+   lua_settable(lua, -3);
+
+   luaL_newmetatable(lua, HV_GLOB_MT);
+   lua_pushliteral(lua, "__gc");
+   lua_pushcfunction(lua, hv_lua_glob_fini);
+   lua_settable(lua, -3);
+
+   luaL_newmetatable(lua, HV_FUZZY_MT);
+   lua_pushliteral(lua, "__gc");
+   lua_pushcfunction(lua, hv_lua_fuzzy_fini);
+   lua_settable(lua, -3);
+
+   const luaL_Reg subset_fns[] = {
+      {"__gc", hv_lua_subset_free},
+      {"__len", hv_lua_subset_size},
+      {"add", hv_lua_subset_add},
+      {"contains", hv_lua_subset_contains},
+      {"size", hv_lua_subset_size},
+      {"iter", hv_lua_subset_iter},
+      {"dump", hv_lua_subset_dump},
+      {NULL, NULL},
+   };
+   luaL_newmetatable(lua, HV_SUBSET_MT);
+   lua_pushvalue(lua, -1);
+   lua_setfield(lua, -2, "__index");
+   luaL_setfuncs(lua, subset_fns, 0);
+
+   luaL_newmetatable(lua, HV_SUFFIX_MT);
+   lua_pushliteral(lua, "__gc");
+   lua_pushcfunction(lua, hv_lua_suffix_fini);
+   lua_settable(lua, -3);
+
+   const luaL_Reg cache_fns[] = {
+      {"__gc", hv_lua_cache_free},
+      {"locate", hv_lua_cache_locate},
+      {"extract", hv_lua_cache_extract},
+      {"stats", hv_lua_cache_stats},
+      {NULL, NULL},
+   };
+   luaL_newmetatable(lua, HV_CACHE_MT);
+   lua_pushvalue(lua, -1);
+   lua_setfield(lua, -2, "__index");
+   luaL_setfuncs(lua, cache_fns, 0);
+
+   const luaL_Reg layers_fns[] = {
+      {"__gc", hv_lua_layers_free},
+      {"__len", hv_lua_layers_size},
+      {"locate", hv_lua_layers_locate},
+      {"extract", hv_lua_layers_extract},
+      {"size", hv_lua_layers_size},
+      {"iter", hv_lua_layers_iter},
+      {NULL, NULL},
+   };
+   luaL_newmetatable(lua, HV_LAYERS_MT);
+   lua_pushvalue(lua, -1);
+   lua_setfield(lua, -2, "__index");
+   luaL_setfuncs(lua, layers_fns, 0);
+
+   const luaL_Reg arena_fns[] = {
+      {"__gc", hv_lua_arena_free},
+      {"size", hv_lua_arena_size},
+      {"reset", hv_lua_arena_reset},
+      {NULL, NULL},
+   };
+   luaL_newmetatable(lua, HV_ARENA_MT);
+   lua_pushvalue(lua, -1);
+   lua_setfield(lua, -2, "__index");
+   luaL_setfuncs(lua, arena_fns, 0);
 
    const luaL_Reg lib[] = {
       {"encoder", hv_lua_enc_new},
       {"load", hv_lua_load},
+      {"load_buffer", hv_lua_load_buffer},
+      {"layers", hv_lua_layers_new},
+      {"arena", hv_lua_arena_new},
       {NULL, NULL},
    };
    luaL_newlib(lua, lib);
@@ -0,0 +1,74 @@
+package.cpath = "../lua/?.so"
+
+local halva = require("halva")
+
+-- Compares the per-word functions of the Lua binding with their batched
+-- counterparts.
+
+local function bench(name, func)
+   local start = os.clock()
+   local cnt = func()
+   local elapsed = os.clock() - start
+   print(string.format("%-20s %8.3fs %12.0f ops/s", name, elapsed, cnt / elapsed))
+end
+
+local ref_words = {}
+for word in io.lines("words.txt") do table.insert(ref_words, word) end
+
+local path = os.tmpname()
+local enc = halva.encoder()
+for _, word in ipairs(ref_words) do enc:add(word) end
+assert(enc:dump(path))
+local lexicon = assert(halva.load(path))
+os.remove(path)
+
+local rounds = tonumber(arg and arg[1]) or 10
+local positions = {}
+for i = 1, #ref_words do positions[i] = i end
+
+bench("locate", function()
+   for _ = 1, rounds do
+      for _, word in ipairs(ref_words) do lexicon:locate(word) end
+   end
+   return rounds * #ref_words
+end)
+
+bench("locate_many", function()
+   local out = {}
+   for _ = 1, rounds do lexicon:locate_many(ref_words, out) end
+   return rounds * #ref_words
+end)
+
+bench("extract", function()
+   for _ = 1, rounds do
+      for i = 1, #ref_words do lexicon:extract(i) end
+   end
+   return rounds * #ref_words
+end)
+
+bench("extract_many", function()
+   local out = {}
+   for _ = 1, rounds do lexicon:extract_many(positions, out) end
+   return rounds * #ref_words
+end)
+
+bench("iter", function()
+   for _ = 1, rounds do
+      for _ in lexicon:iter() do end
+   end
+   return rounds * #ref_words
+end)
+
+bench("batches", function()
+   for _ = 1, rounds do
+      for _ in lexicon:batches(1024) do end
+   end
+   return rounds * #ref_words
+end)
+
+bench("count_prefix", function()
+   for _ = 1, rounds do
+      for _, word in ipairs(ref_words) do lexicon:count_prefix(word) end
+   end
+   return rounds * #ref_words
+end)
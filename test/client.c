@@ -0,0 +1,193 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>  /* htonl(), ntohl(). */
+#include "../halva_client.h"
+
+/* Client of "halva serve", for the tests. Reads items from the standard input,
+ * one per line, looks them up in the lexicon at the given index, and writes
+ * the results to the standard output, one per line:
+ *
+ *    client [-s] <socket_path> <lexicon> locate|extract|count_prefix
+ *
+ * With -s, locate requests are instead framed by hand, one word per request,
+ * and the client shuts down its end of the connection before reading the
+ * responses.
+ */
+
+static void die(const char *msg, int err)
+{
+   fprintf(stderr, "client: %s: %s\n", msg,
+           err == HV_EIO ? strerror(errno) : hv_strerror(err));
+   exit(EXIT_FAILURE);
+}
+
+static void write_all(int fd, const void *data, size_t size)
+{
+   const char *p = data;
+   while (size) {
+      ssize_t ret = write(fd, p, size);
+      if (ret < 0)
+         die("cannot send request", HV_EIO);
+      p += ret;
+      size -= ret;
+   }
+}
+
+static void read_all(int fd, void *data, size_t size)
+{
+   char *p = data;
+   while (size) {
+      ssize_t ret = read(fd, p, size);
+      if (ret <= 0) {
+         if (!ret)
+            errno = ECONNRESET;
+         die("cannot receive response", HV_EIO);
+      }
+      p += ret;
+      size -= ret;
+   }
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+   uint32_t val;
+   memcpy(&val, p, sizeof val);
+   return ntohl(val);
+}
+
+static void put32(uint8_t *p, uint32_t val)
+{
+   val = htonl(val);
+   memcpy(p, &val, sizeof val);
+}
+
+/* Sends all requests, then half-closes the connection, then reads. */
+static void locate_half_closed(const char *path, unsigned lex, size_t num,
+                               char **words, const size_t *lens)
+{
+   struct sockaddr_un addr = {.sun_family = AF_UNIX};
+   if (strlen(path) >= sizeof addr.sun_path) {
+      errno = ENAMETOOLONG;
+      die("cannot connect", HV_EIO);
+   }
+   strcpy(addr.sun_path, path);
+   int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof addr))
+      die("cannot connect", HV_EIO);
+
+   uint8_t frame[HV_FRAME_HEADER_SIZE + 1 + HV_MAX_WORD_LEN];
+   for (size_t i = 0; i < num; i++) {
+      if (lens[i] > HV_MAX_WORD_LEN)
+         die("cannot send request", HV_EWORD);
+      put32(frame, HV_FRAME_HEADER_SIZE - 4 + 1 + lens[i]);
+      put32(&frame[4], i);
+      frame[8] = HV_OP_LOCATE;
+      frame[9] = lex;
+      frame[10] = 0;
+      frame[11] = 1;
+      frame[12] = lens[i];
+      memcpy(&frame[13], words[i], lens[i]);
+      write_all(fd, frame, HV_FRAME_HEADER_SIZE + 1 + lens[i]);
+   }
+   if (shutdown(fd, SHUT_WR))
+      die("cannot shut down connection", HV_EIO);
+
+   uint8_t resp[HV_FRAME_HEADER_SIZE + 4];
+   for (size_t i = 0; i < num; i++) {
+      read_all(fd, resp, sizeof resp);
+      if (get32(resp) != sizeof resp - 4 || get32(&resp[4]) != i) {
+         errno = EPROTO;
+         die("bad response", HV_EIO);
+      }
+      printf("%u\n", (unsigned)get32(&resp[HV_FRAME_HEADER_SIZE]));
+   }
+   /* The server closes the connection once it has answered. */
+   if (read(fd, resp, 1) != 0) {
+      errno = EPROTO;
+      die("connection still open", HV_EIO);
+   }
+   close(fd);
+}
+
+int main(int argc, char **argv)
+{
+   int half_close = argc > 1 && !strcmp(argv[1], "-s");
+   if (argc != 4 + half_close) {
+      fprintf(stderr, "Usage: client [-s] <socket_path> <lexicon> "
+                      "locate|extract|count_prefix\n");
+      return EXIT_FAILURE;
+   }
+   const char *path = argv[1 + half_close];
+   unsigned lex = atoi(argv[2 + half_close]);
+   const char *op = argv[3 + half_close];
+
+   char **lines = NULL;
+   size_t *lens = NULL;
+   size_t num = 0, alloc = 0;
+   char *line = NULL;
+   size_t line_alloc = 0;
+   ssize_t len;
+   while ((len = getline(&line, &line_alloc, stdin)) >= 0) {
+      if (len && line[len - 1] == '\n')
+         line[--len] = '\0';
+      if (num == alloc) {
+         alloc = alloc ? alloc * 2 : 1024;
+         lines = realloc(lines, alloc * sizeof *lines);
+         lens = realloc(lens, alloc * sizeof *lens);
+         if (!lines || !lens)
+            die("cannot read input", HV_ENOMEM);
+      }
+      lines[num] = line;
+      lens[num++] = len;
+      line = NULL;
+      line_alloc = 0;
+   }
+   free(line);
+
+   if (half_close) {
+      locate_half_closed(path, lex, num, lines, lens);
+   } else {
+      struct hv_client *c;
+      int ret = hv_client_connect(&c, path);
+      if (ret)
+         die("cannot connect", ret);
+      uint32_t *nums = malloc((num ? num : 1) * sizeof *nums);
+      if (!nums)
+         die("cannot allocate results", HV_ENOMEM);
+      if (!strcmp(op, "extract")) {
+         char *words = malloc((num ? num : 1) * (HV_MAX_WORD_LEN + 1));
+         if (!words)
+            die("cannot allocate results", HV_ENOMEM);
+         for (size_t i = 0; i < num; i++)
+            nums[i] = strtoul(lines[i], NULL, 10);
+         ret = hv_client_extract(c, lex, num, nums, words, lens);
+         for (size_t i = 0; !ret && i < num; i++)
+            printf("%s\n", &words[i * (HV_MAX_WORD_LEN + 1)]);
+         free(words);
+      } else {
+         int (*fn)(struct hv_client *, unsigned, size_t, const char *const *,
+                   const size_t *, uint32_t *) =
+            !strcmp(op, "locate") ? hv_client_locate : hv_client_count_prefix;
+         ret = fn(c, lex, num, (const char *const *)lines, lens, nums);
+         for (size_t i = 0; !ret && i < num; i++)
+            printf("%u\n", (unsigned)nums[i]);
+      }
+      if (ret)
+         die("lookup failed", ret);
+      free(nums);
+      hv_client_close(c);
+   }
+
+   for (size_t i = 0; i < num; i++)
+      free(lines[i]);
+   free(lines);
+   free(lens);
+   return fflush(stdout) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
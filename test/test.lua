@@ -18,8 +18,13 @@ function string:starts_with(prefix)
    return self:sub(1, #prefix) == prefix
 end
 
-local function encode_hv(path, itor)
-   local enc = halva.encoder()
+function string:ends_with(suffix)
+   return suffix == "" or self:sub(-#suffix) == suffix
+end
+
+local function encode_hv(path, itor, blocking_factor, engine, compress,
+                         suffixes)
+   local enc = halva.encoder(blocking_factor, engine, compress, suffixes)
    for word in itor do enc:add(word) end
    assert(enc:dump(path))
 end
@@ -44,9 +49,10 @@ function test.basic()
    assert(not pcall(encode_hv, path, get_iter{s}))
 end
 
-local function test_functions(ref_words, num_words)
+local function test_functions(ref_words, num_words, blocking_factor, engine,
+                              compress)
    local path = os.tmpname()
-   encode_hv(path, get_iter(ref_words))
+   encode_hv(path, get_iter(ref_words), blocking_factor, engine, compress)
    local words = assert(halva.load(path))
 
    -- Main functions.
@@ -100,6 +106,23 @@ local function test_functions(ref_words, num_words)
    -- Iteration out of bound.
    assert(not words:iter("ÿÿÿÿÿÿÿÿÿÿÿÿÿÿÿÿÿÿÿÿ")())
    assert(not words:iter("ÿÿÿÿÿÿÿÿÿÿÿÿÿÿÿÿÿÿÿÿ", "prefix")())
+
+   -- Ordered set queries. A word followed by a zero byte is not in the
+   -- lexicon, and comes right after that word.
+   for i = 1, num_words do
+      local word = ref_words[i]
+      local next_word = word .. "\0"
+      assert(words:rank(word) == i - 1 and words:rank(next_word) == i)
+      assert(words:floor(word) == i and words:floor(next_word) == i)
+      assert(words:ceil(word) == i)
+      assert(words:ceil(next_word) == (i < num_words and i + 1 or nil))
+      assert(words:count_range(word, next_word) == 1)
+      assert(words:count_range(next_word, word) == 0)
+   end
+   assert(words:rank("") == 0 and not words:floor(""))
+   assert(words:ceil("") == (num_words > 0 and 1 or nil))
+   assert(words:rank("ÿÿÿÿ") == num_words)
+   assert(words:count_range("", "ÿÿÿÿ") == num_words)
 end
 
 function test.functions()
@@ -116,6 +139,141 @@ function test.functions()
    end
 end
 
+function test.blocking_factors()
+   local words = {}
+   for word in io.lines("words.txt") do
+      table.insert(words, word)
+      if #words == 5000 then break end
+   end
+   for _, bf in ipairs{4, 8, 32, 64} do
+      test_functions(words, #words, bf)
+      words[#words] = nil
+   end
+   -- Not a power of two, or out of range.
+   for _, bf in ipairs{0, 2, 24, 128} do
+      assert(not pcall(halva.encoder, bf))
+   end
+end
+
+function test.trie()
+   local words = {}
+   for word in io.lines("words.txt") do
+      table.insert(words, word)
+   end
+   local min = math.random(#words)
+   local max = min + math.random(33)
+   for i = max, min, -1 do
+      words[i] = nil
+      test_functions(words, i - 1, nil, "trie")
+   end
+   -- Small lexicons, where the root holds most of the words.
+   for _, list in ipairs{{"a"}, {"ab", "abc"}, {"abc", "abd", "b"}} do
+      test_functions(list, #list, 4, "trie")
+   end
+   assert(not pcall(halva.encoder, 16, "foo"))
+end
+
+function test.compression()
+   local words = {}
+   for word in io.lines("words.txt") do
+      table.insert(words, word)
+   end
+   for _, engine in ipairs{"front-coding", "trie"} do
+      test_functions(words, #words, nil, engine, true)
+   end
+   test_functions({"a"}, 1, nil, nil, true)
+   local path = os.tmpname()
+   encode_hv(path, get_iter{}, nil, nil, true)
+   assert(#assert(halva.load(path)) == 0)
+   os.remove(path)
+
+   -- Compressed lexicons should be smaller, at least with such words.
+   local path1, path2 = os.tmpname(), os.tmpname()
+   encode_hv(path1, get_iter(words))
+   encode_hv(path2, get_iter(words), nil, nil, true)
+   local size1 = #io.open(path1, "rb"):read("*a")
+   local size2 = #io.open(path2, "rb"):read("*a")
+   assert(size2 < size1)
+   os.remove(path1); os.remove(path2)
+end
+
+function test.values()
+   local words = {}
+   for word in io.lines("words.txt") do
+      table.insert(words, word)
+      if #words == 3000 then break end
+   end
+   local path = os.tmpname()
+   for _, max in ipairs{0, 1, 255, 2^40} do
+      -- Leave some words without a value or blob, at the start in particular,
+      -- so that columns materialize in the middle of the stream.
+      local enc = halva.encoder(8)
+      local values, blobs = {}, {}
+      for i, word in ipairs(words) do
+         if i > 100 and i % 3 ~= 0 then
+            values[i] = math.random(0, 1000) * max / 1000
+            values[i] = values[i] - values[i] % 1
+            blobs[i] = string.rep(string.char(i % 256), i % 7)
+            enc:add(word, values[i], blobs[i])
+         else
+            values[i], blobs[i] = 0, ""
+            enc:add(word)
+         end
+      end
+      assert(enc:dump(path))
+      local lex = assert(halva.load(path))
+      for i = 1, #words do
+         assert(lex:value(i) == values[i])
+         assert(lex:blob(i) == blobs[i])
+      end
+      assert(lex:value(-1) == values[#words])
+      assert(not lex:value(0) and not lex:blob(0))
+      assert(not lex:value(#words + 1) and not lex:blob(#words + 1))
+   end
+   -- Values that are negative, too large, not integers, or NaN.
+   for _, value in ipairs{-1, 2^64, 2^70, 1.5, 0/0, math.huge} do
+      local enc = halva.encoder()
+      assert(not pcall(enc.add, enc, "a", value))
+   end
+   local enc = halva.encoder()
+   enc:add("a", 2^64 - 2^11)
+   os.remove(path)
+end
+
+function test.topk_prefix()
+   local words = {}
+   for word in io.lines("words.txt") do
+      table.insert(words, word)
+      if #words == 3000 then break end
+   end
+   local path = os.tmpname()
+   for _, max in ipairs{0, 10, 1000000} do
+      local enc = halva.encoder(8)
+      local values = {}
+      for i, word in ipairs(words) do
+         values[i] = math.random(0, max)
+         enc:add(word, values[i])
+      end
+      assert(enc:dump(path))
+      local lex = assert(halva.load(path))
+      for _, prefix in ipairs{"", "a", "ab", "zzzz", words[42]} do
+         local ref = {}
+         for i, word in ipairs(words) do
+            if word:starts_with(prefix) then table.insert(ref, i) end
+         end
+         table.sort(ref, function(a, b)
+            return values[a] > values[b] or (values[a] == values[b] and a < b)
+         end)
+         for _, k in ipairs{0, 1, 7, 100} do
+            local ords = lex:topk_prefix(prefix, k)
+            assert(#ords == math.min(k, #ref))
+            for i, ord in ipairs(ords) do assert(ord == ref[i]) end
+         end
+      end
+   end
+   os.remove(path)
+end
+
 function test.empty_lexicon()
    local path = os.tmpname()
    encode_hv(path, function() return nil end)
@@ -152,8 +310,952 @@ function test.binary_strings()
    os.remove(path)
 end
 
+-- Reference implementation of shell wildcard patterns, without brackets.
+local function glob_match(pat, str)
+   if pat == "" then return str == "" end
+   local c = pat:sub(1, 1)
+   if c == "*" then
+      for i = 1, #str + 1 do
+         if glob_match(pat:sub(2), str:sub(i)) then return true end
+      end
+      return false
+   end
+   if str == "" then return false end
+   if c == "\\" and #pat > 1 then
+      pat = pat:sub(2); c = pat:sub(1, 1)
+   elseif c == "?" then
+      return glob_match(pat:sub(2), str:sub(2))
+   end
+   return c == str:sub(1, 1) and glob_match(pat:sub(2), str:sub(2))
+end
+
+function test.glob()
+   local path = os.tmpname()
+   encode_hv(path, io.lines("words.txt"))
+   local words = assert(halva.load(path))
+   os.remove(path)
+
+   local patterns = {"gree*ing", "col?r", "*ness", "a", "", "z*", "*q*u*",
+                     "?", "\\*", "ab*c*d", "ÿ*"}
+   for _, pat in ipairs(patterns) do
+      local itor = words:glob(pat)
+      for word in io.lines("words.txt") do
+         if glob_match(pat, word) then
+            assert(itor() == word)
+         end
+      end
+      assert(not itor())
+   end
+
+   local itor = words:glob("[xyz]?[!a-y]*")
+   for word in itor do
+      assert(word:find("^[xyz].[^a-y]"))
+   end
+end
+
+-- Reference implementation of the Levenshtein distance.
+local function edit_distance(a, b)
+   local prev = {}
+   for j = 0, #b do prev[j] = j end
+   for i = 1, #a do
+      local cur, c = {[0] = i}, a:byte(i)
+      for j = 1, #b do
+         cur[j] = math.min(prev[j] + 1, cur[j - 1] + 1,
+                           prev[j - 1] + (c == b:byte(j) and 0 or 1))
+      end
+      prev = cur
+   end
+   return prev[#b]
+end
+
+function test.fuzzy()
+   -- A quarter of the words, to keep brute force affordable.
+   local words, i = {}, 0
+   for word in io.lines("words.txt") do
+      i = i + 1
+      if i % 4 == 0 then table.insert(words, word) end
+   end
+   local lexs = {}
+   for _, engine in ipairs{"front-coding", "trie"} do
+      local path = os.tmpname()
+      encode_hv(path, get_iter(words), 4, engine)
+      table.insert(lexs, assert(halva.load(path)))
+      os.remove(path)
+   end
+
+   -- Swapping two letters costs two edits, not one.
+   local word = words[math.random(#words)]
+   local swapped = word:sub(2, 2) .. word:sub(1, 1) .. word:sub(3)
+   local queries = {"", "a", "color", "greeting", "zzzzzz", word, swapped,
+                    word .. "x", word:sub(2), string.rep("z", halva.MAX_WORD_LEN)}
+   for _, query in ipairs(queries) do
+      local dists = {}
+      for i, word in ipairs(words) do
+         if math.abs(#word - #query) <= 2 then
+            dists[i] = edit_distance(query, word)
+         end
+      end
+      for max_dist = 0, 2 do
+         for _, lex in ipairs(lexs) do
+            local itor = lex:fuzzy(query, max_dist)
+            for i, word in ipairs(words) do
+               if dists[i] and dists[i] <= max_dist then
+                  local match, pos, dist = itor()
+                  assert(match == word and pos == i and dist == dists[i])
+               end
+            end
+            assert(not itor())
+         end
+      end
+   end
+
+   local lex = lexs[1]
+   local itor = lex:fuzzy("ab", 1)
+   assert(not pcall(lex.fuzzy, lex, string.rep("z", halva.MAX_WORD_LEN + 1), 1))
+   assert(not pcall(lex.fuzzy, lex, "a", -1))
+   -- The query must outlive the call.
+   collectgarbage()
+   local num = 0
+   for word, _, dist in itor do
+      assert(dist == edit_distance("ab", word) and dist <= 1)
+      num = num + 1
+   end
+   assert(num > 0)
+end
+
+function test.suffix()
+   local words = {}
+   for word in io.lines("words.txt") do
+      table.insert(words, word)
+   end
+   local suffixes = {"ness", "ing", "s", "", "zz", "é", "ÿ", "tion",
+                     words[math.random(#words)]}
+   for _, engine in ipairs{"front-coding", "trie"} do
+      local path = os.tmpname()
+      encode_hv(path, get_iter(words), 4, engine, false, true)
+      local lex = assert(halva.load(path))
+      os.remove(path)
+
+      for _, suffix in ipairs(suffixes) do
+         local found, prev = {}, nil
+         for word, pos in lex:suffix(suffix) do
+            assert(words[pos] == word)
+            assert(word:ends_with(suffix))
+            assert(not found[pos])
+            found[pos] = true
+            -- Matches come in the order of their reversed spelling.
+            assert(not prev or prev < word:reverse())
+            prev = word:reverse()
+         end
+         for i, word in ipairs(words) do
+            assert(not found[i] == not word:ends_with(suffix))
+         end
+      end
+   end
+
+   -- Lexicons without a suffix index can't be queried.
+   local path = os.tmpname()
+   encode_hv(path, get_iter{"a", "b"})
+   local lex = assert(halva.load(path))
+   os.remove(path)
+   assert(not pcall(lex.suffix, lex, "a"))
+
+   -- Small lexicons, compressed ones.
+   for _, list in ipairs{{}, {"a"}, {"ab", "b"}} do
+      path = os.tmpname()
+      encode_hv(path, get_iter(list), nil, nil, true, true)
+      lex = assert(halva.load(path))
+      os.remove(path)
+      local num = 0
+      for word, pos in lex:suffix("b") do
+         assert(list[pos] == word)
+         num = num + 1
+      end
+      assert(num == (#list == 2 and 2 or 0))
+   end
+end
+
+function test.subset()
+   local path = os.tmpname()
+   encode_hv(path, io.lines("words.txt"), 4)
+   local lex = assert(halva.load(path))
+   encode_hv(path, get_iter{"a", "b"})
+   local other = assert(halva.load(path))
+
+   for _, density in ipairs{0, 0.001, 0.1, 0.9} do
+      local sub = assert(lex:subset())
+      local members, num = {}, 0
+      for i = 1, #lex * density do
+         local pos = math.random(#lex)
+         assert(sub:add(i % 2 == 0 and pos or lex:extract(pos)))
+         if not members[pos] then num = num + 1 end
+         members[pos] = true
+      end
+      assert(not sub:add("not a word") and not sub:add(#lex + 1))
+
+      assert(sub:dump(path))
+      local loaded = assert(lex:subset(path))
+      for _, s in ipairs{sub, loaded} do
+         assert(#s == num and s:size() == num)
+         local prev = 0
+         for word, pos in s:iter() do
+            assert(members[pos] and pos > prev and lex:extract(pos) == word)
+            assert(s:contains(word) and s:contains(pos))
+            prev = pos
+         end
+         for i = 1, #lex, 97 do
+            assert(s:contains(i) == (members[i] or false))
+         end
+      end
+      -- A subset is tied to the lexicon it was built for.
+      assert(not other:subset(path))
+   end
+   os.remove(path)
+
+   local sub = assert(other:subset())
+   assert(not sub:iter()())
+end
+
+function test.set_operations()
+   local words = {}
+   for word in io.lines("words.txt") do table.insert(words, word) end
+
+   -- Random subsets of the words, with the ordinal of each word in its subset.
+   -- Values and blobs tell which lexicon a word comes from.
+   local path = os.tmpname()
+   local sets, lexs = {}, {}
+   for k, engine in ipairs{"front-coding", "front-coding", "trie"} do
+      local enc = halva.encoder(nil, engine)
+      local set, num = {}, 0
+      for i, word in ipairs(words) do
+         if math.random() < 0.5 then
+            num = num + 1
+            set[word] = num
+            enc:add(word, k * i, tostring(k))
+         end
+      end
+      assert(enc:dump(path))
+      sets[k], lexs[k] = set, assert(halva.load(path))
+   end
+
+   local ops = {
+      merge = function(m) return m[1] or m[2] or m[3] end,
+      intersect = function(m) return m[1] and m[2] and m[3] end,
+      diff = function(m) return m[1] and not m[2] and not m[3] end,
+   }
+   local sizes = {}
+   for op, pred in pairs(ops) do
+      local enc = halva.encoder()
+      local remaps = enc[op](enc, lexs, true)
+      assert(enc:dump(path))
+      local lex = assert(halva.load(path))
+      assert(#remaps == #lexs)
+      for k = 1, #lexs do assert(#remaps[k] == #lexs[k]) end
+
+      local pos = 0
+      for i, word in ipairs(words) do
+         local m = {sets[1][word], sets[2][word], sets[3][word]}
+         local added = pred(m)
+         if added then
+            pos = pos + 1
+            local first = m[1] and 1 or m[2] and 2 or 3
+            assert(lex:extract(pos) == word)
+            assert(lex:value(pos) == first * i)
+            assert(lex:blob(pos) == tostring(first))
+         end
+         for k = 1, #lexs do
+            if m[k] then assert(remaps[k][m[k]] == (added and pos or 0)) end
+         end
+      end
+      assert(#lex == pos)
+      sizes[op] = pos
+   end
+
+   -- No lexicon at all, no remap tables, bad values.
+   local enc = halva.encoder()
+   assert(#enc:merge({}, true) == 0)
+   assert(enc:merge(lexs) == nil)
+   assert(enc:dump(path) and #assert(halva.load(path)) == sizes.merge)
+   assert(not pcall(enc.merge, halva.encoder(), {lexs[1], "foo"}))
+   os.remove(path)
+end
+
+-- Model of a cache of "num" buckets with CLOCK eviction. Returns a function
+-- that records an access to a bucket, and the counters it updates.
+local function clock_model(num)
+   local bkts, refs, hand = {}, {}, 1
+   local stats = {hits = 0, misses = 0, evictions = 0}
+   local function access(bkt)
+      for i = 1, num do
+         if bkts[i] == bkt then
+            refs[i] = true
+            stats.hits = stats.hits + 1
+            return
+         end
+      end
+      stats.misses = stats.misses + 1
+      while refs[hand] do
+         refs[hand] = false
+         hand = hand % num + 1
+      end
+      if bkts[hand] then stats.evictions = stats.evictions + 1 end
+      bkts[hand], refs[hand] = bkt, true
+      hand = hand % num + 1
+   end
+   return access, stats
+end
+
+function test.cache()
+   local words = {}
+   for word in io.lines("words.txt") do table.insert(words, word) end
+
+   for _, engine in ipairs{"front-coding", "trie"} do
+      for _, bf in ipairs{4, 64} do
+         local path = os.tmpname()
+         encode_hv(path, get_iter(words), bf, engine)
+         local lex = assert(halva.load(path))
+         os.remove(path)
+
+         for _, num_bkts in ipairs{1, 2, 3, 4, 64} do
+            local cache = lex:cache(num_bkts)
+            local access, ref = clock_model(num_bkts)
+            -- Mostly the first words, so that buckets are both reused and
+            -- evicted. Cached buckets must all remain reachable as others are
+            -- evicted, or there would be extra misses.
+            for i = 1, 3000 do
+               local pos = math.random() < 0.7 and math.random(100)
+                                               or math.random(#words)
+               if i % 2 == 0 then
+                  assert(cache:locate(words[pos]) == pos)
+               else
+                  assert(cache:extract(pos) == words[pos])
+               end
+               local stats = cache:stats()
+               if engine == "trie" then
+                  assert(stats.hits == 0 and stats.misses == 0)
+               else
+                  access(math.floor((pos - 1) / bf))
+                  assert(stats.hits == ref.hits and stats.misses == ref.misses)
+                  assert(stats.evictions == ref.evictions)
+               end
+            end
+            assert(engine == "trie" or (ref.hits > 0 and ref.evictions > 0))
+            assert(cache:extract(-1) == words[#words])
+            assert(not cache:extract(0) and not cache:extract(#words + 1))
+            assert(not cache:locate("zefonaodnaozndozfneozoz"))
+            assert(not cache:locate(""))
+         end
+         assert(not pcall(lex.cache, lex, 0))
+
+         -- A cache keeps its lexicon alive.
+         local cache = lex:cache(2)
+         lex = nil; collectgarbage()
+         assert(cache:extract(1) == words[1])
+      end
+   end
+end
+
+function test.layers()
+   local words = {}
+   for word in io.lines("words.txt") do table.insert(words, word) end
+
+   -- Small deltas, possibly at the very start or end of the base, and
+   -- degenerate splits.
+   for _, density in ipairs{0, 0.01, 0.3, 1} do
+      local base, delta = {}, {}
+      for i, word in ipairs(words) do
+         local in_delta = math.random() < density or
+                          (density > 0 and (i == 1 or i == #words))
+         table.insert(in_delta and delta or base, word)
+      end
+      local base_path, delta_path = os.tmpname(), os.tmpname()
+      encode_hv(base_path, get_iter(base))
+      encode_hv(delta_path, get_iter(delta), 4, "trie")
+      local hl = halva.layers(assert(halva.load(base_path)),
+                              assert(halva.load(delta_path)))
+      collectgarbage()
+
+      assert(#hl == #words and hl:size() == #words)
+      for i = 1, #words, 7 do
+         assert(hl:locate(words[i]) == i)
+         assert(hl:extract(i) == words[i])
+      end
+      assert(hl:extract(-1) == words[#words])
+      assert(not hl:locate("zefonaodnaozndozfneozoz"))
+      assert(not hl:extract(0) and not hl:extract(#words + 1))
+
+      local i = 0
+      for word in hl:iter() do
+         i = i + 1
+         assert(word == words[i])
+      end
+      assert(i == #words)
+
+      -- Iteration from a word, present or not.
+      local pos = math.random(#words)
+      for _, from in ipairs{words[pos], words[pos] .. "\0"} do
+         local itor, start = hl:iter(from)
+         local first = from == words[pos] and pos or pos + 1
+         assert(start == (first <= #words and first or nil))
+         assert(itor() == words[first])
+         assert(itor() == words[first + 1])
+      end
+      assert(not hl:iter("ÿÿÿÿ")())
+
+      -- Folding the delta into the base gives the same lexicon.
+      assert(os.execute("../halva compact " .. base_path .. " " .. delta_path))
+      local lex = assert(halva.load(base_path))
+      assert(#lex == #words)
+      for i = 1, #words, 7 do assert(lex:extract(i) == words[i]) end
+      os.remove(base_path); os.remove(delta_path)
+   end
+end
+
+function test.batch_functions()
+   local path = os.tmpname()
+   encode_hv(path, io.lines("words.txt"))
+   local words = assert(halva.load(path))
+   os.remove(path)
+
+   local ref_words = {}
+   for word in io.lines("words.txt") do table.insert(ref_words, word) end
+
+   local queries, positions = {}, {}
+   for i = 1, 1000 do
+      local pos = math.random(#ref_words)
+      queries[i] = ref_words[pos]
+      positions[i] = pos
+   end
+   table.insert(queries, "zefonaodnaozndozfneozoz")
+   table.insert(positions, #ref_words + 1)
+   table.insert(positions, -1)
+
+   local found = words:locate_many(queries)
+   local extracted = words:extract_many(positions)
+   assert(#found == #queries and #extracted == #positions)
+   for i = 1, #queries - 1 do
+      assert(found[i] == positions[i])
+      assert(extracted[i] == queries[i])
+   end
+   assert(found[#queries] == false)
+   assert(extracted[#positions - 1] == false)
+   assert(extracted[#positions] == ref_words[#ref_words])
+
+   -- Output tables can be reused.
+   local out = {}
+   assert(words:locate_many({ref_words[1]}, out) == out and out[1] == 1)
+   assert(not pcall(words.locate_many, words, {{}}))
+   assert(not pcall(words.extract_many, words, {"1"}))
+
+   -- Batched iteration.
+   local start = math.random(#ref_words)
+   local i = start
+   local prev_batch
+   for batch, num in words:batches(333, start) do
+      assert(not prev_batch or prev_batch == batch)
+      assert(#batch == num and num <= 333)
+      for j = 1, num do
+         assert(batch[j] == ref_words[i])
+         i = i + 1
+      end
+      prev_batch = batch
+   end
+   assert(i == #ref_words + 1)
+   assert(not pcall(words.batches, words, 0))
+
+   -- Prefix counts.
+   for _, prefix in ipairs{"", "a", "gree", "zz", "zefonaodnaoz", "ÿ"} do
+      local cnt = 0
+      for _, word in ipairs(ref_words) do
+         if word:starts_with(prefix) then cnt = cnt + 1 end
+      end
+      assert(words:count_prefix(prefix) == cnt)
+   end
+end
+
+function test.parallel_scans()
+   local words = {}
+   for word in io.lines("words.txt") do table.insert(words, word) end
+
+   for _, engine in ipairs{"front-coding", "trie"} do
+      local path = os.tmpname()
+      encode_hv(path, get_iter(words), 4, engine)
+      local lex = assert(halva.load(path))
+
+      -- Ranges of buckets hold all words once, in order.
+      local num_bkts = lex:num_buckets()
+      for _, num in ipairs{1, 3, 7, num_bkts + 5} do
+         local bounds = lex:split_buckets(num)
+         assert(#bounds == num + 1)
+         assert(bounds[1] == 0 and bounds[num + 1] == num_bkts)
+         local pos = 0
+         for r = 1, num do
+            assert(bounds[r] <= bounds[r + 1])
+            local itor, start = lex:iter_buckets(bounds[r], bounds[r + 1])
+            assert(start == (bounds[r] < bounds[r + 1] and pos + 1 or nil))
+            for word in itor do
+               pos = pos + 1
+               assert(word == words[pos])
+            end
+         end
+         assert(pos == #words)
+      end
+      assert(not lex:iter_buckets(num_bkts, num_bkts + 1)())
+
+      -- Every ordinal is visited once, with its word.
+      for _, num_threads in ipairs{1, 2, 4} do
+         local seen, num = {}, 0
+         local ret = lex:parallel_for(num_threads, function(thread, pos, word)
+            assert(thread >= 1 and thread <= num_threads)
+            assert(words[pos] == word and not seen[pos])
+            seen[pos] = true
+            num = num + 1
+         end)
+         assert(ret == 0 and num == #words)
+      end
+
+      -- The thread that visits the first word stops at once, and the others
+      -- after their current range.
+      local num = 0
+      local ret = lex:parallel_for(3, function(_, pos)
+         num = num + 1
+         if pos == 1 then return 42 end
+      end)
+      assert(ret == 42 and num < #words / 2)
+      assert(not pcall(lex.parallel_for, lex, 2, function() error("foo") end))
+      assert(lex:parallel_for(2, function() end) == 0)
+
+      -- Parallel dumps write words in order.
+      if engine == "front-coding" then
+         local out = os.tmpname()
+         assert(os.execute("../halva dump -j 3 " .. path .. " > " .. out))
+         local pos = 0
+         for word in io.lines(out) do
+            pos = pos + 1
+            assert(word == words[pos])
+         end
+         assert(pos == #words)
+         os.remove(out)
+      end
+      os.remove(path)
+   end
+end
+
+local function test_corrupted_file(compress)
+   local path = os.tmpname()
+   encode_hv(path, io.lines("words.txt"), nil, nil, compress)
+   local fp = io.open(path, "rb")
+   local data = fp:read("*a")
+   fp:close()
+
+   local function load_data(data)
+      local fp = io.open(path, "wb")
+      fp:write(data)
+      fp:close()
+      return halva.load(path)
+   end
+
+   assert(load_data(data))
+   -- Flip a byte in the buckets region.
+   local pos = math.random(math.floor(#data / 2), #data)
+   local byte = string.char((data:byte(pos) + 1) % 256)
+   local ok, err = load_data(data:sub(1, pos - 1) .. byte .. data:sub(pos + 1))
+   assert(not ok and err:find("corrupt"))
+   -- Truncated file, by one byte at least.
+   assert(not load_data(data:sub(1, pos - 1)))
+   os.remove(path)
+end
+
+function test.corrupted_file()
+   test_corrupted_file(false)
+   test_corrupted_file(true)
+end
+
+function test.load_buffer()
+   local words = {}
+   for word in io.lines("words.txt") do table.insert(words, word) end
+
+   for _, compress in ipairs{false, true} do
+      local path = os.tmpname()
+      encode_hv(path, get_iter(words), nil, nil, compress)
+      local fp = io.open(path, "rb")
+      local data = fp:read("*a")
+      fp:close()
+      os.remove(path)
+
+      for _, trusted in ipairs{false, true} do
+         for _, verify in ipairs{false, true} do
+            -- The lexicon must hold on to a copy nothing else refers to.
+            local copy = (data .. "x"):sub(1, -2)
+            local lex = assert(halva.load_buffer(copy, trusted, verify))
+            copy = nil
+            collectgarbage()
+            assert(#lex == #words)
+            for i = 1, #words, 13 do
+               assert(lex:locate(words[i]) == i and lex:extract(i) == words[i])
+            end
+         end
+      end
+
+      -- Flip a byte in the buckets region.
+      local pos = math.random(math.floor(#data / 2), #data)
+      local byte = string.char((data:byte(pos) + 1) % 256)
+      local bad = data:sub(1, pos - 1) .. byte .. data:sub(pos + 1)
+      for _, verify in ipairs{false, true} do
+         local ok, err = halva.load_buffer(bad, false, verify)
+         assert(not ok and err:find("corrupt"))
+      end
+      -- Truncated buffer, by one byte at least.
+      assert(not halva.load_buffer(data:sub(1, pos - 1)))
+   end
+
+   -- Make a bucket head smaller than the word before it. Only the checksum or
+   -- a verification of the structure can tell.
+   local path = os.tmpname()
+   encode_hv(path, get_iter(words))
+   local fp = io.open(path, "rb")
+   local data = fp:read("*a")
+   fp:close()
+   os.remove(path)
+   local head = words[16 * 1000 + 1]
+   local start = assert(data:find(string.char(#head) .. head, 1, true))
+   local bad = data:sub(1, start) .. "\1" .. data:sub(start + 2)
+   assert(halva.load_buffer(bad, true))
+   for _, trusted in ipairs{false, true} do
+      local ok, err = halva.load_buffer(bad, trusted, true)
+      assert(not ok and err:find("corrupt"))
+   end
+   assert(not halva.load_buffer(bad))
+end
+
 -- Ensure a lexicon object is not collected while there are remaining iterators.
 -- This must be run under valgrind to be useful at all.
+local function read_file(path)
+   local fp = assert(io.open(path, "rb"))
+   local data = fp:read("*a")
+   fp:close()
+   return data
+end
+
+local function encode_values(words, compress, arena)
+   local enc = halva.encoder(nil, nil, compress, nil, arena)
+   for i, word in ipairs(words) do enc:add(word, i, word:sub(1, 3)) end
+   return enc
+end
+
+function test.arena()
+   local words = {}
+   for word in io.lines("words.txt") do table.insert(words, word) end
+   assert(not pcall(halva.arena, false, -1))
+   assert(not pcall(halva.encoder, nil, nil, nil, nil, {}))
+   assert(not pcall(halva.load, "words.txt", {}))
+
+   -- Lexicons encoded with the standard allocator.
+   local ref = {}
+   for _, compress in ipairs{false, true} do
+      local path = os.tmpname()
+      assert(encode_values(words, compress):dump(path))
+      ref[compress] = read_file(path)
+      os.remove(path)
+   end
+
+   -- With 64 KiB regions, the buffers of the encoder start as small blocks,
+   -- and move to regions of their own as they grow. With the default ones,
+   -- they stay in the first region, where the last one grows in place.
+   for _, huge_pages in ipairs{false, true} do
+      for _, region_size in ipairs{65536, 0} do
+         for _, compress in ipairs{false, true} do
+            local arena = halva.arena(huge_pages, region_size)
+            assert(arena:size() == 0)
+            local enc = halva.encoder(nil, nil, compress, nil, arena)
+            enc:add(words[1])
+            local first = arena:size()
+            assert(first >= 65536)
+            enc:clear()
+            for i, word in ipairs(words) do enc:add(word, i, word:sub(1, 3)) end
+            if region_size > 0 then
+               assert(arena:size() > first)
+            else
+               assert(arena:size() == first)
+            end
+            local path = os.tmpname()
+            assert(enc:dump(path))
+            assert(read_file(path) == ref[compress])
+
+            -- Only the first region is kept.
+            assert(not pcall(arena.reset, arena))
+            enc = nil
+            collectgarbage()
+            arena:reset()
+            assert(arena:size() == first)
+
+            -- The lexicon keeps the arena alive.
+            local lex = assert(halva.load(path, arena))
+            os.remove(path)
+            arena = nil
+            collectgarbage()
+            assert(#lex == #words)
+            for i, word in ipairs(words) do
+               assert(lex:locate(word) == i and lex:extract(i) == word)
+            end
+            for i = 1, #words, 97 do
+               assert(lex:value(i) == i and lex:blob(i) == words[i]:sub(1, 3))
+            end
+         end
+      end
+   end
+
+   -- Lexicons and encoders can share an arena, and it can be reused once they
+   -- are gone.
+   local arena = halva.arena()
+   local path = os.tmpname()
+   assert(encode_values(words, false, arena):dump(path))
+   local lex = assert(halva.load(path, arena))
+   local enc = encode_values(words, true, arena)
+   assert(not pcall(arena.reset, arena))
+   lex, enc = nil, nil
+   collectgarbage()
+   arena:reset()
+   lex = assert(halva.load(path, arena))
+   os.remove(path)
+   for i = 1, #words, 13 do
+      assert(lex:locate(words[i]) == i and lex:extract(i) == words[i])
+   end
+end
+
+-- Runs a command with the given input, and returns what it writes, or nil if
+-- it fails.
+local function run(cmd, data)
+   local inp, out = os.tmpname(), os.tmpname()
+   local fp = assert(io.open(inp, "wb"))
+   fp:write(data)
+   fp:close()
+   local ok = os.execute(cmd .. " < " .. inp .. " > " .. out .. " 2> /dev/null")
+   local ret = ok and read_file(out)
+   os.remove(inp)
+   os.remove(out)
+   return ret
+end
+
+-- Same as run(), with lists of lines as input and output.
+local function run_lines(cmd, lines)
+   local out = run(cmd, #lines > 0 and table.concat(lines, "\n") .. "\n" or "")
+   if not out then return nil end
+   local ret = {}
+   for line in out:gmatch("([^\n]*)\n") do table.insert(ret, line) end
+   return ret
+end
+
+local function wait_for(cond)
+   for _ = 1, 200 do
+      if cond() then return true end
+      os.execute("sleep 0.05")
+   end
+   return false
+end
+
+function test.lookup_commands()
+   local words = {}
+   for word in io.lines("words.txt") do table.insert(words, word) end
+   local path = os.tmpname()
+   encode_hv(path, get_iter(words))
+   local lex = assert(halva.load(path))
+
+   -- A few MiB of input, so that it is split into several blocks.
+   local queries, ords = {}, {}
+   for _ = 1, 3 * #words do
+      local word = words[math.random(#words)]
+      table.insert(queries, math.random(4) == 1 and word .. "x" or word)
+      table.insert(ords, tostring(math.random(0, #words + 10)))
+   end
+   table.insert(queries, 1, "")
+   table.insert(queries, string.rep("z", halva.MAX_WORD_LEN + 1))
+   table.insert(ords, "4294967296")
+   table.insert(ords, "99999999999999999999")
+   table.insert(ords, "")
+
+   local located, extracted = {}, {}
+   for i, word in ipairs(queries) do
+      located[i] = tostring(lex:locate(word) or 0)
+   end
+   for i, pos in ipairs(ords) do
+      local ord = tonumber(pos) or 0
+      extracted[i] = ord <= #words and lex:extract(ord) or ""
+   end
+
+   for _, opts in ipairs{"", "-c 8", "-j 3", "-j 3 -c 8"} do
+      local cmd = " " .. opts .. " " .. path
+      local res = assert(run_lines("../halva locate" .. cmd, queries))
+      assert(#res == #queries)
+      for i = 1, #res do assert(res[i] == located[i]) end
+      res = assert(run_lines("../halva extract" .. cmd, ords))
+      assert(#res == #ords)
+      for i = 1, #res do assert(res[i] == extracted[i]) end
+   end
+
+   -- The last line need not end with a newline.
+   for _, opts in ipairs{"", "-j 3"} do
+      local cmd = " " .. opts .. " " .. path
+      assert(run("../halva locate" .. cmd, words[1] .. "\n" .. words[5])
+             == "1\n5\n")
+      assert(run("../halva extract" .. cmd, "1\n5") == words[1] .. "\n"
+                                                   .. words[5] .. "\n")
+      assert(run("../halva locate" .. cmd, "") == "")
+   end
+   assert(not run("../halva extract " .. path, "1\n12x\n"))
+   assert(not run("../halva extract " .. path, "-1\n"))
+   os.remove(path)
+end
+
+-- Encodes a record as "halva dump -f <fmt>" does.
+local record_formats = {
+   lines = function(w) return w .. "\n" end,
+   nul = function(w) return w .. "\0" end,
+   u8 = function(w) return string.char(#w) .. w end,
+   u16 = function(w)
+      return string.char(math.floor(#w / 256), #w % 256) .. w
+   end,
+   varint = function(w)
+      if #w < 128 then return string.char(#w) .. w end
+      return string.char(#w % 128 + 128, math.floor(#w / 128)) .. w
+   end,
+}
+
+function test.record_formats()
+   -- About 10 MiB of words with embedded zero and newline bytes, so that
+   -- records straddle the blocks read by "create", and words of all lengths,
+   -- so that varints take two bytes.
+   local all = {}
+   for word in io.lines("words.txt") do
+      for _, sep in ipairs{"", "\0", "\0" .. word, "\n", "\n\0" .. word,
+                           "\n" .. word} do
+         table.insert(all, word .. sep)
+      end
+   end
+   for len = 1, halva.MAX_WORD_LEN do
+      table.insert(all, "\255" .. string.rep("x", len - 1))
+   end
+
+   -- Formats, and the byte their words can't hold.
+   local groups = {{{"lines"}, "\n"}, {{"nul"}, "\0"}, {{"u8", "u16", "varint"}}}
+   local path, copy = os.tmpname(), os.tmpname()
+   for _, group in ipairs(groups) do
+      local fmts, banned = group[1], group[2]
+      local words = {}
+      for _, word in ipairs(all) do
+         if not (banned and word:find(banned, 1, true)) then
+            table.insert(words, word)
+         end
+      end
+      encode_hv(path, get_iter(words))
+      local lexicon = read_file(path)
+
+      for _, fmt in ipairs(fmts) do
+         local put = record_formats[fmt]
+         local recs = {}
+         for i, word in ipairs(words) do recs[i] = put(word) end
+         local data = table.concat(recs)
+         for _, opts in ipairs{"", " -j 3"} do
+            assert(run("../halva dump -f " .. fmt .. opts .. " " .. path, "")
+                   == data)
+         end
+         assert(run("../halva create -f " .. fmt .. " " .. copy, data))
+         assert(read_file(copy) == lexicon)
+      end
+   end
+
+   -- Truncated records, and lengths over the limit.
+   for _, fmt in ipairs{"u8", "u16", "varint"} do
+      local put = record_formats[fmt]
+      local cmd = "../halva create -f " .. fmt .. " " .. copy
+      local data = put("a") .. put(string.rep("b", 200))
+      assert(run(cmd, data))
+      assert(not run(cmd, data:sub(1, -2)))
+      assert(not run(cmd, data .. put("c"):sub(1, 1)))
+      if fmt ~= "u8" then
+         assert(not run(cmd, data .. put(string.rep("c", 200)):sub(1, 1)))
+         assert(not run(cmd, put(string.rep("c", halva.MAX_WORD_LEN + 1))))
+      end
+   end
+   os.remove(path)
+   os.remove(copy)
+end
+
+function test.serve()
+   local words = {}
+   for word in io.lines("words.txt") do table.insert(words, word) end
+   local half = {}
+   for i = 1, #words, 2 do table.insert(half, words[i]) end
+   local paths = {os.tmpname(), os.tmpname()}
+   encode_hv(paths[1], get_iter(words))
+   encode_hv(paths[2], get_iter(half), nil, "trie")
+   local lexs = {assert(halva.load(paths[1])), assert(halva.load(paths[2]))}
+
+   local sock, pid_path = os.tmpname(), os.tmpname()
+   os.remove(sock)
+   assert(os.execute(string.format("../halva serve -j 2 %s %s %s & echo $! > %s",
+                                   sock, paths[1], paths[2], pid_path)))
+   local function is_listening()
+      return os.execute("test -S " .. sock)
+   end
+
+   local ok, err = pcall(function()
+      assert(wait_for(is_listening))
+      local queries, prefixes, ords = {}, {}, {}
+      for i = 1, #words, 3 do
+         table.insert(queries, words[i])
+         table.insert(queries, words[i] .. "x")
+         table.insert(prefixes, words[i]:sub(1, i % 4))
+      end
+      table.insert(queries, "")
+      for i = 0, #words + 2, 5 do table.insert(ords, tostring(i)) end
+
+      for idx, lex in ipairs(lexs) do
+         local client = "./client " .. sock .. " " .. (idx - 1)
+         -- Many requests in flight at once.
+         local res = assert(run_lines(client .. " locate", queries))
+         assert(#res == #queries)
+         for i, word in ipairs(queries) do
+            assert(tonumber(res[i]) == (lex:locate(word) or 0))
+         end
+         res = assert(run_lines(client .. " count_prefix", prefixes))
+         assert(#res == #prefixes)
+         for i, prefix in ipairs(prefixes) do
+            assert(tonumber(res[i]) == lex:count_prefix(prefix))
+         end
+         res = assert(run_lines(client .. " extract", ords))
+         assert(#res == #ords)
+         for i, pos in ipairs(ords) do
+            assert(res[i] == (lex:extract(tonumber(pos)) or ""))
+         end
+
+         -- Requests sent before the client shuts down its end are answered.
+         local first = {}
+         for i = 1, 500 do first[i] = queries[i] end
+         res = assert(run_lines("./client -s " .. sock .. " " .. (idx - 1)
+                                .. " locate", first))
+         assert(#res == 500)
+         for i = 1, 500 do
+            assert(tonumber(res[i]) == (lex:locate(queries[i]) or 0))
+         end
+      end
+
+      -- Invalid lexicon index: the server closes the connection.
+      assert(not run_lines("./client " .. sock .. " 2 locate", queries))
+      assert(not run_lines("./client -s " .. sock .. " 2 locate", {"a"}))
+      -- The server still answers other clients.
+      assert(run_lines("./client " .. sock .. " 0 locate", {"a"}))
+   end)
+
+   -- The server removes its socket when it exits on SIGTERM.
+   os.execute("kill -TERM $(cat " .. pid_path .. ")")
+   local stopped = wait_for(function() return not is_listening() end)
+   os.remove(pid_path)
+   for _, path in ipairs(paths) do os.remove(path) end
+   assert(ok, err)
+   assert(stopped)
+end
+
 function test.lexicon_collection()
    local path = os.tmpname()
    encode_hv(path, io.lines("words.txt"))